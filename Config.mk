@@ -49,8 +49,14 @@
         NTERMS=3
 
 # Set the number of disks that we should be launching with
+# With more than one disk, the last one is used as swap space (see
+# kernel/mm/swap.c) rather than holding a file system
         NDISKS=1
 
+# Size of the swap area in blocks (pages), used when NDISKS > 1. ./weenix
+# reads this (and NDISKS) to create and attach swap0.img
+        SWAP_BLOCKS=16384
+
 # terminal binary to use when opening a second terminal for gdb
         GDB_TERM=xterm
         GDB_PORT=1234
@@ -67,6 +73,6 @@
 
 # Boolean options specified in this specified in this file that should be
 # included as definitions at compile time
-        COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC MOUNTING MTP GETCWD RENAMEDIR UPREEMPT PIPES KPREEMPT"
+        COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC SHADOWD MOUNTING MTP GETCWD RENAMEDIR UPREEMPT PIPES KPREEMPT"
 # As above, but not booleans
-        COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE "
+        COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE SWAP_BLOCKS "
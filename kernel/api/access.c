@@ -7,6 +7,7 @@
 
 #include "mm/kmalloc.h"
 #include "mm/mman.h"
+#include "mm/pagetable.h"
 
 #include "api/access.h"
 #include "api/syscall.h"
@@ -16,11 +17,104 @@ static inline long userland_address(const void *addr)
     return addr >= (void *)USER_MEM_LOW && addr < (void *)USER_MEM_HIGH;
 }
 
+/*
+ * Copying to and from user memory.
+ *
+ * Once range_perm() has said the process may access a range, the copy goes
+ * straight through the current page table with rep movsb. Pages that are not
+ * mapped yet, or are mapped read-only for copy-on-write, make the copy fault.
+ * The page fault handler finds the faulting instruction in the exception
+ * table (the .ex_table section, see user_access_fixup()) and resumes at its
+ * fixup, which returns what was left to copy. That page is then copied through
+ * vmmap_read()/vmmap_write(), which fetch the pframe, and the direct copy picks
+ * up again at the next page.
+ *
+ * Supervisor writes only respect read-only pages with CR0.WP set, which
+ * pt_core_init() does on every core.
+ */
+
+typedef struct ex_entry
+{
+    uintptr_t ex_rip;   /* instruction that may fault on a user address */
+    uintptr_t ex_fixup; /* where to continue if it does */
+} ex_entry_t;
+
+/*
+ * Copies n bytes from src to dst, one of which is in user memory, through the
+ * current page table. Returns the number of bytes left uncopied because of a
+ * fault, 0 if the whole copy went through.
+ */
+static size_t _user_copy(void *dst, const void *src, size_t n)
+{
+    __asm__ volatile("1: rep movsb\n"
+                     "2:\n"
+                     ".pushsection .ex_table, \"a\"\n"
+                     ".quad 1b, 2b\n"
+                     ".popsection\n"
+                     : "+D"(dst), "+S"(src), "+c"(n)
+                     :
+                     : "memory");
+    return n;
+}
+
+/*
+ * Returns where to resume after a page fault at rip on a user address, or 0 if
+ * rip is not a user access from this file (i.e. the fault is a kernel bug).
+ */
+uintptr_t user_access_fixup(uintptr_t rip)
+{
+    for (ex_entry_t *ex = (ex_entry_t *)&ex_table_start;
+         ex < (ex_entry_t *)&ex_table_end; ex++)
+    {
+        if (ex->ex_rip == rip)
+        {
+            return ex->ex_fixup;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copies nbytes between kaddr and uaddr (to_user says which way), directly
+ * where the page table allows it and through the vmmap for the pages where it
+ * does not.
+ */
+static long _copy_user(void *kaddr, void *uaddr, size_t nbytes, long to_user)
+{
+    // kernel threads have no user memory of their own in the current table
+    long direct = curproc->p_pml4 == pt_get();
+    while (nbytes)
+    {
+        if (direct)
+        {
+            size_t left = to_user ? _user_copy(uaddr, kaddr, nbytes)
+                                  : _user_copy(kaddr, uaddr, nbytes);
+            kaddr = (char *)kaddr + (nbytes - left);
+            uaddr = (char *)uaddr + (nbytes - left);
+            nbytes = left;
+            if (!nbytes)
+            {
+                break;
+            }
+        }
+
+        size_t chunk = MIN(nbytes, PAGE_SIZE - PAGE_OFFSET(uaddr));
+        long ret = to_user ? vmmap_write(curproc->p_vmmap, uaddr, kaddr, chunk)
+                           : vmmap_read(curproc->p_vmmap, uaddr, kaddr, chunk);
+        if (ret)
+        {
+            return ret;
+        }
+        kaddr = (char *)kaddr + chunk;
+        uaddr = (char *)uaddr + chunk;
+        nbytes -= chunk;
+    }
+    return 0;
+}
+
 /*
  * Check for permissions on [uaddr, uaddr + nbytes), then
  * copy nbytes from userland address uaddr to kernel address kaddr.
- * Do not access the userland virtual addresses directly; instead,
- * use vmmap_read.
  */
 long copy_from_user(void *kaddr, const void *uaddr, size_t nbytes)
 {
@@ -29,14 +123,12 @@ long copy_from_user(void *kaddr, const void *uaddr, size_t nbytes)
         return -EFAULT;
     }
     KASSERT(userland_address(uaddr) && !userland_address(kaddr));
-    return vmmap_read(curproc->p_vmmap, uaddr, kaddr, nbytes);
+    return _copy_user(kaddr, (void *)uaddr, nbytes, 0);
 }
 
 /*
  * Check for permissions on [uaddr, uaddr + nbytes), then
  * copy nbytes from kernel address kaddr to userland address uaddr.
- * Do not access the userland virtual addresses directly; instead,
- * use vmmap_write.
  */
 long copy_to_user(void *uaddr, const void *kaddr, size_t nbytes)
 {
@@ -45,7 +137,7 @@ long copy_to_user(void *uaddr, const void *kaddr, size_t nbytes)
         return -EFAULT;
     }
     KASSERT(userland_address(uaddr) && !userland_address(kaddr));
-    return vmmap_write(curproc->p_vmmap, uaddr, kaddr, nbytes);
+    return _copy_user((void *)kaddr, uaddr, nbytes, 1);
 }
 
 /*
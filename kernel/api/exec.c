@@ -1,8 +1,16 @@
+#include "errno.h"
+#include "globals.h"
 #include "util/debug.h"
 #include <util/string.h>
 
 #include "main/gdt.h"
 
+#include "fs/file.h"
+#include "fs/vnode.h"
+
+#include "proc/proc.h"
+#include "proc/sched.h"
+
 #include "api/binfmt.h"
 #include "api/exec.h"
 #include "api/syscall.h"
@@ -80,14 +88,12 @@ long do_execve(const char *filename, char *const *argv, char *const *envp,
  * as in 32-bit, although the segment descriptors they point to are slightly
  * different.
  */
-void kernel_execve(const char *filename, char *const *argv, char *const *envp)
+/*
+ * Builds a set of saved user registers for a fresh image and fakes a return
+ * from an interrupt into it. Does not return.
+ */
+static void _userland_start(uint64_t rip, uint64_t rsp)
 {
-    uint64_t rip, rsp;
-    long ret = binfmt_load(filename, argv, envp, &rip, &rsp);
-    dbg(DBG_EXEC, "ret = %ld\n", ret);
-
-    KASSERT(0 == ret); /* Should never fail to load the first binary */
-
     dbg(DBG_EXEC, "Entering userland with rip 0x%p, rsp 0x%p\n", (void *)rip,
         (void *)rsp);
     /* To enter userland, we build a set of saved registers to "trick" the
@@ -107,4 +113,188 @@ void kernel_execve(const char *filename, char *const *argv, char *const *envp)
 
     regs.r_rflags = 0x202; // see 32-bit version
     userland_entry(regs);
-}
\ No newline at end of file
+}
+
+/*
+ * The kernel version of execve needs to construct a set of saved user registers
+ * and fake a return from an interrupt to get to userland.  The 64-bit version
+ * behaves mostly the same as the 32-bit version, but there are a few
+ * differences. Besides different general purpose registers, there is no longer
+ * a need for two esp/rsp fields since popa is not valid assembly in 64-bit. The
+ * only non-null segment registers are now cs and ss, but they are set the same
+ * as in 32-bit, although the segment descriptors they point to are slightly
+ * different.
+ */
+void kernel_execve(const char *filename, char *const *argv, char *const *envp)
+{
+    uint64_t rip, rsp;
+    long ret = binfmt_load(filename, argv, envp, &rip, &rsp);
+    dbg(DBG_EXEC, "ret = %ld\n", ret);
+
+    KASSERT(0 == ret); /* Should never fail to load the first binary */
+
+    _userland_start(rip, rsp);
+}
+
+/*
+ * State shared between do_spawn() and the child's first thread. It lives on
+ * the parent's stack, which is safe because the parent sleeps until the child
+ * has finished loading the binary and no longer needs it.
+ */
+typedef struct spawn_req
+{
+    const char *sr_filename;
+    char *const *sr_argv;
+    char *const *sr_envp;
+    long sr_done;
+    long sr_ret;
+    ktqueue_t sr_wait;
+} spawn_req_t;
+
+static void *_spawn_run(long arg1, void *arg2)
+{
+    spawn_req_t *req = arg2;
+    uint64_t rip, rsp;
+    long ret =
+        binfmt_load(req->sr_filename, req->sr_argv, req->sr_envp, &rip, &rsp);
+    dbg(DBG_EXEC, "spawn of %s: ret = %ld\n", req->sr_filename, ret);
+
+    req->sr_ret = ret;
+    req->sr_done = 1;
+    sched_wakeup_on(&req->sr_wait, NULL);
+    /* req is gone once the parent runs again */
+    if (ret < 0)
+    {
+        return (void *)ret;
+    }
+    _userland_start(rip, rsp);
+    panic("returned from userland_entry\n");
+    return NULL;
+}
+
+#ifdef __VFS__
+/*
+ * Gives the child a copy of the parent's file table and cwd, then applies the
+ * caller's dup2/close actions to the child's table only.
+ */
+static long _spawn_files(proc_t *child, const spawn_action_t *actions,
+                         size_t nactions)
+{
+    /* proc_create() may already have copied these */
+    for (int fd = 0; fd < NFILES; fd++)
+    {
+        if (!child->p_files[fd] && curproc->p_files[fd])
+        {
+            child->p_files[fd] = curproc->p_files[fd];
+            fref(child->p_files[fd]);
+        }
+    }
+    if (!child->p_cwd && curproc->p_cwd)
+    {
+        child->p_cwd = curproc->p_cwd;
+        vref(child->p_cwd);
+    }
+
+    for (size_t i = 0; i < nactions; i++)
+    {
+        const spawn_action_t *sa = &actions[i];
+        if (sa->sa_fd < 0 || sa->sa_fd >= NFILES)
+        {
+            return -EBADF;
+        }
+        switch (sa->sa_op)
+        {
+        case SPAWN_CLOSE:
+            if (!child->p_files[sa->sa_fd])
+            {
+                return -EBADF;
+            }
+            fput(&child->p_files[sa->sa_fd]);
+            break;
+        case SPAWN_DUP2:
+            if (sa->sa_newfd < 0 || sa->sa_newfd >= NFILES ||
+                !child->p_files[sa->sa_fd])
+            {
+                return -EBADF;
+            }
+            if (sa->sa_newfd == sa->sa_fd)
+            {
+                break;
+            }
+            if (child->p_files[sa->sa_newfd])
+            {
+                fput(&child->p_files[sa->sa_newfd]);
+            }
+            child->p_files[sa->sa_newfd] = child->p_files[sa->sa_fd];
+            fref(child->p_files[sa->sa_newfd]);
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Creates a child process running filename, without ever duplicating the
+ * parent's address space: the child starts out with an empty vmmap that
+ * binfmt_load() replaces, so there is no vmmap clone, no shadow objects and no
+ * copy-on-write faults to undo the moment the child execs.
+ *
+ * The parent sleeps until the child has loaded the binary, so a failed load
+ * is reported to the caller (and the child reaped) instead of showing up as
+ * an exit status later.
+ *
+ * Returns the child's pid, or:
+ *  - ENOMEM: Could not create the process or its thread
+ *  - EBADF, EINVAL: An fd action was invalid
+ *  - Propagate errors from binfmt_load()
+ */
+long do_spawn(const char *filename, char *const *argv, char *const *envp,
+              const spawn_action_t *actions, size_t nactions)
+{
+    proc_t *child = proc_create(filename);
+    if (!child)
+    {
+        return -ENOMEM;
+    }
+
+    long ret = 0;
+#ifdef __VFS__
+    ret = _spawn_files(child, actions, nactions);
+#else
+    if (nactions)
+    {
+        ret = -EINVAL;
+    }
+#endif
+    spawn_req_t req = {.sr_filename = filename,
+                       .sr_argv = argv,
+                       .sr_envp = envp,
+                       .sr_done = 0,
+                       .sr_ret = 0};
+    sched_queue_init(&req.sr_wait);
+
+    kthread_t *thr = ret ? NULL : kthread_create(child, _spawn_run, 0, &req);
+    if (!thr)
+    {
+        list_remove(&child->p_child_link);
+        proc_destroy(child);
+        return ret ? ret : -ENOMEM;
+    }
+
+    pid_t pid = child->p_pid;
+    sched_make_runnable(thr);
+    while (!req.sr_done)
+    {
+        sched_sleep_on(&req.sr_wait);
+    }
+
+    if (req.sr_ret < 0)
+    {
+        do_waitpid(pid, NULL, 0);
+        return req.sr_ret;
+    }
+    return pid;
+}
@@ -2,6 +2,7 @@
 #include "globals.h"
 #include "kernel.h"
 #include <fs/vfs.h>
+#include <limits.h>
 #include <util/time.h>
 
 #include "main/inits.h"
@@ -9,7 +10,9 @@
 
 #include "mm/kmalloc.h"
 #include "mm/mman.h"
+#include "mm/page.h"
 
+#include "fs/file.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 
@@ -30,7 +33,7 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs);
 
 extern size_t active_tty;
 
-static const char *syscall_strings[49] = {
+static const char *syscall_strings[61] = {
     "syscall", "exit", "fork", "read", "write", "open",
     "close", "waitpid", "link", "unlink", "execve", "chdir",
     "sleep", "unknown", "lseek", "sync", "nuke", "dup",
@@ -38,7 +41,10 @@ static const char *syscall_strings[49] = {
     "mmap", "mprotect", "munmap", "rename", "uname", "thr_create",
     "thr_cancel", "thr_exit", "thr_yield", "thr_join", "gettid", "getpid",
     "unknown", "unkown", "unknown", "errno", "halt", "get_free_mem",
-    "set_errno", "dup2", "brk", "mount", "umount", "stat", "usleep"};
+    "set_errno", "dup2", "brk", "mount", "umount", "stat",
+    "time", "usleep", "spawn", "madvise", "mlock",
+    "munlock", "fsync", "fdatasync", "getdents64", "readv",
+    "writev", "pread", "pwrite"};
 
 void syscall_init(void) { intr_register(INTR_SYSCALL, syscall_handler); }
 
@@ -88,6 +94,139 @@ static long sys_write(write_args_t *args)
     return -1;
 }
 
+/* Largest kernel buffer a single readv/writev/pread/pwrite goes through */
+#define RW_VEC_MAX_PAGES 4
+
+/*
+ * Read into or write from the user segments uiov (already copied into the
+ * kernel) at offset, or at the file position if offset is -1. The transfer
+ * goes through a kernel bounce buffer of RW_VEC_MAX_PAGES pages, one buffer
+ * full at a time: each round hands do_readv or do_writev the slices of the
+ * segments that fit in it. A short transfer or an error ends the call; an
+ * error after some bytes were moved returns those bytes instead.
+ */
+static long sys_rw_vec(int fd, const iovec_t *uiov, int iovcnt, off_t offset,
+                       long write)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        ERROR_OUT(uiov[i].iov_len > (size_t)LONG_MAX - total, EINVAL);
+        total += uiov[i].iov_len;
+    }
+
+    // kiov[i] is a slice of the buffer, uslice[i] the user memory it is for
+    iovec_t *kiov = kmalloc(2 * MAX(iovcnt, 1) * sizeof(iovec_t));
+    ERROR_OUT(!kiov, ENOMEM);
+    iovec_t *uslice = kiov + MAX(iovcnt, 1);
+    char *buf = page_alloc_n(RW_VEC_MAX_PAGES);
+    if (!buf)
+    {
+        kfree(kiov);
+        ERROR_OUT(1, ENOMEM);
+    }
+
+    long ret = 0;
+    size_t done = 0;
+    int seg = 0;
+    size_t segoff = 0;
+    do
+    {
+        // slice the segments from (seg, segoff) on into the buffer
+        int n = 0;
+        size_t len = 0;
+        while (seg < iovcnt && len < RW_VEC_MAX_PAGES * PAGE_SIZE)
+        {
+            size_t take = MIN(uiov[seg].iov_len - segoff,
+                              RW_VEC_MAX_PAGES * PAGE_SIZE - len);
+            kiov[n].iov_base = buf + len;
+            kiov[n].iov_len = take;
+            uslice[n].iov_base = (char *)uiov[seg].iov_base + segoff;
+            uslice[n].iov_len = take;
+            if (write && take)
+            {
+                ret = copy_from_user(kiov[n].iov_base, uslice[n].iov_base,
+                                     take);
+                if (ret)
+                {
+                    break;
+                }
+            }
+            n++;
+            len += take;
+            segoff += take;
+            if (segoff == uiov[seg].iov_len)
+            {
+                seg++;
+                segoff = 0;
+            }
+        }
+        if (ret)
+        {
+            break;
+        }
+
+        off_t pos = offset == -1 ? -1 : offset + (off_t)done;
+        ret = write ? do_writev(fd, kiov, n, pos) : do_readv(fd, kiov, n, pos);
+        if (ret < 0)
+        {
+            break;
+        }
+
+        size_t moved = write ? (size_t)ret : 0;
+        for (int i = 0; !write && moved < (size_t)ret; i++)
+        {
+            size_t take = MIN(kiov[i].iov_len, (size_t)ret - moved);
+            long err = copy_to_user(uslice[i].iov_base, kiov[i].iov_base, take);
+            if (err)
+            {
+                ret = err;
+                break;
+            }
+            moved += take;
+        }
+        done += moved;
+        if (ret < 0 || (size_t)ret < len)
+        {
+            break;
+        }
+    } while (seg < iovcnt);
+
+    page_free_n(buf, RW_VEC_MAX_PAGES);
+    kfree(kiov);
+    if (done)
+    {
+        return done;
+    }
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_readv(readv_args_t *args, long write)
+{
+    readv_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ERROR_OUT(kargs.iovcnt < 0 || kargs.iovcnt > IOV_MAX, EINVAL);
+
+    iovec_t uiov[IOV_MAX];
+    ret = copy_from_user(uiov, kargs.iov, kargs.iovcnt * sizeof(iovec_t));
+    ERROR_OUT_RET(ret);
+
+    return sys_rw_vec(kargs.fd, uiov, kargs.iovcnt, -1, write);
+}
+
+static long sys_pread(pread_args_t *args, long write)
+{
+    pread_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ERROR_OUT(kargs.offset < 0, EINVAL);
+
+    iovec_t uiov = {.iov_base = kargs.buf, .iov_len = kargs.nbytes};
+    return sys_rw_vec(kargs.fd, &uiov, 1, kargs.offset, write);
+}
+
 /*
  * This similar to the other system calls that you have implemented above. 
  * 
@@ -104,6 +243,49 @@ static long sys_getdents(getdents_args_t *args)
     return -1;
 }
 
+/* Largest kernel buffer a single getdents64 goes through, in pages */
+#define GETDENTS64_MAX_PAGES 4
+
+/*
+ * Fill the user's buffer with as many packed entries as fit (see
+ * do_getdents64). The entries are gathered in a kernel buffer of up to
+ * GETDENTS64_MAX_PAGES pages, so a bigger user buffer is only partly filled.
+ * If they cannot be copied out, the file position is put back so that the
+ * entries are not lost.
+ */
+static long sys_getdents64(getdents64_args_t *args)
+{
+    getdents64_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ERROR_OUT(kargs.count < DIRENT64_RECLEN(0), EINVAL);
+
+    size_t npages =
+        MIN(ADDR_TO_PN(PAGE_ALIGN_UP(kargs.count)), GETDENTS64_MAX_PAGES);
+    void *buf = page_alloc_n(npages);
+    ERROR_OUT(!buf, ENOMEM);
+
+    file_t *file = fget(kargs.fd);
+    size_t pos = file ? file->f_pos : 0;
+    ret = do_getdents64(kargs.fd, buf, MIN(kargs.count, npages * PAGE_SIZE));
+    if (ret > 0)
+    {
+        long err = copy_to_user(kargs.dirp, buf, (size_t)ret);
+        if (err && file)
+        {
+            file->f_pos = pos;
+        }
+        ret = err ? err : ret;
+    }
+    if (file)
+    {
+        fput(&file);
+    }
+    page_free_n(buf, npages);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
 #ifdef __MOUNTING__
 static long sys_mount(mount_args_t *arg)
 {
@@ -194,6 +376,13 @@ static long sys_dup(int fd)
     return ret;
 }
 
+static long sys_fsync(int fd, long datasync)
+{
+    long ret = do_fsync(fd, datasync);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
 static long sys_dup2(const dup2_args_t *args)
 {
     dup2_args_t kargs;
@@ -363,6 +552,31 @@ static long sys_munmap(munmap_args_t *args)
     return ret;
 }
 
+static long sys_madvise(madvise_args_t *args)
+{
+    madvise_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    ret = do_madvise(kargs.addr, kargs.len, kargs.advice);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_mlock(mlock_args_t *args, long lock)
+{
+    mlock_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    ret = lock ? do_mlock(kargs.addr, kargs.len)
+               : do_munlock(kargs.addr, kargs.len);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
 static void *sys_mmap(mmap_args_t *arg)
 {
     mmap_args_t kargs;
@@ -534,6 +748,60 @@ cleanup:
     return ret;
 }
 
+static long sys_spawn(spawn_args_t *args)
+{
+    spawn_args_t kargs;
+    char *filename = NULL;
+    char **argv = NULL;
+    char **envp = NULL;
+    spawn_action_t *actions = NULL;
+
+    long ret;
+    if ((ret = copy_from_user(&kargs, args, sizeof(kargs))))
+        goto cleanup;
+
+    if (kargs.nactions > 2 * NFILES)
+    {
+        ret = -EINVAL;
+        goto cleanup;
+    }
+
+    if ((ret = user_strdup(&kargs.filename, &filename)))
+        goto cleanup;
+
+    if (kargs.argv.av_vec && (ret = user_vecdup(&kargs.argv, &argv)))
+        goto cleanup;
+
+    if (kargs.envp.av_vec && (ret = user_vecdup(&kargs.envp, &envp)))
+        goto cleanup;
+
+    if (kargs.nactions)
+    {
+        size_t size = kargs.nactions * sizeof(spawn_action_t);
+        if (!(actions = kmalloc(size)))
+        {
+            ret = -ENOMEM;
+            goto cleanup;
+        }
+        if ((ret = copy_from_user(actions, kargs.actions, size)))
+            goto cleanup;
+    }
+
+    ret = do_spawn(filename, argv, envp, actions, kargs.nactions);
+
+cleanup:
+    if (filename)
+        kfree(filename);
+    if (argv)
+        free_vector(argv);
+    if (envp)
+        free_vector(envp);
+    if (actions)
+        kfree(actions);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
 static long sys_debug(argstr_t *args)
 {
     argstr_t kargs;
@@ -589,7 +857,7 @@ static long syscall_handler(regs_t *regs)
     uintptr_t args = (uintptr_t)regs->r_rdx;
 
     const char *syscall_string;
-    if (sysnum <= 47)
+    if (sysnum < sizeof(syscall_strings) / sizeof(syscall_strings[0]))
     {
         syscall_string = syscall_strings[sysnum];
     }
@@ -668,6 +936,15 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_munmap:
         return sys_munmap((munmap_args_t *)args);
 
+    case SYS_madvise:
+        return sys_madvise((madvise_args_t *)args);
+
+    case SYS_mlock:
+        return sys_mlock((mlock_args_t *)args, 1);
+
+    case SYS_munlock:
+        return sys_mlock((mlock_args_t *)args, 0);
+
     case SYS_open:
         return sys_open((open_args_t *)args);
 
@@ -683,6 +960,12 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_dup:
         return sys_dup((int)args);
 
+    case SYS_fsync:
+        return sys_fsync((int)args, 0);
+
+    case SYS_fdatasync:
+        return sys_fsync((int)args, 1);
+
     case SYS_dup2:
         return sys_dup2((dup2_args_t *)args);
 
@@ -707,6 +990,21 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_getdents:
         return sys_getdents((getdents_args_t *)args);
 
+    case SYS_getdents64:
+        return sys_getdents64((getdents64_args_t *)args);
+
+    case SYS_readv:
+        return sys_readv((readv_args_t *)args, 0);
+
+    case SYS_writev:
+        return sys_readv((readv_args_t *)args, 1);
+
+    case SYS_pread:
+        return sys_pread((pread_args_t *)args, 0);
+
+    case SYS_pwrite:
+        return sys_pread((pread_args_t *)args, 1);
+
     case SYS_brk:
         return (long)sys_brk((void *)args);
 
@@ -727,6 +1025,9 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_execve:
         return sys_execve((execve_args_t *)args, regs);
 
+    case SYS_spawn:
+        return sys_spawn((spawn_args_t *)args);
+
     case SYS_stat:
         return sys_stat((stat_args_t *)args);
 
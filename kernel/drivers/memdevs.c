@@ -114,17 +114,19 @@ static ssize_t zero_read(chardev_t *dev, size_t pos, void *buf, size_t count)
  * Unlike in s5fs_mmap(), you can't necessarily use the file's underlying mobj.
  * Instead, you should simply provide an anonymous object to ret. Keep the
  * anonymous object locked when this function returns.
+ *
+ * Pages of the mapping that are only ever read all share the zero page (see
+ * mobj_default_get_pframe()).
  */
 static long zero_mmap(vnode_t *file, mobj_t **ret)
 {
-    // Create an anonymous memory object for /dev/zero mmap
+    // Create an anonymous memory object for /dev/zero mmap; anon_create()
+    // returns it locked
     mobj_t *anon_obj = anon_create();
     if (!anon_obj){
         return -ENOMEM;
     }
     
-    // Keep the anonymous object locked when returning
-    mobj_lock(anon_obj);
     *ret = anon_obj;
     return 0;
 }
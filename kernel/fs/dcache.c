@@ -0,0 +1,276 @@
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "fs/dcache.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "mm/slab.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+/*
+ * The directory entry cache.
+ *
+ * Remembers the results of directory lookups, keyed by the directory and the
+ * name looked up, so that resolving the same path again does not have to call
+ * into the filesystem. An entry records the inode number the name leads to, or
+ * that the name does not exist (a negative entry, for lookups that failed with
+ * ENOENT). Entries identify directories and files by filesystem and inode
+ * number and hold no vnode references; a hit is turned back into a vnode with
+ * vget(), which the vnode cache answers without touching the filesystem for
+ * recently used files.
+ *
+ * Entries are only valid while the directory is unchanged, so everything that
+ * adds, removes or renames a name must call dcache_remove() for it while the
+ * directory is still locked, and rmdir must also call dcache_purge_dir() on the
+ * directory it removed, whose inode number can be reused. Lookups must hold the
+ * directory's lock as well, so an entry cannot go stale between being found and
+ * the vget() of its file.
+ *
+ * "." is never cached. Names longer than NAME_LEN are not either. Once there
+ * are DCACHE_MAX_ENTRIES, the least recently used entry is reused.
+ */
+
+#define DCACHE_HASH_BITS 9
+#define DCACHE_HASH_BUCKETS (1UL << DCACHE_HASH_BITS)
+
+#define DCACHE_MAX_ENTRIES 1024
+
+typedef struct dcache_entry
+{
+    list_link_t de_hash_link;
+    list_link_t de_lru_link;
+    fs_t *de_fs;
+    ino_t de_dir;
+    ino_t de_ino;
+    long de_negative;
+    size_t de_hash;
+    size_t de_namelen;
+    char de_name[NAME_LEN];
+} dcache_entry_t;
+
+static list_t dcache_hash[DCACHE_HASH_BUCKETS];
+static list_t dcache_lru = LIST_INITIALIZER(dcache_lru);
+static size_t dcache_count;
+static kmutex_t dcache_mutex = KMUTEX_INITIALIZER(dcache_mutex);
+static slab_allocator_t *dcache_allocator;
+
+static size_t dcache_hits;
+static size_t dcache_negative_hits;
+static size_t dcache_misses;
+static size_t dcache_removed;
+
+void dcache_init()
+{
+    for (size_t i = 0; i < DCACHE_HASH_BUCKETS; i++)
+    {
+        list_init(&dcache_hash[i]);
+    }
+    dcache_allocator = slab_allocator_create("dcache", sizeof(dcache_entry_t));
+    KASSERT(dcache_allocator);
+}
+
+/* FNV-1a over the name, mixed with the directory */
+static size_t _dcache_hash(vnode_t *dir, const char *name, size_t namelen)
+{
+    uint64_t hash = 0xcbf29ce484222325UL ^ ((uintptr_t)dir->vn_fs >> 4) ^
+                    ((uint64_t)dir->vn_vno << 32);
+    for (size_t i = 0; i < namelen; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3UL;
+    }
+    return hash;
+}
+
+static list_t *_dcache_bucket(size_t hash)
+{
+    return &dcache_hash[(hash * 0x9E3779B97F4A7C15UL) >>
+                        (64 - DCACHE_HASH_BITS)];
+}
+
+/* Returns the entry for name in dir, or NULL. dcache_mutex must be held. */
+static dcache_entry_t *_dcache_find(vnode_t *dir, const char *name,
+                                    size_t namelen, size_t hash)
+{
+    list_iterate(_dcache_bucket(hash), de, dcache_entry_t, de_hash_link)
+    {
+        if (de->de_hash == hash && de->de_fs == dir->vn_fs &&
+            de->de_dir == dir->vn_vno && de->de_namelen == namelen &&
+            !memcmp(de->de_name, name, namelen))
+        {
+            return de;
+        }
+    }
+    return NULL;
+}
+
+static void _dcache_free(dcache_entry_t *de)
+{
+    list_remove(&de->de_hash_link);
+    list_remove(&de->de_lru_link);
+    dcache_count--;
+    slab_obj_free(dcache_allocator, de);
+}
+
+static long _dcache_cacheable(const char *name, size_t namelen)
+{
+    return namelen && namelen < NAME_LEN && !(namelen == 1 && name[0] == '.');
+}
+
+/*
+ * Looks name up in dir's cached entries. dir must be locked.
+ *
+ * Returns 0 and a new reference to the file's vnode in *res_vnode, -ENOENT if
+ * the name is known not to exist, or DCACHE_MISS if nothing is cached for it.
+ */
+long dcache_lookup(vnode_t *dir, const char *name, size_t namelen,
+                   vnode_t **res_vnode)
+{
+    KASSERT(kmutex_owns_mutex(&dir->vn_mobj.mo_mutex));
+    if (!_dcache_cacheable(name, namelen))
+    {
+        return DCACHE_MISS;
+    }
+
+    size_t hash = _dcache_hash(dir, name, namelen);
+    kmutex_lock(&dcache_mutex);
+    dcache_entry_t *de = _dcache_find(dir, name, namelen, hash);
+    if (!de)
+    {
+        dcache_misses++;
+        kmutex_unlock(&dcache_mutex);
+        return DCACHE_MISS;
+    }
+    list_remove(&de->de_lru_link);
+    list_insert_tail(&dcache_lru, &de->de_lru_link);
+    long negative = de->de_negative;
+    ino_t ino = de->de_ino;
+    if (negative)
+    {
+        dcache_negative_hits++;
+    }
+    else
+    {
+        dcache_hits++;
+    }
+    kmutex_unlock(&dcache_mutex);
+
+    if (negative)
+    {
+        return -ENOENT;
+    }
+    *res_vnode = vget(dir->vn_fs, ino);
+    return 0;
+}
+
+/*
+ * Records the result of looking name up in dir: res_vnode, or NULL if the
+ * lookup failed with ENOENT. dir must be locked.
+ */
+void dcache_enter(vnode_t *dir, const char *name, size_t namelen,
+                  vnode_t *res_vnode)
+{
+    KASSERT(kmutex_owns_mutex(&dir->vn_mobj.mo_mutex));
+    if (!_dcache_cacheable(name, namelen) ||
+        (res_vnode && res_vnode->vn_fs != dir->vn_fs))
+    {
+        return;
+    }
+
+    size_t hash = _dcache_hash(dir, name, namelen);
+    kmutex_lock(&dcache_mutex);
+    dcache_entry_t *de = _dcache_find(dir, name, namelen, hash);
+    if (!de)
+    {
+        if (dcache_count < DCACHE_MAX_ENTRIES)
+        {
+            de = slab_obj_alloc(dcache_allocator);
+        }
+        if (!de && dcache_count)
+        {
+            de = list_head(&dcache_lru, dcache_entry_t, de_lru_link);
+            list_remove(&de->de_hash_link);
+            list_remove(&de->de_lru_link);
+            dcache_count--;
+        }
+        if (!de)
+        {
+            kmutex_unlock(&dcache_mutex);
+            return;
+        }
+        de->de_fs = dir->vn_fs;
+        de->de_dir = dir->vn_vno;
+        de->de_hash = hash;
+        de->de_namelen = namelen;
+        memcpy(de->de_name, name, namelen);
+        list_insert_head(_dcache_bucket(hash), &de->de_hash_link);
+        list_insert_tail(&dcache_lru, &de->de_lru_link);
+        dcache_count++;
+    }
+    de->de_negative = !res_vnode;
+    de->de_ino = res_vnode ? res_vnode->vn_vno : 0;
+    kmutex_unlock(&dcache_mutex);
+}
+
+/*
+ * Forgets what is cached for name in dir. Called when name is created,
+ * removed or renamed, with dir locked.
+ */
+void dcache_remove(vnode_t *dir, const char *name, size_t namelen)
+{
+    if (!_dcache_cacheable(name, namelen))
+    {
+        return;
+    }
+    size_t hash = _dcache_hash(dir, name, namelen);
+    kmutex_lock(&dcache_mutex);
+    dcache_entry_t *de = _dcache_find(dir, name, namelen, hash);
+    if (de)
+    {
+        _dcache_free(de);
+        dcache_removed++;
+    }
+    kmutex_unlock(&dcache_mutex);
+}
+
+/* Removes every entry whose directory is on fs and, if dir is set, is dir */
+static void _dcache_purge(fs_t *fs, ino_t dir, long match_dir)
+{
+    kmutex_lock(&dcache_mutex);
+    list_iterate(&dcache_lru, de, dcache_entry_t, de_lru_link)
+    {
+        if (de->de_fs == fs && (!match_dir || de->de_dir == dir))
+        {
+            _dcache_free(de);
+        }
+    }
+    kmutex_unlock(&dcache_mutex);
+}
+
+/*
+ * Forgets everything cached about the contents of dir. Called on a directory
+ * that was removed, before its inode number can be reused.
+ */
+void dcache_purge_dir(vnode_t *dir)
+{
+    _dcache_purge(dir->vn_fs, dir->vn_vno, 1);
+}
+
+/* Forgets everything cached about fs, ahead of unmounting it. */
+void dcache_purge(fs_t *fs) { _dcache_purge(fs, 0, 0); }
+
+size_t dcache_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+    iprintf(&buf, &size, "dentry cache lookups: %lu hits, %lu negative hits, "
+                         "%lu misses\n",
+            dcache_hits, dcache_negative_hits, dcache_misses);
+    iprintf(&buf, &size, "dentries:             %lu (%lu invalidated)\n",
+            dcache_count, dcache_removed);
+    return size;
+}
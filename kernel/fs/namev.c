@@ -6,6 +6,7 @@
 #include "util/debug.h"
 #include "util/string.h"
 
+#include "fs/dcache.h"
 #include "fs/fcntl.h"
 #include "fs/stat.h"
 #include "fs/vfs.h"
@@ -28,6 +29,9 @@
  * Because you are the one writing nearly all of the calls to namev_lookup(), it
  * is up to you both how you handle all inputs (i.e. dir or name is null,
  * namelen is 0), and whether namev_lookup() even gets called with a bad input.
+ *
+ * Try dcache_lookup() before the lookup operation; only on DCACHE_MISS call the
+ * operation, and record a successful result or an ENOENT with dcache_enter().
  */
 long namev_lookup(vnode_t *dir, const char *name, size_t namelen,
                   vnode_t **res_vnode)
@@ -172,7 +176,8 @@ long namev_dir(vnode_t *base, const char *path, vnode_t **res_vnode,
  *  - If namev_lookup() fails and O_CREAT is specified in oflags, use
  *    the parent directory's vnode operation mknod to create the vnode.
  *    Use the basename info from namev_dir(), and the mode and devid
- *    provided to namev_open().
+ *    provided to namev_open(). Then dcache_remove() the name, which is
+ *    cached as not existing.
  *  - Use the macro S_ISDIR() to check if a vnode actually is a directory.
  *  - Use the macro NAME_LEN to check the basename length. Check out
  *    ramfs_mknod() to confirm that the name should be null-terminated.
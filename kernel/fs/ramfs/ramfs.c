@@ -33,10 +33,13 @@ static void ramfs_read_vnode(fs_t *fs, vnode_t *vn);
 
 static void ramfs_delete_vnode(fs_t *fs, vnode_t *vn);
 
+static long ramfs_keep_vnode(fs_t *fs, vnode_t *vn);
+
 static long ramfs_umount(fs_t *fs);
 
 static fs_ops_t ramfs_ops = {.read_vnode = ramfs_read_vnode,
                              .delete_vnode = ramfs_delete_vnode,
+                             .keep_vnode = ramfs_keep_vnode,
                              .umount = ramfs_umount};
 
 /*
@@ -95,7 +98,8 @@ static vnode_ops_t ramfs_dir_vops = {.read = NULL,
                                      .get_pframe = NULL,
                                      .fill_pframe = NULL,
                                      .flush_pframe = NULL,
-                                     .truncate_file = NULL};
+                                     .truncate_file = NULL,
+                                     .fsync = NULL};
 
 static vnode_ops_t ramfs_file_vops = {.read = ramfs_read,
                                       .write = ramfs_write,
@@ -112,7 +116,8 @@ static vnode_ops_t ramfs_file_vops = {.read = ramfs_read,
                                       .get_pframe = NULL,
                                       .fill_pframe = NULL,
                                       .flush_pframe = NULL,
-                                      .truncate_file = ramfs_truncate_file};
+                                      .truncate_file = ramfs_truncate_file,
+                                      .fsync = NULL};
 
 /*
  * The ramfs 'inode' structure
@@ -314,6 +319,12 @@ static void ramfs_delete_vnode(fs_t *fs, vnode_t *vn)
     }
 }
 
+/* The vnode holds one of the inode's links itself, see ramfs_read_vnode() */
+static long ramfs_keep_vnode(fs_t *fs, vnode_t *vn)
+{
+    return VNODE_TO_RAMFSINODE(vn)->rf_linkcount > 1;
+}
+
 static ssize_t ramfs_umount(fs_t *fs)
 {
     /* We don't need to do any flushing or anything as everything is in memory.
@@ -12,6 +12,7 @@
 #include "fs/dirent.h"
 #include "fs/file.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/stat.h"
 
@@ -25,6 +26,8 @@ static void s5fs_read_vnode(fs_t *fs, vnode_t *vn);
 
 static void s5fs_delete_vnode(fs_t *fs, vnode_t *vn);
 
+static long s5fs_keep_vnode(fs_t *fs, vnode_t *vn);
+
 static long s5fs_umount(fs_t *fs);
 
 static void s5fs_sync(fs_t *fs);
@@ -62,6 +65,8 @@ static long s5fs_stat(vnode_t *vnode, stat_t *ss);
 
 static void s5fs_truncate_file(vnode_t *vnode);
 
+static long s5fs_fsync(vnode_t *vnode, long datasync);
+
 static long s5fs_release(vnode_t *vnode, file_t *file);
 
 static long s5fs_get_pframe(vnode_t *vnode, size_t pagenum, long forwrite,
@@ -73,6 +78,7 @@ static long s5fs_flush_pframe(vnode_t *vnode, pframe_t *pf);
 
 fs_ops_t s5fs_fsops = {.read_vnode = s5fs_read_vnode,
                        .delete_vnode = s5fs_delete_vnode,
+                       .keep_vnode = s5fs_keep_vnode,
                        .umount = s5fs_umount,
                        .sync = s5fs_sync};
 
@@ -93,7 +99,8 @@ static vnode_ops_t s5fs_dir_vops = {.read = NULL,
                                     .get_pframe = s5fs_get_pframe,
                                     .fill_pframe = s5fs_fill_pframe,
                                     .flush_pframe = s5fs_flush_pframe,
-                                    .truncate_file = NULL};
+                                    .truncate_file = NULL,
+                                    .fsync = s5fs_fsync};
 
 static vnode_ops_t s5fs_file_vops = {.read = s5fs_read,
                                      .write = s5fs_write,
@@ -111,12 +118,17 @@ static vnode_ops_t s5fs_file_vops = {.read = s5fs_read,
                                      .get_pframe = s5fs_get_pframe,
                                      .fill_pframe = s5fs_fill_pframe,
                                      .flush_pframe = s5fs_flush_pframe,
-                                     .truncate_file = s5fs_truncate_file};
+                                     .truncate_file = s5fs_truncate_file,
+                                     .fsync = s5fs_fsync};
+
 
+static long s5fs_meta_fill_pframe(mobj_t *o, pframe_t *pf);
+
+static long s5fs_meta_flush_pframe(mobj_t *o, pframe_t *pf);
 
 static mobj_ops_t s5fs_mobj_ops = {.get_pframe = NULL,
-                                   .fill_pframe = blockdev_fill_pframe,
-                                   .flush_pframe = blockdev_flush_pframe,
+                                   .fill_pframe = s5fs_meta_fill_pframe,
+                                   .flush_pframe = s5fs_meta_flush_pframe,
                                    .destructor = NULL};
 
 /*
@@ -157,6 +169,7 @@ long s5fs_mount(fs_t *fs)
 
     mobj_init(&s5fs->s5f_mobj, MOBJ_FS, &s5fs_mobj_ops);
     s5fs->s5f_bdev = dev;
+    memset(&s5fs->s5f_journal, 0, sizeof(s5fs->s5f_journal));
 
     pframe_t *pf;
     s5_get_meta_disk_block(s5fs, S5_SUPER_BLOCK, 0, &pf);
@@ -172,6 +185,27 @@ long s5fs_mount(fs_t *fs)
     }
 
     kmutex_init(&s5fs->s5f_mutex);
+    kmutex_init(&s5fs->s5f_inode_mutex);
+    list_init(&s5fs->s5f_dirty_inodes);
+
+    // replaying the journal may bring in a newer superblock
+    long ret = s5_journal_init(s5fs);
+    if (!ret && s5_check_super(&s5fs->s5f_super))
+    {
+        ret = -EINVAL;
+    }
+    if (!ret)
+    {
+        ret = s5_bitmap_init(s5fs);
+    }
+    if (ret)
+    {
+        s5_journal_shutdown(s5fs);
+        kfree(s5fs);
+        slab_allocator_destroy(fs->fs_vnode_allocator);
+        fs->fs_vnode_allocator = NULL;
+        return ret;
+    }
 
     s5fs->s5f_fs = fs;
 
@@ -215,6 +249,12 @@ static long s5fs_umount(fs_t *fs)
     vput(&fs->fs_root);
 
     s5fs_sync(fs);
+    KASSERT(list_empty(&s5fs->s5f_dirty_inodes));
+    s5_journal_shutdown(s5fs);
+    if (s5fs->s5f_group_free)
+    {
+        kfree(s5fs->s5f_group_free);
+    }
     kfree(s5fs);
     return 0;
 }
@@ -225,6 +265,8 @@ static void s5fs_sync(fs_t *fs)
     mobj_t *mobj = &s5fs->s5f_mobj;
 
     
+    s5_write_dirty_inodes(s5fs);
+
     pframe_t *pf;
     s5_get_meta_disk_block(s5fs, S5_SUPER_BLOCK, 1, &pf);
     memcpy(pf->pf_addr, &s5fs->s5f_super, sizeof(s5_super_t));
@@ -250,9 +292,12 @@ static void s5fs_sync(fs_t *fs)
  *       containing it (returns the offset that the inode is stored within the block)
  *  - You should initialize the s5_node_t's inode field by reading directly from
  *    the inode on disk by using the page frame returned from s5_get_disk_block. Also 
- *    make sure to initialize the dirtied_inode field.
+ *    make sure to initialize the dirtied_inode field (to 0) and dirty_link
+ *    (list_link_init). The node goes on the dirty inode list only once its
+ *    inode changes (s5_dirty_inode).
  *  - Using the inode info, you need to initialize the following vnode fields:
  *    vn_len, vn_mode, and vn_ops using the fields found in the s5_inode struct.
+ *    Use s5_inode_size for vn_len.
  *  - See stat.h for vn_mode values.
  *  - For character and block devices:
  *    1) Initialize vn_devid by reading the inode's s5_indirect_block field.
@@ -271,7 +316,11 @@ static void s5fs_read_vnode(fs_t *fs, vnode_t *vn)
  *  - Cases to consider:
  *    1) The inode is no longer in use (linkcount == 0), so free it using
  *       s5_free_inode.
- *    2) The inode is dirty, so write it back to disk.
+ *    2) The inode is dirty, so write it back to disk with s5_write_inode,
+ *       which also writes the other dirty inodes of its inode block. Do
+ *       this in case 1 as well, before s5_free_inode, both to take the node
+ *       off the dirty inode list and because s5_free_inode frees the blocks
+ *       listed in the inode on disk.
  *    3) The inode is unchanged, so do nothing.
  */
 static void s5fs_delete_vnode(fs_t *fs, vnode_t *vn)
@@ -279,6 +328,12 @@ static void s5fs_delete_vnode(fs_t *fs, vnode_t *vn)
     NOT_YET_IMPLEMENTED("S5FS: s5fs_delete_vnode");
 }
 
+/* Unused vnodes of files that are still linked are worth keeping around. */
+static long s5fs_keep_vnode(fs_t *fs, vnode_t *vn)
+{
+    return VNODE_TO_S5NODE(vn)->inode.s5_linkcount > 0;
+}
+
 /* Wrapper around s5_read_file. */
 static ssize_t s5fs_read(vnode_t *vnode, size_t pos, void *buf, size_t len)
 {
@@ -484,8 +539,9 @@ static long s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen,
  *
  * Hints:
  *  - If you are confident you are managing directory entries properly, you can
- *    check for ENOTEMPTY by simply checking the length of the directory to be
- *    removed. An empty directory has two entries: "." and "..". 
+ *    check for ENOTEMPTY by simply checking the number of entries in the
+ *    directory to be removed (s5_dir_nentries). An empty directory has two
+ *    entries: "." and "..". 
  *  - Remove the three entries created in s5fs_mkdir.
  */
 static long s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
@@ -512,6 +568,8 @@ static long s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
  *    s5_dirent_t variable and use that as the buffer to pass into s5_read_file. 
  *  - Be careful that you read into an s5_dirent_t and populate the provided
  *    dirent_t properly.
+ *  - If s5_dir_is_indexed, use s5_dir_index_readdir instead; it skips the
+ *    unused slots of a hashed directory.
  */
 static long s5fs_readdir(vnode_t *vnode, size_t pos, struct dirent *d)
 {
@@ -560,8 +618,8 @@ static void s5fs_truncate_file(vnode_t *file)
     s5_node_t* s5_node = VNODE_TO_S5NODE(file); 
     s5_inode_t* s5_inode = &s5_node->inode; 
     // setting the size of the inode to be 0 as well 
-    s5_inode->s5_un.s5_size = 0; 
-    s5_node->dirtied_inode = 1; 
+    s5_inode_set_size(s5_inode, 0); 
+    s5_dirty_inode(s5_node);
     
     // Call subroutine to free the blocks that were used 
     vlock(file); 
@@ -569,6 +627,21 @@ static void s5fs_truncate_file(vnode_t *file)
     vunlock(file); 
 }
 
+/*
+ * Write back the file's dirty pages, then its metadata (s5_sync_inode). The
+ * pages go first: on disks with a bitmap, flushing them is what gives them
+ * their disk blocks.
+ */
+static long s5fs_fsync(vnode_t *vnode, long datasync)
+{
+    long ret = mobj_flush(&vnode->vn_mobj);
+    if (ret)
+    {
+        return ret;
+    }
+    return s5_sync_inode(VNODE_TO_S5NODE(vnode), datasync);
+}
+
 /*
  * Wrapper around device's read_block function; first looks up block in file-system cache.
  * If not there, allocates and fills a page frame. 
@@ -588,11 +661,10 @@ inline void s5_get_meta_disk_block(s5fs_t *s5fs, uint64_t blocknum, long forwrit
     }
     mobj_create_pframe(&s5fs->s5f_mobj, blocknum, blocknum, pfp);
     pframe_t *pf = *pfp;
-    pf->pf_addr = page_alloc();
-    KASSERT(pf->pf_addr);
+    long ret = pframe_alloc_page(pf);
+    KASSERT(!ret);
 
-    blockdev_t *bd = s5fs->s5f_bdev;
-    long ret = bd->bd_ops->read_block(bd, pf->pf_addr, (blocknum_t)pf->pf_loc, 1);
+    ret = s5fs_meta_fill_pframe(&s5fs->s5f_mobj, pf);
     pf->pf_dirty |= forwrite;  // yes, needed
     KASSERT (!ret);
     mobj_unlock(&s5fs->s5f_mobj);
@@ -609,14 +681,99 @@ static inline void s5_get_file_disk_block(vnode_t *vnode, uint64_t blocknum, uin
 {
     mobj_create_pframe(&vnode->vn_mobj, blocknum, loc, pfp);
     pframe_t *pf = *pfp;
-    pf->pf_addr = page_alloc();
-    KASSERT(pf->pf_addr);
+    long ret = pframe_alloc_page(pf);
+    KASSERT(!ret);
     blockdev_t *bd = VNODE_TO_S5FS(vnode)->s5f_bdev;
-    long ret = bd->bd_ops->read_block(bd, pf->pf_addr, (blocknum_t)pf->pf_loc, 1);
+    ret = bd->bd_ops->read_block(bd, pf->pf_addr, (blocknum_t)pf->pf_loc, 1);
     pf->pf_dirty |= forwrite;
     KASSERT (!ret);
 }
 
+/* File blocks read from disk together when they follow each other on disk */
+#define S5_READ_CLUSTER 8
+
+/*
+ * Like s5_get_file_disk_block, but the file blocks after blocknum that follow
+ * it on disk and are not cached yet (up to S5_READ_CLUSTER blocks in all, and
+ * not past the end of the file) are read with the same request and cached too.
+ * The blocks are read into a bounce buffer, since page frames get their pages
+ * one at a time.
+ */
+static void s5_get_file_disk_blocks(vnode_t *vnode, uint64_t blocknum,
+                                    uint64_t loc, long forwrite, pframe_t **pfp)
+{
+    size_t nblocks = MIN(S5_READ_CLUSTER,
+                         ADDR_TO_PN(PAGE_ALIGN_UP(vnode->vn_len)) - blocknum);
+    if (nblocks > 1 && s5_file_block_run(VNODE_TO_S5NODE(vnode), blocknum,
+                                         nblocks, &nblocks) != (long)loc)
+    {
+        nblocks = 1;
+    }
+    for (size_t i = 1; i < nblocks; i++)
+    {
+        pframe_t *pf;
+        mobj_find_pframe(&vnode->vn_mobj, blocknum + i, &pf);
+        if (pf)
+        {
+            pframe_release(&pf);
+            nblocks = i;
+        }
+    }
+
+    char *buf = nblocks > 1 ? page_alloc_n(nblocks) : NULL;
+    if (!buf)
+    {
+        s5_get_file_disk_block(vnode, blocknum, loc, forwrite, pfp);
+        return;
+    }
+    blockdev_t *bd = VNODE_TO_S5FS(vnode)->s5f_bdev;
+    long ret = bd->bd_ops->read_block(bd, buf, (blocknum_t)loc, nblocks);
+    KASSERT(!ret);
+
+    for (size_t i = 0; i < nblocks; i++)
+    {
+        pframe_t *pf;
+        mobj_create_pframe(&vnode->vn_mobj, blocknum + i, loc + i, &pf);
+        ret = pframe_alloc_page(pf);
+        KASSERT(!ret);
+        memcpy(pf->pf_addr, buf + i * PAGE_SIZE, PAGE_SIZE);
+        if (i)
+        {
+            pframe_release(&pf);
+            continue;
+        }
+        pf->pf_dirty |= forwrite;
+        *pfp = pf;
+    }
+    page_free_n(buf, nblocks);
+}
+
+/*
+ * Metadata blocks are read from the journal's log while their latest image is
+ * only there (see s5_journal_locate).
+ */
+static long s5fs_meta_fill_pframe(mobj_t *o, pframe_t *pf)
+{
+    s5fs_t *s5fs = CONTAINER_OF(o, s5fs_t, s5f_mobj);
+    blockdev_t *bd = s5fs->s5f_bdev;
+    return bd->bd_ops->read_block(
+        bd, pf->pf_addr, s5_journal_locate(s5fs, (blocknum_t)pf->pf_loc), 1);
+}
+
+/*
+ * On disks with a journal, a dirty metadata block is not written home but
+ * committed to the journal, along with every other dirty metadata block.
+ */
+static long s5fs_meta_flush_pframe(mobj_t *o, pframe_t *pf)
+{
+    s5fs_t *s5fs = CONTAINER_OF(o, s5fs_t, s5f_mobj);
+    if (s5fs->s5f_journal.sj_nblocks)
+    {
+        return s5_journal_commit(s5fs, pf);
+    }
+    return blockdev_flush_pframe(o, pf);
+}
+
 /* Wrapper around pframe_release.
  *
  * Note: All pframe_release does is unlock the pframe. Why aren't we actually
@@ -646,27 +803,39 @@ inline void s5_release_disk_block(pframe_t **pfp) { pframe_release(pfp); }
  * the pframe that resides in the vnode itself for the requested pagenum. To
  * do so, you will want to use mobj_find_pframe and mobj_free_pframe.
  *
- * Given the above design, we s5fs itself does not need to implement
- * flush_pframe. Any pframe that will be written to (forwrite = 1) should always
- * have a disk block backing it on successful return. Thus, the page frame will
- * reside in the block device of the filesystem, where the flush_pframe is
- * already implemented. We do, however, need to implement fill_pframe for sparse
- * blocks.
+ * Disks with a free block bitmap use delayed allocation (see
+ * s5_delalloc_reserve): a write to a sparse block only reserves room, and the
+ * page keeps pf_loc 0 until s5fs_flush_pframe picks its disk block. Older
+ * disks allocate the block here, so that any pframe that will be written to
+ * (forwrite = 1) has a disk block backing it on successful return.
  */
 static long s5fs_get_pframe(vnode_t *vnode, uint64_t pagenum, long forwrite,
                             pframe_t **pfp)
 {
     if (vnode->vn_len <= pagenum * PAGE_SIZE)
         return -EINVAL;
+    s5fs_t *s5fs = VNODE_TO_S5FS(vnode);
+    long delalloc = s5_has_bitmap(s5fs);
     mobj_find_pframe(&vnode->vn_mobj, pagenum, pfp);
     if (*pfp)
     {
         // block is cached
+        if (forwrite && delalloc && !(*pfp)->pf_loc && !(*pfp)->pf_dirty)
+        {
+            // first write to a sparse block that has been read
+            long ret = s5_delalloc_reserve(s5fs, pagenum);
+            if (ret)
+            {
+                pframe_release(pfp);
+                return ret;
+            }
+        }
         (*pfp)->pf_dirty |= forwrite;
         return 0;
     }
     int new;
-    long loc = s5_file_block_to_disk_block(VNODE_TO_S5NODE(vnode), pagenum, forwrite, &new);
+    long loc = s5_file_block_to_disk_block(VNODE_TO_S5NODE(vnode), pagenum,
+                                           forwrite && !delalloc, &new);
     if (loc < 0)
         return loc;
     if (loc) {
@@ -675,16 +844,27 @@ static long s5fs_get_pframe(vnode_t *vnode, uint64_t pagenum, long forwrite,
             // block didn't previously exist, thus its current contents are meaningless
             *pfp = s5_cache_and_clear_block(&vnode->vn_mobj, pagenum, loc);
         } else {
-            // block must be read from disk
-            s5_get_file_disk_block(vnode, pagenum, loc, forwrite, pfp);
+            // block must be read from disk, along with the ones after it
+            s5_get_file_disk_blocks(vnode, pagenum, loc, forwrite, pfp);
         }
         return 0;
     }
     else
     {
-        // block is in a sparse region of the file
-        KASSERT(!forwrite);
-        return mobj_default_get_pframe(&vnode->vn_mobj, pagenum, forwrite, pfp);
+        // block is in a sparse region of the file; if it is being written,
+        // it gets a disk block when it is flushed
+        KASSERT(!forwrite || delalloc);
+        long ret = forwrite ? s5_delalloc_reserve(s5fs, pagenum) : 0;
+        if (ret)
+        {
+            return ret;
+        }
+        ret = mobj_default_get_pframe(&vnode->vn_mobj, pagenum, forwrite, pfp);
+        if (ret && forwrite)
+        {
+            s5_delalloc_release(s5fs, pagenum);
+        }
+        return ret;
     }
 }
 
@@ -699,8 +879,33 @@ static long s5fs_fill_pframe(vnode_t *vnode, pframe_t *pf)
     return 0;
 }
 
-static long s5fs_flush_pframe(vnode_t *vnode, pframe_t *pf) {
-    return blockdev_flush_pframe(&VNODE_TO_S5FS(vnode)->s5f_mobj, pf);
+/*
+ * Write pf back to its disk block. A page that was written while its block was
+ * sparse has no disk block yet (pf_loc is 0): allocate it now, next to the
+ * blocks before it, and give back the reservation made for it.
+ */
+static long s5fs_flush_pframe(vnode_t *vnode, pframe_t *pf)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(vnode);
+    if (!pf->pf_loc)
+    {
+        // the page's reservation covers the blocks allocated here
+        int new;
+        long loc = s5_file_block_to_disk_block(
+            VNODE_TO_S5NODE(vnode), pf->pf_pagenum,
+            s5_has_bitmap(s5fs) ? S5_ALLOC_RESERVED : 1, &new);
+        if (loc < 0)
+        {
+            return loc;
+        }
+        KASSERT(loc);
+        if (s5_has_bitmap(s5fs))
+        {
+            s5_delalloc_release(s5fs, pf->pf_pagenum);
+        }
+        pf->pf_loc = (uint64_t)loc;
+    }
+    return blockdev_flush_pframe(&s5fs->s5f_mobj, pf);
 }
 
 /*
@@ -715,12 +920,32 @@ static long s5_check_super(s5_super_t *super)
     {
         return -1;
     }
-    if (super->s5s_version != S5_CURRENT_VERSION)
+    if (super->s5s_version < S5_MIN_VERSION ||
+        super->s5s_version > S5_CURRENT_VERSION)
     {
         dbg(DBG_PRINT,
             "Filesystem is version %d; "
-            "only version %d is supported.\n",
-            super->s5s_version, S5_CURRENT_VERSION);
+            "only versions %d to %d are supported.\n",
+            super->s5s_version, S5_MIN_VERSION, S5_CURRENT_VERSION);
+        return -1;
+    }
+    if (super->s5s_version >= S5_BITMAP_VERSION &&
+        !(super->s5s_bitmap_block > S5_INODE_BLOCK(super->s5s_num_inodes - 1) &&
+          super->s5s_bitmap_block + super->s5s_bitmap_nblocks <=
+              super->s5s_nblocks &&
+          (uint64_t)super->s5s_bitmap_nblocks * S5_BITS_PER_BLOCK >=
+              super->s5s_nblocks))
+    {
+        return -1;
+    }
+    if (super->s5s_version >= S5_JOURNAL_VERSION &&
+        !(super->s5s_journal_block >=
+              super->s5s_bitmap_block + super->s5s_bitmap_nblocks &&
+          super->s5s_journal_block + super->s5s_journal_nblocks <=
+              super->s5s_nblocks &&
+          super->s5s_journal_nblocks >= 3 &&
+          super->s5s_journal_nblocks <= S5_JOURNAL_MAX_BLOCKS))
+    {
         return -1;
     }
     return 0;
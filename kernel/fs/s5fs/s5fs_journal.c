@@ -0,0 +1,506 @@
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "drivers/blockdev.h"
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "mm/kmalloc.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "util/debug.h"
+#include "util/string.h"
+
+/*
+ * The s5fs metadata journal; see s5fs.h for the disk format.
+ *
+ * Dirty blocks of the block device cache (s5f_mobj) are never written to
+ * their home location directly. Flushing one of them, whether from
+ * s5fs_sync() or because its page is being reclaimed, commits every dirty
+ * block of the cache at once: they are copied into one transaction, which is
+ * appended to the log with a single write, and are then clean. Many small
+ * metadata updates thus become one sequential write.
+ *
+ * When the log has no room for the next transaction, it is checkpointed: the
+ * latest image of every logged block is written home and the log starts over.
+ * The same happens at unmount, so that a cleanly unmounted disk has an empty
+ * log. At mount, the committed transactions of the log are replayed.
+ *
+ * A transaction is whatever happens to be dirty when it is committed. Blocks
+ * that are locked at that point, because someone is in the middle of changing
+ * them, are left for the next one.
+ */
+
+static inline s5_journal_desc_t *s5_journal_desc(char *log, size_t off)
+{
+    return (s5_journal_desc_t *)(log + off * S5_BLOCK_SIZE);
+}
+
+/* FNV-1a of nblocks blocks, as stored in s5jd_checksum */
+static uint32_t s5_journal_checksum(const char *buf, size_t nblocks)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < nblocks * S5_BLOCK_SIZE; i++)
+    {
+        hash = (hash ^ (uint8_t)buf[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Write the journal header, using page as the buffer */
+static long s5_journal_write_header(s5fs_t *s5fs, char *page)
+{
+    s5_journal_t *j = &s5fs->s5f_journal;
+    memset(page, 0, S5_BLOCK_SIZE);
+    s5_journal_header_t *header = (s5_journal_header_t *)page;
+    header->s5jh_magic = S5_JOURNAL_MAGIC;
+    header->s5jh_seq = j->sj_seq;
+    blockdev_t *bd = s5fs->s5f_bdev;
+    return bd->bd_ops->write_block(bd, page, j->sj_start, 1);
+}
+
+/*
+ * Whether the log block off of the journal read into log holds the
+ * descriptor of a committed transaction with sequence number seq.
+ */
+static long s5_journal_valid(char *log, size_t off, size_t nblocks,
+                             uint32_t seq)
+{
+    s5_journal_desc_t *desc = s5_journal_desc(log, off);
+    if (desc->s5jd_magic != S5_JOURNAL_DESC_MAGIC || desc->s5jd_seq != seq ||
+        desc->s5jd_nblocks > nblocks - 1 - off ||
+        desc->s5jd_nblocks + desc->s5jd_nrevoked > S5_JOURNAL_DESC_ENTRIES)
+    {
+        return 0;
+    }
+    uint32_t checksum = desc->s5jd_checksum;
+    desc->s5jd_checksum = 0;
+    long valid =
+        s5_journal_checksum((char *)desc, 1 + desc->s5jd_nblocks) == checksum;
+    desc->s5jd_checksum = checksum;
+    return valid;
+}
+
+/* Whether a transaction after the one at off, and before end, revokes block */
+static long s5_journal_revoked_after(char *log, size_t off, size_t end,
+                                     uint32_t block)
+{
+    for (off += 1 + s5_journal_desc(log, off)->s5jd_nblocks; off < end;
+         off += 1 + s5_journal_desc(log, off)->s5jd_nblocks)
+    {
+        s5_journal_desc_t *desc = s5_journal_desc(log, off);
+        for (uint32_t i = 0; i < desc->s5jd_nrevoked; i++)
+        {
+            if (desc->s5jd_blocks[desc->s5jd_nblocks + i] == block)
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Write the committed transactions of the log home, then empty the log.
+ * Return the number of transactions replayed, or an error.
+ */
+static long s5_journal_replay(s5fs_t *s5fs)
+{
+    s5_journal_t *j = &s5fs->s5f_journal;
+    blockdev_t *bd = s5fs->s5f_bdev;
+    char *log = page_alloc_n(j->sj_nblocks);
+    if (!log)
+    {
+        return -ENOMEM;
+    }
+    long ret = bd->bd_ops->read_block(bd, log, j->sj_start, j->sj_nblocks);
+    s5_journal_header_t *header = (s5_journal_header_t *)log;
+    if (!ret && header->s5jh_magic != S5_JOURNAL_MAGIC)
+    {
+        ret = -EINVAL;
+    }
+    if (ret)
+    {
+        goto out;
+    }
+
+    // the committed transactions take up [1, end) of the log
+    uint32_t seq = header->s5jh_seq;
+    size_t end = 1;
+    while (end < j->sj_nblocks && s5_journal_valid(log, end, j->sj_nblocks, seq))
+    {
+        end += 1 + s5_journal_desc(log, end)->s5jd_nblocks;
+        seq++;
+    }
+    long ntransactions = seq - header->s5jh_seq;
+
+    size_t nreplayed = 0;
+    for (size_t off = 1; off < end;
+         off += 1 + s5_journal_desc(log, off)->s5jd_nblocks)
+    {
+        s5_journal_desc_t *desc = s5_journal_desc(log, off);
+        for (uint32_t i = 0; i < desc->s5jd_nblocks; i++)
+        {
+            if (s5_journal_revoked_after(log, off, end, desc->s5jd_blocks[i]))
+            {
+                continue;
+            }
+            ret = bd->bd_ops->write_block(
+                bd, log + (off + 1 + i) * S5_BLOCK_SIZE, desc->s5jd_blocks[i],
+                1);
+            if (ret)
+            {
+                goto out;
+            }
+            nreplayed++;
+        }
+    }
+    if (ntransactions)
+    {
+        dbg(DBG_S5FS, "replayed %ld transactions (%lu blocks) from the journal\n",
+            ntransactions, nreplayed);
+    }
+
+    j->sj_seq = seq;
+    j->sj_head = 1;
+    ret = s5_journal_write_header(s5fs, log);
+    if (!ret)
+    {
+        ret = ntransactions;
+    }
+out:
+    page_free_n(log, j->sj_nblocks);
+    return ret;
+}
+
+/*
+ * Set up the journal of a disk that has one, replaying what it holds. If
+ * anything was replayed, the cached blocks (the superblock) are stale, so they
+ * are dropped and s5f_super is read again.
+ *
+ * Return 0, or -ENOMEM, -EINVAL if the journal is corrupt, or an I/O error.
+ */
+long s5_journal_init(s5fs_t *s5fs)
+{
+    s5_journal_t *j = &s5fs->s5f_journal;
+    memset(j, 0, sizeof(*j));
+    s5_super_t *s = &s5fs->s5f_super;
+    if (s->s5s_version < S5_JOURNAL_VERSION)
+    {
+        return 0;
+    }
+
+    size_t nblocks = s->s5s_journal_nblocks;
+    j->sj_logged = kmalloc(nblocks * sizeof(s5_journal_entry_t));
+    j->sj_revoked = kmalloc(nblocks * sizeof(uint32_t));
+    j->sj_batch = kmalloc(nblocks * sizeof(pframe_t *));
+    long ret = -ENOMEM;
+    if (j->sj_logged && j->sj_revoked && j->sj_batch)
+    {
+        j->sj_start = s->s5s_journal_block;
+        j->sj_nblocks = (uint32_t)nblocks;
+        ret = s5_journal_replay(s5fs);
+    }
+    if (ret < 0)
+    {
+        j->sj_nblocks = 0;
+        s5_journal_shutdown(s5fs);
+        return ret;
+    }
+
+    if (ret)
+    {
+        mobj_lock(&s5fs->s5f_mobj);
+        list_iterate(&s5fs->s5f_mobj.mo_pframes, pf, pframe_t, pf_link)
+        {
+            mobj_delete_pframe(&s5fs->s5f_mobj, pf->pf_pagenum);
+        }
+        mobj_unlock(&s5fs->s5f_mobj);
+
+        pframe_t *pf;
+        s5_get_meta_disk_block(s5fs, S5_SUPER_BLOCK, 0, &pf);
+        memcpy(s, pf->pf_addr, sizeof(s5_super_t));
+        s5_release_disk_block(&pf);
+    }
+    return 0;
+}
+
+/*
+ * Checkpoint the journal and free its state. Called at unmount, once
+ * everything has been committed.
+ */
+long s5_journal_shutdown(s5fs_t *s5fs)
+{
+    s5_journal_t *j = &s5fs->s5f_journal;
+    long ret = 0;
+    if (j->sj_nblocks)
+    {
+        mobj_lock(&s5fs->s5f_mobj);
+        ret = s5_journal_checkpoint(s5fs);
+        mobj_unlock(&s5fs->s5f_mobj);
+        dbg(DBG_S5FS,
+            "journal: %lu commits of %lu blocks in all, %lu checkpoints\n",
+            j->sj_commits, j->sj_blocks_logged, j->sj_checkpoints);
+    }
+    if (j->sj_logged)
+    {
+        kfree(j->sj_logged);
+    }
+    if (j->sj_revoked)
+    {
+        kfree(j->sj_revoked);
+    }
+    if (j->sj_batch)
+    {
+        kfree(j->sj_batch);
+    }
+    memset(j, 0, sizeof(*j));
+    return ret;
+}
+
+/*
+ * Write the latest image of every block logged since the last checkpoint home,
+ * then empty the log. s5f_mobj must be locked.
+ */
+long s5_journal_checkpoint(s5fs_t *s5fs)
+{
+    KASSERT(kmutex_owns_mutex(&s5fs->s5f_mobj.mo_mutex));
+    s5_journal_t *j = &s5fs->s5f_journal;
+    if (j->sj_head == 1)
+    {
+        return 0;
+    }
+
+    // the log is read back with one request rather than keeping copies of
+    // the images around; page 0 of the buffer is for the header
+    blockdev_t *bd = s5fs->s5f_bdev;
+    char *log = page_alloc_n(j->sj_head);
+    if (!log)
+    {
+        return -ENOMEM;
+    }
+    long ret = bd->bd_ops->read_block(bd, log + S5_BLOCK_SIZE, j->sj_start + 1,
+                                      j->sj_head - 1);
+
+    // in disk order, to keep the seeks short
+    for (uint32_t i = 1; i < j->sj_nlogged; i++)
+    {
+        s5_journal_entry_t entry = j->sj_logged[i];
+        uint32_t k = i;
+        for (; k > 0 && j->sj_logged[k - 1].sje_block > entry.sje_block; k--)
+        {
+            j->sj_logged[k] = j->sj_logged[k - 1];
+        }
+        j->sj_logged[k] = entry;
+    }
+    for (uint32_t i = 0; i < j->sj_nlogged && !ret; i++)
+    {
+        s5_journal_entry_t *entry = &j->sj_logged[i];
+        if (entry->sje_logoff)
+        {
+            ret = bd->bd_ops->write_block(
+                bd, log + entry->sje_logoff * S5_BLOCK_SIZE, entry->sje_block,
+                1);
+        }
+    }
+    if (!ret)
+    {
+        ret = s5_journal_write_header(s5fs, log);
+    }
+    page_free_n(log, j->sj_head);
+    if (ret)
+    {
+        return ret;
+    }
+
+    j->sj_head = 1;
+    j->sj_nlogged = 0;
+    j->sj_nrevoked = 0;
+    j->sj_checkpoints++;
+    return 0;
+}
+
+/* Record that the latest image of block is at log block logoff */
+static void s5_journal_note(s5_journal_t *j, uint32_t block, uint32_t logoff)
+{
+    for (uint32_t i = 0; i < j->sj_nlogged; i++)
+    {
+        if (j->sj_logged[i].sje_block == block)
+        {
+            j->sj_logged[i].sje_logoff = logoff;
+            return;
+        }
+    }
+    KASSERT(j->sj_nlogged < j->sj_nblocks);
+    j->sj_logged[j->sj_nlogged].sje_block = block;
+    j->sj_logged[j->sj_nlogged].sje_logoff = logoff;
+    j->sj_nlogged++;
+}
+
+/*
+ * Lock and collect up to max dirty pframes of s5f_mobj into sj_batch. held is
+ * already locked by the caller.
+ */
+static size_t s5_journal_gather(s5fs_t *s5fs, pframe_t *held, size_t max)
+{
+    s5_journal_t *j = &s5fs->s5f_journal;
+    size_t n = 0;
+    list_iterate(&s5fs->s5f_mobj.mo_pframes, pf, pframe_t, pf_link)
+    {
+        if (n == max)
+        {
+            break;
+        }
+        if (pf != held && !kmutex_trylock(&pf->pf_mutex))
+        {
+            continue;
+        }
+        if (pf->pf_dirty && pf->pf_addr)
+        {
+            j->sj_batch[n++] = pf;
+        }
+        else if (pf != held)
+        {
+            pframe_release(&pf);
+        }
+    }
+    return n;
+}
+
+/* Append the n pframes of sj_batch to the log as one transaction */
+static long s5_journal_write(s5fs_t *s5fs, size_t n)
+{
+    s5_journal_t *j = &s5fs->s5f_journal;
+    long ret;
+    if (j->sj_head + 1 + n > j->sj_nblocks &&
+        (ret = s5_journal_checkpoint(s5fs)))
+    {
+        return ret;
+    }
+
+    char *buf = page_alloc_n(1 + n);
+    if (!buf)
+    {
+        return -ENOMEM;
+    }
+    s5_journal_desc_t *desc = (s5_journal_desc_t *)buf;
+    memset(desc, 0, S5_BLOCK_SIZE);
+    desc->s5jd_magic = S5_JOURNAL_DESC_MAGIC;
+    desc->s5jd_seq = j->sj_seq;
+    desc->s5jd_nblocks = (uint32_t)n;
+    desc->s5jd_nrevoked = j->sj_nrevoked;
+    for (size_t i = 0; i < n; i++)
+    {
+        desc->s5jd_blocks[i] = (uint32_t)j->sj_batch[i]->pf_loc;
+        memcpy(buf + (1 + i) * S5_BLOCK_SIZE, j->sj_batch[i]->pf_addr,
+               S5_BLOCK_SIZE);
+    }
+    memcpy(&desc->s5jd_blocks[n], j->sj_revoked,
+           j->sj_nrevoked * sizeof(uint32_t));
+    desc->s5jd_checksum = s5_journal_checksum(buf, 1 + n);
+
+    blockdev_t *bd = s5fs->s5f_bdev;
+    ret = bd->bd_ops->write_block(bd, buf, j->sj_start + j->sj_head,
+                                  1 + n);
+    page_free_n(buf, 1 + n);
+    if (ret)
+    {
+        return ret;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        s5_journal_note(j, (uint32_t)j->sj_batch[i]->pf_loc,
+                        (uint32_t)(j->sj_head + 1 + i));
+    }
+    dbg(DBG_S5FS, "committed transaction %u: %lu blocks, %u revoked\n",
+        j->sj_seq, n, j->sj_nrevoked);
+    j->sj_nrevoked = 0;
+    j->sj_head += 1 + n;
+    j->sj_seq++;
+    j->sj_commits++;
+    j->sj_blocks_logged += n;
+    return 0;
+}
+
+/*
+ * Commit every dirty block of s5f_mobj to the journal, in as many
+ * transactions as the log needs. The blocks are clean on success. s5f_mobj
+ * must be locked, and so must held if it is given: it is the pframe whose
+ * flush brought this on.
+ */
+long s5_journal_commit(s5fs_t *s5fs, pframe_t *held)
+{
+    KASSERT(kmutex_owns_mutex(&s5fs->s5f_mobj.mo_mutex));
+    s5_journal_t *j = &s5fs->s5f_journal;
+    KASSERT(j->sj_nblocks);
+
+    size_t max = j->sj_nblocks - 2;
+    long ret = 0;
+    size_t n;
+    do
+    {
+        n = s5_journal_gather(s5fs, held, max);
+        if (n)
+        {
+            ret = s5_journal_write(s5fs, n);
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            pframe_t *pf = j->sj_batch[i];
+            if (!ret)
+            {
+                pf->pf_dirty = 0;
+            }
+            if (pf != held)
+            {
+                pframe_release(&pf);
+            }
+        }
+    } while (!ret && n == max);
+    return ret;
+}
+
+/*
+ * Where to read block from: the log, if it was logged since the last
+ * checkpoint, or else its home. s5f_mobj must be locked.
+ */
+blocknum_t s5_journal_locate(s5fs_t *s5fs, blocknum_t block)
+{
+    s5_journal_t *j = &s5fs->s5f_journal;
+    for (uint32_t i = 0; i < j->sj_nlogged; i++)
+    {
+        if (j->sj_logged[i].sje_block == block && j->sj_logged[i].sje_logoff)
+        {
+            return j->sj_start + j->sj_logged[i].sje_logoff;
+        }
+    }
+    return block;
+}
+
+/*
+ * Called when block is freed. If it has an image in the log, that image must
+ * neither be checkpointed nor replayed any more, as the block may now be
+ * reused for file data.
+ */
+void s5_journal_revoke(s5fs_t *s5fs, blocknum_t block)
+{
+    s5_journal_t *j = &s5fs->s5f_journal;
+    if (!j->sj_nblocks)
+    {
+        return;
+    }
+    mobj_lock(&s5fs->s5f_mobj);
+    for (uint32_t i = 0; i < j->sj_nlogged; i++)
+    {
+        if (j->sj_logged[i].sje_block == block && j->sj_logged[i].sje_logoff)
+        {
+            j->sj_logged[i].sje_logoff = 0;
+            KASSERT(j->sj_nrevoked < j->sj_nblocks);
+            j->sj_revoked[j->sj_nrevoked++] = block;
+            break;
+        }
+    }
+    mobj_unlock(&s5fs->s5f_mobj);
+}
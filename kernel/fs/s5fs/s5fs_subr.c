@@ -2,20 +2,22 @@
 #include "drivers/blockdev.h"
 #include "errno.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
 #include "fs/stat.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "kernel.h"
+#include "mm/kmalloc.h"
 #include "mm/pframe.h"
 #include "proc/kmutex.h"
 #include "util/debug.h"
 #include "util/string.h"
 #include <fs/s5fs/s5fs.h>
 
-static void s5_free_block(s5fs_t *s5fs, blocknum_t block);
-
 static long s5_alloc_block(s5fs_t *s5fs);
 
+static void s5_bitmap_set(s5fs_t *s5fs, blocknum_t block, long used);
+
 static inline void s5_lock_super(s5fs_t *s5fs)
 {
     kmutex_lock(&s5fs->s5f_mutex);
@@ -91,6 +93,64 @@ static inline void s5_release_file_block(pframe_t **pfp)
     pframe_release(pfp);
 }
 
+/* Find where a file block is mapped.
+ *
+ * Return how many indirect blocks lie between the inode and the file block: 0
+ * for a direct block, 1 for the indirect block, 2 for the double indirect block
+ * and 3 for the triple indirect block. path[0] is then the index into
+ * s5_direct_blocks (depth 0 only), and path[1] to path[depth] are the indices
+ * into each indirect block on the way down. For example, file block
+ * S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS + 5 has depth 2, path[1] = 0 and
+ * path[2] = 5.
+ *
+ * file_blocknum must be less than S5_MAX_FILE_BLOCKS.
+ */
+static long s5_block_path(size_t file_blocknum, size_t path[4])
+{
+    KASSERT(file_blocknum < S5_MAX_FILE_BLOCKS);
+    if (file_blocknum < S5_NDIRECT_BLOCKS)
+    {
+        path[0] = file_blocknum;
+        return 0;
+    }
+    file_blocknum -= S5_NDIRECT_BLOCKS;
+
+    size_t span = 1;
+    long depth;
+    for (depth = 1; depth < 3; depth++)
+    {
+        span *= S5_NIDIRECT_BLOCKS;
+        if (file_blocknum < span)
+        {
+            break;
+        }
+        file_blocknum -= span;
+    }
+    for (long level = depth; level > 0; level--)
+    {
+        path[level] = file_blocknum % S5_NIDIRECT_BLOCKS;
+        file_blocknum /= S5_NIDIRECT_BLOCKS;
+    }
+    return depth;
+}
+
+/* The block pointer in the inode at the top of a mapping of the given depth */
+static inline uint32_t *s5_block_root(s5_inode_t *inode, long depth,
+                                      size_t path[4])
+{
+    switch (depth)
+    {
+        case 0:
+            return &inode->s5_direct_blocks[path[0]];
+        case 1:
+            return &inode->s5_indirect_block;
+        case 2:
+            return &inode->s5_dindirect_block;
+        default:
+            return &inode->s5_tindirect_block;
+    }
+}
+
 /* Given a file and a file block number, return the disk block number of the
  * desired file block.
  *
@@ -99,34 +159,43 @@ static inline void s5_release_file_block(pframe_t **pfp)
  *                  the file
  *  alloc         - If set, allocate the block / indirect block as necessary
  *                  If clear, don't allocate sparse blocks
+ *                  S5_ALLOC_RESERVED allocates too, from blocks the caller
+ *                  reserved with s5_delalloc_reserve
  *  newp          - Set *newp = 1 if a block is allocated, otherwise 0
  *
  * Return a disk block number on success, or:
  *  - 0: The block is sparse, and alloc is clear, OR
- *       The indirect block would contain the block, but the indirect block is
+ *       An indirect block would contain the block, but that indirect block is
  *       sparse, and alloc is clear
  *  - EINVAL: The specified block number is greater than or equal to 
  *            S5_MAX_FILE_BLOCKS
- *  - Propagate errors from s5_alloc_block.
+ *  - Propagate errors from s5_alloc_block_near.
  *
  * Hints:
- *  - Use the file inode's s5_direct_blocks and s5_indirect_block to perform the
- *    translation.
- *  - Use s5_alloc_block to allocate blocks.
+ *  - Use s5_block_path to find out which of the inode's block pointers
+ *    (s5_block_root) the block hangs off, and which entry of each indirect
+ *    block to follow on the way down.
+ *  - Use s5_alloc_block_near(s5fs, s5_block_goal(sn, file_blocknum),
+ *    alloc == S5_ALLOC_RESERVED) to allocate blocks, indirect blocks included,
+ *    so that the file stays contiguous on disk.
  *  - An indirect block should be allocated with all 0s (none of its direct blocks
  *    are allocated yet).
  *      - Hint: Use s5_cache_and_clear_block.
- *  - Be sure to mark the inode as dirty when appropriate, i.e. when you are
- *    making changes to the actual s5_inode_t struct. Hint: Does allocating a
- *    direct block dirty the inode? What about allocating the indirect block?
- *    Finally, what about allocating a block pointed to by the indirect block?
+ *  - Be sure to mark the inode as dirty (s5_dirty_inode) when appropriate,
+ *    i.e. when you are making changes to the actual s5_inode_t struct. Hint:
+ *    Does allocating a direct block dirty the inode? What about allocating the
+ *    indirect block? Finally, what about allocating a block pointed to by the
+ *    indirect block?
  *  - Cases to consider:
  *    1) file_blocknum < S_NDIRECT_BLOCKS
- *    2) Indirect block is not allocated but alloc is set. Be careful not to
- *       leak a block in an error case!
- *    3) Indirect block is allocated. The desired block may be sparse, and you
- *       may have to allocate it.
- *    4) The indirect block has not been allocated and alloc is clear.
+ *    2) An indirect block on the way down is not allocated but alloc is set.
+ *       Be careful not to leak blocks in an error case! With the double and
+ *       triple indirect blocks, more than one indirect block may have to be
+ *       allocated before the data block.
+ *    3) The indirect blocks are allocated. The desired block may be sparse,
+ *       and you may have to allocate it.
+ *    4) An indirect block on the way down has not been allocated and alloc
+ *       is clear.
  */
 long s5_file_block_to_disk_block(s5_node_t *sn, size_t file_blocknum,
                                  int alloc, int *newp)
@@ -135,6 +204,74 @@ long s5_file_block_to_disk_block(s5_node_t *sn, size_t file_blocknum,
     return -1;
 }
 
+/* Map a run of file blocks without allocating anything.
+ *
+ *  sn            - The s5_node representing the file
+ *  file_blocknum - The first file block of the run
+ *  maxblocks     - The longest run the caller is interested in
+ *  nblocksp      - Return parameter for the length of the run, at least 1
+ *
+ * Return the disk block of file_blocknum, the run being the blocks after it
+ * that follow it on disk as well. If file_blocknum is sparse, return 0 and the
+ * run is the sparse blocks after it. Runs stop at the end of an indirect block,
+ * even if the next one continues them on disk. Return -EINVAL if file_blocknum
+ * is not less than S5_MAX_FILE_BLOCKS.
+ *
+ * This lets callers read or write a contiguous stretch of a file with a single
+ * request to the block device.
+ */
+long s5_file_block_run(s5_node_t *sn, size_t file_blocknum, size_t maxblocks,
+                       size_t *nblocksp)
+{
+    KASSERT(maxblocks);
+    if (file_blocknum >= S5_MAX_FILE_BLOCKS)
+    {
+        return -EINVAL;
+    }
+    maxblocks = MIN(maxblocks, S5_MAX_FILE_BLOCKS - file_blocknum);
+
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    size_t path[4];
+    long depth = s5_block_path(file_blocknum, path);
+    uint32_t *blocks = sn->inode.s5_direct_blocks;
+    size_t nblocks = S5_NDIRECT_BLOCKS;
+    pframe_t *pf = NULL;
+
+    if (depth)
+    {
+        uint32_t block = *s5_block_root(&sn->inode, depth, path);
+        for (long level = 1; level < depth && block; level++)
+        {
+            s5_get_meta_disk_block(s5fs, block, 0, &pf);
+            block = ((uint32_t *)pf->pf_addr)[path[level]];
+            s5_release_disk_block(&pf);
+        }
+        if (!block)
+        {
+            *nblocksp = 1;
+            return 0;
+        }
+        s5_get_meta_disk_block(s5fs, block, 0, &pf);
+        blocks = pf->pf_addr;
+        nblocks = S5_NIDIRECT_BLOCKS;
+    }
+
+    size_t i = path[depth];
+    uint32_t first = blocks[i];
+    size_t run = 1;
+    while (run < maxblocks && i + run < nblocks &&
+           blocks[i + run] == (first ? first + run : 0))
+    {
+        run++;
+    }
+    if (pf)
+    {
+        s5_release_disk_block(&pf);
+    }
+    *nblocksp = run;
+    return first;
+}
+
 /* Given a mobj and a block, clear any data in the block and store a newly
  * created page frame in the mobj's cache
  *
@@ -149,8 +286,8 @@ long s5_file_block_to_disk_block(s5_node_t *sn, size_t file_blocknum,
 pframe_t *s5_cache_and_clear_block(mobj_t *mo, long block, long loc) {
     pframe_t *pf;
     mobj_create_pframe(mo, block, loc, &pf);
-    pf->pf_addr = page_alloc();
-    KASSERT(pf->pf_addr);
+    long ret = pframe_alloc_page(pf);
+    KASSERT(!ret);
     memset(pf->pf_addr, 0, PAGE_SIZE);
     pf->pf_dirty = 1;  // XXX do this later --I think it's okay here -mgyee
     return pf;
@@ -206,15 +343,15 @@ ssize_t s5_read_file(s5_node_t *sn, size_t pos, char *buf, size_t len)
  *  - Because s5_get_file_block calls s5fs_get_pframe, which checks the length
  *    of the vnode, you may have to update the vnode's length before you call
  *    s5_get_file_block. In this case, you should also update the inode's
- *    s5_size and mark the inode dirty.
+ *    size (s5_inode_set_size) and mark the inode dirty (s5_dirty_inode).
  *  - If, midway through writing, you run into an error with s5_get_file_block,
  *    it is okay to merely undo your most recent changes while leaving behind
  *    writes you've already made to other blocks, before returning the error.
  *    That is, it is okay to make a partial write that the caller does not know
  *    about, as long as the file's length is consistent with what you've
  *    actually written so far.
- *  - You should maintain the vn_len of the vnode and the s5_un.s5_size field of the 
- *    inode to be the same. 
+ *  - You should maintain the vn_len of the vnode and the size of the inode
+ *    (s5_inode_size) to be the same. 
  */
 ssize_t s5_write_file(s5_node_t *sn, size_t pos, const char *buf, size_t len)
 {
@@ -243,6 +380,8 @@ ssize_t s5_write_file(s5_node_t *sn, size_t pos, const char *buf, size_t len)
  *  - You may find it helpful to take a look at the implementation of
  *    s5_free_block below.
  *  - You may assume/assert that any pframe calls succeed.
+ *  - Disks of S5_BITMAP_VERSION or later have no free list. They are handled
+ *    by s5_alloc_block_near, which only calls this function for older disks.
  */
 static long s5_alloc_block(s5fs_t *s5fs)
 {
@@ -259,12 +398,24 @@ static long s5_alloc_block(s5fs_t *s5fs)
  * expand the linked list correctly if the super block can no longer hold any
  * more free blocks in its s5s_free_blocks array according to s5s_nfree.
  */
-static void s5_free_block(s5fs_t *s5fs, blocknum_t blockno)
+void s5_free_block(s5fs_t *s5fs, blocknum_t blockno)
 {
     s5_lock_super(s5fs);
     s5_super_t *s = &s5fs->s5f_super;
     dbg(DBG_S5FS, "freeing disk block %d\n", blockno);
     KASSERT(blockno);
+    s5_journal_revoke(s5fs, blockno);
+    if (s5_has_bitmap(s5fs))
+    {
+        s5_bitmap_set(s5fs, blockno, 0);
+        // the journal walks s5f_mobj's pframes under its lock; same order as
+        // in s5_journal_revoke
+        mobj_lock(&s5fs->s5f_mobj);
+        mobj_delete_pframe(&s5fs->s5f_mobj, blockno);
+        mobj_unlock(&s5fs->s5f_mobj);
+        s5_unlock_super(s5fs);
+        return;
+    }
     KASSERT(s->s5s_nfree < S5_NBLKS_PER_FNODE);
 
     // Don't need to remove pframe from file mobj, since
@@ -288,12 +439,274 @@ static void s5_free_block(s5fs_t *s5fs, blocknum_t blockno)
         s->s5s_free_blocks[s->s5s_nfree++] = blockno;
         // only delete in this case b/c in first case we're still using that
         // block as a "meta" block, just to store free block numbers
+        mobj_lock(&s5fs->s5f_mobj);
         mobj_delete_pframe(&s5fs->s5f_mobj, blockno);
+        mobj_unlock(&s5fs->s5f_mobj);
     }
 
     s5_unlock_super(s5fs);
 }
 
+/*
+ * Set (used) or clear the bitmap bit of block, keeping the free counts in
+ * step. The super block must be locked.
+ */
+static void s5_bitmap_set(s5fs_t *s5fs, blocknum_t block, long used)
+{
+    KASSERT(kmutex_owns_mutex(&s5fs->s5f_mutex));
+    KASSERT(block < s5fs->s5f_super.s5s_nblocks);
+    pframe_t *pf;
+    s5_get_meta_disk_block(
+        s5fs, s5fs->s5f_super.s5s_bitmap_block + block / S5_BITS_PER_BLOCK, 1,
+        &pf);
+    uint64_t *word = (uint64_t *)pf->pf_addr + block % S5_BITS_PER_BLOCK / 64;
+    uint64_t mask = 1UL << (block % 64);
+    KASSERT(!(*word & mask) == !!used && "block is already in that state");
+    *word ^= mask;
+    s5_release_disk_block(&pf);
+
+    if (used)
+    {
+        s5fs->s5f_group_free[block / S5_GROUP_BLOCKS]--;
+        s5fs->s5f_nfree--;
+    }
+    else
+    {
+        s5fs->s5f_group_free[block / S5_GROUP_BLOCKS]++;
+        s5fs->s5f_nfree++;
+    }
+}
+
+/*
+ * Return the first block in [from, to) whose bitmap bit is clear, or -1. The
+ * range must lie within one bitmap block, as allocation groups do.
+ */
+static long s5_bitmap_find(s5fs_t *s5fs, blocknum_t from, blocknum_t to)
+{
+    if (from >= to)
+    {
+        return -1;
+    }
+    size_t base = from - from % S5_BITS_PER_BLOCK;
+    KASSERT(to - base <= S5_BITS_PER_BLOCK);
+
+    pframe_t *pf;
+    s5_get_meta_disk_block(
+        s5fs, s5fs->s5f_super.s5s_bitmap_block + from / S5_BITS_PER_BLOCK, 0,
+        &pf);
+    uint64_t *words = pf->pf_addr;
+    long found = -1;
+    for (size_t bit = from - base; bit < to - base; bit += 64 - bit % 64)
+    {
+        uint64_t free = ~words[bit / 64] & (~0UL << (bit % 64));
+        if (free)
+        {
+            size_t first = bit - bit % 64 + __builtin_ctzl(free);
+            found = first < to - base ? (long)(base + first) : -1;
+            break;
+        }
+    }
+    s5_release_disk_block(&pf);
+    return found;
+}
+
+/*
+ * Count the free blocks of each allocation group of a bitmap disk. Called at
+ * mount time; return 0, or -ENOMEM.
+ */
+long s5_bitmap_init(s5fs_t *s5fs)
+{
+    s5_super_t *s = &s5fs->s5f_super;
+    s5fs->s5f_nfree = 0;
+    s5fs->s5f_reserved = 0;
+    s5fs->s5f_ngroups = 0;
+    s5fs->s5f_group_free = NULL;
+    if (!s5_has_bitmap(s5fs))
+    {
+        return 0;
+    }
+
+    size_t ngroups = (s->s5s_nblocks + S5_GROUP_BLOCKS - 1) / S5_GROUP_BLOCKS;
+    s5fs->s5f_group_free = kmalloc(ngroups * sizeof(uint32_t));
+    if (!s5fs->s5f_group_free)
+    {
+        return -ENOMEM;
+    }
+    s5fs->s5f_ngroups = (uint32_t)ngroups;
+
+    for (size_t g = 0; g < ngroups; g++)
+    {
+        blocknum_t start = g * S5_GROUP_BLOCKS;
+        blocknum_t end = MIN(start + S5_GROUP_BLOCKS, s->s5s_nblocks);
+        pframe_t *pf;
+        s5_get_meta_disk_block(s5fs, s->s5s_bitmap_block + start / S5_BITS_PER_BLOCK,
+                               0, &pf);
+        uint64_t *words = pf->pf_addr;
+        uint32_t nfree = 0;
+        for (blocknum_t b = start; b < end; b += 64)
+        {
+            uint64_t free = ~words[b % S5_BITS_PER_BLOCK / 64];
+            if (end - b < 64)
+            {
+                free &= (1UL << (end - b)) - 1;
+            }
+            // no libgcc for __builtin_popcountl
+            for (; free; free &= free - 1)
+            {
+                nfree++;
+            }
+        }
+        s5_release_disk_block(&pf);
+        s5fs->s5f_group_free[g] = nfree;
+        s5fs->s5f_nfree += nfree;
+    }
+    dbg(DBG_S5FS, "%u of %u blocks free in %lu allocation groups\n",
+        s5fs->s5f_nfree, s->s5s_nblocks, ngroups);
+    return 0;
+}
+
+/*
+ * Allocate the free block closest after goal on a bitmap disk: the first one
+ * from goal to the end of its allocation group, then from the start of that
+ * group, then the first free block of the next group that has any.
+ *
+ * Blocks promised to delayed allocations (s5f_reserved) are only handed out if
+ * reserved is set, i.e. to a caller that holds such a reservation.
+ *
+ * Return the block number, or -ENOSPC.
+ */
+static long s5_bitmap_alloc(s5fs_t *s5fs, blocknum_t goal, long reserved)
+{
+    s5_lock_super(s5fs);
+    if (s5fs->s5f_nfree <= (reserved ? 0 : s5fs->s5f_reserved))
+    {
+        s5_unlock_super(s5fs);
+        return -ENOSPC;
+    }
+    s5_super_t *s = &s5fs->s5f_super;
+    if (goal >= s->s5s_nblocks)
+    {
+        goal = 0;
+    }
+
+    size_t group = goal / S5_GROUP_BLOCKS;
+    long block = -1;
+    for (size_t i = 0; i < s5fs->s5f_ngroups && block < 0; i++)
+    {
+        size_t g = (group + i) % s5fs->s5f_ngroups;
+        if (!s5fs->s5f_group_free[g])
+        {
+            continue;
+        }
+        blocknum_t start = g * S5_GROUP_BLOCKS;
+        blocknum_t end = MIN(start + S5_GROUP_BLOCKS, s->s5s_nblocks);
+        block = s5_bitmap_find(s5fs, i ? start : goal, end);
+        if (block < 0 && !i)
+        {
+            block = s5_bitmap_find(s5fs, start, goal);
+        }
+    }
+    KASSERT(block > 0 && "free block counts disagree with the bitmap");
+    s5_bitmap_set(s5fs, block, 1);
+    s5_unlock_super(s5fs);
+
+    dbg(DBG_S5FS, "allocated disk block %ld (goal %u)\n", block, goal);
+    return block;
+}
+
+/*
+ * Allocate one block, as close after goal as possible on disks that have a
+ * free block bitmap. Older disks fall back on the free list (s5_alloc_block),
+ * which does not take a goal. Set reserved if the block is for a page that
+ * holds a delayed allocation reservation (see s5_delalloc_reserve); older
+ * disks make no reservations.
+ *
+ * Return the block number, or -ENOSPC.
+ */
+long s5_alloc_block_near(s5fs_t *s5fs, blocknum_t goal, long reserved)
+{
+    return s5_has_bitmap(s5fs) ? s5_bitmap_alloc(s5fs, goal, reserved)
+                               : s5_alloc_block(s5fs);
+}
+
+/*
+ * Where to look for a disk block for file_blocknum of sn (and for any indirect
+ * block that has to be allocated with it): right after the disk block of the
+ * file block before it, so that files grow contiguously, or if there is none,
+ * at the start of the allocation group that goes with the inode. Inodes are
+ * spread evenly over the groups, so nearby inodes share a group.
+ */
+blocknum_t s5_block_goal(s5_node_t *sn, size_t file_blocknum)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    if (!s5fs->s5f_ngroups)
+    {
+        return 0;
+    }
+    if (file_blocknum)
+    {
+        size_t nblocks;
+        long prev = s5_file_block_run(sn, file_blocknum - 1, 1, &nblocks);
+        if (prev > 0)
+        {
+            return (blocknum_t)prev + 1;
+        }
+    }
+    uint64_t group = (uint64_t)sn->inode.s5_number * s5fs->s5f_ngroups /
+                     s5fs->s5f_super.s5s_num_inodes;
+    return (blocknum_t)(group * S5_GROUP_BLOCKS);
+}
+
+/* The most blocks that giving file_blocknum a disk block can take: the data
+ * block and every indirect block on the way to it */
+static size_t s5_delalloc_blocks(size_t file_blocknum)
+{
+    size_t path[4];
+    return 1 + s5_block_path(file_blocknum, path);
+}
+
+/*
+ * Delayed allocation. On bitmap disks, a write to a sparse file block does not
+ * allocate a disk block right away: the page is cached with pf_loc 0, and the
+ * block is only picked when the page is flushed (see s5fs_flush_pframe). By
+ * then the blocks around it have usually been written too, so the goal of
+ * s5_block_goal is much more likely to be free and in the right place.
+ *
+ * So that the flush cannot run out of space, enough blocks are reserved for
+ * the page when it is first dirtied, and given back once it has its block (or
+ * is thrown away by a truncate). Every dirty page with pf_loc 0 holds a
+ * reservation.
+ *
+ * Return 0, or -ENOSPC if the free blocks are all spoken for.
+ */
+long s5_delalloc_reserve(s5fs_t *s5fs, size_t file_blocknum)
+{
+    KASSERT(s5_has_bitmap(s5fs));
+    size_t n = s5_delalloc_blocks(file_blocknum);
+    long ret = 0;
+    s5_lock_super(s5fs);
+    if (s5fs->s5f_nfree < s5fs->s5f_reserved + n)
+    {
+        ret = -ENOSPC;
+    }
+    else
+    {
+        s5fs->s5f_reserved += n;
+    }
+    s5_unlock_super(s5fs);
+    return ret;
+}
+
+void s5_delalloc_release(s5fs_t *s5fs, size_t file_blocknum)
+{
+    KASSERT(s5_has_bitmap(s5fs));
+    size_t n = s5_delalloc_blocks(file_blocknum);
+    s5_lock_super(s5fs);
+    KASSERT(s5fs->s5f_reserved >= n);
+    s5fs->s5f_reserved -= n;
+    s5_unlock_super(s5fs);
+}
+
 /*
  * Allocate one inode from the filesystem. You will need to use the super block
  * s5s_free_inode member. You must initialize the on-disk contents of the
@@ -331,12 +744,14 @@ long s5_alloc_inode(s5fs_t *s5fs, uint16_t type, devid_t devid)
     s5fs->s5f_super.s5s_free_inode = inode->s5_un.s5_next_free;
     KASSERT(inode->s5_un.s5_next_free != inode->s5_number);
 
-    inode->s5_un.s5_size = 0;
+    s5_inode_set_size(inode, 0);
     inode->s5_type = type;
     inode->s5_linkcount = 0;
     memset(inode->s5_direct_blocks, 0, sizeof(inode->s5_direct_blocks));
     inode->s5_indirect_block =
         (S5_TYPE_CHR == type || S5_TYPE_BLK == type) ? devid : 0;
+    inode->s5_dindirect_block = 0;
+    inode->s5_tindirect_block = 0;
 
     s5_release_inode(&pf, &inode);
     s5_unlock_super(s5fs);
@@ -345,6 +760,58 @@ long s5_alloc_inode(s5fs_t *s5fs, uint16_t type, devid_t devid)
     return new_ino;
 }
 
+/*
+ * Free an indirect block of the given depth (1 for an indirect block, 2 for a
+ * double indirect block, 3 for a triple one) and everything below it. first is
+ * the first file block it maps. If o is given, the cached pages of the data
+ * blocks are deleted from it as well.
+ */
+static void s5_free_indirect(s5fs_t *s5fs, mobj_t *o, uint32_t block,
+                             long depth, size_t first)
+{
+    size_t span = 1;
+    for (long level = 1; level < depth; level++)
+    {
+        span *= S5_NIDIRECT_BLOCKS;
+    }
+
+    pframe_t *pf;
+    s5_get_meta_disk_block(s5fs, block, 0, &pf);
+    uint32_t *blocks = pf->pf_addr;
+    for (size_t i = 0; i < S5_NIDIRECT_BLOCKS; i++)
+    {
+        if (!blocks[i])
+        {
+            continue;
+        }
+        if (depth > 1)
+        {
+            s5_free_indirect(s5fs, o, blocks[i], depth - 1, first + i * span);
+            continue;
+        }
+        s5_free_block(s5fs, blocks[i]);
+        if (o)
+        {
+            mobj_delete_pframe(o, first + i);
+        }
+    }
+    s5_release_disk_block(&pf);
+    s5_free_block(s5fs, block);
+}
+
+/* The first file block mapped through the inode's indirect block of the given
+ * depth */
+static size_t s5_indirect_first(long depth)
+{
+    size_t first = S5_NDIRECT_BLOCKS, span = 1;
+    for (long level = 1; level < depth; level++)
+    {
+        span *= S5_NIDIRECT_BLOCKS;
+        first += span;
+    }
+    return first;
+}
+
 /*
  * Free the inode by:
  *  1) adding the inode to the free inode linked list (opposite of
@@ -358,11 +825,8 @@ long s5_alloc_inode(s5fs_t *s5fs, uint16_t type, devid_t devid)
  *  5) release the inode
  *  6) unlock the super block
  *  7) free all direct blocks
- *  8) get the indirect block
- *  9) copy the indirect block array onto the stack
- *  10) release the indirect block
- *  11) free the indirect blocks
- *  12) free the indirect block itself
+ *  8) free the indirect, double indirect and triple indirect blocks and
+ *     everything below them (s5_free_indirect)
  */
 void s5_free_inode(s5fs_t *s5fs, ino_t ino)
 {
@@ -372,17 +836,19 @@ void s5_free_inode(s5fs_t *s5fs, ino_t ino)
     s5_get_inode(s5fs, ino, 1, &pf, &inode);
 
     uint32_t direct_blocks_to_free[S5_NDIRECT_BLOCKS];
-    uint32_t indirect_block_to_free;
+    uint32_t indirect_blocks_to_free[3];
     if (inode->s5_type == S5_TYPE_DATA || inode->s5_type == S5_TYPE_DIR)
     {
-        indirect_block_to_free = inode->s5_indirect_block;
+        indirect_blocks_to_free[0] = inode->s5_indirect_block;
+        indirect_blocks_to_free[1] = inode->s5_dindirect_block;
+        indirect_blocks_to_free[2] = inode->s5_tindirect_block;
         memcpy(direct_blocks_to_free, inode->s5_direct_blocks,
                sizeof(direct_blocks_to_free));
     }
     else
     {
         KASSERT(inode->s5_type == S5_TYPE_BLK || inode->s5_type == S5_TYPE_CHR);
-        indirect_block_to_free = 0;
+        memset(indirect_blocks_to_free, 0, sizeof(indirect_blocks_to_free));
         memset(direct_blocks_to_free, 0, sizeof(direct_blocks_to_free));
     }
 
@@ -400,23 +866,13 @@ void s5_free_inode(s5fs_t *s5fs, ino_t ino)
             s5_free_block(s5fs, direct_blocks_to_free[i]);
         }
     }
-    if (indirect_block_to_free)
+    for (long depth = 1; depth <= 3; depth++)
     {
-        uint32_t indirect_blocks_to_free[S5_NIDIRECT_BLOCKS];
-
-        s5_get_meta_disk_block(s5fs, indirect_block_to_free, 0, &pf);
-        KASSERT(S5_BLOCK_SIZE == PAGE_SIZE);
-        memcpy(indirect_blocks_to_free, pf->pf_addr, S5_BLOCK_SIZE);
-        s5_release_disk_block(&pf);
-
-        for (unsigned i = 0; i < S5_NIDIRECT_BLOCKS; i++)
+        if (indirect_blocks_to_free[depth - 1])
         {
-            if (indirect_blocks_to_free[i])
-            {
-                s5_free_block(s5fs, indirect_blocks_to_free[i]);
-            }
+            s5_free_indirect(s5fs, NULL, indirect_blocks_to_free[depth - 1],
+                             depth, s5_indirect_first(depth));
         }
-        s5_free_block(s5fs, indirect_block_to_free);
     }
     dbg(DBG_S5FS, "freed inode %d\n", ino);
 }
@@ -442,6 +898,8 @@ void s5_free_inode(s5fs_t *s5fs, ino_t ino)
  *  - You could optimize this function by using s5_get_file_block (rather than
  *    s5_read_file) to ensure you do not read beyond the length of the file,
  *    but doing so is optional.
+ *  - If s5_dir_is_indexed(sn), the directory is hashed and can't be read
+ *    linearly; use s5_dir_index_find instead.
  */
 long s5_find_dirent(s5_node_t *sn, const char *name, size_t namelen,
                     size_t *filepos)
@@ -472,8 +930,10 @@ long s5_find_dirent(s5_node_t *sn, const char *name, size_t namelen,
  *  - Make sure you are only using s5_dirent_t, and not dirent_t structs.
  *  - Decrement the child's linkcount, because you have removed the directory's
  *    link to the child.
- *  - Mark the inodes as dirtied.
+ *  - Mark the inodes as dirtied (s5_dirty_inode).
  *  - Use s5_find_dirent to find the position of the entry being removed. 
+ *  - If s5_dir_is_indexed(sn), use s5_dir_index_remove to clear the entry in
+ *    place instead of moving the last entry over it.
  */
 void s5_remove_dirent(s5_node_t *sn, const char *name, size_t namelen,
                       s5_node_t *child)
@@ -528,6 +988,9 @@ void s5_replace_dirent(s5_node_t *sn, const char *name, size_t namelen,
  *  - Update linkcounts and mark inodes dirty appropriately.
  *  - You may wish to assert at the end of s5_link that the directory entry
  *    exists and that its inode is, as expected, the inode of child.
+ *  - A directory that is already hashed or whose linear entries fill a block
+ *    (vn_len == S5_BLOCK_SIZE) must get the entry through s5_dir_index_add,
+ *    which converts the directory to the hashed format when needed.
  */
 long s5_link(s5_node_t *dir, const char *name, size_t namelen,
              s5_node_t *child)
@@ -538,10 +1001,530 @@ long s5_link(s5_node_t *dir, const char *name, size_t namelen,
     return -1;
 }
 
+/*
+ * Hashed directories. See the description above s5_dir_index_t in s5fs.h.
+ * The directory must be locked for all of the functions below.
+ *
+ * Blocks are fetched with forwrite clear and marked dirty by hand when they
+ * are changed: every block of a hashed directory is allocated, so this is the
+ * same as asking for them with forwrite set, without dirtying the blocks that
+ * are only looked at.
+ */
+
+/* The position in the directory file of the given slot of a dirent block */
+#define S5_DIR_SLOT_POS(block, slot) \
+    ((block)*S5_BLOCK_SIZE + ((slot) + 1) * sizeof(s5_dirent_t))
+
+/* 32-bit FNV-1a; tools/fsmaker/api.py must agree */
+static uint32_t s5_dir_hash(const char *name, size_t namelen)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < namelen; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Return whether the directory sn is in the hashed format. A linear directory
+ * never grows past a block.
+ */
+long s5_dir_is_indexed(s5_node_t *sn)
+{
+    KASSERT(S_ISDIR(sn->vnode.vn_mode));
+    return sn->vnode.vn_len > S5_BLOCK_SIZE;
+}
+
+/* Add a zeroed block to the end of the directory.
+ *
+ * Return its file block number, or:
+ *  - ENOSPC: The directory is as large as a file can be
+ *  - Propagate errors from s5_get_file_block
+ */
+static long s5_dir_extend(s5_node_t *sn)
+{
+    size_t block = sn->vnode.vn_len / S5_BLOCK_SIZE;
+    if (block >= S5_MAX_FILE_BLOCKS)
+    {
+        return -ENOSPC;
+    }
+
+    pframe_t *pf;
+    sn->vnode.vn_len += S5_BLOCK_SIZE;
+    long ret = s5_get_file_block(sn, block, 1, &pf);
+    if (ret)
+    {
+        sn->vnode.vn_len -= S5_BLOCK_SIZE;
+        return ret;
+    }
+    s5_release_file_block(&pf);
+
+    s5_inode_set_size(&sn->inode, sn->vnode.vn_len);
+    s5_dirty_inode(sn);
+    return block;
+}
+
+/* Take a block off the directory's free list, or add one if the list is empty.
+ * Return its file block number or propagate errors from s5_dir_extend.
+ */
+static long s5_dir_new_block(s5_node_t *sn, s5_dir_index_t *index)
+{
+    if (!index->s5di_free)
+    {
+        return s5_dir_extend(sn);
+    }
+
+    pframe_t *pf;
+    long block = index->s5di_free;
+    long ret = s5_get_file_block(sn, block, 0, &pf);
+    KASSERT(!ret);
+    s5_dir_block_t *db = pf->pf_addr;
+    KASSERT(!db->s5db_count);
+    index->s5di_free = db->s5db_next;
+    db->s5db_next = 0;
+    pf->pf_dirty = 1;
+    s5_release_file_block(&pf);
+    return block;
+}
+
+/* Put name into the first free slot of the chain starting at block, adding a
+ * block to the end of the chain if all of them are full.
+ */
+static long s5_dir_chain_insert(s5_node_t *sn, s5_dir_index_t *index,
+                                uint32_t block, const char *name,
+                                size_t namelen, ino_t ino)
+{
+    for (;;)
+    {
+        pframe_t *pf;
+        long ret = s5_get_file_block(sn, block, 0, &pf);
+        if (ret)
+        {
+            return ret;
+        }
+        s5_dir_block_t *db = pf->pf_addr;
+
+        if (db->s5db_count < S5_DIR_SLOTS_PER_BLOCK)
+        {
+            s5_dirent_t *d = db->s5db_dirents;
+            while (d->s5d_name[0])
+            {
+                d++;
+            }
+            KASSERT(d < db->s5db_dirents + S5_DIR_SLOTS_PER_BLOCK);
+            d->s5d_inode = ino;
+            memcpy(d->s5d_name, name, namelen);
+            d->s5d_name[namelen] = '\0';
+            db->s5db_count++;
+            pf->pf_dirty = 1;
+            s5_release_file_block(&pf);
+            return 0;
+        }
+
+        if (!db->s5db_next)
+        {
+            ret = s5_dir_new_block(sn, index);
+            if (ret < 0)
+            {
+                s5_release_file_block(&pf);
+                return ret;
+            }
+            db->s5db_next = ret;
+            pf->pf_dirty = 1;
+        }
+        block = db->s5db_next;
+        s5_release_file_block(&pf);
+    }
+}
+
+/* Move the empty blocks of the chain starting at head, other than head itself,
+ * to the directory's free list.
+ */
+static void s5_dir_chain_compact(s5_node_t *sn, s5_dir_index_t *index,
+                                 uint32_t head)
+{
+    pframe_t *prevpf;
+    long ret = s5_get_file_block(sn, head, 0, &prevpf);
+    KASSERT(!ret);
+
+    uint32_t block;
+    while ((block = ((s5_dir_block_t *)prevpf->pf_addr)->s5db_next))
+    {
+        pframe_t *pf;
+        ret = s5_get_file_block(sn, block, 0, &pf);
+        KASSERT(!ret);
+        s5_dir_block_t *db = pf->pf_addr;
+        if (db->s5db_count)
+        {
+            s5_release_file_block(&prevpf);
+            prevpf = pf;
+            continue;
+        }
+
+        ((s5_dir_block_t *)prevpf->pf_addr)->s5db_next = db->s5db_next;
+        prevpf->pf_dirty = 1;
+        db->s5db_next = index->s5di_free;
+        index->s5di_free = block;
+        pf->pf_dirty = 1;
+        s5_release_file_block(&pf);
+    }
+    s5_release_file_block(&prevpf);
+}
+
+/* Double the number of buckets, splitting every chain in two.
+ *
+ * Every block the split can need is put on the free list before any entry is
+ * moved, so that running out of space leaves the table as it was instead of
+ * half split. Growing is only an optimization, so failing to is not an error.
+ */
+static void s5_dir_index_split(s5_node_t *sn, s5_dir_index_t *index)
+{
+    uint32_t nbuckets = index->s5di_nbuckets;
+    pframe_t *pf;
+    long ret;
+
+    size_t needed = 0;
+    for (uint32_t b = 0; b < nbuckets; b++)
+    {
+        size_t moving = 0;
+        for (uint32_t block = index->s5di_buckets[b]; block;)
+        {
+            ret = s5_get_file_block(sn, block, 0, &pf);
+            KASSERT(!ret);
+            s5_dir_block_t *db = pf->pf_addr;
+            for (size_t i = 0; i < S5_DIR_SLOTS_PER_BLOCK; i++)
+            {
+                s5_dirent_t *d = &db->s5db_dirents[i];
+                moving += d->s5d_name[0] &&
+                          (s5_dir_hash(d->s5d_name, strlen(d->s5d_name)) &
+                           nbuckets);
+            }
+            block = db->s5db_next;
+            s5_release_file_block(&pf);
+        }
+        needed += moving ? (moving - 1) / S5_DIR_SLOTS_PER_BLOCK + 1 : 1;
+    }
+
+    size_t nfree = 0;
+    for (uint32_t block = index->s5di_free; block; nfree++)
+    {
+        ret = s5_get_file_block(sn, block, 0, &pf);
+        KASSERT(!ret);
+        block = ((s5_dir_block_t *)pf->pf_addr)->s5db_next;
+        s5_release_file_block(&pf);
+    }
+    for (; nfree < needed; nfree++)
+    {
+        long block = s5_dir_extend(sn);
+        if (block < 0)
+        {
+            dbg(DBG_S5FS, "not splitting directory %d: %ld\n",
+                sn->inode.s5_number, block);
+            return;
+        }
+        ret = s5_get_file_block(sn, block, 0, &pf);
+        KASSERT(!ret);
+        ((s5_dir_block_t *)pf->pf_addr)->s5db_next = index->s5di_free;
+        index->s5di_free = block;
+        pf->pf_dirty = 1;
+        s5_release_file_block(&pf);
+    }
+
+    for (uint32_t b = 0; b < nbuckets; b++)
+    {
+        ret = s5_dir_new_block(sn, index);
+        KASSERT(ret > 0);
+        uint32_t head = index->s5di_buckets[b + nbuckets] = ret;
+
+        for (uint32_t block = index->s5di_buckets[b]; block;)
+        {
+            ret = s5_get_file_block(sn, block, 0, &pf);
+            KASSERT(!ret);
+            s5_dir_block_t *db = pf->pf_addr;
+            for (size_t i = 0; i < S5_DIR_SLOTS_PER_BLOCK; i++)
+            {
+                s5_dirent_t *d = &db->s5db_dirents[i];
+                size_t namelen = strlen(d->s5d_name);
+                if (!namelen || !(s5_dir_hash(d->s5d_name, namelen) & nbuckets))
+                {
+                    continue;
+                }
+                ret = s5_dir_chain_insert(sn, index, head, d->s5d_name, namelen,
+                                          d->s5d_inode);
+                KASSERT(!ret);
+                memset(d, 0, sizeof(*d));
+                db->s5db_count--;
+                pf->pf_dirty = 1;
+            }
+            block = db->s5db_next;
+            s5_release_file_block(&pf);
+        }
+        s5_dir_chain_compact(sn, index, index->s5di_buckets[b]);
+    }
+    index->s5di_nbuckets = nbuckets * 2;
+    dbg(DBG_S5FS, "directory %d now has %u buckets\n", sn->inode.s5_number,
+        index->s5di_nbuckets);
+}
+
+/* Convert a linear directory that fills exactly one block to the hashed
+ * format. The directory is left as it was on failure.
+ */
+static long s5_dir_index_build(s5_node_t *sn)
+{
+    KASSERT(sn->vnode.vn_len == S5_BLOCK_SIZE);
+
+    s5_dirent_t *dirents = page_alloc();
+    if (!dirents)
+    {
+        return -ENOMEM;
+    }
+    pframe_t *pf;
+    long ret = s5_get_file_block(sn, 0, 0, &pf);
+    if (ret)
+    {
+        goto out;
+    }
+    memcpy(dirents, pf->pf_addr, S5_BLOCK_SIZE);
+    s5_release_file_block(&pf);
+
+    // The bucket heads, plus one block in case every entry lands in the same
+    // bucket, so that filling in the table cannot fail. Blocks added before a
+    // failure stay allocated past the end of the file, zeroed, and are picked
+    // up again the next time the directory grows.
+    for (size_t i = 0; i <= S5_DIR_MIN_BUCKETS; i++)
+    {
+        ret = s5_dir_extend(sn);
+        if (ret < 0)
+        {
+            sn->vnode.vn_len = S5_BLOCK_SIZE;
+            s5_inode_set_size(&sn->inode, S5_BLOCK_SIZE);
+            goto out;
+        }
+    }
+
+    ret = s5_get_file_block(sn, 0, 1, &pf);
+    KASSERT(!ret);
+    s5_dir_index_t *index = pf->pf_addr;
+    memset(index, 0, S5_BLOCK_SIZE);
+    index->s5di_magic = S5_DIR_INDEX_MAGIC;
+    index->s5di_nbuckets = S5_DIR_MIN_BUCKETS;
+    for (uint32_t b = 0; b < S5_DIR_MIN_BUCKETS; b++)
+    {
+        index->s5di_buckets[b] = b + 1;
+    }
+    index->s5di_free = S5_DIR_MIN_BUCKETS + 1;
+
+    for (size_t i = 0; i < S5_DIRENTS_PER_BLOCK; i++)
+    {
+        size_t namelen = strlen(dirents[i].s5d_name);
+        if (!namelen)
+        {
+            continue;
+        }
+        uint32_t hash = s5_dir_hash(dirents[i].s5d_name, namelen);
+        ret = s5_dir_chain_insert(
+            sn, index, index->s5di_buckets[hash & (S5_DIR_MIN_BUCKETS - 1)],
+            dirents[i].s5d_name, namelen, dirents[i].s5d_inode);
+        KASSERT(!ret);
+        index->s5di_nentries++;
+    }
+    s5_release_file_block(&pf);
+    dbg(DBG_S5FS, "directory %d is now hashed\n", sn->inode.s5_number);
+
+out:
+    page_free(dirents);
+    return ret;
+}
+
+/* Find name in a hashed directory. Same as s5_find_dirent. */
+long s5_dir_index_find(s5_node_t *sn, const char *name, size_t namelen,
+                       size_t *filepos)
+{
+    KASSERT(s5_dir_is_indexed(sn));
+
+    pframe_t *pf;
+    long ret = s5_get_file_block(sn, 0, 0, &pf);
+    if (ret)
+    {
+        return ret;
+    }
+    s5_dir_index_t *index = pf->pf_addr;
+    KASSERT(index->s5di_magic == S5_DIR_INDEX_MAGIC);
+    uint32_t block = index->s5di_buckets[s5_dir_hash(name, namelen) &
+                                         (index->s5di_nbuckets - 1)];
+    s5_release_file_block(&pf);
+
+    while (block)
+    {
+        ret = s5_get_file_block(sn, block, 0, &pf);
+        if (ret)
+        {
+            return ret;
+        }
+        s5_dir_block_t *db = pf->pf_addr;
+        for (size_t i = 0; db->s5db_count && i < S5_DIR_SLOTS_PER_BLOCK; i++)
+        {
+            s5_dirent_t *d = &db->s5db_dirents[i];
+            if (name_match(d->s5d_name, name, namelen))
+            {
+                if (filepos)
+                {
+                    *filepos = S5_DIR_SLOT_POS(block, i);
+                }
+                ret = d->s5d_inode;
+                s5_release_file_block(&pf);
+                return ret;
+            }
+        }
+        block = db->s5db_next;
+        s5_release_file_block(&pf);
+    }
+    return -ENOENT;
+}
+
+/* Add an entry for name to the directory, which must either be hashed or be a
+ * linear directory that fills a block (it is converted first). The caller
+ * makes sure the name is not there yet and takes care of linkcounts.
+ *
+ * Return 0 on success, or:
+ *  - ENOSPC: The directory is as large as a file can be
+ *  - Propagate errors from s5_get_file_block
+ */
+long s5_dir_index_add(s5_node_t *sn, const char *name, size_t namelen,
+                      ino_t ino)
+{
+    KASSERT(kmutex_owns_mutex(&sn->vnode.vn_mobj.mo_mutex));
+    KASSERT(namelen < S5_NAME_LEN);
+
+    long ret;
+    if (!s5_dir_is_indexed(sn) && (ret = s5_dir_index_build(sn)))
+    {
+        return ret;
+    }
+
+    pframe_t *pf;
+    ret = s5_get_file_block(sn, 0, 1, &pf);
+    if (ret)
+    {
+        return ret;
+    }
+    s5_dir_index_t *index = pf->pf_addr;
+    KASSERT(index->s5di_magic == S5_DIR_INDEX_MAGIC);
+    if (index->s5di_nentries >=
+            index->s5di_nbuckets * S5_DIR_SLOTS_PER_BLOCK &&
+        index->s5di_nbuckets < S5_DIR_MAX_BUCKETS)
+    {
+        s5_dir_index_split(sn, index);
+    }
+
+    uint32_t hash = s5_dir_hash(name, namelen);
+    ret = s5_dir_chain_insert(
+        sn, index, index->s5di_buckets[hash & (index->s5di_nbuckets - 1)],
+        name, namelen, ino);
+    if (!ret)
+    {
+        index->s5di_nentries++;
+    }
+    s5_release_file_block(&pf);
+    return ret;
+}
+
+/* Remove the entry at filepos (as returned by s5_dir_index_find) from a hashed
+ * directory. The caller takes care of linkcounts. This function does not fail.
+ */
+void s5_dir_index_remove(s5_node_t *sn, size_t filepos)
+{
+    KASSERT(kmutex_owns_mutex(&sn->vnode.vn_mobj.mo_mutex));
+    KASSERT(s5_dir_is_indexed(sn));
+    size_t block = S5_DATA_BLOCK(filepos);
+    size_t slot = S5_DATA_OFFSET(filepos) / sizeof(s5_dirent_t) - 1;
+    KASSERT(block && slot < S5_DIR_SLOTS_PER_BLOCK);
+
+    pframe_t *pf;
+    long ret = s5_get_file_block(sn, block, 0, &pf);
+    KASSERT(!ret);
+    s5_dir_block_t *db = pf->pf_addr;
+    s5_dirent_t *d = &db->s5db_dirents[slot];
+    KASSERT(d->s5d_name[0]);
+    uint32_t hash = s5_dir_hash(d->s5d_name, strlen(d->s5d_name));
+    memset(d, 0, sizeof(*d));
+    long emptied = !--db->s5db_count;
+    pf->pf_dirty = 1;
+    s5_release_file_block(&pf);
+
+    ret = s5_get_file_block(sn, 0, 1, &pf);
+    KASSERT(!ret);
+    s5_dir_index_t *index = pf->pf_addr;
+    index->s5di_nentries--;
+    if (emptied)
+    {
+        s5_dir_chain_compact(
+            sn, index, index->s5di_buckets[hash & (index->s5di_nbuckets - 1)]);
+    }
+    s5_release_file_block(&pf);
+}
+
+/* Read the first entry of a hashed directory at or after pos into d.
+ *
+ * Return the number of bytes from pos to the end of that entry, 0 if there
+ * are no more entries, or propagate errors from s5_get_file_block.
+ */
+long s5_dir_index_readdir(s5_node_t *sn, size_t pos, s5_dirent_t *d)
+{
+    KASSERT(s5_dir_is_indexed(sn));
+    size_t nblocks = sn->vnode.vn_len / S5_BLOCK_SIZE;
+    size_t block = S5_DATA_BLOCK(pos);
+    size_t slot = S5_DATA_OFFSET(pos) / sizeof(s5_dirent_t);
+    if (!block)
+    {
+        block = 1;
+        slot = 0;
+    }
+    slot = slot ? slot - 1 : 0;
+
+    for (; block < nblocks; block++, slot = 0)
+    {
+        pframe_t *pf;
+        long ret = s5_get_file_block(sn, block, 0, &pf);
+        if (ret)
+        {
+            return ret;
+        }
+        s5_dir_block_t *db = pf->pf_addr;
+        for (; db->s5db_count && slot < S5_DIR_SLOTS_PER_BLOCK; slot++)
+        {
+            if (db->s5db_dirents[slot].s5d_name[0])
+            {
+                *d = db->s5db_dirents[slot];
+                s5_release_file_block(&pf);
+                return S5_DIR_SLOT_POS(block, slot) + sizeof(s5_dirent_t) - pos;
+            }
+        }
+        s5_release_file_block(&pf);
+    }
+    return 0;
+}
+
+/* Return the number of entries in the directory, "." and ".." included. */
+long s5_dir_nentries(s5_node_t *sn)
+{
+    if (!s5_dir_is_indexed(sn))
+    {
+        return sn->vnode.vn_len / sizeof(s5_dirent_t);
+    }
+    pframe_t *pf;
+    long ret = s5_get_file_block(sn, 0, 0, &pf);
+    KASSERT(!ret);
+    ret = ((s5_dir_index_t *)pf->pf_addr)->s5di_nentries;
+    s5_release_file_block(&pf);
+    return ret;
+}
+
 /* Return the number of file blocks allocated for sn. This means any
- * file blocks that are not sparse, direct or indirect. If the indirect
- * block itself is allocated, that must also count. This function should not
- * fail.
+ * file blocks that are not sparse, direct or indirect. The indirect, double
+ * indirect and triple indirect blocks themselves, and the indirect blocks
+ * below them, must also count. This function should not fail.
  *
  * Hint:
  *  - You may wish to assert that the special character / block files do not
@@ -567,6 +1550,21 @@ void s5_remove_blocks(s5_node_t *sn)
     s5fs_t* s5fs = VNODE_TO_S5FS(&sn->vnode);
     s5_inode_t* s5_inode = &sn->inode; 
     mobj_t *o = &sn->vnode.vn_mobj;
+
+    // Pages that are waiting for a disk block (delayed allocation) only have
+    // a reservation to give back
+    list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
+    {
+        if (!pf->pf_loc)
+        {
+            if (pf->pf_dirty && s5_has_bitmap(s5fs))
+            {
+                s5_delalloc_release(s5fs, pf->pf_pagenum);
+            }
+            mobj_delete_pframe(o, pf->pf_pagenum);
+        }
+    }
+
     for (unsigned i = 0; i < S5_NDIRECT_BLOCKS; i++) 
     {
         if (s5_inode->s5_direct_blocks[i])
@@ -581,25 +1579,214 @@ void s5_remove_blocks(s5_node_t *sn)
 
     memset(s5_inode->s5_direct_blocks, 0, sizeof(s5_inode->s5_direct_blocks));
 
-    // Get the indirect blocks and free them, if they exist
-    if (s5_inode->s5_indirect_block)
+    // Free the indirect blocks and the blocks below them, if they exist
+    for (long depth = 1; depth <= 3; depth++)
     {
-        pframe_t *pf;
-        s5_get_meta_disk_block(s5fs, s5_inode->s5_indirect_block, 0, &pf);
-        uint32_t *blocknum_ptr = pf->pf_addr;
+        size_t path[4];
+        uint32_t *root = s5_block_root(s5_inode, depth, path);
+        if (*root)
+        {
+            s5_free_indirect(s5fs, o, *root, depth, s5_indirect_first(depth));
+            *root = 0;
+        }
+    }
+}
 
-        for (unsigned i = 0; i < S5_NIDIRECT_BLOCKS; i++)
+/*
+ * Put sn on the dirty inode list, after a change to sn->inode. The inode is
+ * copied into its inode block later, along with the other dirty inodes of
+ * that block.
+ */
+void s5_dirty_inode(s5_node_t *sn)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    kmutex_lock(&s5fs->s5f_inode_mutex);
+    if (!sn->dirtied_inode)
+    {
+        list_link_t *next = &s5fs->s5f_dirty_inodes;
+        list_iterate(&s5fs->s5f_dirty_inodes, other, s5_node_t, dirty_link)
         {
-            if (blocknum_ptr[i])
+            if (other->vnode.vn_vno > sn->vnode.vn_vno)
             {
-                s5_free_block(s5fs, blocknum_ptr[i]);
-                mobj_delete_pframe(o, S5_NDIRECT_BLOCKS + i);
+                next = &other->dirty_link;
+                break;
             }
         }
+        list_insert_before(next, &sn->dirty_link);
+        sn->dirtied_inode = 1;
+    }
+    kmutex_unlock(&s5fs->s5f_inode_mutex);
+}
+
+/*
+ * Copy every dirty inode that lives in inode block blockno into it and take
+ * them off the dirty list. s5f_inode_mutex must be locked.
+ */
+static void s5_write_inode_block(s5fs_t *s5fs, blocknum_t blockno)
+{
+    KASSERT(kmutex_owns_mutex(&s5fs->s5f_inode_mutex));
+    pframe_t *pf;
+    s5_get_meta_disk_block(s5fs, blockno, 1, &pf);
+    list_iterate(&s5fs->s5f_dirty_inodes, sn, s5_node_t, dirty_link)
+    {
+        ino_t ino = sn->vnode.vn_vno;
+        if (S5_INODE_BLOCK(ino) < blockno)
+        {
+            continue;
+        }
+        if (S5_INODE_BLOCK(ino) > blockno)
+        {
+            break;
+        }
+        s5_inode_t *inode = (s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(ino);
+        KASSERT(inode->s5_number == ino);
+        memcpy(inode, &sn->inode, sizeof(s5_inode_t));
+        list_remove(&sn->dirty_link);
+        sn->dirtied_inode = 0;
+    }
+    s5_release_disk_block(&pf);
+}
 
+/*
+ * Write back sn's inode if it is dirty, and with it the other dirty inodes
+ * in its inode block.
+ */
+void s5_write_inode(s5_node_t *sn)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    kmutex_lock(&s5fs->s5f_inode_mutex);
+    if (sn->dirtied_inode)
+    {
+        s5_write_inode_block(s5fs, S5_INODE_BLOCK(sn->vnode.vn_vno));
+    }
+    kmutex_unlock(&s5fs->s5f_inode_mutex);
+}
+
+/* Write back every dirty inode, one inode block at a time. */
+void s5_write_dirty_inodes(s5fs_t *s5fs)
+{
+    kmutex_lock(&s5fs->s5f_inode_mutex);
+    while (!list_empty(&s5fs->s5f_dirty_inodes))
+    {
+        s5_node_t *sn =
+            list_head(&s5fs->s5f_dirty_inodes, s5_node_t, dirty_link);
+        s5_write_inode_block(s5fs, S5_INODE_BLOCK(sn->vnode.vn_vno));
+    }
+    kmutex_unlock(&s5fs->s5f_inode_mutex);
+}
+
+/* Write back block of s5f_mobj if it is cached and dirty. */
+static long s5_flush_meta_block(s5fs_t *s5fs, blocknum_t block)
+{
+    mobj_t *o = &s5fs->s5f_mobj;
+    pframe_t *pf;
+    long ret = 0;
+    mobj_lock(o);
+    mobj_find_pframe(o, block, &pf);
+    if (pf)
+    {
+        ret = mobj_flush_pframe(o, pf);
+        pframe_release(&pf);
+    }
+    mobj_unlock(o);
+    return ret;
+}
+
+/*
+ * Write back an indirect block of the given depth and the indirect blocks
+ * below it, lowest first. The data blocks they map are left alone.
+ */
+static long s5_flush_indirect(s5fs_t *s5fs, uint32_t block, long depth)
+{
+    long ret = 0;
+    if (depth > 1)
+    {
+        pframe_t *pf;
+        s5_get_meta_disk_block(s5fs, block, 0, &pf);
+        uint32_t *blocks = pf->pf_addr;
+        for (size_t i = 0; i < S5_NIDIRECT_BLOCKS && !ret; i++)
+        {
+            if (blocks[i])
+            {
+                ret = s5_flush_indirect(s5fs, blocks[i], depth - 1);
+            }
+        }
         s5_release_disk_block(&pf);
-        // Free the indirect block itself
-        s5_free_block(s5fs, s5_inode->s5_indirect_block);
-        s5_inode->s5_indirect_block = 0;
     }
+    return ret ? ret : s5_flush_meta_block(s5fs, block);
+}
+
+/*
+ * Whether the on-disk copy of an inode maps the same data as the in-core one:
+ * same size and same block pointers. The link count may differ.
+ */
+static long s5_inode_same_data(const s5_inode_t *a, const s5_inode_t *b)
+{
+    return s5_inode_size(a) == s5_inode_size(b) &&
+           !memcmp(a->s5_direct_blocks, b->s5_direct_blocks,
+                   sizeof(a->s5_direct_blocks)) &&
+           a->s5_indirect_block == b->s5_indirect_block &&
+           a->s5_dindirect_block == b->s5_dindirect_block &&
+           a->s5_tindirect_block == b->s5_tindirect_block;
+}
+
+/*
+ * Write back the metadata of sn for fsync: its indirect blocks, the bitmap
+ * blocks that record their allocation, then the block holding the inode,
+ * after the in-core inode has been copied into it (along with the other dirty
+ * inodes of the block). With datasync set, an inode whose size and block
+ * pointers have not changed is left on the dirty list.
+ *
+ * Only the blocks of this file are written, except on disks with a journal,
+ * where the first dirty block commits every dirty metadata block. On disks
+ * without a bitmap the free list is in the superblock, which only sync writes.
+ *
+ * The file's pages must have been flushed already, since on disks with a
+ * bitmap that is when their blocks are allocated.
+ */
+long s5_sync_inode(s5_node_t *sn, long datasync)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    s5_inode_t *inode = &sn->inode;
+    long ret = 0;
+    if (S_ISCHR(sn->vnode.vn_mode) || S_ISBLK(sn->vnode.vn_mode))
+    {
+        // s5_indirect_block holds the device id
+        return 0;
+    }
+
+    for (long depth = 1; depth <= 3 && !ret; depth++)
+    {
+        size_t path[4];
+        uint32_t root = *s5_block_root(inode, depth, path);
+        if (root)
+        {
+            ret = s5_flush_indirect(s5fs, root, depth);
+        }
+    }
+    for (size_t i = 0; s5_has_bitmap(s5fs) && !ret &&
+                       i < s5fs->s5f_super.s5s_bitmap_nblocks;
+         i++)
+    {
+        ret = s5_flush_meta_block(s5fs, s5fs->s5f_super.s5s_bitmap_block + i);
+    }
+    if (ret)
+    {
+        return ret;
+    }
+
+    long write = !datasync;
+    if (datasync && sn->dirtied_inode)
+    {
+        pframe_t *pf;
+        s5_inode_t *disk;
+        s5_get_inode(s5fs, sn->vnode.vn_vno, 0, &pf, &disk);
+        write = !s5_inode_same_data(disk, inode);
+        s5_release_inode(&pf, &disk);
+    }
+    if (write)
+    {
+        s5_write_inode(sn);
+    }
+    return s5_flush_meta_block(s5fs, S5_INODE_BLOCK(sn->vnode.vn_vno));
 }
@@ -5,6 +5,7 @@
 #include <fs/s5fs/s5fs.h>
 #include <fs/vnode.h>
 
+#include "fs/dcache.h"
 #include "fs/file.h"
 #include "fs/ramfs/ramfs.h"
 
@@ -128,6 +129,8 @@ long vfs_shutdown()
     }
 #endif
 
+    dcache_purge(&vfs_root_fs);
+    vnode_cache_purge(&vfs_root_fs);
     if (vfs_is_in_use(&vfs_root_fs))
     {
         panic("vfs_shutdown: found active vnodes in root filesystem");
@@ -50,6 +50,122 @@ ssize_t do_write(int fd, const void *buf, size_t len)
     return -1;
 }
 
+/*
+ * Read or write the segments of iov in order, as one operation, with the
+ * vnode locked once for all of them. Stops at the first short transfer (end
+ * of file, or a device with nothing more to give).
+ *
+ * If offset is -1, the transfer starts at the file position (or, for an
+ * append-mode write, at the end of the file) and moves the position past the
+ * bytes transferred. Otherwise it starts at offset and the file position is
+ * neither used nor changed (pread and pwrite).
+ */
+static ssize_t do_rw_vec(int fd, const iovec_t *iov, int iovcnt, off_t offset,
+                         long write)
+{
+    file_t *file = fget(fd);
+    if (!file || !(file->f_mode & (write ? FMODE_WRITE : FMODE_READ)))
+    {
+        if (file)
+        {
+            fput(&file);
+        }
+        return -EBADF;
+    }
+    vnode_t *vn = file->f_vnode;
+    ssize_t ret = 0;
+    if (S_ISDIR(vn->vn_mode))
+    {
+        ret = -EISDIR;
+    }
+    else if (offset >= 0 && S_ISFIFO(vn->vn_mode))
+    {
+        ret = -ESPIPE;
+    }
+    else if (write ? !vn->vn_ops->write : !vn->vn_ops->read)
+    {
+        ret = -EINVAL;
+    }
+    if (ret)
+    {
+        fput(&file);
+        return ret;
+    }
+
+    vlock(vn);
+    size_t pos = (size_t)offset;
+    if (offset < 0)
+    {
+        pos = write && (file->f_mode & FMODE_APPEND) ? vn->vn_len
+                                                     : file->f_pos;
+    }
+    size_t done = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (!iov[i].iov_len)
+        {
+            continue;
+        }
+        ret = write ? vn->vn_ops->write(vn, pos, iov[i].iov_base,
+                                        iov[i].iov_len)
+                    : vn->vn_ops->read(vn, pos, iov[i].iov_base,
+                                       iov[i].iov_len);
+        if (ret < 0)
+        {
+            break;
+        }
+        pos += (size_t)ret;
+        done += (size_t)ret;
+        if ((size_t)ret < iov[i].iov_len)
+        {
+            break;
+        }
+    }
+    if (offset < 0)
+    {
+        file->f_pos = pos;
+    }
+    vunlock(vn);
+    fput(&file);
+    return done || ret >= 0 ? (ssize_t)done : ret;
+}
+
+/*
+ * Read from the fd's file into the segments of iov, filling each before
+ * moving to the next, using the file's vnode operation read. Reads at offset,
+ * or at the file position if offset is -1 (see do_rw_vec).
+ *
+ * Return the number of bytes read on success, or:
+ *  - EBADF: fd is invalid or is not open for reading
+ *  - EISDIR: fd refers to a directory
+ *  - ESPIPE: an offset was given and fd refers to a pipe
+ *  - EINVAL: the file has no read operation
+ *  - Propagate errors from the vnode operation read, unless some bytes were
+ *    read already
+ */
+ssize_t do_readv(int fd, const iovec_t *iov, int iovcnt, off_t offset)
+{
+    return do_rw_vec(fd, iov, iovcnt, offset, 0);
+}
+
+/*
+ * Write the segments of iov to the fd's file, in order, using the file's
+ * vnode operation write. Writes at offset, or at the file position if offset
+ * is -1 (see do_rw_vec).
+ *
+ * Return the number of bytes written on success, or:
+ *  - EBADF: fd is invalid or is not open for writing
+ *  - EISDIR: fd refers to a directory
+ *  - ESPIPE: an offset was given and fd refers to a pipe
+ *  - EINVAL: the file has no write operation
+ *  - Propagate errors from the vnode operation write, unless some bytes were
+ *    written already
+ */
+ssize_t do_writev(int fd, const iovec_t *iov, int iovcnt, off_t offset)
+{
+    return do_rw_vec(fd, iov, iovcnt, offset, 1);
+}
+
 /*
  * Close the file descriptor fd.
  *
@@ -134,7 +250,8 @@ long do_mknod(const char *path, int mode, devid_t devid)
  * Hints:
  * 1) Use namev_dir() to find the parent of the directory to be created.
  * 2) Use namev_lookup() to check that the directory does not already exist.
- * 3) Use the vnode operation mkdir to create the directory.
+ * 3) Use the vnode operation mkdir to create the directory, and dcache_remove()
+ *    the name, which namev_lookup() just cached as not existing.
  *  - Compare against NAME_LEN to determine if the basename is too long.
  *    Check out ramfs_mkdir() to confirm that the basename will be null-
  *    terminated.
@@ -162,6 +279,9 @@ long do_mkdir(const char *path)
  *  - Be careful about refcounts from calling namev_dir().
  *  - Use the parent directory's rmdir operation to remove the directory.
  *  - Lock/unlock the vnode when calling its rmdir operation.
+ *  - Before unlocking, dcache_remove() the name. Look the directory up first
+ *    and dcache_purge_dir() it once it is gone, so that nothing cached about
+ *    its contents outlives its inode number.
  */
 long do_rmdir(const char *path)
 {
@@ -179,7 +299,8 @@ long do_rmdir(const char *path)
  *
  * Hints:
  *  - Use namev_dir() and be careful about refcounts.
- *  - Lock/unlock the parent directory when calling its unlink operation.
+ *  - Lock/unlock the parent directory when calling its unlink operation, and
+ *    dcache_remove() the name before unlocking.
  */
 long do_unlink(const char *path)
 {
@@ -199,7 +320,8 @@ long do_unlink(const char *path)
  * 1) Use namev_resolve() on oldpath to get the target vnode.
  * 2) Use namev_dir() on newpath to get the directory vnode.
  * 3) Use vlock_in_order() to lock the directory and target vnodes.
- * 4) Use the directory vnode's link operation to create a link to the target.
+ * 4) Use the directory vnode's link operation to create a link to the target,
+ *    then dcache_remove() the new name from the directory.
  * 5) Use vunlock_in_order() to unlock the vnodes.
  * 6) Make sure to clean up references added from calling namev_resolve() and
  *    namev_dir().
@@ -222,7 +344,7 @@ long do_link(const char *oldpath, const char *newpath)
  * 1. namev_dir oldpath --> olddir vnode
  * 2. namev_dir newpath --> newdir vnode
  * 4. Lock the olddir and newdir in ancestor-first order (see `vlock_in_order`)
- * 5. Use the `rename` vnode operation
+ * 5. Use the `rename` vnode operation, then dcache_remove() both names
  * 6. Unlock the olddir and newdir
  * 8. vput the olddir and newdir vnodes
  *
@@ -235,7 +357,8 @@ long do_link(const char *oldpath, const char *newpath)
  * 2. namev_dir newpath --> newdir vnode
  * 3. Lock the global filesystem `vnode_rename_mutex`
  * 4. Lock the olddir and newdir in ancestor-first order (see `vlock_in_order`)
- * 5. Use the `rename` vnode operation
+ * 5. Use the `rename` vnode operation, then dcache_remove() both names (and
+ *    ".." in the directory that moved)
  * 6. Unlock the olddir and newdir
  * 7. Unlock the global filesystem `vnode_rename_mutex`
  * 8. vput the olddir and newdir vnodes
@@ -286,6 +409,62 @@ ssize_t do_getdent(int fd, struct dirent *dirp)
     return -1;
 }
 
+/*
+ * Fill buf with as many of the fd's directory entries as fit in count bytes,
+ * packed as dirent64_t's (see dirent.h). Like do_getdent, reading starts at
+ * the file's position, which works as a directory cookie: it is moved past
+ * each entry by the amount readdir returns, and each entry's d_off holds the
+ * cookie of the one after it. The vnode is locked once for the whole batch.
+ *
+ * Return the number of bytes filled in, 0 at the end of the directory, or:
+ *  - EBADF: fd is invalid or is not open
+ *  - ENOTDIR: fd does not refer to a directory
+ *  - EINVAL: the next entry does not fit in count bytes
+ *  - Propagate errors from the vnode operation readdir, unless some entries
+ *    were filled in already
+ */
+ssize_t do_getdents64(int fd, void *buf, size_t count)
+{
+    file_t *file = fget(fd);
+    if (!file)
+    {
+        return -EBADF;
+    }
+    vnode_t *vn = file->f_vnode;
+    if (!S_ISDIR(vn->vn_mode) || !vn->vn_ops->readdir)
+    {
+        fput(&file);
+        return -ENOTDIR;
+    }
+
+    size_t filled = 0;
+    ssize_t ret;
+    dirent_t d;
+    vlock(vn);
+    while ((ret = vn->vn_ops->readdir(vn, file->f_pos, &d)) > 0)
+    {
+        size_t namelen = strnlen(d.d_name, NAME_LEN - 1);
+        size_t reclen = DIRENT64_RECLEN(namelen);
+        if (filled + reclen > count)
+        {
+            ret = filled ? 0 : -EINVAL;
+            break;
+        }
+        dirent64_t *ent = (dirent64_t *)((char *)buf + filled);
+        memset(ent, 0, reclen);
+        ent->d_ino = d.d_ino;
+        ent->d_off = (off_t)(file->f_pos + (size_t)ret);
+        ent->d_reclen = (unsigned short)reclen;
+        memcpy(ent->d_name, d.d_name, namelen);
+
+        file->f_pos += (size_t)ret;
+        filled += reclen;
+    }
+    vunlock(vn);
+    fput(&file);
+    return filled || ret >= 0 ? (ssize_t)filled : ret;
+}
+
 /*
  * Set the position of the file represented by fd according to offset and
  * whence.
@@ -316,6 +495,42 @@ long do_stat(const char *path, stat_t *buf)
     return -1;
 }
 
+/*
+ * Write the fd's file back to disk using the file's vnode operation fsync.
+ * Unlike sync, only this file's pages and metadata are written. If datasync is
+ * set (fdatasync), metadata that is not needed to read the data back may be
+ * left in memory.
+ *
+ * Return 0 on success, or:
+ *  - EBADF: fd is invalid
+ *  - EINVAL: fd refers to something other than a regular file or directory
+ *  - Propagate errors from the vnode operation fsync
+ *
+ * A file system without an fsync operation has nothing to write back.
+ */
+long do_fsync(int fd, long datasync)
+{
+    file_t *file = fget(fd);
+    if (!file)
+    {
+        return -EBADF;
+    }
+    vnode_t *vn = file->f_vnode;
+    long ret = 0;
+    if (!S_ISREG(vn->vn_mode) && !S_ISDIR(vn->vn_mode))
+    {
+        ret = -EINVAL;
+    }
+    else if (vn->vn_ops->fsync)
+    {
+        vlock(vn);
+        ret = vn->vn_ops->fsync(vn, datasync);
+        vunlock(vn);
+    }
+    fput(&file);
+    return ret;
+}
+
 #ifdef __MOUNTING__
 /*
  * Implementing this function is not required and strongly discouraged unless
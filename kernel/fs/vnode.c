@@ -3,13 +3,78 @@
 #include "fs/stat.h"
 #include "fs/vfs.h"
 #include "kernel.h"
+#include "mm/page.h"
 #include "mm/slab.h"
 #include "util/debug.h"
+#include "util/printf.h"
 #include "util/string.h"
 #include <fs/vnode_specials.h>
 
 #define MOBJ_TO_VNODE(o) CONTAINER_OF((o), vnode_t, vn_mobj)
 
+/*
+ * The vnode cache.
+ *
+ * Every vnode in memory is on one of the vnode_hash buckets, keyed by its
+ * filesystem and inode number, so __vget() only searches one short list. Each
+ * bucket has its own mutex, which protects the list.
+ *
+ * When the last reference to a vnode is dropped, vnode_destructor() asks the
+ * filesystem whether the file still exists (fs_ops->keep_vnode). If it does,
+ * the vnode is not deleted: it goes on vnode_lru with a refcount of 0, keeping
+ * its loaded state and cached pages, and the next __vget() of the file takes
+ * it back. Once more than VNODE_CACHE_MAX vnodes are unused, or fewer than
+ * VNODE_CACHE_MIN_FREE_PAGES pages are free, the least recently used ones are
+ * deleted for real.
+ *
+ * Whether an unused vnode is on vnode_lru is decided under vnode_lru_mutex. A
+ * vnode with a refcount of 0 that is not on it is being deleted; __vget()
+ * waits for it to leave its bucket and then creates a new one.
+ *
+ * Lock order: bucket mutex, then vnode_lru_mutex.
+ */
+
+#define VNODE_HASH_BITS 8
+#define VNODE_HASH_BUCKETS (1UL << VNODE_HASH_BITS)
+
+/* Most unused vnodes kept */
+#define VNODE_CACHE_MAX 256
+
+/* Below this many free pages, no unused vnodes are kept */
+#define VNODE_CACHE_MIN_FREE_PAGES 256
+
+typedef struct vnode_bucket
+{
+    kmutex_t vb_mutex;
+    list_t vb_list;
+} vnode_bucket_t;
+
+static vnode_bucket_t vnode_hash[VNODE_HASH_BUCKETS];
+
+static list_t vnode_lru = LIST_INITIALIZER(vnode_lru);
+static kmutex_t vnode_lru_mutex = KMUTEX_INITIALIZER(vnode_lru_mutex);
+static size_t vnode_lru_count;
+
+static size_t vnode_cache_hits;
+static size_t vnode_cache_revived;
+static size_t vnode_cache_misses;
+static size_t vnode_cache_evicted;
+
+void vnode_cache_init()
+{
+    for (size_t i = 0; i < VNODE_HASH_BUCKETS; i++)
+    {
+        kmutex_init(&vnode_hash[i].vb_mutex);
+        list_init(&vnode_hash[i].vb_list);
+    }
+}
+
+static vnode_bucket_t *_vnode_bucket(fs_t *fs, ino_t ino)
+{
+    uint64_t key = ((uintptr_t)fs >> 4) ^ ino;
+    return &vnode_hash[(key * 0x9E3779B97F4A7C15UL) >> (64 - VNODE_HASH_BITS)];
+}
+
 static long vnode_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
                              pframe_t **pfp);
 static long vnode_fill_pframe(mobj_t *o, pframe_t *pf);
@@ -119,34 +184,52 @@ void vnode_init(vnode_t *vn, fs_t *fs, ino_t ino, int state)
 
 vnode_t *__vget(fs_t *fs, ino_t ino, int get_locked)
 {
+    vnode_bucket_t *bucket = _vnode_bucket(fs, ino);
 find:
-    kmutex_lock(&fs->vnode_list_mutex);
-    list_iterate(&fs->vnode_list, vn, vnode_t, vn_link)
+    kmutex_lock(&bucket->vb_mutex);
+    list_iterate(&bucket->vb_list, vn, vnode_t, vn_hash_link)
     {
-        if (vn->vn_vno == ino)
+        if (vn->vn_fs != fs || vn->vn_vno != ino)
         {
-            if (atomic_inc_not_zero(&vn->vn_mobj.mo_refcount))
+            continue;
+        }
+        if (atomic_inc_not_zero(&vn->vn_mobj.mo_refcount))
+        {
+            vnode_cache_hits++;
+        }
+        else
+        {
+            /* unused: take it off the LRU, unless it is being deleted */
+            kmutex_lock(&vnode_lru_mutex);
+            long cached = list_link_is_linked(&vn->vn_lru_link);
+            if (cached)
             {
-                /* reference acquired, we can release the per-FS list */
-                kmutex_unlock(&fs->vnode_list_mutex);
-                await_vnode_loaded(vn);
-                if (get_locked)
-                {
-                    vlock(vn);
-                }
-                return vn;
+                list_remove(&vn->vn_lru_link);
+                vnode_lru_count--;
             }
-            else
+            kmutex_unlock(&vnode_lru_mutex);
+            if (!cached)
             {
                 /* count must be 0, wait and try again later */
-                kmutex_unlock(&fs->vnode_list_mutex);
+                kmutex_unlock(&bucket->vb_mutex);
                 sched_yield();
                 goto find;
             }
+            atomic_set(&vn->vn_mobj.mo_refcount, 1);
+            vnode_cache_revived++;
+        }
+        /* reference acquired, we can release the bucket */
+        kmutex_unlock(&bucket->vb_mutex);
+        await_vnode_loaded(vn);
+        if (get_locked)
+        {
+            vlock(vn);
         }
+        return vn;
     }
 
     /* vnode does not exist, must allocate one */
+    vnode_cache_misses++;
     dbg(DBG_VFS, "creating vnode %d\n", ino);
     vnode_t *vn = slab_obj_alloc(fs->fs_vnode_allocator);
     KASSERT(vn);
@@ -155,11 +238,14 @@ find:
     /* initialize the vnode state */
     vnode_init(vn, fs, ino, VNODE_LOADING);
 
-    /* add the vnode to the per-FS list, lock the vnode, and release the list
-     * (unblocking other `vget` calls) */
+    /* add the vnode to its bucket and the per-FS list, lock the vnode, and
+     * release the bucket (unblocking other `vget` calls) */
+    list_insert_tail(&bucket->vb_list, &vn->vn_hash_link);
+    kmutex_lock(&fs->vnode_list_mutex);
     list_insert_tail(&fs->vnode_list, &vn->vn_link);
-    vlock(vn);
     kmutex_unlock(&fs->vnode_list_mutex);
+    vlock(vn);
+    kmutex_unlock(&bucket->vb_mutex);
 
     /* load the vnode */
     vn->vn_fs->fs_ops->read_vnode(vn->vn_fs, vn);
@@ -223,9 +309,13 @@ static long vnode_flush_pframe(mobj_t *o, pframe_t *pf)
     return vnode->vn_ops->flush_pframe(vnode, pf);
 }
 
-static void vnode_destructor(mobj_t *o)
+/*
+ * Flushes and deletes vn, which has no references and is not on vnode_lru,
+ * then frees it.
+ */
+static void _vnode_delete(vnode_t *vn)
 {
-    vnode_t *vn = MOBJ_TO_VNODE(o);
+    mobj_t *o = &vn->vn_mobj;
     dbg(DBG_VFS, "destroying vnode %d\n", vn->vn_vno);
 
     /* lock, flush, and delete the vnode */
@@ -241,10 +331,95 @@ static void vnode_destructor(mobj_t *o)
     KASSERT(!kmutex_has_waiters(&o->mo_mutex));
     vunlock(vn);
 
-    /* remove the vnode from the list and free it*/
+    /* remove the vnode from its bucket and the per-FS list and free it */
+    vnode_bucket_t *bucket = _vnode_bucket(vn->vn_fs, vn->vn_vno);
+    kmutex_lock(&bucket->vb_mutex);
+    list_remove(&vn->vn_hash_link);
+    kmutex_unlock(&bucket->vb_mutex);
     kmutex_lock(&vn->vn_fs->vnode_list_mutex);
     KASSERT(list_link_is_linked(&vn->vn_link));
     list_remove(&vn->vn_link);
     kmutex_unlock(&vn->vn_fs->vnode_list_mutex);
     slab_obj_free(vn->vn_fs->fs_vnode_allocator, vn);
 }
+
+/*
+ * Deletes least recently used unused vnodes (only those of fs, if fs is not
+ * NULL) until no more than keep are left.
+ */
+static void _vnode_cache_trim(fs_t *fs, size_t keep)
+{
+    while (1)
+    {
+        vnode_t *victim = NULL;
+        kmutex_lock(&vnode_lru_mutex);
+        if (vnode_lru_count > keep)
+        {
+            list_iterate(&vnode_lru, vn, vnode_t, vn_lru_link)
+            {
+                if (!fs || vn->vn_fs == fs)
+                {
+                    victim = vn;
+                    list_remove(&vn->vn_lru_link);
+                    vnode_lru_count--;
+                    break;
+                }
+            }
+        }
+        kmutex_unlock(&vnode_lru_mutex);
+        if (!victim)
+        {
+            return;
+        }
+        vnode_cache_evicted++;
+        _vnode_delete(victim);
+    }
+}
+
+void vnode_cache_purge(fs_t *fs)
+{
+    fs->fs_unmounting = 1;
+    _vnode_cache_trim(fs, 0);
+}
+
+static void vnode_destructor(mobj_t *o)
+{
+    vnode_t *vn = MOBJ_TO_VNODE(o);
+    fs_t *fs = vn->vn_fs;
+    KASSERT(!o->mo_refcount);
+
+    long keep = 0;
+    if (fs->fs_ops->keep_vnode && !fs->fs_unmounting)
+    {
+        vlock(vn);
+        keep = fs->fs_ops->keep_vnode(fs, vn);
+        vunlock(vn);
+    }
+    if (!keep)
+    {
+        _vnode_delete(vn);
+        return;
+    }
+
+    dbg(DBG_VFS, "caching unused vnode %d\n", vn->vn_vno);
+    kmutex_lock(&vnode_lru_mutex);
+    list_insert_tail(&vnode_lru, &vn->vn_lru_link);
+    vnode_lru_count++;
+    kmutex_unlock(&vnode_lru_mutex);
+
+    _vnode_cache_trim(NULL, page_free_count() < VNODE_CACHE_MIN_FREE_PAGES
+                                ? 0
+                                : VNODE_CACHE_MAX);
+}
+
+size_t vnode_cache_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+    iprintf(&buf, &size, "vnode cache lookups: %lu hits, %lu unused hits, "
+                         "%lu misses\n",
+            vnode_cache_hits, vnode_cache_revived, vnode_cache_misses);
+    iprintf(&buf, &size, "unused vnodes:       %lu (%lu evicted)\n",
+            vnode_lru_count, vnode_cache_evicted);
+    return size;
+}
@@ -17,3 +17,5 @@ long user_vecdup(struct argvec *uvec, char ***kvecp);
 long range_perm(struct proc *p, const void *vaddr, size_t len, int perm);
 
 long addr_perm(struct proc *p, const void *vaddr, int perm);
+
+uintptr_t user_access_fixup(uintptr_t rip);
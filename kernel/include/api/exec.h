@@ -3,10 +3,14 @@
 #include "types.h"
 
 struct regs;
+struct spawn_action;
 
 long do_execve(const char *filename, char *const *argv, char *const *envp,
                struct regs *regs);
 
 void kernel_execve(const char *filename, char *const *argv, char *const *envp);
 
+long do_spawn(const char *filename, char *const *argv, char *const *envp,
+              const struct spawn_action *actions, size_t nactions);
+
 void userland_entry(struct regs regs);
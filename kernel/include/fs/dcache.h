@@ -0,0 +1,25 @@
+#pragma once
+
+#include "types.h"
+
+struct fs;
+struct vnode;
+
+/* dcache_lookup() found nothing, ask the directory's lookup operation */
+#define DCACHE_MISS 1
+
+void dcache_init();
+
+long dcache_lookup(struct vnode *dir, const char *name, size_t namelen,
+                   struct vnode **res_vnode);
+
+void dcache_enter(struct vnode *dir, const char *name, size_t namelen,
+                  struct vnode *res_vnode);
+
+void dcache_remove(struct vnode *dir, const char *name, size_t namelen);
+
+void dcache_purge_dir(struct vnode *dir);
+
+void dcache_purge(struct fs *fs);
+
+size_t dcache_info(const void *arg, char *buf, size_t osize);
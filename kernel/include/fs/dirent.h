@@ -23,3 +23,41 @@ typedef struct dirent
 } dirent_t;
 
 #define d_fileno d_ino
+
+/*
+ * The entries getdents64() fills its buffer with, packed one after another.
+ * Each takes d_reclen bytes: room for d_name and its null terminator, rounded
+ * up so that the next entry is 8-byte aligned.
+ */
+typedef struct dirent64
+{
+    ino_t d_ino;             /* entry inode number */
+    off_t d_off;             /* directory cookie of the next entry */
+    unsigned short d_reclen; /* size of this entry */
+    char d_name[];           /* filename, null-terminated */
+} dirent64_t;
+
+#define DIRENT64_RECLEN(namelen) \
+    ((__builtin_offsetof(dirent64_t, d_name) + (namelen) + 1 + 7) & ~7UL)
+
+#ifndef __KERNEL__
+
+/* A directory stream: entries come from getdents64() a buffer at a time */
+typedef struct
+{
+    int dd_fd;
+    int dd_len;      /* bytes of entries in dd_buf */
+    int dd_pos;      /* offset of the next entry in dd_buf */
+    dirent_t dd_ent; /* the entry returned by readdir() */
+    char dd_buf[4096] __attribute__((aligned(8)));
+} DIR;
+
+DIR *opendir(const char *name);
+
+struct dirent *readdir(DIR *dirp);
+
+void rewinddir(DIR *dirp);
+
+int closedir(DIR *dirp);
+
+#endif
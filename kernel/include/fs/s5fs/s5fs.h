@@ -26,10 +26,13 @@
 #define S5_NBLKS_PER_FNODE 30
 
 #define S5_BLOCK_SIZE 4096
-#define S5_NDIRECT_BLOCKS 28
+#define S5_NDIRECT_BLOCKS 25
 #define S5_INODES_PER_BLOCK (S5_BLOCK_SIZE / sizeof(s5_inode_t))
 #define S5_DIRENTS_PER_BLOCK (S5_BLOCK_SIZE / sizeof(s5_dirent_t))
-#define S5_MAX_FILE_BLOCKS (S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS)
+#define S5_MAX_FILE_BLOCKS                                               \
+    (S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS +                            \
+     S5_NIDIRECT_BLOCKS * S5_NIDIRECT_BLOCKS +                           \
+     S5_NIDIRECT_BLOCKS * S5_NIDIRECT_BLOCKS * S5_NIDIRECT_BLOCKS)
 #define S5_MAX_FILE_SIZE (S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE)
 #define S5_NAME_LEN 28
 
@@ -40,9 +43,23 @@
 #define S5_TYPE_BLK 0x8
 
 #define S5_MAGIC 071177
-#define S5_CURRENT_VERSION 3
+#define S5_CURRENT_VERSION 7
 
-/* Number of blocks stored in the indirect block */
+/* Oldest disk format that can still be mounted. Version 5 changed the layout
+ * of the inode. */
+#define S5_MIN_VERSION 5
+
+/* First disk format whose large directories are hashed (see below). Older
+ * than S5_MIN_VERSION, so every disk that mounts has hashed directories. */
+#define S5_DIR_INDEX_VERSION 4
+
+/* First disk format that tracks free blocks with a bitmap (see below) */
+#define S5_BITMAP_VERSION 6
+
+/* First disk format with a metadata journal (see below) */
+#define S5_JOURNAL_VERSION 7
+
+/* Number of blocks stored in an indirect block */
 #define S5_NIDIRECT_BLOCKS (S5_BLOCK_SIZE / sizeof(uint32_t))
 
 /* Given a file offset, returns the block number that it is in */
@@ -87,27 +104,133 @@ typedef struct s5_super
     uint32_t s5s_root_inode; /* root inode */
     uint32_t s5s_num_inodes; /* number of inodes */
     uint32_t s5s_version;    /* version of this disk format */
+
+    /* S5_BITMAP_VERSION and later, which leave the free list empty */
+    uint32_t s5s_nblocks;        /* blocks on the disk */
+    uint32_t s5s_bitmap_block;   /* first block of the free block bitmap */
+    uint32_t s5s_bitmap_nblocks; /* blocks in the bitmap */
+
+    /* S5_JOURNAL_VERSION and later */
+    uint32_t s5s_journal_block;   /* first block of the journal */
+    uint32_t s5s_journal_nblocks; /* blocks in the journal */
 } s5_super_t;
 
-/* The contents of an inode, as stored on disk. */
+/*
+ * Free block bitmap (S5_BITMAP_VERSION and later).
+ *
+ * The disk holds the superblock, the inode blocks, the bitmap, then data. Bit
+ * b of the bitmap (bit b % 8 of byte b / 8) is set when disk block b is in
+ * use. The bits of the blocks in front of the data, and the bits past
+ * s5s_nblocks, are always set.
+ *
+ * The disk is split into allocation groups of S5_GROUP_BLOCKS blocks. A file
+ * starts out in the group that goes with its inode and then grows from the
+ * block after its last one, so that it ends up contiguous on disk. Only when
+ * that group is full does allocation move on to the next group with room.
+ */
+#define S5_BITS_PER_BLOCK (S5_BLOCK_SIZE * 8)
+#define S5_GROUP_BLOCKS 1024
+
+/*
+ * Metadata journal (S5_JOURNAL_VERSION and later).
+ *
+ * The journal comes right after the bitmap. Its first block is an
+ * s5_journal_header_t, and the rest is the log: transactions one after the
+ * other, starting at log block 1. A transaction is an s5_journal_desc_t
+ * followed by s5jd_nblocks block images, written with a single request. It
+ * counts as committed once it is on disk whole: its magic, its sequence number
+ * (one more than the transaction before it, the first one being s5jh_seq) and
+ * its checksum all have to match.
+ *
+ * Only blocks of the block device cache are logged: the superblock, inodes,
+ * the bitmap and indirect blocks. File and directory contents are written in
+ * place.
+ *
+ * A logged block is only written to its home location when the log is
+ * checkpointed, which empties it by writing s5jh_seq past every transaction
+ * in it. Until then, reads of the block are served from the log.
+ *
+ * A block that was logged and then freed may be reused for file data, which
+ * the replay of an old image would clobber. So descriptors also list the
+ * blocks freed since the last commit (s5jd_nrevoked of them, after the home
+ * block numbers), and an image is not replayed if a later transaction revokes
+ * its block.
+ */
+#define S5_JOURNAL_MAGIC 0x4c4e524a      /* "JRNL" on disk */
+#define S5_JOURNAL_DESC_MAGIC 0x4353444a /* "JDSC" on disk */
+#define S5_JOURNAL_MAX_BLOCKS 128
+#define S5_JOURNAL_DESC_ENTRIES (S5_BLOCK_SIZE / sizeof(uint32_t) - 5)
+
+typedef struct s5_journal_header
+{
+    uint32_t s5jh_magic; /* S5_JOURNAL_MAGIC */
+    uint32_t s5jh_seq;   /* sequence number of the first transaction */
+} s5_journal_header_t;
+
+typedef struct s5_journal_desc
+{
+    uint32_t s5jd_magic;    /* S5_JOURNAL_DESC_MAGIC */
+    uint32_t s5jd_seq;      /* sequence number of this transaction */
+    uint32_t s5jd_nblocks;  /* block images after this block */
+    uint32_t s5jd_nrevoked; /* blocks revoked by this transaction */
+    uint32_t s5jd_checksum; /* FNV-1a of this block (with the checksum 0) and
+                             * the images */
+    uint32_t s5jd_blocks[S5_JOURNAL_DESC_ENTRIES]; /* home block of each
+                                                    * image, then the revoked
+                                                    * blocks */
+} s5_journal_desc_t;
+
+/* The contents of an inode, as stored on disk.
+ *
+ * File blocks past the direct blocks are mapped through the indirect block,
+ * then through the double indirect block (a block of indirect blocks), then
+ * through the triple indirect block.
+ */
 typedef struct s5_inode
 {
     union {
         uint32_t s5_next_free; /* inode free list ptr */
-        uint32_t s5_size;      /* file size */
+        uint32_t s5_size;      /* file size, low 32 bits */
     } s5_un;
     uint32_t s5_number;   /* this inode's number */
     uint16_t s5_type;     /* one of S5_TYPE_{FREE,DATA,DIR,CHR,BLK} */
     int16_t s5_linkcount; /* link count of this inode */
     uint32_t s5_direct_blocks[S5_NDIRECT_BLOCKS];
     uint32_t s5_indirect_block;
+    uint32_t s5_dindirect_block; /* double indirect */
+    uint32_t s5_tindirect_block; /* triple indirect */
+    uint32_t s5_size_high;       /* file size, high 32 bits */
 } s5_inode_t;
 
+/* Use these rather than s5_un.s5_size, which only holds the low 32 bits. */
+static inline uint64_t s5_inode_size(const s5_inode_t *inode)
+{
+    return (uint64_t)inode->s5_size_high << 32 | inode->s5_un.s5_size;
+}
+
+static inline void s5_inode_set_size(s5_inode_t *inode, uint64_t size)
+{
+    inode->s5_un.s5_size = (uint32_t)size;
+    inode->s5_size_high = (uint32_t)(size >> 32);
+}
+
+/*
+ * The in-core inode of a file. It lives as long as the file's vnode, which is
+ * kept cached while unused (see vnode.c), so looking a file up again does not
+ * go back to its inode block.
+ *
+ * Changes to the inode are made here and the node is put on the file system's
+ * dirty inode list (s5_dirty_inode) rather than written into the inode block
+ * right away. The list is sorted by inode number, so that dirty inodes sharing
+ * an inode block sit next to each other and are copied into the block in one
+ * go (s5_write_inode, s5_write_dirty_inodes).
+ */
 typedef struct s5_node
 {
     vnode_t vnode;
     s5_inode_t inode;
-    long dirtied_inode;
+    long dirtied_inode;      /* on s5f_dirty_inodes */
+    list_link_t dirty_link;  /* link on s5f_dirty_inodes */
 } s5_node_t;
 
 #define VNODE_TO_S5NODE(vn) CONTAINER_OF(vn, s5_node_t, vnode)
@@ -119,7 +242,76 @@ typedef struct s5_dirent
     char s5d_name[S5_NAME_LEN];
 } s5_dirent_t;
 
+/*
+ * Hashed directories.
+ *
+ * A directory starts out in the linear format: a packed array of s5_dirent_t.
+ * Once it would grow past one block, it is converted to the hashed format:
+ *
+ *  - File block 0 is an s5_dir_index_t. Each bucket holds the file block of
+ *    the first block of a chain of dirent blocks.
+ *  - Every other block is an s5_dir_block_t: a small header in the slot of
+ *    the first dirent, then S5_DIR_SLOTS_PER_BLOCK dirent slots. A slot whose
+ *    name is empty is unused.
+ *  - An entry lives in the chain of bucket (hash & (nbuckets - 1)), where hash
+ *    is the 32-bit FNV-1a hash of its name.
+ *  - When the table averages a full block per bucket, the number of buckets is
+ *    doubled and every chain is split in two.
+ *  - Blocks that are emptied are kept on s5di_free for reuse, so a hashed
+ *    directory never shrinks.
+ */
+#define S5_DIR_INDEX_MAGIC 0x52494448 /* "HDIR" on disk */
+#define S5_DIR_MIN_BUCKETS 4
+#define S5_DIR_MAX_BUCKETS 512
+#define S5_DIR_SLOTS_PER_BLOCK (S5_DIRENTS_PER_BLOCK - 1)
+
+/* File block 0 of a hashed directory */
+typedef struct s5_dir_index
+{
+    uint32_t s5di_magic;    /* S5_DIR_INDEX_MAGIC */
+    uint32_t s5di_nbuckets; /* a power of two */
+    uint32_t s5di_nentries; /* live entries, "." and ".." included */
+    uint32_t s5di_free;     /* first unused block, 0 if none */
+    uint32_t s5di_buckets[S5_DIR_MAX_BUCKETS];
+} s5_dir_index_t;
+
+/* Any other block of a hashed directory */
+typedef struct s5_dir_block
+{
+    uint32_t s5db_next;  /* next block of the chain, 0 if this is the last */
+    uint32_t s5db_count; /* live entries in this block */
+    uint32_t s5db_unused[6];
+    s5_dirent_t s5db_dirents[S5_DIR_SLOTS_PER_BLOCK];
+} s5_dir_block_t;
+
 #ifndef __FSMAKER__
+/* A block logged since the last checkpoint */
+typedef struct s5_journal_entry
+{
+    uint32_t sje_block;  /* home block */
+    uint32_t sje_logoff; /* log block holding its latest image, 0 if the block
+                          * was freed since */
+} s5_journal_entry_t;
+
+/* The running state of the journal. Protected by the lock of s5f_mobj. */
+typedef struct s5_journal
+{
+    uint32_t sj_start;   /* disk block of the journal header */
+    uint32_t sj_nblocks; /* blocks in the journal, 0 if there is none */
+    uint32_t sj_head;    /* log block where the next transaction goes */
+    uint32_t sj_seq;     /* sequence number of the next transaction */
+
+    s5_journal_entry_t *sj_logged; /* blocks logged since the last checkpoint */
+    uint32_t sj_nlogged;
+    uint32_t *sj_revoked; /* freed blocks to revoke in the next transaction */
+    uint32_t sj_nrevoked;
+    pframe_t **sj_batch; /* the pframes of the transaction being written */
+
+    size_t sj_commits;
+    size_t sj_checkpoints;
+    size_t sj_blocks_logged;
+} s5_journal_t;
+
 /* Our in-memory representation of a s5fs filesytem (fs_i points to this) */
 typedef struct s5fs
 {
@@ -128,8 +320,28 @@ typedef struct s5fs
     kmutex_t s5f_mutex;
     fs_t *s5f_fs;
     mobj_t s5f_mobj;
+
+    /* Free block counts of bitmap disks, worked out at mount. Protected by
+     * s5f_mutex. */
+    uint32_t s5f_nfree;       /* free blocks */
+    uint32_t s5f_reserved;    /* free blocks promised to delayed allocations */
+    uint32_t s5f_ngroups;     /* allocation groups */
+    uint32_t *s5f_group_free; /* free blocks in each allocation group */
+
+    s5_journal_t s5f_journal;
+
+    /* s5_node_t's whose inode has changed since it was last copied into its
+     * inode block, by inode number. Protected by s5f_inode_mutex, which is
+     * taken before s5f_mobj. */
+    list_t s5f_dirty_inodes;
+    kmutex_t s5f_inode_mutex;
 } s5fs_t;
 
+static inline long s5_has_bitmap(s5fs_t *s5fs)
+{
+    return s5fs->s5f_super.s5s_version >= S5_BITMAP_VERSION;
+}
+
 long s5fs_mount(struct fs *fs);
 
 void s5_get_meta_disk_block(s5fs_t *s5fs, uint64_t blocknum, long forwrite,
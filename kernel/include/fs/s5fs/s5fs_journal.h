@@ -0,0 +1,24 @@
+/*
+ *   FILE: s5fs_journal.h
+ *  DESCR: S5 metadata journal
+ */
+
+#pragma once
+
+#include "types.h"
+#include "mm/pframe.h"
+#include "fs/s5fs/s5fs.h"
+
+struct s5fs;
+
+long s5_journal_init(struct s5fs *s5fs);
+
+long s5_journal_shutdown(struct s5fs *s5fs);
+
+long s5_journal_commit(struct s5fs *s5fs, pframe_t *held);
+
+long s5_journal_checkpoint(struct s5fs *s5fs);
+
+blocknum_t s5_journal_locate(struct s5fs *s5fs, blocknum_t block);
+
+void s5_journal_revoke(struct s5fs *s5fs, blocknum_t block);
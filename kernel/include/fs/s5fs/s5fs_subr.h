@@ -34,13 +34,54 @@ void s5_remove_dirent(struct s5_node *dir, const char *name, size_t namelen,
 void s5_replace_dirent(struct s5_node *sn, const char *name, size_t namelen,
                        struct s5_node *old, struct s5_node *new);
 
+long s5_dir_is_indexed(struct s5_node *sn);
+
+long s5_dir_index_find(struct s5_node *sn, const char *name, size_t namelen,
+                       size_t *filepos);
+
+long s5_dir_index_add(struct s5_node *sn, const char *name, size_t namelen,
+                      ino_t ino);
+
+void s5_dir_index_remove(struct s5_node *sn, size_t filepos);
+
+long s5_dir_index_readdir(struct s5_node *sn, size_t pos, s5_dirent_t *d);
+
+long s5_dir_nentries(struct s5_node *sn);
+
+/* alloc value for s5_file_block_to_disk_block: allocate from a delayed
+ * allocation reservation */
+#define S5_ALLOC_RESERVED 2
+
 long s5_file_block_to_disk_block(struct s5_node *sn, size_t file_blocknum,
                                  int alloc, int *new);
 
+long s5_file_block_run(struct s5_node *sn, size_t file_blocknum,
+                       size_t maxblocks, size_t *nblocksp);
+
+long s5_bitmap_init(struct s5fs *s5fs);
+
+long s5_alloc_block_near(struct s5fs *s5fs, blocknum_t goal, long reserved);
+
+void s5_free_block(struct s5fs *s5fs, blocknum_t blockno);
+
+blocknum_t s5_block_goal(struct s5_node *sn, size_t file_blocknum);
+
+long s5_delalloc_reserve(struct s5fs *s5fs, size_t file_blocknum);
+
+void s5_delalloc_release(struct s5fs *s5fs, size_t file_blocknum);
+
 long s5_inode_blocks(struct s5_node *vnode);
 
 void s5_remove_blocks(struct s5_node *vnode);
 
+void s5_dirty_inode(struct s5_node *sn);
+
+void s5_write_inode(struct s5_node *sn);
+
+void s5_write_dirty_inodes(struct s5fs *s5fs);
+
+long s5_sync_inode(struct s5_node *sn, long datasync);
+
 /* Converts a vnode_t* to the s5fs_t* (s5fs file system) struct */
 #define VNODE_TO_S5FS(vn) ((s5fs_t *)((vn)->vn_fs->fs_i))
 
@@ -30,6 +30,15 @@ typedef struct fs_ops
      */
     void (*delete_vnode)(struct fs *fs, struct vnode *vn);
 
+    /*
+     * Optional. Called when the vnode's reference count drops to 0, before
+     * delete_vnode. Return nonzero if the file still exists (it is linked
+     * from some directory), in which case the vnode is kept in the unused
+     * vnode cache and delete_vnode is only called once it is evicted.
+     * Without it, vnodes are deleted as soon as they are unused.
+     */
+    long (*keep_vnode)(struct fs *fs, struct vnode *vn);
+
     /*
      * Optional. Default behavior is to vput() fs_root.
      * Unmount the filesystem, performing any desired sanity checks
@@ -102,6 +111,7 @@ typedef struct fs
     list_t vnode_list;
     kmutex_t vnode_list_mutex;
     kmutex_t vnode_rename_mutex;
+    long fs_unmounting; /* set by vnode_cache_purge(): keep no unused vnodes */
 
 } fs_t;
 
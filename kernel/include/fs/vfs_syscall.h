@@ -7,6 +7,7 @@
 #include "fs/open.h"
 #include "fs/pipe.h"
 #include "fs/stat.h"
+#include "fs/uio.h"
 
 long do_close(int fd);
 
@@ -14,6 +15,10 @@ ssize_t do_read(int fd, void *buf, size_t len);
 
 ssize_t do_write(int fd, const void *buf, size_t len);
 
+ssize_t do_readv(int fd, const iovec_t *iov, int iovcnt, off_t offset);
+
+ssize_t do_writev(int fd, const iovec_t *iov, int iovcnt, off_t offset);
+
 long do_dup(int fd);
 
 long do_dup2(int ofd, int nfd);
@@ -34,6 +39,10 @@ long do_chdir(const char *path);
 
 ssize_t do_getdent(int fd, struct dirent *dirp);
 
+ssize_t do_getdents64(int fd, void *buf, size_t count);
+
 off_t do_lseek(int fd, off_t offset, int whence);
 
 long do_stat(const char *path, struct stat *uf);
+
+long do_fsync(int fd, long datasync);
@@ -172,6 +172,15 @@ typedef struct vnode_ops
     * Should only be used on regular files, not directories. 
     */
     void (*truncate_file)(struct vnode *vnode);
+
+    /*
+     * fsync writes the file's dirty pages back to disk, along with the
+     * metadata needed to find them again (such as its inode and indirect
+     * blocks). If datasync is set, metadata that is not needed to read the
+     * data back may stay in memory. Called with the vnode locked. May be
+     * NULL if the file system keeps nothing to write back.
+     */
+    long (*fsync)(struct vnode *vnode, long datasync);
 } vnode_ops_t;
 
 typedef struct vnode
@@ -256,7 +265,9 @@ typedef struct vnode
     } vn_dev;
 
     /* Used (only) by the v{get,ref,put} facilities (vfs/vnode.c): */
-    list_link_t vn_link; /* link on system vnode list */
+    list_link_t vn_link;      /* link on the per-FS vnode list */
+    list_link_t vn_hash_link; /* link on a vnode cache hash bucket */
+    list_link_t vn_lru_link;  /* link on the unused vnode LRU, if unused */
 } vnode_t;
 
 void init_special_vnode(vnode_t *vn);
@@ -317,9 +328,11 @@ void vref(vnode_t *vn);
  * This function decrements the reference count on this vnode 
  * (i.e. the refcount of vn_mobj).
  *
- * If, as a result of this, refcount reaches zero, the underlying
- * fs's 'delete_vnode' entry point will be called and the vnode will be
- * freed.
+ * If, as a result of this, refcount reaches zero, the vnode is either kept
+ * in the unused vnode cache (if the fs's 'keep_vnode' says the file still
+ * exists) or the underlying fs's 'delete_vnode' entry point will be called and
+ * the vnode will be freed. Cached vnodes are deleted the same way once they
+ * are evicted.
  *
  * If the linkcount of the corresponding on inode on the filesystem is zero,
  * then the inode will be freed.
@@ -347,6 +360,16 @@ long vfs_is_in_use(struct fs *fs);
  */
 size_t vfs_count_active_vnodes(struct fs *fs);
 
+/*
+ * Deletes all of fs's unused cached vnodes and stops caching them, ahead of
+ * unmounting fs.
+ */
+void vnode_cache_purge(struct fs *fs);
+
+void vnode_cache_init();
+
+size_t vnode_cache_info(const void *arg, char *buf, size_t osize);
+
 /* Diagnostic: */
 /*
  * Prints the vnodes that are in use. Specifying a fs_t will restrict
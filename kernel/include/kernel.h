@@ -20,6 +20,8 @@ extern void *kernel_end_data;
 extern void *kernel_end_bss;
 extern void *kernel_start_init;
 extern void *kernel_end_init;
+extern void *ex_table_start;
+extern void *ex_table_end;
 
 extern void *kernel_phys_base;
 extern void *kernel_phys_end;
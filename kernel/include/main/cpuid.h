@@ -33,6 +33,7 @@ enum
     CPUID_FEAT_ECX_CX16 = 1 << 13,
     CPUID_FEAT_ECX_ETPRD = 1 << 14,
     CPUID_FEAT_ECX_PDCM = 1 << 15,
+    CPUID_FEAT_ECX_PCID = 1 << 17,
     CPUID_FEAT_ECX_DCA = 1 << 18,
     CPUID_FEAT_ECX_SSE4_1 = 1 << 19,
     CPUID_FEAT_ECX_SSE4_2 = 1 << 20,
@@ -75,12 +76,22 @@ enum
     CPUID_FEAT_EDX_PBE = 1 << 31
 };
 
+/* CPUID_GETEXTFEATURES, subleaf 0 */
+enum
+{
+    CPUID_EXTFEAT_EBX_ERMS = 1 << 9,
+    CPUID_EXTFEAT_EBX_INVPCID = 1 << 10,
+
+    CPUID_EXTFEAT_EDX_FSRM = 1 << 4,
+};
+
 enum cpuid_requests
 {
     CPUID_GETVENDORSTRING,
     CPUID_GETFEATURES,
     CPUID_GETTLB,
     CPUID_GETSERIAL,
+    CPUID_GETEXTFEATURES = 7,
 
     CPUID_INTELEXTENDED = 0x80000000,
     CPUID_INTELFEATURES,
@@ -97,6 +108,15 @@ static inline void cpuid(int request, uint32_t *a, uint32_t *b, uint32_t *c,
                      : "0"(request));
 }
 
+/* For requests that take a subleaf in ecx */
+static inline void cpuid_subleaf(int request, int subleaf, uint32_t *a,
+                                 uint32_t *b, uint32_t *c, uint32_t *d)
+{
+    __asm__ volatile("cpuid"
+                     : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                     : "0"(request), "2"(subleaf));
+}
+
 static inline void cpuid_get_msr(uint32_t msr, uint32_t *lo, uint32_t *hi)
 {
     __asm__ volatile("rdmsr"
@@ -17,6 +17,7 @@
 #define INTR_SPURIOUS 0xfe
 #define INTR_APICERR 0xff
 #define INTR_SHUTDOWN 0xfd
+#define INTR_TLB_SHOOTDOWN 0xfc
 
 /* NOTE: INTR_SYSCALL is not defined here, but is in syscall.h (it must be
  * in a userland-accessible header) */
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "types.h"
+
+void compact_init();
+
+/* Migrates movable pages until a free block of at least npages pages exists.
+ * Returns nonzero if a block was freed up. Must be called from a thread that
+ * is allowed to block and that holds no memory object or pframe mutex. */
+long page_compact(size_t npages);
+
+size_t compact_info(const void *arg, char *buf, size_t osize);
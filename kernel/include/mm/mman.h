@@ -23,3 +23,13 @@
  */
 #define MAP_FIXED 4
 #define MAP_ANON 8
+#define MAP_POPULATE 16 /* Fault the whole mapping in up front. */
+#define MAP_LOCKED 32   /* Keep the mapping resident, as mlock() does. */
+
+/* Advice for madvise().
+ */
+#define MADV_NORMAL 0     /* No special treatment. */
+#define MADV_RANDOM 1     /* Expect page references in random order. */
+#define MADV_SEQUENTIAL 2 /* Expect page references in sequential order. */
+#define MADV_WILLNEED 3   /* Will need these pages soon. */
+#define MADV_DONTNEED 4   /* Don't need these pages any more. */
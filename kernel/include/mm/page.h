@@ -100,6 +100,15 @@ void *page_alloc_bounded(void *max_paddr);
 
 void page_free(void *addr);
 
+/* Allocates a single page whose contents the caller can relocate on demand
+ * (see mm/compact.c). Movable pages are grouped at the top of physical memory,
+ * away from unmovable kernel allocations, so that they do not break up the
+ * free blocks needed by page_alloc_n. Free them with page_free as usual. */
+void *page_alloc_movable(void);
+
+/* Returns nonzero if addr was handed out by page_alloc_movable. */
+long page_is_movable(void *addr);
+
 /* These functions allocate and free a page-aligned
  * block of memory which are npages pages in length.
  * A call to page_alloc_n will allocate a block, to free
@@ -118,7 +127,19 @@ void page_mark_reserved(void *paddr);
 
 void page_init_finish();
 
+/* Turns deferred merging of free buddies on or off. Off merges every free
+ * all the way up, which is only useful to compare against (see pagebench). */
+void page_defer_merges(long defer);
+
 /* Returns the number of free pages remaining in the
  * system. Note that calls to page_alloc_n(npages) may
  * fail even if page_free_count() >= npages. */
 size_t page_free_count();
+
+/* Finds the block of 2^order pages that is cheapest to free up by migrating
+ * movable pages out of it, or NULL if every such block holds an unmovable
+ * page. On success *nmovable is set to the number of movable pages in it. */
+void *page_compaction_target(size_t order, size_t *nmovable);
+
+/* Prints per-order free block counts and fragmentation statistics. */
+size_t page_info(const void *arg, char *buf, size_t osize);
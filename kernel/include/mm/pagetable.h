@@ -66,8 +66,12 @@ uintptr_t pt_virt_to_phys_helper(pml4_t *pml4, uintptr_t vaddr);
 
 uintptr_t pt_virt_to_phys(uintptr_t vaddr);
 
+long pt_is_mapped(pml4_t *pml4, uintptr_t vaddr);
+
 void pt_init(void);
 
+void pt_core_init(void);
+
 /* Currently unused. */
 void pt_template_init(void);
 
@@ -79,8 +83,17 @@ pml4_t *clone_pml4(pml4_t *pml4, long include_user_mappings);
 
 pml4_t *pt_create();
 
+/* Shares src's user page tables with dst (whose user half must be empty)
+ * copy-on-write, write-protecting them in both. Flushes the TLB if src is the
+ * current page table. */
+void pt_share_user(pml4_t *src, pml4_t *dst);
+
 void pt_destroy(pml4_t *pml4);
 
+/* Returns the number of page table pages below the user half of pml4, and in
+ * *shared how many of those are also used by another page table. */
+size_t pt_table_pages(pml4_t *pml4, size_t *shared);
+
 long pt_map(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr, uint32_t pdflags,
             uint32_t ptflags);
 
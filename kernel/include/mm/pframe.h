@@ -4,6 +4,8 @@
 #include "proc/kmutex.h"
 #include "types.h"
 
+struct mobj;
+
 typedef struct pframe
 {
     size_t pf_pagenum;
@@ -12,8 +14,17 @@ typedef struct pframe
     long pf_dirty;
     kmutex_t pf_mutex;
     list_link_t pf_link;
+    struct mobj *pf_obj;          /* memory object this frame belongs to */
+    list_link_t pf_resident_link; /* link on pframe_resident_list while
+                                     pf_addr is allocated by pframe_alloc_page */
+    size_t pf_swap;               /* swap slot + 1 holding a clean copy of the
+                                     contents, or 0 (see mm/swap.c) */
 } pframe_t;
 
+/* Every pframe whose contents are in memory, i.e. every page that can be
+ * moved by compaction. Protected by pframe_resident_lock. */
+extern list_t pframe_resident_list;
+
 void pframe_init();
 
 pframe_t *pframe_create();
@@ -21,3 +32,21 @@ pframe_t *pframe_create();
 void pframe_release(pframe_t **pfp);
 
 void pframe_free(pframe_t **pfp);
+
+long pframe_alloc_page(pframe_t *pf);
+
+void pframe_free_page(pframe_t *pf);
+
+void pframe_move_page(pframe_t *pf, void *page);
+
+void pframe_map_zero_page(pframe_t *pf);
+
+long pframe_is_zero_page(pframe_t *pf);
+
+long pframe_unshare_zero_page(pframe_t *pf);
+
+size_t pframe_info(const void *arg, char *buf, size_t osize);
+
+struct mobj *pframe_find_resident(void *addr, size_t *pagenump);
+
+struct mobj *pframe_next_victim(size_t *pagenump);
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "types.h"
+
+struct mobj;
+struct pframe;
+
+/* Most pages moved to or from swap in a single disk operation */
+#define SWAP_CLUSTER 8
+
+void swap_init();
+
+long swap_flush_pframe(struct mobj *o, struct pframe *pf);
+
+long swap_in(struct mobj *o, struct pframe *pf);
+
+void swap_release(struct pframe *pf);
+
+size_t swap_reclaim(size_t npages);
+
+size_t swap_info(const void *arg, char *buf, size_t osize);
@@ -12,19 +12,12 @@ static inline void tlb_flush(uintptr_t vaddr)
     __asm__ volatile("invlpg (%0)" ::"r"(vaddr));
 }
 
-/* Invalidates any entries for count pages starting at
- * vaddr from the TLB. If this range is very large it may
- * be more efficient to call tlb_flush_all to invalidate
- * the entire TLB. */
-static inline void tlb_flush_range(uintptr_t vaddr, size_t count)
-{
-    for (size_t i = 0; i < count; i++, vaddr += PAGE_SIZE)
-    {
-        tlb_flush(vaddr);
-    }
-}
+/* Past this many pages, reloading CR3 is cheaper than invlpg page by page. */
+#define TLB_FLUSH_RANGE_MAX 32
 
-/* Invalidates the entire TLB. */
+/* Invalidates the entire TLB. With PCIDs enabled this only covers the current
+ * address space (and kernel mappings cached under it); entries tagged with
+ * other PCIDs are kept, see pt_set(). */
 static inline void tlb_flush_all()
 {
     uintptr_t pdir;
@@ -33,3 +26,33 @@ static inline void tlb_flush_all()
     __asm__ volatile("movq %0, %%cr3" ::"r"(pdir)
                      : "memory");
 }
+
+/* Invalidates any entries for count pages starting at
+ * vaddr from the TLB. Ranges longer than TLB_FLUSH_RANGE_MAX
+ * pages invalidate the entire TLB instead. */
+static inline void tlb_flush_range(uintptr_t vaddr, size_t count)
+{
+    if (count > TLB_FLUSH_RANGE_MAX)
+    {
+        tlb_flush_all();
+        return;
+    }
+    for (size_t i = 0; i < count; i++, vaddr += PAGE_SIZE)
+    {
+        tlb_flush(vaddr);
+    }
+}
+
+struct pt;
+
+void tlb_init(void);
+
+/* Records that the current core has just loaded pml4 (called by pt_set()). */
+void tlb_activate(struct pt *pml4);
+
+/* Invalidates [vaddr, vmax) of pml4 on every other core that has it loaded,
+ * with one IPI per core, and waits for them to finish. The calling core's own
+ * TLB is left to the caller. */
+void tlb_shootdown(struct pt *pml4, uintptr_t vaddr, uintptr_t vmax);
+
+size_t tlb_info(const void *arg, char *buf, size_t osize);
@@ -42,6 +42,25 @@ void kmutex_init(kmutex_t *mtx);
  */
 void kmutex_lock(kmutex_t *mtx);
 
+/**
+ * Locks the specified mutex if no thread holds it.
+ *
+ * Kernel threads are not preempted, so nothing can take the mutex between
+ * the check and the call to kmutex_lock, which therefore never blocks.
+ *
+ * @param mtx the mutex to lock
+ * @return 1 if the mutex was locked, 0 otherwise
+ */
+static inline long kmutex_trylock(kmutex_t *mtx)
+{
+    if (mtx->km_holder)
+    {
+        return 0;
+    }
+    kmutex_lock(mtx);
+    return 1;
+}
+
 /**
  * Unlocks the specified mutex.
  *
@@ -38,6 +38,8 @@ typedef struct proc
 
     long p_status;        /* Exit status */
     proc_state_t p_state; /* Process state */
+    long p_daemon;        /* Kernel daemon that exits by itself once init
+                             has nothing else to wait for */
 
     pml4_t *p_pml4; /* Page table. */
 
@@ -128,6 +130,13 @@ void proc_kill(proc_t *proc, long status);
  */
 void proc_kill_all(void);
 
+/**
+ * Returns nonzero if every sibling of the current process is a kernel daemon
+ * (p_daemon set). Daemons poll this and exit once it holds, so that init's
+ * wait for its children can finish and the system can shut down.
+ */
+long proc_only_daemons_left(void);
+
 /*========================
  * Functions: System calls
  *=======================*/
@@ -175,6 +184,11 @@ long do_fork(struct regs *regs);
  */
 extern proc_t idleproc;
 
+/*
+ * Global list of all processes (except for the idle process)
+ */
+extern list_t proc_list;
+
 /*=====================
  * Functions: Debugging
  *====================*/
@@ -0,0 +1,3 @@
+#pragma once
+
+long stringbench_main(long, void *);
@@ -58,6 +58,9 @@
 #include "stdarg.h"
 #include "types.h"
 
+/* picks the memcpy()/memset() strategy for this CPU, see string.c */
+void string_init();
+
 /* string and memory manipulation */
 int memcmp(const void *cs, const void *ct, size_t count);
 
@@ -6,3 +6,9 @@ long do_munmap(void *addr, size_t len);
 
 long do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off,
              void **ret);
+
+long do_madvise(void *addr, size_t len, int advice);
+
+long do_mlock(void *addr, size_t len);
+
+long do_munlock(void *addr, size_t len);
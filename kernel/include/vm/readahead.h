@@ -0,0 +1,14 @@
+#pragma once
+
+#include "types.h"
+
+struct mobj;
+struct vmarea;
+
+void readahead_start();
+
+void readahead_async(struct mobj *o, size_t pagenum, size_t npages);
+
+void readahead_fault(struct vmarea *vma, size_t vfn);
+
+size_t readahead_info(const void *arg, char *buf, size_t osize);
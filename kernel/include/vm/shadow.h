@@ -2,10 +2,25 @@
 
 #include "mm/mobj.h"
 
+/* Longest shadow chain a page fault should ever have to walk */
+#define SHADOW_MAX_DEPTH 8
+
 void shadow_init();
 
 mobj_t *shadow_create(mobj_t *shadowed);
 
 void shadow_collapse(mobj_t *o);
 
+long shadow_chain_contains(mobj_t *o, mobj_t *target);
+
+size_t shadow_chain_depth(mobj_t *o);
+
+mobj_t *shadow_chain_bottom(mobj_t *o);
+
+pframe_t *shadow_peek_pframe(mobj_t *o, size_t pagenum);
+
+long shadow_bound_depth(mobj_t *o);
+
 extern int shadow_count;
+
+extern size_t shadow_flatten_count;
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "types.h"
+
+void shadowd_start();
+
+size_t shadowd_info(const void *arg, char *buf, size_t osize);
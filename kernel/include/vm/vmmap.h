@@ -7,6 +7,9 @@
 #define VMMAP_DIR_LOHI 1
 #define VMMAP_DIR_HILO 2
 
+/* Most pages a process may have in MAP_LOCKED areas */
+#define VMMAP_LOCKED_MAX_PAGES 4096
+
 struct mobj;
 struct proc;
 struct vnode;
@@ -31,7 +34,11 @@ typedef struct vmarea
 
     int vma_prot;  /* permissions (protections) on mapping, see mman.h */
     int vma_flags; /* either MAP_SHARED or MAP_PRIVATE. It can also specify 
-                      MAP_ANON and MAP_FIXED */
+                      MAP_ANON and MAP_FIXED, and MAP_LOCKED while the area
+                      is mlock()ed */
+    int vma_advice; /* expected access pattern, set by madvise(): one of
+                       MADV_NORMAL (the default), MADV_RANDOM and
+                       MADV_SEQUENTIAL. See vm/readahead.c */
 
     struct vmmap *vma_vmmap; /* address space that this area belongs to */
     struct mobj *vma_obj;    /* the memory object that corresponds to this address region */
@@ -53,6 +60,14 @@ long vmmap_map(vmmap_t *map, struct vnode *file, size_t lopage, size_t npages,
 
 long vmmap_remove(vmmap_t *map, size_t lopage, size_t npages);
 
+long vmmap_advise(vmmap_t *map, size_t lopage, size_t npages, int advice);
+
+long vmmap_populate(vmmap_t *map, size_t lopage, size_t npages);
+
+long vmmap_lock(vmmap_t *map, size_t lopage, size_t npages, long lock);
+
+size_t vmmap_locked_pages(vmmap_t *map);
+
 long vmmap_is_range_empty(vmmap_t *map, size_t startvfn, size_t npages);
 
 ssize_t vmmap_find_range(vmmap_t *map, size_t npages, int dir);
@@ -61,6 +76,12 @@ long vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count);
 
 long vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count);
 
+void vmmap_unmap_mobj_page(struct mobj *o, size_t pagenum);
+
+void vmmap_unmap_mobj(struct mobj *o);
+
+long vmmap_mobj_page_locked(struct mobj *o, size_t pagenum);
+
 vmmap_t *vmmap_clone(vmmap_t *map);
 
 size_t vmmap_mapping_info_helper(const void *map, char *buf, size_t size,
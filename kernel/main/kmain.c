@@ -6,13 +6,18 @@
 #include <drivers/tty/tty.h>
 #include <drivers/tty/vterminal.h>
 #include <main/io.h>
+#include <mm/compact.h>
 #include <mm/mm.h>
 #include <mm/slab.h>
+#include <mm/swap.h>
+#include <mm/tlb.h>
 #include <test/kshell/kshell.h>
 #include <test/proctest.h>
 #include <util/time.h>
 #include <vm/anon.h>
+#include <vm/readahead.h>
 #include <vm/shadow.h>
+#include <vm/shadowd.h>
 
 #include "util/debug.h"
 #include "util/gdb.h"
@@ -28,6 +33,7 @@
 
 #include "api/syscall.h"
 
+#include "fs/dcache.h"
 #include "fs/fcntl.h"
 #include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
@@ -48,14 +54,17 @@ static void initproc_start();
 typedef void (*init_func_t)();
 static init_func_t init_funcs[] = {
     dbg_init,
+    string_init,
     intr_init,
     page_init,
     pt_init,
+    tlb_init,
     acpi_init,
     apic_init,
     core_init,
     slab_init,
     pframe_init,
+    compact_init,
     pci_init,
     vga_init,
 #ifdef __VM__
@@ -68,8 +77,11 @@ static init_func_t init_funcs[] = {
 #ifdef __DRIVERS__
     chardev_init,
     blockdev_init,
+    swap_init,
 #endif
     kshell_init,
+    vnode_cache_init,
+    dcache_init,
     file_init,
     pipe_init,
     syscall_init,
@@ -180,6 +192,13 @@ static void *initproc_run(long arg1, void *arg2)
     }
 #endif
 
+#ifdef __VM__
+    readahead_start();
+#endif
+#if defined(__VM__) && defined(__SHADOWD__)
+    shadowd_start();
+#endif
+
     // Wait for all children to finish before exiting
     int status;
     while (do_waitpid(-1, &status, 0) != -ECHILD) {
@@ -72,6 +72,7 @@ void core_init()
     curcore.kc_id = apic_current_id();
     curcore.kc_queue = NULL;
     curcore.kc_csdpaddr = csd_paddr;
+    pt_core_init();
 
     intr_init();
     gdt_init();
@@ -0,0 +1,196 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "main/interrupt.h"
+
+#include "mm/compact.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "vm/vmmap.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+
+/*
+ * Memory compaction.
+ *
+ * Page cache and anonymous pages are allocated with page_alloc_movable(), which
+ * groups them at the top of physical memory and marks them as movable. When a
+ * multi-page allocation fails because free memory is too fragmented,
+ * page_alloc_n() calls page_compact(), which picks the block that is cheapest
+ * to clear (see page_compaction_target()) and moves every movable page in it
+ * somewhere else:
+ *
+ *  1) Find the pframe whose contents live in the page and lock its mobj.
+ *  2) Allocate a replacement page outside the block.
+ *  3) Unmap the page from every user address space that maps it; the next
+ *     access refaults and maps the new page.
+ *  4) Copy the contents over and free the old page (pframe_move_page()).
+ *
+ * The pframe stays the same object and keeps its place in the mobj, so only
+ * pf_addr changes and the mobj's index does not need to be touched.
+ *
+ * Pages of mlock()ed areas are never moved (see vmmap_mobj_page_locked()).
+ *
+ * Compaction runs in the context of the failing allocation, which may already
+ * hold some mobj or pframe mutex. To stay clear of lock ordering problems it
+ * never blocks on a mutex: pages whose mobj or pframe is held by someone are
+ * simply skipped.
+ */
+
+static long compact_ready = 0;
+
+static size_t compact_runs;
+static size_t compact_successes;
+static size_t compact_migrated;
+static size_t compact_skipped;
+
+void compact_init() { compact_ready = 1; }
+
+/*
+ * Moves the movable page at addr out of [start, end). Pages allocated while
+ * looking for a replacement that land inside the block are pushed onto *stash
+ * (linked through their first word) to be freed by the caller once the block
+ * is clear.
+ *
+ * Returns 0 if the page was moved or is no longer in use, -EBUSY if it is
+ * locked by someone else, or -ENOMEM if there was no page to move it to.
+ */
+static long _compact_migrate(void *addr, void *start, void *end, void **stash)
+{
+    size_t pagenum;
+    mobj_t *o = pframe_find_resident(addr, &pagenum);
+    if (!o)
+    {
+        // freed, or allocated but not yet filled in by its owner
+        return page_is_movable(addr) ? -EBUSY : 0;
+    }
+
+    long ret = -EBUSY;
+    if (!kmutex_trylock(&o->mo_mutex))
+    {
+        mobj_put(&o);
+        return ret;
+    }
+
+    // the same lookup as mobj_find_pframe(), minus the blocking lock
+    pframe_t *pf =
+        o->mo_btree ? (pframe_t *)btree_search(o->mo_btree, pagenum) : NULL;
+    if (!pf || vmmap_mobj_page_locked(o, pagenum) ||
+        !kmutex_trylock(&pf->pf_mutex))
+    {
+        goto out;
+    }
+    if (pf->pf_addr != addr)
+    {
+        // moved or evicted while we were looking
+        ret = 0;
+        goto out_release;
+    }
+
+    void *page;
+    while ((page = page_alloc_movable()) && page >= start && page < end)
+    {
+        *(void **)page = *stash;
+        *stash = page;
+    }
+    if (!page)
+    {
+        ret = -ENOMEM;
+        goto out_release;
+    }
+
+    vmmap_unmap_mobj_page(o, pagenum);
+    pframe_move_page(pf, page);
+    compact_migrated++;
+    ret = 0;
+
+out_release:
+    pframe_release(&pf);
+out:
+    mobj_put_locked(&o);
+    return ret;
+}
+
+static long _compact_stashed(void *stash, void *addr)
+{
+    for (; stash; stash = *(void **)stash)
+    {
+        if (stash == addr)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+long page_compact(size_t npages)
+{
+    if (!compact_ready || !curthr || !intr_enabled())
+    {
+        return 0;
+    }
+
+    size_t order = 0;
+    while ((1UL << order) < npages)
+    {
+        order++;
+    }
+
+    size_t nmovable;
+    void *start = page_compaction_target(order, &nmovable);
+    if (!start)
+    {
+        return 0;
+    }
+    void *end = (char *)start + (PAGE_SIZE << order);
+    compact_runs++;
+
+    dbg(DBG_MM, "compacting [0x%p, 0x%p): %lu movable pages\n", start, end,
+        nmovable);
+
+    long cleared = 1;
+    void *stash = NULL;
+    for (void *addr = start; addr < end && nmovable;
+         addr = (char *)addr + PAGE_SIZE)
+    {
+        if (!page_is_movable(addr) || _compact_stashed(stash, addr))
+        {
+            continue;
+        }
+        long ret = _compact_migrate(addr, start, end, &stash);
+        if (ret)
+        {
+            compact_skipped++;
+            cleared = 0;
+            if (ret == -ENOMEM)
+            {
+                break;
+            }
+        }
+        nmovable--;
+    }
+
+    while (stash)
+    {
+        void *next = *(void **)stash;
+        page_free(stash);
+        stash = next;
+    }
+
+    compact_successes += cleared;
+    return cleared;
+}
+
+size_t compact_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+    iprintf(&buf, &size, "compaction runs:     %lu (%lu cleared a block)\n",
+            compact_runs, compact_successes);
+    iprintf(&buf, &size, "pages migrated:      %lu\n", compact_migrated);
+    iprintf(&buf, &size, "pages left in place: %lu\n", compact_skipped);
+    return size;
+}
@@ -2,6 +2,9 @@
 
 #include "mm/mobj.h"
 #include "mm/pframe.h"
+#include "mm/swap.h"
+
+#include "vm/vmmap.h"
 
 #include "util/debug.h"
 #include <util/string.h>
@@ -137,6 +140,7 @@ void mobj_create_pframe(mobj_t *o, uint64_t pagenum, uint64_t loc, pframe_t **pf
 
         pf->pf_pagenum = pagenum;
         pf->pf_loc = loc;
+        pf->pf_obj = o;
         list_insert_tail(&o->mo_pframes, &pf->pf_link);
         btree_insert(&o->mo_btree, pagenum, (void *)pf);
     }
@@ -152,7 +156,7 @@ void mobj_create_pframe(mobj_t *o, uint64_t pagenum, uint64_t loc, pframe_t **pf
  *
  * First, check if an pframe already exists in the mobj, creating one as
  * necessary. Then, ensure that the pframe's contents are loaded: i.e. that
- * pf->pf_addr is non-null. You will want to use page_alloc() and fill_pframe
+ * pf->pf_addr is non-null. You will want to use pframe_alloc_page() and fill_pframe
  * function pointer of the mobj. Finally, if forwrite is true, mark the pframe
  * as dirtied. The resulting pframe should be set in *pfp.
  *
@@ -181,28 +185,50 @@ long mobj_default_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
         return -ENOMEM;
     }
     KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
-    if (!pf->pf_addr)
+    if (!pf->pf_addr && !forwrite && !pf->pf_swap && o->mo_type == MOBJ_ANON)
+    {
+        // untouched anonymous memory reads as zeros; share a single page of
+        // them until the first write
+        pframe_map_zero_page(pf);
+    }
+    else if (!pf->pf_addr)
     {
         KASSERT(!pf->pf_dirty &&
                 "dirtied page doesn't have a physical address");
-        pf->pf_addr = page_alloc();
-        if (!pf->pf_addr)
+        if (pframe_alloc_page(pf))
         {
+            kmutex_unlock(&pf->pf_mutex);
             return -ENOMEM;
         }
 
         dbg(DBG_PFRAME, "filling pframe 0x%p (mobj 0x%p page %lu)\n", pf, o,
             pf->pf_pagenum);
         KASSERT(o->mo_ops.fill_pframe);
-        long ret = o->mo_ops.fill_pframe(o, pf);
+        // pages that were pushed out to swap come back from there instead
+        long ret = pf->pf_swap ? swap_in(o, pf) : o->mo_ops.fill_pframe(o, pf);
         if (ret)
         {
-            page_free(pf->pf_addr);
-            pf->pf_addr = NULL;
+            pframe_free_page(pf);
             kmutex_unlock(&pf->pf_mutex);
             return ret;
         }
     }
+    else if (forwrite && pframe_is_zero_page(pf))
+    {
+        // whoever mapped the zero page for this pframe has to refault and
+        // pick up the private copy
+        vmmap_unmap_mobj_page(o, pagenum);
+        if (pframe_unshare_zero_page(pf))
+        {
+            kmutex_unlock(&pf->pf_mutex);
+            return -ENOMEM;
+        }
+    }
+    if (forwrite)
+    {
+        // the copy in swap is about to go stale
+        swap_release(pf);
+    }
     pf->pf_dirty |= forwrite;
     *pfp = pf;
     return 0;
@@ -257,7 +283,7 @@ long mobj_flush(mobj_t *o)
 
 /*
  * Attempt to flush the pframe. If the flush succeeds, then free the pframe's
- * contents (pf->pf_addr) using page_free, remove the pframe from the mobj's
+ * contents (pf->pf_addr) using pframe_free_page, remove the pframe from the mobj's
  * list and call pframe_free.
  *
  * Upon successful return, *pfp MUST be null. If the function returns an error
@@ -278,10 +304,10 @@ long mobj_free_pframe(mobj_t *o, pframe_t **pfp)
         // TABLES THAT USE THEM)
         if (pf->pf_addr)
         {
-            page_free(pf->pf_addr);
-            pf->pf_addr = NULL;
+            pframe_free_page(pf);
         }
     }
+    swap_release(pf);
     *pfp = NULL;
     list_remove(&pf->pf_link);
 
@@ -302,9 +328,9 @@ void mobj_delete_pframe(mobj_t *o, size_t pagenum)
         pf->pf_dirty = 0;
         if (pf->pf_addr)
         {
-            page_free(pf->pf_addr);
-            pf->pf_addr = NULL;
+            pframe_free_page(pf);
         }
+        swap_release(pf);
         pframe_free(&pf);
     }
     
@@ -322,6 +348,11 @@ void mobj_default_destructor(mobj_t *o)
     list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
     {
         kmutex_lock(&pf->pf_mutex); // get the pframe (lock it)
+        if (o->mo_type == MOBJ_ANON || o->mo_type == MOBJ_SHADOW)
+        {
+            // anonymous contents die with the object, don't write them to swap
+            pf->pf_dirty = 0;
+        }
         ret |= mobj_free_pframe(o, &pf);
     }
 
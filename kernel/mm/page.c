@@ -6,24 +6,34 @@
 
 #include "boot/config.h"
 
+#include "main/apic.h"
+#include "main/interrupt.h"
+
+#include "mm/compact.h"
 #include "mm/mm.h"
 #include "mm/page.h"
 
+#include "proc/spinlock.h"
+
 #include "util/debug.h"
 #include "util/gdb.h"
+#include "util/printf.h"
 #include "util/string.h"
 
 #include "multiboot.h"
 
 // BTREE === Binary Tree (not an actual B-Tree)
 
-// Algorithmic optimization ideas
-// have a "min free idx" pointer for each order (have a "count free" at each
-// order) delay cascading availability bits up the tree until needed; would
-// prevent state "thrashing"
-//      can do this with a cascaded_order flag that equals the highest order
-//      which we have cascaed up to. For a given allocation, if the required
-//      order is > cascaded_order, then we cascade up to the required order
+// Algorithmic optimizations
+// each order has a "min free idx" pointer and a "count free"; the min free idx
+// is maintained by scanning whole btree words with clz rather than bit by bit.
+// cascading availability bits up the tree is delayed until needed, which
+// prevents state "thrashing" (freeing a page merging all the way up to
+// max_order only for the next allocation to split it all the way back down)
+//      cascaded_order is the highest order which we have cascaded up to; no
+//      two available buddies exist below it. Frees only merge up to
+//      cascaded_order. For a given allocation, if the required order is >
+//      cascaded_order, then we cascade up to the required order
 
 // get ready for bit manipulation heaven :)
 
@@ -103,7 +113,61 @@ static size_t max_order; // max depth of binary tree
 
 static btree_word *btree;
 static uintptr_t *min_available_idx_by_order;
+static uintptr_t *max_available_idx_by_order;
 static size_t *count_available_by_order;
+static size_t cascaded_order;
+
+// Anti-fragmentation grouping: unmovable kernel allocations are taken from the
+// lowest free index of each order and movable pages (page cache, anonymous
+// memory) from the highest, so the two kinds pile up at opposite ends of
+// physical memory instead of interleaving. One bit per page records which
+// allocated pages are movable, which is what compaction needs to know.
+static uintptr_t *movable_map;
+static size_t movable_count;
+
+#define MOVABLE_WORD(pn) ((pn) / BTREE_NUM_BITS)
+#define MOVABLE_MASK(pn) ((uintptr_t)1 << ((pn) & (BTREE_NUM_BITS - 1)))
+#define PAGE_IS_MOVABLE(pn) (movable_map[MOVABLE_WORD(pn)] & MOVABLE_MASK(pn))
+
+// protects the btree and all of the metadata above
+static spinlock_t page_lock = SPINLOCK_INITIALIZER(page_lock);
+
+// Per-core free lists of order-0 pages sitting in front of the btree. Free
+// pages are chained through their first word, so page_alloc() and page_free()
+// are a pop/push on the current core's stack. The lists are refilled from and
+// drained to the btree PAGE_PCP_BATCH pages at a time, so the global lock is
+// only taken once per batch. The per-list lock is uncontended except when
+// another core drains every list to satisfy a large allocation.
+#define PAGE_PCP_BATCH 16
+#define PAGE_PCP_HIGH (PAGE_PCP_BATCH * 4)
+
+typedef struct page_pcp
+{
+    spinlock_t pp_lock;
+    size_t pp_count;
+    void *pp_head;
+} page_pcp_t;
+
+static page_pcp_t page_pcp[MAX_LAPICS];
+
+// Masks interrupts on this core and takes the global allocator lock. Returns
+// whether interrupts were enabled so that _page_unlock() can restore them.
+static inline uint64_t _page_lock()
+{
+    uint64_t enabled = intr_enabled();
+    intr_disable();
+    spinlock_lock(&page_lock);
+    return enabled;
+}
+
+static inline void _page_unlock(uint64_t enabled)
+{
+    spinlock_unlock(&page_lock);
+    if (enabled)
+    {
+        intr_enable();
+    }
+}
 
 static char *type_strings[] = {"ERROR: type = 0", "Available", "Reserved",
                                "ACPI Reclaimable", "ACPI NVS", "GRUB Bad Ram"};
@@ -125,6 +189,7 @@ static inline void _btree_expensive_sanity_check()
     for (unsigned order = 0; order <= max_order; order++)
     {
         long checked_first = 0;
+        uintptr_t last = BTREE_ROW_END_INDEX(order);
         unsigned order_count = 0;
         uintptr_t max = BTREE_ROW_END_INDEX(order);
 
@@ -137,8 +202,11 @@ static inline void _btree_expensive_sanity_check()
                     KASSERT(min_available_idx_by_order[order] == idx);
                     checked_first = 1;
                 }
+                last = idx;
                 available += (1 << order);
                 order_count++;
+                KASSERT(order >= cascaded_order ||
+                        !BTREE_IS_AVAILABLE(BTREE_SIBLING(idx)));
                 KASSERT(BTREE_INDEX_TO_ADDR(idx + 1, order) <= physmap_end());
             }
         }
@@ -146,6 +214,7 @@ static inline void _btree_expensive_sanity_check()
         {
             KASSERT(min_available_idx_by_order[order] == max);
         }
+        KASSERT(max_available_idx_by_order[order] == last);
         KASSERT(count_available_by_order[order] == order_count);
     }
     KASSERT(available == page_freecount);
@@ -215,14 +284,17 @@ void page_init()
     // that fits (this can obviously be done more intelligently, but this also
     // works)
     size_t btree_size;
+    size_t movable_map_size;
     size_t metadata_size;
     while (max_order)
     {
         // we need 2^(max_order+1) pages, and one byte maps 8 pages, so we need
         // 2^(max_order-2) bytes for the binary tree
         btree_size = 1UL << (max_order - 2);
-        metadata_size = sizeof(uintptr_t) * (max_order + 1) +
-                        sizeof(size_t) * (max_order + 1);
+        movable_map_size = sizeof(uintptr_t) *
+                           ((max_pages + BTREE_NUM_BITS - 1) / BTREE_NUM_BITS);
+        metadata_size = 2 * sizeof(uintptr_t) * (max_order + 1) +
+                        sizeof(size_t) * (max_order + 1) + movable_map_size;
 
         if (memory_available_for_use >= btree_size + metadata_size)
         {
@@ -253,16 +325,23 @@ void page_init()
     memset(btree, 0, btree_size);
 
     min_available_idx_by_order = (uintptr_t *)((uintptr_t)btree + btree_size);
+    max_available_idx_by_order = min_available_idx_by_order + (max_order + 1);
     for (unsigned order = 0; order <= max_order; order++)
     {
         min_available_idx_by_order[order] = BTREE_ROW_END_INDEX(order);
+        max_available_idx_by_order[order] = BTREE_ROW_END_INDEX(order);
     }
 
     count_available_by_order =
-        min_available_idx_by_order + sizeof(uintptr_t) * (max_order + 1);
+        (size_t *)(max_available_idx_by_order + (max_order + 1));
     memset(count_available_by_order, 0, sizeof(size_t) * (max_order + 1));
 
+    movable_map = (uintptr_t *)(count_available_by_order + (max_order + 1));
+    memset(movable_map, 0, movable_map_size);
+
     page_freecount = 0;
+    cascaded_order = 0;
+    movable_count = 0;
 
     uintptr_t reserved_ram_start = KERNEL_PHYS_BASE;
     uintptr_t reserved_ram_end =
@@ -333,64 +412,110 @@ void page_init_finish()
     btree = (btree_word *)((uintptr_t)btree + PHYS_OFFSET);
     min_available_idx_by_order =
         (uintptr_t *)((uintptr_t)min_available_idx_by_order + PHYS_OFFSET);
+    max_available_idx_by_order =
+        (uintptr_t *)((uintptr_t)max_available_idx_by_order + PHYS_OFFSET);
     count_available_by_order =
         (uintptr_t *)((uintptr_t)count_available_by_order + PHYS_OFFSET);
+    movable_map = (uintptr_t *)((uintptr_t)movable_map + PHYS_OFFSET);
 }
 
-static void _btree_update_metadata_after_removal(size_t order, size_t idx)
+// Returns the first available index in the row for order that is >= from, or
+// BTREE_ROW_END_INDEX(order) if there is none. Index i lives in bit
+// (BTREE_NUM_BITS - 1 - BTREE_BIT_POS(i)) of its word, so the lowest available
+// index within a word is given by its count of leading zeros.
+static uintptr_t _btree_row_find_available(size_t order, uintptr_t from)
 {
-    // [+] TODO Intel-specific optimizations, see BSF, BSR, REPE CMPS/SCAS
-    if (count_available_by_order[order])
+    uintptr_t end = BTREE_ROW_END_INDEX(order);
+    if (from >= end)
+    {
+        return end;
+    }
+
+    uintptr_t word_idx = BTREE_WORD_POS(from);
+    uintptr_t last_word_idx = BTREE_WORD_POS(end - 1);
+    // ignore the bits for indices below from
+    btree_word word = btree[word_idx] & (~(btree_word)0 >> BTREE_BIT_POS(from));
+    while (!word)
     {
-        if (idx == min_available_idx_by_order[order])
+        if (++word_idx > last_word_idx)
         {
-            uintptr_t word_idx = BTREE_WORD_POS(idx);
-            if (btree[word_idx] &&
-                word_idx == BTREE_WORD_POS(BTREE_ROW_START_INDEX(order)))
-            {
-                // mask off bits to the left of BTREE_BIT_POS(idx); i.e.
-                // consider only positions > than BTREE_BIT_POS(idx) in
-                // btree[word_idx] when idx is the old index of the first
-                // available node for the given order. This is to avoid setting
-                // min available for an order x to be an index that actually
-                // belongs to order (x + 1) (in the row above).
-                btree_word copy =
-                    btree[word_idx] &
-                    ((1UL << (BTREE_NUM_BITS - BTREE_BIT_POS(idx))) - 1);
-                unsigned bit_idx = BTREE_NUM_BITS;
-                while (copy != 0 && bit_idx > BTREE_BIT_POS(idx))
-                {
-                    bit_idx--;
-                    copy = copy >> 1;
-                }
-                if (BTREE_IS_AVAILABLE(word_idx * BTREE_NUM_BITS + bit_idx))
-                {
-                    min_available_idx_by_order[order] =
-                        word_idx * BTREE_NUM_BITS + bit_idx;
-                    return;
-                }
-                word_idx++;
-            }
-            while (!btree[word_idx])
-                word_idx++;
-            btree_word copy = btree[word_idx];
-            unsigned bit_idx = BTREE_NUM_BITS;
-            while (copy != 0)
-            {
-                bit_idx--;
-                copy = copy >> 1;
-            }
-            uintptr_t min_available = word_idx * BTREE_NUM_BITS + bit_idx;
-            if (min_available > BTREE_ROW_END_INDEX(order))
-            {
-                min_available = BTREE_ROW_END_INDEX(order);
-            }
-            min_available_idx_by_order[order] = min_available;
+            return end;
         }
+        word = btree[word_idx];
     }
-    else
+
+    // the last word may be shared with the row below; anything past end is not
+    // ours to report
+    uintptr_t idx = word_idx * BTREE_NUM_BITS + __builtin_clzl(word);
+    return idx < end ? idx : end;
+}
+
+// Returns the last available index in the row for order that is <= from, or
+// BTREE_ROW_END_INDEX(order) if there is none. The highest available index
+// within a word is given by its count of trailing zeros.
+static uintptr_t _btree_row_find_available_reverse(size_t order,
+                                                   uintptr_t from)
+{
+    uintptr_t start = BTREE_ROW_START_INDEX(order);
+    uintptr_t end = BTREE_ROW_END_INDEX(order);
+    if (from < start || from >= end)
+    {
+        return end;
+    }
+
+    uintptr_t word_idx = BTREE_WORD_POS(from);
+    uintptr_t first_word_idx = BTREE_WORD_POS(start);
+    // ignore the bits for indices above from
+    btree_word word = btree[word_idx] &
+                      (~(btree_word)0 << (BTREE_NUM_BITS - 1 - BTREE_BIT_POS(from)));
+    while (!word)
+    {
+        if (word_idx == first_word_idx)
+        {
+            return end;
+        }
+        word = btree[--word_idx];
+    }
+
+    // the first word may be shared with the row above
+    uintptr_t idx =
+        word_idx * BTREE_NUM_BITS + (BTREE_NUM_BITS - 1 - __builtin_ctzl(word));
+    return idx >= start ? idx : end;
+}
+
+// Bookkeeping for idx having just been marked available.
+static inline void _btree_note_available(size_t order, uintptr_t idx)
+{
+    if (!count_available_by_order[order]++ ||
+        idx > max_available_idx_by_order[order])
+    {
+        max_available_idx_by_order[order] = idx;
+    }
+    if (idx < min_available_idx_by_order[order])
+    {
+        min_available_idx_by_order[order] = idx;
+    }
+}
+
+// Bookkeeping for idx having just been marked unavailable.
+static void _btree_note_unavailable(size_t order, uintptr_t idx)
+{
+    KASSERT(count_available_by_order[order]);
+    if (!--count_available_by_order[order])
     {
         min_available_idx_by_order[order] = BTREE_ROW_END_INDEX(order);
+        max_available_idx_by_order[order] = BTREE_ROW_END_INDEX(order);
+        return;
+    }
+    if (idx == min_available_idx_by_order[order])
+    {
+        min_available_idx_by_order[order] =
+            _btree_row_find_available(order, idx + 1);
+    }
+    if (idx == max_available_idx_by_order[order])
+    {
+        max_available_idx_by_order[order] =
+            _btree_row_find_available_reverse(order, idx - 1);
     }
 }
 
@@ -404,31 +529,67 @@ static void _btree_mark_available(uintptr_t idx, size_t order)
     dbg(DBG_MM, "marking available (0x%p, 0x%p)\n", (void *)start, (void *)end);
     KASSERT(!(0xb1000 >= start && 0xb1000 < end));
 
-    count_available_by_order[order]++;
-    if (idx < min_available_idx_by_order[order])
-    {
-        min_available_idx_by_order[order] = idx;
-    }
+    _btree_note_available(order, idx);
 
-    while (idx > 0 && BTREE_IS_AVAILABLE(BTREE_SIBLING(idx)))
+    while (order < cascaded_order && BTREE_IS_AVAILABLE(BTREE_SIBLING(idx)))
     {
         BTREE_MARK_UNAVAILABLE(idx);
         BTREE_MARK_UNAVAILABLE(BTREE_SIBLING(idx));
-
-        count_available_by_order[order] -= 2;
-        _btree_update_metadata_after_removal(order, BTREE_LEFT_SIBLING(idx));
+        _btree_note_unavailable(order, idx);
+        _btree_note_unavailable(order, BTREE_SIBLING(idx));
 
         idx = BTREE_PARENT(idx);
         order++;
         BTREE_MARK_AVAILABLE(idx);
-        count_available_by_order[order]++;
-        if (idx < min_available_idx_by_order[order])
+        _btree_note_available(order, idx);
+    }
+}
+
+// Merges every pair of available buddies in the row for order into their
+// parent.
+static void _btree_cascade_row(size_t order)
+{
+    KASSERT(order < max_order);
+    uintptr_t end = BTREE_ROW_END_INDEX(order);
+    uintptr_t idx = min_available_idx_by_order[order];
+    while ((idx = _btree_row_find_available(order, idx)) < end)
+    {
+        // we scan left to right, so a right child's available buddy would
+        // already have been merged with it
+        if (BTREE_IS_LEFT_CHILD(idx) && BTREE_IS_AVAILABLE(BTREE_SIBLING(idx)))
+        {
+            BTREE_MARK_UNAVAILABLE(idx);
+            BTREE_MARK_UNAVAILABLE(BTREE_SIBLING(idx));
+            _btree_note_unavailable(order, idx);
+            _btree_note_unavailable(order, BTREE_SIBLING(idx));
+
+            uintptr_t parent = BTREE_PARENT(idx);
+            BTREE_MARK_AVAILABLE(parent);
+            _btree_note_available(order + 1, parent);
+            idx += 2;
+        }
+        else
         {
-            min_available_idx_by_order[order] = idx;
+            idx++;
         }
     }
 }
 
+// Performs the merges that frees have been deferring, bottom up, so that every
+// free block of 2^order pages is represented by a single available node.
+static void _btree_cascade(size_t order)
+{
+    if (order > max_order)
+    {
+        order = max_order;
+    }
+    for (; cascaded_order < order; cascaded_order++)
+    {
+        _btree_cascade_row(cascaded_order);
+    }
+    _btree_expensive_sanity_check();
+}
+
 static void _btree_mark_range_available(uintptr_t leaf_idx, size_t npages)
 {
     // coult be optimized further so that we don't need to keep traversing fromm
@@ -466,46 +627,36 @@ void page_add_range(void *start, void *end)
     start = PAGE_ALIGN_UP(start);
     end = PAGE_ALIGN_DOWN(end);
     size_t npages = ((uintptr_t)end - (uintptr_t)start) >> PAGE_SHIFT;
+    uint64_t enabled = _page_lock();
     _btree_mark_range_available(BTREE_ADDR_TO_LEAF_INDEX(start), npages);
     page_freecount += npages;
     _btree_expensive_sanity_check();
+    _page_unlock(enabled);
 }
 
-void *page_alloc() { return page_alloc_n(1); }
-
-void *page_alloc_bounded(void *max_paddr)
-{
-    return page_alloc_n_bounded(1, max_paddr);
-}
-
-void page_free(void *addr) { page_free_n(addr, 1); }
-
 static void *_btree_alloc(size_t npages, uintptr_t idx, size_t smallest_order,
-                          size_t actual_order)
+                          size_t actual_order, long movable)
 {
     while (actual_order != smallest_order)
     {
         BTREE_MARK_UNAVAILABLE(idx);
-        count_available_by_order[actual_order]--;
-        _btree_update_metadata_after_removal(actual_order, idx);
+        _btree_note_unavailable(actual_order, idx);
 
-        idx = BTREE_LEFT_CHILD(idx);
+        // movable allocations keep to the high end of the block they split
+        idx = movable ? BTREE_RIGHT_CHILD(idx) : BTREE_LEFT_CHILD(idx);
         BTREE_MARK_AVAILABLE(idx);
         BTREE_MARK_AVAILABLE(BTREE_SIBLING(idx));
         actual_order--;
 
-        count_available_by_order[actual_order] += 2;
-        if (idx < min_available_idx_by_order[actual_order])
-        {
-            min_available_idx_by_order[actual_order] = idx;
-        }
-        _btree_expensive_sanity_check();
+        _btree_note_available(actual_order, idx);
+        _btree_note_available(actual_order, BTREE_SIBLING(idx));
+        // no sanity check here; idx and its buddy are both available until we
+        // take idx below
     }
 
     // actually allocate the 2^smallest_order pages by marking them unavailable
     BTREE_MARK_UNAVAILABLE(idx);
-    count_available_by_order[actual_order]--;
-    _btree_update_metadata_after_removal(actual_order, idx);
+    _btree_note_unavailable(actual_order, idx);
 
     uintptr_t allocated_idx = idx;
     size_t allocated_order = actual_order;
@@ -543,14 +694,8 @@ static void *_btree_alloc(size_t npages, uintptr_t idx, size_t smallest_order,
     return (void *)(addr + PHYS_OFFSET);
 }
 
-void *page_alloc_n(size_t npages)
-{
-    return page_alloc_n_bounded(npages, (void *)~0UL);
-}
-
-// this is really only used for setting up initial page tables
-// this memory will be immediately overriden, so no need to poison the memory
-void *page_alloc_n_bounded(size_t npages, void *max_paddr)
+static void *_page_alloc_n_bounded_locked(size_t npages, void *max_paddr,
+                                          long movable)
 {
     KASSERT(npages > 0 && npages <= (1UL << max_order));
     if (npages > page_freecount)
@@ -565,10 +710,12 @@ void *page_alloc_n_bounded(size_t npages, void *max_paddr)
     uintptr_t max_page_number =
         ((uintptr_t)max_paddr >> PAGE_SHIFT) - npages + 1;
 
-    // [+] TODO intel-specific optimization possible here?
-    size_t smallest_order = 0;
-    while ((1UL << smallest_order) < npages)
-        smallest_order++;
+    size_t smallest_order =
+        npages == 1 ? 0 : BTREE_NUM_BITS - __builtin_clzl(npages - 1);
+    if (smallest_order > cascaded_order)
+    {
+        _btree_cascade(smallest_order);
+    }
 
     for (size_t actual_order = smallest_order; actual_order <= max_order;
          actual_order++)
@@ -577,7 +724,8 @@ void *page_alloc_n_bounded(size_t npages, void *max_paddr)
         {
             continue;
         }
-        uintptr_t idx = min_available_idx_by_order[actual_order];
+        uintptr_t idx = movable ? max_available_idx_by_order[actual_order]
+                                : min_available_idx_by_order[actual_order];
         KASSERT(idx >= BTREE_ROW_START_INDEX(actual_order) &&
                 idx < BTREE_ROW_END_INDEX(actual_order));
         if ((idx - BTREE_ROW_START_INDEX(actual_order)) * (1 << actual_order) <
@@ -587,7 +735,8 @@ void *page_alloc_n_bounded(size_t npages, void *max_paddr)
                         (1 << actual_order) <
                     max_pages);
 
-            void *ret = _btree_alloc(npages, idx, smallest_order, actual_order);
+            void *ret = _btree_alloc(npages, idx, smallest_order, actual_order,
+                                     movable);
             KASSERT(((uintptr_t)ret + (npages << PAGE_SHIFT)) <=
                     (uintptr_t)physmap_end());
             return ret;
@@ -596,21 +745,253 @@ void *page_alloc_n_bounded(size_t npages, void *max_paddr)
     return 0;
 }
 
-void page_free_n(void *addr, size_t npages)
+static void _page_free_n_locked(void *addr, size_t npages)
 {
     dbgq(DBG_MM, "page_free_n(%lu): [0x%p, 0x%p)\t\t%lu pages remain\n", npages,
          addr, (void *)((uintptr_t)addr + (npages << PAGE_SHIFT)),
          page_freecount);
-    GDB_CALL_HOOK(page_free, addr, npages);
     KASSERT(npages > 0 && npages <= (1UL << max_order) && PAGE_ALIGNED(addr));
     uintptr_t idx = BTREE_ADDR_TO_LEAF_INDEX((uintptr_t)addr - PHYS_OFFSET);
     KASSERT(idx + npages - BTREE_LEAF_START_INDEX <= max_pages);
+    uintptr_t pn = ADDR_TO_PN((uintptr_t)addr - PHYS_OFFSET);
+    if (PAGE_IS_MOVABLE(pn))
+    {
+        KASSERT(npages == 1 && "movable pages are allocated one at a time");
+        movable_map[MOVABLE_WORD(pn)] &= ~MOVABLE_MASK(pn);
+        movable_count--;
+    }
     _btree_mark_range_available(idx, npages);
     page_freecount += npages;
     _btree_expensive_sanity_check();
 }
 
-void page_mark_reserved(void *paddr)
+// Returns this core's free list, or NULL if we are still booting and cannot
+// yet tell which core we are on. Must be called with interrupts masked.
+static inline page_pcp_t *_page_pcp_get()
+{
+    KASSERT(!intr_enabled());
+    if (!apic_initialized())
+    {
+        return NULL;
+    }
+    return &page_pcp[apic_current_id()];
+}
+
+static inline void _page_pcp_push(page_pcp_t *pcp, void *addr)
+{
+    *(void **)addr = pcp->pp_head;
+    pcp->pp_head = addr;
+    pcp->pp_count++;
+}
+
+static inline void *_page_pcp_pop(page_pcp_t *pcp)
+{
+    void *addr = pcp->pp_head;
+    KASSERT(addr && pcp->pp_count);
+    pcp->pp_head = *(void **)addr;
+    pcp->pp_count--;
+    return addr;
+}
+
+// Moves up to PAGE_PCP_BATCH pages from the btree onto pcp. The caller must
+// hold pcp->pp_lock.
+static void _page_pcp_refill(page_pcp_t *pcp)
+{
+    uint64_t enabled = _page_lock();
+    for (size_t i = 0; i < PAGE_PCP_BATCH; i++)
+    {
+        void *addr = _page_alloc_n_bounded_locked(1, (void *)~0UL, 0);
+        if (!addr)
+        {
+            break;
+        }
+        _page_pcp_push(pcp, addr);
+    }
+    _page_unlock(enabled);
+}
+
+// Returns up to count pages from pcp to the btree. The caller must hold
+// pcp->pp_lock.
+static void _page_pcp_drain(page_pcp_t *pcp, size_t count)
+{
+    uint64_t enabled = _page_lock();
+    while (count-- && pcp->pp_count)
+    {
+        _page_free_n_locked(_page_pcp_pop(pcp), 1);
+    }
+    _page_unlock(enabled);
+}
+
+// Empties every core's free list so that pages stranded there can coalesce
+// back into higher orders. Returns the number of pages given back.
+static size_t _page_pcp_drain_all()
+{
+    size_t drained = 0;
+    uint64_t enabled = intr_enabled();
+    intr_disable();
+    for (size_t core = 0; core < MAX_LAPICS; core++)
+    {
+        page_pcp_t *pcp = &page_pcp[core];
+        spinlock_lock(&pcp->pp_lock);
+        drained += pcp->pp_count;
+        _page_pcp_drain(pcp, pcp->pp_count);
+        spinlock_unlock(&pcp->pp_lock);
+    }
+    if (enabled)
+    {
+        intr_enable();
+    }
+    return drained;
+}
+
+void *page_alloc()
+{
+    uint64_t enabled = intr_enabled();
+    intr_disable();
+    page_pcp_t *pcp = _page_pcp_get();
+    if (!pcp)
+    {
+        if (enabled)
+        {
+            intr_enable();
+        }
+        return page_alloc_n(1);
+    }
+
+    spinlock_lock(&pcp->pp_lock);
+    if (!pcp->pp_count)
+    {
+        _page_pcp_refill(pcp);
+    }
+    void *addr = pcp->pp_count ? _page_pcp_pop(pcp) : NULL;
+    spinlock_unlock(&pcp->pp_lock);
+    if (enabled)
+    {
+        intr_enable();
+    }
+
+    // every other core may be hoarding the last free pages
+    if (!addr && _page_pcp_drain_all())
+    {
+        return page_alloc_n(1);
+    }
+    return addr;
+}
+
+void *page_alloc_bounded(void *max_paddr)
+{
+    return page_alloc_n_bounded(1, max_paddr);
+}
+
+void page_free(void *addr)
+{
+    KASSERT(PAGE_ALIGNED(addr));
+    // movable pages bypass the per-core lists so that they are not handed
+    // back out as unmovable ones, which would defeat the grouping
+    if (PAGE_IS_MOVABLE(ADDR_TO_PN((uintptr_t)addr - PHYS_OFFSET)))
+    {
+        page_free_n(addr, 1);
+        return;
+    }
+
+    uint64_t enabled = intr_enabled();
+    intr_disable();
+    page_pcp_t *pcp = _page_pcp_get();
+    if (!pcp)
+    {
+        if (enabled)
+        {
+            intr_enable();
+        }
+        page_free_n(addr, 1);
+        return;
+    }
+
+    GDB_CALL_HOOK(page_free, addr, 1);
+    spinlock_lock(&pcp->pp_lock);
+    _page_pcp_push(pcp, addr);
+    if (pcp->pp_count >= PAGE_PCP_HIGH)
+    {
+        _page_pcp_drain(pcp, PAGE_PCP_BATCH);
+    }
+    spinlock_unlock(&pcp->pp_lock);
+    if (enabled)
+    {
+        intr_enable();
+    }
+}
+
+static void *_page_alloc_movable_locked()
+{
+    void *addr = _page_alloc_n_bounded_locked(1, (void *)~0UL, 1);
+    if (addr)
+    {
+        uintptr_t pn = ADDR_TO_PN((uintptr_t)addr - PHYS_OFFSET);
+        movable_map[MOVABLE_WORD(pn)] |= MOVABLE_MASK(pn);
+        movable_count++;
+    }
+    return addr;
+}
+
+void *page_alloc_movable()
+{
+    uint64_t enabled = _page_lock();
+    void *addr = _page_alloc_movable_locked();
+    _page_unlock(enabled);
+
+    if (!addr && _page_pcp_drain_all())
+    {
+        enabled = _page_lock();
+        addr = _page_alloc_movable_locked();
+        _page_unlock(enabled);
+    }
+    return addr;
+}
+
+long page_is_movable(void *addr)
+{
+    uintptr_t pn = ADDR_TO_PN((uintptr_t)addr - PHYS_OFFSET);
+    return pn < max_pages && PAGE_IS_MOVABLE(pn);
+}
+
+void *page_alloc_n(size_t npages)
+{
+    void *addr = page_alloc_n_bounded(npages, (void *)~0UL);
+    if (!addr && npages > 1 && page_compact(npages))
+    {
+        addr = page_alloc_n_bounded(npages, (void *)~0UL);
+    }
+    return addr;
+}
+
+// this is really only used for setting up initial page tables
+// this memory will be immediately overriden, so no need to poison the memory
+void *page_alloc_n_bounded(size_t npages, void *max_paddr)
+{
+    uint64_t enabled = _page_lock();
+    void *addr = _page_alloc_n_bounded_locked(npages, max_paddr, 0);
+    _page_unlock(enabled);
+
+    // the pages we need may be sitting on the per-core lists, preventing the
+    // buddies from coalescing; give them back and try once more
+    if (!addr && _page_pcp_drain_all())
+    {
+        enabled = _page_lock();
+        addr = _page_alloc_n_bounded_locked(npages, max_paddr, 0);
+        _page_unlock(enabled);
+    }
+    return addr;
+}
+
+void page_free_n(void *addr, size_t npages)
+{
+    GDB_CALL_HOOK(page_free, addr, npages);
+    uint64_t enabled = _page_lock();
+    _page_free_n_locked(addr, npages);
+    _page_unlock(enabled);
+}
+
+static void _page_mark_reserved_locked(void *paddr)
 {
     if ((uintptr_t)paddr > (max_pages << PAGE_SHIFT))
         return;
@@ -634,8 +1015,7 @@ void page_mark_reserved(void *paddr)
     }
 
     BTREE_MARK_UNAVAILABLE(idx);
-    count_available_by_order[order]--;
-    _btree_update_metadata_after_removal(order, idx);
+    _btree_note_unavailable(order, idx);
 
     uintptr_t unavailable_leaf_idx = BTREE_ADDR_TO_LEAF_INDEX(paddr);
     uintptr_t still_available_leaf_idx_start =
@@ -655,4 +1035,138 @@ void page_mark_reserved(void *paddr)
     _btree_expensive_sanity_check();
 }
 
-size_t page_free_count() { return page_freecount; }
+void page_mark_reserved(void *paddr)
+{
+    uint64_t enabled = _page_lock();
+    _page_mark_reserved_locked(paddr);
+    _page_unlock(enabled);
+}
+
+// With defer clear, merges everything now and from then on merges on every
+// free, as the allocator did before merges were deferred; with defer set, goes
+// back to merging only what allocations need. Lowering cascaded_order is
+// always safe: it only narrows the orders that may have no available buddies.
+void page_defer_merges(long defer)
+{
+    uint64_t enabled = _page_lock();
+    if (defer)
+    {
+        cascaded_order = 0;
+    }
+    else
+    {
+        _btree_cascade(max_order);
+    }
+    _page_unlock(enabled);
+}
+
+size_t page_free_count()
+{
+    // unlocked read; the per-core lists only hold free pages
+    size_t count = page_freecount;
+    for (size_t core = 0; core < MAX_LAPICS; core++)
+    {
+        count += page_pcp[core].pp_count;
+    }
+    return count;
+}
+
+// Counts the free pages in the block of 2^order pages rooted at idx, none of
+// whose ancestors are available.
+static size_t _btree_count_free_below(uintptr_t idx, size_t order)
+{
+    size_t free = 0;
+    for (size_t depth = 0; depth <= order; depth++)
+    {
+        uintptr_t first = ((idx + 1) << depth) - 1;
+        for (uintptr_t i = first; i < first + (1UL << depth); i++)
+        {
+            if (BTREE_IS_AVAILABLE(i))
+            {
+                free += 1UL << (order - depth);
+            }
+        }
+    }
+    return free;
+}
+
+void *page_compaction_target(size_t order, size_t *nmovable)
+{
+    KASSERT(order <= max_order);
+    uint64_t enabled = _page_lock();
+
+    void *best = NULL;
+    size_t best_free = 0;
+    size_t best_movable = 0;
+    uintptr_t end = BTREE_ROW_END_INDEX(order);
+    for (uintptr_t idx = BTREE_ROW_START_INDEX(order); idx < end; idx++)
+    {
+        uintptr_t first_pn = (idx - BTREE_ROW_START_INDEX(order)) << order;
+        if (first_pn + (1UL << order) > max_pages)
+        {
+            break;
+        }
+
+        // already free as a whole (possibly as part of a larger block)
+        uintptr_t ancestor = idx;
+        while (ancestor && !BTREE_IS_AVAILABLE(ancestor))
+        {
+            ancestor = BTREE_PARENT(ancestor);
+        }
+        if (BTREE_IS_AVAILABLE(ancestor))
+        {
+            best = (void *)((uintptr_t)PN_TO_ADDR(first_pn) + PHYS_OFFSET);
+            best_movable = 0;
+            break;
+        }
+
+        size_t free = _btree_count_free_below(idx, order);
+        size_t movable = 0;
+        for (uintptr_t pn = first_pn; pn < first_pn + (1UL << order); pn++)
+        {
+            movable += !!PAGE_IS_MOVABLE(pn);
+        }
+
+        // anything else in the block is pinned kernel memory or a hole
+        if (free + movable == (1UL << order) && (!best || free > best_free))
+        {
+            best = (void *)((uintptr_t)PN_TO_ADDR(first_pn) + PHYS_OFFSET);
+            best_free = free;
+            best_movable = movable;
+        }
+    }
+
+    _page_unlock(enabled);
+    *nmovable = best_movable;
+    return best;
+}
+
+size_t page_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+
+    uint64_t enabled = _page_lock();
+    size_t free = page_freecount;
+    size_t below = 0;
+    iprintf(&buf, &size, "%5s %10s %10s %10s\n", "ORDER", "BLOCKS", "PAGES",
+            "UNUSABLE");
+    for (size_t order = 0; order <= max_order; order++)
+    {
+        // the unusable index of an order is the share of free memory that
+        // sits in blocks too small to satisfy a request of that order
+        size_t pages = count_available_by_order[order] << order;
+        iprintf(&buf, &size, "%5lu %10lu %10lu %9lu%%\n", order,
+                count_available_by_order[order], pages,
+                free ? below * 100 / free : 0);
+        below += pages;
+    }
+    iprintf(&buf, &size, "free pages:      %lu (+%lu on per-core lists)\n",
+            free, page_free_count() - free);
+    iprintf(&buf, &size, "movable pages:   %lu\n", movable_count);
+    iprintf(&buf, &size, "cascaded order:  %lu (smaller free blocks may not "
+                         "be merged yet)\n",
+            cascaded_order);
+    _page_unlock(enabled);
+    return size;
+}
@@ -3,10 +3,17 @@
 #include "kernel.h"
 #include "types.h"
 
+#include "api/access.h"
+
+#include "main/apic.h"
+#include "main/cpuid.h"
+
 #include "mm/mm.h"
 #include "mm/pframe.h"
 #include "mm/mobj.h"
+#include "mm/tlb.h"
 
+#include "util/btree.h"
 #include "util/debug.h"
 #include "util/string.h"
 
@@ -22,10 +29,197 @@ typedef enum
 
 static pml4_t *global_kernel_only_pml4;
 
+/*
+ * Process-context identifiers.
+ *
+ * Without PCIDs every CR3 load throws away the whole TLB, so each context
+ * switch starts the next process cold. With CR4.PCIDE set, TLB entries are
+ * tagged with the PCID in the low 12 bits of CR3, and a load with
+ * CR3_NOFLUSH set keeps them, so a process that was switched out recently
+ * comes back with its translations still cached.
+ *
+ * Each core keeps PT_PCID_SLOTS page tables it has recently run, slot i
+ * being PCID i + 1 (0 is left for tables that never had one). Every pt_set()
+ * bumps the core's generation and stamps the slot it uses; a table without a
+ * slot takes the one with the oldest stamp, and its first load is a flushing
+ * one so the previous owner's entries go away.
+ *
+ * Cached entries belong to a pml4, not to whatever is running, so anything
+ * that removes or changes a translation in a pml4 other than the current one
+ * has to deal with them too (_pt_tlb_invalidate()): on this core the stale
+ * pages are dropped with INVPCID where available, and any other slot holding
+ * the pml4 is marked stale in its core's pc_stale so that its next load
+ * flushes. Only the owning core touches its slots; other cores only set
+ * pc_stale bits, which the owner consumes in _pt_pcid_assign(). Cores that
+ * have the pml4 loaded right now get a shootdown (see mm/tlb.c). pt_destroy()
+ * marks the slots of the table it frees, as the page may come back as another
+ * pml4.
+ *
+ * Ordering: pt_set() publishes the table it is about to load (tlb_activate())
+ * before it looks at pc_stale, and invalidators mark slots before they look at
+ * which tables are active. So either the invalidator sees the table as active
+ * and shoots the core down, or the core sees the stale mark and flushes.
+ */
+#define CR3_NOFLUSH (1UL << 63)
+#define CR4_PCIDE (1UL << 17)
+#define CR0_WP (1UL << 16)
+#define PT_PCID_SLOTS 8
+#define PT_INVPCID_MAX 32 /* pages worth invalidating one by one */
+
+typedef struct pt_pcid_slot
+{
+    pml4_t *ps_pml4;
+    uint64_t ps_used;
+} pt_pcid_slot_t;
+
+typedef struct pt_pcid_core
+{
+    uint64_t pc_gen;
+    pt_pcid_slot_t pc_slots[PT_PCID_SLOTS];
+    uint64_t pc_stale; /* bit i: slot i must flush on its next load; set by
+                          any core, cleared only by the owner */
+} pt_pcid_core_t;
+
+static pt_pcid_core_t pt_pcids[MAX_LAPICS];
+static long pt_pcid_enabled;
+static long pt_invpcid_enabled;
+
+/*
+ * Per-core paging setup: make supervisor writes respect read-only pages
+ * (CR0.WP), which the direct user copies in api/access.c rely on to catch
+ * copy-on-write pages, and turn on PCIDs if the CPU has them.
+ */
+void pt_core_init()
+{
+    uintptr_t cr0;
+    __asm__ volatile("movq %%cr0, %0"
+                     : "=r"(cr0));
+    __asm__ volatile("movq %0, %%cr0" ::"r"(cr0 | CR0_WP)
+                     : "memory");
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & CPUID_FEAT_ECX_PCID))
+    {
+        dbg(DBG_PGTBL, "no PCID support, flushing the TLB on every switch\n");
+        return;
+    }
+    cpuid_subleaf(CPUID_GETEXTFEATURES, 0, &eax, &ebx, &ecx, &edx);
+    pt_invpcid_enabled = !!(ebx & CPUID_EXTFEAT_EBX_INVPCID);
+
+    // PCIDE can only be turned on while CR3 holds PCID 0
+    KASSERT(pt_pcids[curcore.kc_id].pc_gen == 0);
+    uintptr_t cr4;
+    __asm__ volatile("movq %%cr4, %0"
+                     : "=r"(cr4));
+    __asm__ volatile("movq %0, %%cr4" ::"r"(cr4 | CR4_PCIDE)
+                     : "memory");
+    pt_pcid_enabled = 1;
+    dbg(DBG_PGTBL, "C%ld: PCIDs enabled (INVPCID: %ld)\n", curcore.kc_id,
+        pt_invpcid_enabled);
+}
+
+/* Returns the PCID bits to load CR3 with for pml4 on this core. */
+static uintptr_t _pt_pcid_assign(pml4_t *pml4)
+{
+    pt_pcid_core_t *pc = &pt_pcids[curcore.kc_id];
+    pt_pcid_slot_t *victim = &pc->pc_slots[0];
+    pc->pc_gen++;
+    for (uintptr_t i = 0; i < PT_PCID_SLOTS; i++)
+    {
+        pt_pcid_slot_t *slot = &pc->pc_slots[i];
+        if (slot->ps_pml4 == pml4)
+        {
+            slot->ps_used = pc->pc_gen;
+            uint64_t stale = __atomic_fetch_and(&pc->pc_stale, ~(1UL << i),
+                                                __ATOMIC_SEQ_CST);
+            // reloading the current table is how callers ask for a flush
+            if ((stale & (1UL << i)) || pml4 == pt_get())
+            {
+                return i + 1;
+            }
+            return (i + 1) | CR3_NOFLUSH;
+        }
+        if (slot->ps_used < victim->ps_used)
+        {
+            victim = slot;
+        }
+    }
+    // this load flushes anyway
+    uintptr_t i = (uintptr_t)(victim - pc->pc_slots);
+    __atomic_fetch_and(&pc->pc_stale, ~(1UL << i), __ATOMIC_SEQ_CST);
+    __atomic_store_n(&victim->ps_pml4, pml4, __ATOMIC_RELAXED);
+    victim->ps_used = pc->pc_gen;
+    return i + 1;
+}
+
+static void _pt_invpcid_page(uintptr_t pcid, uintptr_t vaddr)
+{
+    struct
+    {
+        uint64_t pcid;
+        uint64_t addr;
+    } desc = {pcid, vaddr};
+    __asm__ volatile("invpcid %0, %1" ::"m"(desc), "r"(0UL)
+                     : "memory");
+}
+
+/*
+ * Gets rid of cached translations for [vaddr, vmax) in pml4 that the caller
+ * cannot flush itself, i.e. everything except the current table on this core
+ * (callers already flush that with tlb_flush() or tlb_flush_all()).
+ */
+static void _pt_tlb_invalidate(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
+{
+    // slots are marked before the shootdown looks at the active tables; see
+    // the ordering note above
+    if (pt_pcid_enabled)
+    {
+        long targeted = pt_invpcid_enabled &&
+                        (vmax - vaddr) / PAGE_SIZE <= PT_INVPCID_MAX;
+        pml4_t *current = pt_get();
+        for (long core = 0; core < MAX_LAPICS; core++)
+        {
+            pt_pcid_core_t *pc = &pt_pcids[core];
+            for (uintptr_t i = 0; i < PT_PCID_SLOTS; i++)
+            {
+                if (__atomic_load_n(&pc->pc_slots[i].ps_pml4,
+                                    __ATOMIC_RELAXED) != pml4 ||
+                    (core == curcore.kc_id && pml4 == current))
+                {
+                    continue;
+                }
+                if (core == curcore.kc_id && targeted)
+                {
+                    for (uintptr_t addr = vaddr; addr < vmax;
+                         addr += PAGE_SIZE)
+                    {
+                        _pt_invpcid_page(i + 1, addr);
+                    }
+                    continue;
+                }
+                // the next load of this table flushes instead
+                __atomic_fetch_or(&pc->pc_stale, 1UL << i, __ATOMIC_SEQ_CST);
+            }
+        }
+    }
+    tlb_shootdown(pml4, vaddr, vmax);
+}
+
 void pt_set(pml4_t *pml4)
 {
     KASSERT((void *)pml4 >= physmap_start());
     uintptr_t phys_addr = pt_virt_to_phys((uintptr_t)pml4);
+    // published before the slot is picked, so that an invalidator either sees
+    // pml4 as active here or has already marked the slot stale. Until the
+    // load below, shootdowns for the old table may miss this core; nothing
+    // in between touches user memory.
+    tlb_activate(pml4);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (pt_pcid_enabled)
+    {
+        phys_addr |= _pt_pcid_assign(pml4);
+    }
     __asm__ volatile("movq %0, %%cr3" ::"r"(phys_addr)
                      : "memory");
 }
@@ -41,7 +235,8 @@ inline pml4_t *pt_get()
     uintptr_t pml4;
     __asm__ volatile("movq %%cr3, %0"
                      : "=r"(pml4));
-    return (pml4_t *)(pml4 + PHYS_OFFSET);
+    // the low bits hold the PCID
+    return (pml4_t *)((pml4 & PAGE_MASK) + PHYS_OFFSET);
 }
 
 vaddr_map_status _vaddr_status(pml4_t *pml4, uintptr_t vaddr)
@@ -89,6 +284,11 @@ vaddr_map_status _vaddr_status(pml4_t *pml4, uintptr_t vaddr)
     return PAGE_4KB;
 }
 
+long pt_is_mapped(pml4_t *pml4, uintptr_t vaddr)
+{
+    return _vaddr_status(pml4, vaddr) != UNMAPPED;
+}
+
 uintptr_t pt_virt_to_phys_helper(pml4_t *table, uintptr_t vaddr)
 {
     if (vaddr >= (uintptr_t)physmap_start() &&
@@ -238,6 +438,164 @@ long _fill_pml4(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr, uintptr_t vmax,
     return 0;
 }
 
+/*
+ * Copy-on-write sharing of user page tables.
+ *
+ * pt_share_user() lets a second pml4 point at the same PDPs as the first
+ * instead of copying the hierarchy below them, and clears PT_WRITE in both
+ * pml4s' entries so the MMU faults on any write through them. Sharing touches
+ * at most one entry per 512GB of user address space, independent of how much
+ * is mapped.
+ *
+ * Anything that modifies a table (pt_map_range(), pt_unmap_range()) first
+ * takes ownership of it with _pt_own_entry(). A table that is still shared is
+ * copied, and the copy's entries are write-protected in turn while taking a
+ * reference on each table below, so sharing moves one level down rather than
+ * being undone for the whole subtree. A write fault therefore copies at most
+ * one table per level on the path to the faulting address.
+ *
+ * Tables with more than one reference are kept in pt_shared_tables, keyed by
+ * page number, with the number of extra references as the value. Exclusively
+ * owned tables have no entry, so address spaces that never share pay only a
+ * failed lookup of an empty tree.
+ */
+static btree_node_t *pt_shared_tables;
+
+static uintptr_t _pt_table_sharers(uintptr_t entry)
+{
+    return (uintptr_t)btree_search(pt_shared_tables,
+                                   ADDR_TO_PN(entry & PAGE_MASK));
+}
+
+static void _pt_table_ref(uintptr_t entry)
+{
+    uint64_t pn = ADDR_TO_PN(entry & PAGE_MASK);
+    uintptr_t extra = (uintptr_t)btree_search(pt_shared_tables, pn);
+    if (extra)
+    {
+        btree_delete(&pt_shared_tables, pn);
+    }
+    btree_insert(&pt_shared_tables, pn, (void *)(extra + 1));
+}
+
+/* Drops a reference to a table, returning 1 if it was the last one. */
+static long _pt_table_unref(uintptr_t entry)
+{
+    uint64_t pn = ADDR_TO_PN(entry & PAGE_MASK);
+    uintptr_t extra = (uintptr_t)btree_search(pt_shared_tables, pn);
+    if (!extra)
+    {
+        return 1;
+    }
+    btree_delete(&pt_shared_tables, pn);
+    if (extra > 1)
+    {
+        btree_insert(&pt_shared_tables, pn, (void *)(extra - 1));
+    }
+    return 0;
+}
+
+/*
+ * Makes the table that *entry points to safe to modify, copying it if other
+ * page tables still share it. depth is that of the table (3 = pdp, 2 = pd,
+ * 1 = pt). Returns 0 on success or -ENOMEM.
+ */
+static long _pt_own_entry(uintptr_t *entry, long depth)
+{
+    if (*entry & PT_WRITE)
+    {
+        return 0;
+    }
+    pt_t *table = (pt_t *)((*entry & PAGE_MASK) + PHYS_OFFSET);
+    if (_pt_table_sharers(*entry))
+    {
+        pt_t *copy = page_alloc();
+        if (!copy)
+        {
+            return -ENOMEM;
+        }
+        memcpy(copy, table, PAGE_SIZE);
+        _pt_table_unref(*entry);
+        *entry = ((uintptr_t)copy - PHYS_OFFSET) | PAGE_FLAGS(*entry);
+        table = copy;
+        for (unsigned i = 0; depth > 1 && i < PT_ENTRY_COUNT; i++)
+        {
+            if (IS_PRESENT(table->phys[i]) && !IS_2MB_PAGE(table->phys[i]))
+            {
+                _pt_table_ref(table->phys[i]);
+            }
+        }
+    }
+
+    // the write protection that covered this table now has to cover
+    // everything below it
+    for (unsigned i = 0; i < PT_ENTRY_COUNT; i++)
+    {
+        table->phys[i] &= ~(uintptr_t)PT_WRITE;
+    }
+    *entry |= PT_WRITE;
+    return 0;
+}
+
+/*
+ * If *entry points to a shared table and the unmap covers everything the
+ * table maps (span bytes starting at vaddr), drops this page table's
+ * reference to it instead of copying it just to clear it. Returns 1 if the
+ * entry was cleared.
+ */
+static long _pt_unmap_shared(uintptr_t *entry, uintptr_t vaddr, uint64_t size,
+                             uintptr_t span)
+{
+    if ((vaddr & (span - 1)) || size < span || !_pt_table_sharers(*entry))
+    {
+        return 0;
+    }
+    _pt_table_unref(*entry);
+    *entry = 0;
+    return 1;
+}
+
+/*
+ * Called when the unmap needs its own copy of a shared table but there is no
+ * memory for one: drops this page table's reference to the table instead,
+ * which unmaps all span bytes it maps around vaddr, not just those asked for.
+ * That is harmless, as the extra pages simply refault. Widens [*lo, *hi) to
+ * cover them and returns the address just past them.
+ */
+static uintptr_t _pt_unmap_drop(uintptr_t *entry, uintptr_t vaddr,
+                                uintptr_t span, uintptr_t *lo, uintptr_t *hi)
+{
+    uintptr_t base = vaddr & ~(span - 1);
+    dbg(DBG_PGTBL, "out of memory, dropping shared table for [0x%p, 0x%p)\n",
+        (void *)base, (void *)(base + span));
+    _pt_table_unref(*entry);
+    *entry = 0;
+    *lo = MIN(*lo, base);
+    *hi = MAX(*hi, base + span);
+    return base + span;
+}
+
+void pt_share_user(pml4_t *src, pml4_t *dst)
+{
+    for (uintptr_t i = 0; i < PT_ENTRY_COUNT / 2; i++)
+    {
+        if (!IS_PRESENT(src->phys[i]))
+        {
+            continue;
+        }
+        KASSERT(!IS_PRESENT(dst->phys[i]));
+        src->phys[i] &= ~(uintptr_t)PT_WRITE;
+        dst->phys[i] = src->phys[i];
+        _pt_table_ref(src->phys[i]);
+    }
+    dbg(DBG_PGTBL, "sharing user page tables of 0x%p with 0x%p\n", src, dst);
+    _pt_tlb_invalidate(src, USER_MEM_LOW, USER_MEM_HIGH);
+    if (src == pt_get())
+    {
+        tlb_flush_all();
+    }
+}
+
 long pt_map(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr, uint32_t pdflags,
             uint32_t ptflags)
 {
@@ -277,6 +635,10 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
         }
         else
         {
+            if (_pt_own_entry(&table->phys[idx], 3))
+            {
+                return -ENOMEM;
+            }
             // can't split up if control flags don't match, so liberally include
             // all of them
             table->phys[idx] |= pdflags;
@@ -330,6 +692,10 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
         }
         else
         {
+            if (_pt_own_entry(&table->phys[idx], 2))
+            {
+                return -ENOMEM;
+            }
             table->phys[idx] |= pdflags;
         }
         table = (pd_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
@@ -379,6 +745,10 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
         }
         else
         {
+            if (_pt_own_entry(&table->phys[idx], 1))
+            {
+                return -ENOMEM;
+            }
             table->phys[idx] |= pdflags;
         }
         table = (pt_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
@@ -386,7 +756,12 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
         // PT (4KB pages)
 
         idx = PTE(vaddr);
+        uintptr_t old = table->phys[idx] & ~(uintptr_t)(PT_ACCESSED | PT_DIRTY);
         table->phys[idx] = (uintptr_t)paddr | ptflags;
+        if (IS_PRESENT(old) && old != table->phys[idx])
+        {
+            _pt_tlb_invalidate(pml4, vaddr, vaddr + PAGE_SIZE);
+        }
 
         KASSERT(IS_PRESENT(table->phys[idx]));
 
@@ -406,10 +781,17 @@ static long _pt_fault_handler(regs_t *regs)
     uintptr_t cause = regs->r_err;
 
     /* Check if pagefault was in user space (otherwise, BAD!) */
+    uintptr_t fixup;
     if (cause & FAULT_USER)
     {
         handle_pagefault(vaddr, cause);
     }
+    else if (vaddr < USER_MEM_HIGH && (fixup = user_access_fixup(regs->r_rip)))
+    {
+        // a direct copy to or from user memory ran into a page that is not
+        // mapped (writable); copy_to_user()/copy_from_user() take it from here
+        regs->r_rip = fixup;
+    }
     else
     {
         dump_registers(regs);
@@ -548,7 +930,7 @@ pml4_t *clone_pml4(pml4_t *pml4, long include_user_mappings)
     }
     dbg(DBG_PGTBL, "克隆页映射4级表(PML4): 源地址=0x%p, 目标地址=0x%p\n", pml4, clone);
     memset(clone, 0, PAGE_SIZE);
-    for (uintptr_t i = include_user_mappings ? 0 : PT_ENTRY_COUNT / 2; i < PT_ENTRY_COUNT; i++) {
+    for (uintptr_t i = PT_ENTRY_COUNT / 2; i < PT_ENTRY_COUNT; i++) {
         if (pml4->phys[i]) {
             dbg(DBG_PGTBL, "克隆页映射4级表(PML4)项[%lu]: 开始克隆子页目录指针\n", i);
             pdp_t *cloned_pdp = clone_pdp((pdp_t *)((pml4->phys[i] & PAGE_MASK) + PHYS_OFFSET));
@@ -563,6 +945,10 @@ pml4_t *clone_pml4(pml4_t *pml4, long include_user_mappings)
             clone->phys[i] = 0;
         }
     }
+    // user mappings are shared copy-on-write rather than copied
+    if (include_user_mappings) {
+        pt_share_user(pml4, clone);
+    }
     dbg(DBG_PGTBL, "克隆页映射4级表(PML4)完成\n");
     return clone;
 }
@@ -581,15 +967,111 @@ void pt_destroy_helper(pt_t *pt, long depth)
                 continue;
             }
             KASSERT(IS_PRESENT(pt->phys[i]) && (pt->phys[i] & PAGE_MASK));
-            pt_destroy_helper((pt_t *)((pt->phys[i] & PAGE_MASK) + PHYS_OFFSET),
-                              depth - 1);
+            // tables shared with another page table stay with it
+            if (_pt_table_unref(pt->phys[i]))
+            {
+                pt_destroy_helper(
+                    (pt_t *)((pt->phys[i] & PAGE_MASK) + PHYS_OFFSET),
+                    depth - 1);
+            }
             pt->phys[i] = 0;
         }
     }
     page_free(pt);
 }
 
-void pt_destroy(pml4_t *pml4) { pt_destroy_helper(pml4, 4); }
+void pt_destroy(pml4_t *pml4)
+{
+    // the page may come back as another pml4; don't let it inherit a PCID
+    _pt_tlb_invalidate(pml4, USER_MEM_LOW, USER_MEM_HIGH);
+    pt_destroy_helper(pml4, 4);
+}
+
+static long _pt_table_empty(pt_t *pt)
+{
+    for (uintptr_t i = 0; i < PT_ENTRY_COUNT; i++)
+    {
+        if (pt->phys[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Frees the tables below table (of the given depth, mapping addresses from
+ * base) that overlap [vaddr, vmax) and no longer map anything, working up so
+ * that a directory emptied by freeing its last table goes too. Tables still
+ * shared with another page table are left alone. Returns the number of pages
+ * freed.
+ */
+static size_t _pt_reclaim(pt_t *table, long depth, uintptr_t base,
+                          uintptr_t vaddr, uintptr_t vmax)
+{
+    // 4 = pml4, 3 = pdp, 2 = pd, 1 = pt
+    size_t shift = PAGE_SHIFT + 9 * (depth - 1);
+    uintptr_t first = (vaddr - base) >> shift;
+    uintptr_t last = MIN((vmax - 1 - base) >> shift, PT_ENTRY_COUNT - 1);
+    size_t freed = 0;
+    for (uintptr_t idx = first; idx <= last; idx++)
+    {
+        uintptr_t entry = table->phys[idx];
+        if (!IS_PRESENT(entry) || (depth < 4 && IS_2MB_PAGE(entry)) ||
+            _pt_table_sharers(entry))
+        {
+            continue;
+        }
+        pt_t *child = (pt_t *)((entry & PAGE_MASK) + PHYS_OFFSET);
+        if (depth > 2)
+        {
+            uintptr_t child_base = base + (idx << shift);
+            freed += _pt_reclaim(child, depth - 1, child_base,
+                                 MAX(vaddr, child_base),
+                                 MIN(vmax, child_base + (1UL << shift)));
+        }
+        if (_pt_table_empty(child))
+        {
+            table->phys[idx] = 0;
+            page_free(child);
+            freed++;
+        }
+    }
+    return freed;
+}
+
+size_t pt_table_pages(pml4_t *pml4, size_t *shared)
+{
+    size_t pages = 0;
+    *shared = 0;
+    // depth-first over the user half, with an explicit stack of tables
+    pt_t *tables[4] = {pml4};
+    uintptr_t next[4] = {0};
+    long in_shared[4] = {0};
+    long depth = 0;
+    while (depth >= 0)
+    {
+        uintptr_t limit = depth ? PT_ENTRY_COUNT : PT_ENTRY_COUNT / 2;
+        if (depth == 3 || next[depth] >= limit)
+        {
+            depth--;
+            continue;
+        }
+        uintptr_t entry = tables[depth]->phys[next[depth]++];
+        if (!IS_PRESENT(entry) || (depth && IS_2MB_PAGE(entry)))
+        {
+            continue;
+        }
+        long sharing = in_shared[depth] || _pt_table_sharers(entry);
+        pages++;
+        *shared += sharing;
+        depth++;
+        tables[depth] = (pt_t *)((entry & PAGE_MASK) + PHYS_OFFSET);
+        next[depth] = 0;
+        in_shared[depth] = sharing;
+    }
+    return pages;
+}
 
 void pt_unmap(pml4_t *pml4, uintptr_t vaddr)
 {
@@ -598,13 +1080,18 @@ void pt_unmap(pml4_t *pml4, uintptr_t vaddr)
 
 void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
 {
-    // TODO reclaim pages on-the-fly?
+    // Shared tables wholly inside the range are dropped rather than copied,
+    // so unmapping all of a forked address space (e.g. in exec) is cheap.
+    // Tables left empty are freed afterwards by _pt_reclaim(). Unmapping never
+    // fails for lack of memory: swap and compaction unmap exactly when memory
+    // is short, so a shared table that cannot be copied is dropped whole.
 
     dbg(DBG_PGTBL, "virt[0x%p, 0x%p); pml4: 0x%p\n", (void *)vaddr,
         (void *)vmax, pml4);
     KASSERT(PAGE_ALIGNED(vaddr) && PAGE_ALIGNED(vmax) && vmax > vaddr);
 
     uintptr_t vaddr_start = vaddr;
+    uintptr_t flush_lo = vaddr, flush_hi = vmax;
 
     while (vaddr < vmax)
     {
@@ -618,6 +1105,17 @@ void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
             vaddr = PAGE_ALIGN_UP_512GB(vaddr + 1);
             continue;
         }
+        if (_pt_unmap_shared(&table->phys[idx], vaddr, size, PAGE_SIZE_512GB))
+        {
+            vaddr += PAGE_SIZE_512GB;
+            continue;
+        }
+        if (_pt_own_entry(&table->phys[idx], 3))
+        {
+            vaddr = _pt_unmap_drop(&table->phys[idx], vaddr, PAGE_SIZE_512GB, &flush_lo,
+                                   &flush_hi);
+            continue;
+        }
         table = (pdp_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
 
         // PDP (1GB pages)
@@ -667,6 +1165,17 @@ void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
             }
             continue;
         }
+        if (_pt_unmap_shared(&table->phys[idx], vaddr, size, PAGE_SIZE_1GB))
+        {
+            vaddr += PAGE_SIZE_1GB;
+            continue;
+        }
+        if (_pt_own_entry(&table->phys[idx], 2))
+        {
+            vaddr = _pt_unmap_drop(&table->phys[idx], vaddr, PAGE_SIZE_1GB, &flush_lo,
+                                   &flush_hi);
+            continue;
+        }
         table = (pd_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
 
         // PD (2MB pages)
@@ -714,6 +1223,17 @@ void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
             }
             continue;
         }
+        if (_pt_unmap_shared(&table->phys[idx], vaddr, size, PAGE_SIZE_2MB))
+        {
+            vaddr += PAGE_SIZE_2MB;
+            continue;
+        }
+        if (_pt_own_entry(&table->phys[idx], 1))
+        {
+            vaddr = _pt_unmap_drop(&table->phys[idx], vaddr, PAGE_SIZE_2MB, &flush_lo,
+                                   &flush_hi);
+            continue;
+        }
         table = (pt_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
 
         // PT (4KB pages)
@@ -728,6 +1248,21 @@ void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
         vaddr += PAGE_SIZE;
     }
     KASSERT(_vaddr_status(pml4, vaddr_start) == UNMAPPED);
+    _pt_tlb_invalidate(pml4, flush_lo, flush_hi);
+    if ((flush_lo != vaddr_start || flush_hi != vmax) && pml4 == pt_get())
+    {
+        // the caller only flushes what it asked to unmap
+        tlb_flush_all();
+    }
+
+    // only now that no TLB can still walk through them
+    if (PML4E(vaddr_start) < PT_ENTRY_COUNT / 2 &&
+        _pt_reclaim(pml4, 4, 0, vaddr_start, MIN(vmax, USER_MEM_HIGH)) &&
+        pml4 == pt_get())
+    {
+        // also drops this PCID's cached pointers into the freed tables
+        tlb_flush(vaddr_start);
+    }
 }
 
 static char *entry_strings[] = {
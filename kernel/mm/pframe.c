@@ -1,17 +1,44 @@
+#include "errno.h"
 #include "globals.h"
 
+#include "mm/mobj.h"
+#include "mm/page.h"
 #include "mm/pframe.h"
 #include "mm/slab.h"
+#include "mm/swap.h"
 
+#include "util/btree.h"
 #include "util/debug.h"
+#include "util/printf.h"
 #include "util/string.h"
 
 static slab_allocator_t *pframe_allocator;
 
+list_t pframe_resident_list = LIST_INITIALIZER(pframe_resident_list);
+static spinlock_t pframe_resident_lock = SPINLOCK_INITIALIZER(pframe_resident_lock);
+
+/*
+ * The pframes on pframe_resident_list, keyed by the page number of their
+ * pf_addr, so that compaction can go from a page to its owner without walking
+ * the list. Protected by pframe_resident_lock.
+ */
+static btree_node_t *pframe_resident_pages;
+
+/*
+ * A page of zeros shared, read-only, by every pframe of untouched anonymous
+ * memory. See pframe_map_zero_page().
+ */
+static void *pframe_zero_page;
+static size_t pframe_zero_shared;
+static size_t pframe_zero_breaks;
+
 void pframe_init()
 {
     pframe_allocator = slab_allocator_create("pframe", sizeof(pframe_t));
     KASSERT(pframe_allocator);
+    pframe_zero_page = page_alloc();
+    KASSERT(pframe_zero_page);
+    memset(pframe_zero_page, 0, PAGE_SIZE);
 }
 
 /*
@@ -27,6 +54,7 @@ pframe_t *pframe_create()
     memset(pf, 0, sizeof(pframe_t));
     kmutex_init(&pf->pf_mutex);
     list_link_init(&pf->pf_link);
+    list_link_init(&pf->pf_resident_link);
     return pf;
 }
 
@@ -42,6 +70,8 @@ void pframe_free(pframe_t **pfp)
     KASSERT(!(*pfp)->pf_addr);
     KASSERT(!(*pfp)->pf_dirty);
     KASSERT(!list_link_is_linked(&(*pfp)->pf_link));
+    KASSERT(!list_link_is_linked(&(*pfp)->pf_resident_link));
+    KASSERT(!(*pfp)->pf_swap);
     kmutex_unlock(&(*pfp)->pf_mutex);
     slab_obj_free(pframe_allocator, *pfp);
     *pfp = NULL;
@@ -57,3 +87,187 @@ void pframe_release(pframe_t **pfp)
     *pfp = NULL;
     kmutex_unlock(&pf->pf_mutex);
 }
+
+/*
+ * Allocate the physical page holding pf's contents. The page comes from the
+ * movable part of physical memory and pf is put on pframe_resident_list so
+ * that compaction can find it and move it elsewhere.
+ *
+ * If memory is short, anonymous pages are pushed out to swap to make room.
+ *
+ * The pframe must be locked. Returns 0 on success or -ENOMEM.
+ */
+long pframe_alloc_page(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(!pf->pf_addr);
+    pf->pf_addr = page_alloc_movable();
+    if (!pf->pf_addr && swap_reclaim(SWAP_CLUSTER))
+    {
+        pf->pf_addr = page_alloc_movable();
+    }
+    if (!pf->pf_addr)
+    {
+        return -ENOMEM;
+    }
+    spinlock_lock(&pframe_resident_lock);
+    list_insert_tail(&pframe_resident_list, &pf->pf_resident_link);
+    btree_insert(&pframe_resident_pages, ADDR_TO_PN(pf->pf_addr), pf);
+    spinlock_unlock(&pframe_resident_lock);
+    return 0;
+}
+
+/*
+ * Free the physical page holding pf's contents and set pf->pf_addr = NULL.
+ *
+ * The pframe must be locked.
+ */
+void pframe_free_page(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(pf->pf_addr);
+    if (pframe_is_zero_page(pf))
+    {
+        pframe_zero_shared--;
+        pf->pf_addr = NULL;
+        return;
+    }
+    if (list_link_is_linked(&pf->pf_resident_link))
+    {
+        spinlock_lock(&pframe_resident_lock);
+        list_remove(&pf->pf_resident_link);
+        btree_delete(&pframe_resident_pages, ADDR_TO_PN(pf->pf_addr));
+        spinlock_unlock(&pframe_resident_lock);
+    }
+    page_free(pf->pf_addr);
+    pf->pf_addr = NULL;
+}
+
+/*
+ * Give pf the shared zero page as its contents instead of a page of its own.
+ * The page must never be written to: it may only be mapped read-only, and the
+ * pframe must go through pframe_unshare_zero_page() before it is modified.
+ *
+ * The pframe must be locked and have no page.
+ */
+void pframe_map_zero_page(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(!pf->pf_addr && !pf->pf_dirty);
+    pf->pf_addr = pframe_zero_page;
+    pframe_zero_shared++;
+}
+
+long pframe_is_zero_page(pframe_t *pf)
+{
+    return pf->pf_addr == pframe_zero_page;
+}
+
+/*
+ * Replace the shared zero page of pf with a zeroed page of its own, so that
+ * it can be written to. The caller must make sure that nothing maps the zero
+ * page on pf's behalf anymore.
+ *
+ * The pframe must be locked. Returns 0 on success or -ENOMEM.
+ */
+long pframe_unshare_zero_page(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(pframe_is_zero_page(pf));
+    pf->pf_addr = NULL;
+    long ret = pframe_alloc_page(pf);
+    if (ret)
+    {
+        pf->pf_addr = pframe_zero_page;
+        return ret;
+    }
+    memset(pf->pf_addr, 0, PAGE_SIZE);
+    pframe_zero_shared--;
+    pframe_zero_breaks++;
+    return 0;
+}
+
+size_t pframe_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+    iprintf(&buf, &size, "zero page sharers:   %lu (%lu KiB saved)\n",
+            pframe_zero_shared, pframe_zero_shared * (PAGE_SIZE >> 10));
+    iprintf(&buf, &size, "zero page COW breaks: %lu\n", pframe_zero_breaks);
+    return size;
+}
+
+/*
+ * Copy pf's contents into page, which must come from page_alloc_movable(),
+ * and free the page that held them. Nothing else may be using the old page;
+ * in particular it must no longer be mapped into any user address space.
+ *
+ * The pframe must be locked.
+ */
+void pframe_move_page(pframe_t *pf, void *page)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(pf->pf_addr && page_is_movable(page));
+    KASSERT(list_link_is_linked(&pf->pf_resident_link));
+    memcpy(page, pf->pf_addr, PAGE_SIZE);
+    spinlock_lock(&pframe_resident_lock);
+    btree_delete(&pframe_resident_pages, ADDR_TO_PN(pf->pf_addr));
+    btree_insert(&pframe_resident_pages, ADDR_TO_PN(page), pf);
+    spinlock_unlock(&pframe_resident_lock);
+    page_free(pf->pf_addr);
+    pf->pf_addr = page;
+}
+
+/*
+ * Find the resident pframe whose contents are the page at addr. On success,
+ * take a reference on the memory object the pframe belongs to, store the
+ * pframe's page number in *pagenump, and return the object. Return NULL if
+ * there is no such pframe or its object is already being destroyed.
+ *
+ * The pframe itself is not locked, so the caller must look it up again with
+ * mobj_find_pframe() and check that it still holds addr.
+ */
+mobj_t *pframe_find_resident(void *addr, size_t *pagenump)
+{
+    mobj_t *o = NULL;
+    spinlock_lock(&pframe_resident_lock);
+    // pframes are removed under this lock before they (and their objects) can
+    // go away, so pf and pf->pf_obj are safe to look at here
+    pframe_t *pf = btree_search(pframe_resident_pages, ADDR_TO_PN(addr));
+    if (pf && pf->pf_obj && atomic_inc_not_zero(&pf->pf_obj->mo_refcount))
+    {
+        o = pf->pf_obj;
+        *pagenump = pf->pf_pagenum;
+    }
+    spinlock_unlock(&pframe_resident_lock);
+    return o;
+}
+
+/*
+ * Pick the resident pframe that has been in memory the longest as a candidate
+ * for reclaim and move it to the back of pframe_resident_list, so that
+ * repeated calls walk through all resident pframes. Returns the pframe's
+ * memory object with a new reference and stores the page number in
+ * *pagenump, or returns NULL if there is nothing to pick.
+ *
+ * As with pframe_find_resident(), the caller must look the pframe up again.
+ */
+mobj_t *pframe_next_victim(size_t *pagenump)
+{
+    mobj_t *o = NULL;
+    spinlock_lock(&pframe_resident_lock);
+    if (!list_empty(&pframe_resident_list))
+    {
+        pframe_t *pf = list_head(&pframe_resident_list, pframe_t,
+                                 pf_resident_link);
+        list_remove(&pf->pf_resident_link);
+        list_insert_tail(&pframe_resident_list, &pf->pf_resident_link);
+        if (pf->pf_obj && atomic_inc_not_zero(&pf->pf_obj->mo_refcount))
+        {
+            o = pf->pf_obj;
+            *pagenump = pf->pf_pagenum;
+        }
+    }
+    spinlock_unlock(&pframe_resident_lock);
+    return o;
+}
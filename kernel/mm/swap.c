@@ -0,0 +1,399 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+
+#include "main/interrupt.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/swap.h"
+
+#include "vm/vmmap.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+/*
+ * Swap.
+ *
+ * Anonymous and shadow objects have no file to write their pages back to, so
+ * when __NDISKS__ > 1 the last disk is used as a swap area instead. The disk is
+ * divided into page-sized slots, tracked by a bitmap. A pframe whose contents
+ * have been written to a slot remembers it in pf_swap.
+ *
+ * Pages leave memory through swap_reclaim(), which pframe_alloc_page() calls
+ * when it runs out of pages. It walks pframe_resident_list oldest first and,
+ * for each anonymous or shadow page it can lock without blocking and that no
+ * mlock()ed area maps:
+ *
+ *  - if the page is clean (never written, or unchanged since it was last read
+ *    back from swap) it is unmapped and dropped.
+ *  - if it is dirty, it is written to swap together with the dirty pages
+ *    that follow it in the object, up to SWAP_CLUSTER pages in one write to
+ *    consecutive slots, and then dropped.
+ *
+ * The pframe itself stays in its object with pf_addr == NULL. The next
+ * mobj_default_get_pframe() on it calls swap_in(), which reads back the rest of
+ * the cluster along with it. A page read back from swap keeps its slot until
+ * it is written to, so dropping it again costs no I/O.
+ */
+
+#ifndef __SWAP_BLOCKS__
+#define __SWAP_BLOCKS__ 16384
+#endif
+
+#define SWAP_SLOT_WORD(slot) ((slot) / 64)
+#define SWAP_SLOT_MASK(slot) (1UL << ((slot) % 64))
+#define SWAP_SLOT_USED(slot) \
+    (swap_map[SWAP_SLOT_WORD(slot)] & SWAP_SLOT_MASK(slot))
+
+/* Pages looked at by swap_reclaim() per page it is asked to free */
+#define SWAP_SCAN_RATIO 16
+
+static blockdev_t *swap_dev;
+static size_t swap_nslots;
+static uint64_t *swap_map;
+static size_t swap_used;
+static size_t swap_next; /* where to start looking for free slots */
+
+/* Protects the slot bitmap and the cluster buffer */
+static kmutex_t swap_mutex = KMUTEX_INITIALIZER(swap_mutex);
+static char *swap_buf;
+
+static long swap_reclaiming;
+
+static size_t swap_pages_out;
+static size_t swap_pages_in;
+static size_t swap_writes;
+static size_t swap_reads;
+static size_t swap_dropped;
+
+void swap_init()
+{
+#if __NDISKS__ > 1
+    swap_dev = blockdev_lookup(MKDEVID(DISK_MAJOR, __NDISKS__ - 1));
+    if (!swap_dev)
+    {
+        dbg(DBG_MM, "no disk %d, running without swap\n", __NDISKS__ - 1);
+        return;
+    }
+    // the disk driver does not know the size of the disk; ./weenix makes the
+    // swap image SWAP_BLOCKS blocks, from the same Config.mk setting
+    swap_nslots = __SWAP_BLOCKS__;
+    size_t map_size = (swap_nslots + 63) / 64 * sizeof(uint64_t);
+    swap_map = kmalloc(map_size);
+    swap_buf = page_alloc_n(SWAP_CLUSTER);
+    KASSERT(swap_map && swap_buf);
+    memset(swap_map, 0, map_size);
+    dbg(DBG_MM, "swapping to disk %d, %lu slots\n", __NDISKS__ - 1,
+        swap_nslots);
+#endif
+}
+
+/*
+ * Allocates n consecutive slots, or returns -ENOSPC. Allocation continues from
+ * where the last one left off, so clusters written one after the other also
+ * end up next to each other on disk.
+ */
+static ssize_t _swap_alloc_slots(size_t n)
+{
+    KASSERT(kmutex_owns_mutex(&swap_mutex));
+    size_t run = 0;
+    size_t slot = swap_next;
+    for (size_t scanned = 0; scanned < swap_nslots; scanned++, slot++)
+    {
+        if (slot == swap_nslots)
+        {
+            slot = 0;
+            run = 0;
+        }
+        if (SWAP_SLOT_USED(slot))
+        {
+            run = 0;
+            continue;
+        }
+        if (++run == n)
+        {
+            size_t start = slot + 1 - n;
+            for (slot = start; slot < start + n; slot++)
+            {
+                swap_map[SWAP_SLOT_WORD(slot)] |= SWAP_SLOT_MASK(slot);
+            }
+            swap_next = start + n;
+            swap_used += n;
+            return (ssize_t)start;
+        }
+    }
+    return -ENOSPC;
+}
+
+static void _swap_free_slot(size_t slot)
+{
+    KASSERT(kmutex_owns_mutex(&swap_mutex));
+    KASSERT(slot < swap_nslots && SWAP_SLOT_USED(slot));
+    swap_map[SWAP_SLOT_WORD(slot)] &= ~SWAP_SLOT_MASK(slot);
+    swap_used--;
+}
+
+/*
+ * Writes the n pages in pfs, which hold consecutive pages of o, to n
+ * consecutive slots with a single disk write. The pages are unmapped from user
+ * address spaces first, so that a later write through a mapping faults and
+ * marks the pframe dirty again.
+ *
+ * o, the pframes and swap_mutex must be locked.
+ */
+static long _swap_write(mobj_t *o, pframe_t **pfs, size_t n)
+{
+    ssize_t slot = _swap_alloc_slots(n);
+    if (slot < 0)
+    {
+        return slot;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        vmmap_unmap_mobj_page(o, pfs[i]->pf_pagenum);
+        memcpy(swap_buf + i * PAGE_SIZE, pfs[i]->pf_addr, PAGE_SIZE);
+    }
+    long ret = swap_dev->bd_ops->write_block(swap_dev, swap_buf,
+                                             (blocknum_t)slot, n);
+    if (ret)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            _swap_free_slot((size_t)slot + i);
+        }
+        return ret;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (pfs[i]->pf_swap)
+        {
+            _swap_free_slot(pfs[i]->pf_swap - 1);
+        }
+        pfs[i]->pf_swap = (size_t)slot + i + 1;
+    }
+    swap_pages_out += n;
+    swap_writes++;
+    return 0;
+}
+
+/*
+ * The flush_pframe operation of anonymous and shadow objects: write the page
+ * out to swap. Both o and pf must be locked.
+ */
+long swap_flush_pframe(mobj_t *o, pframe_t *pf)
+{
+    if (!swap_dev)
+    {
+        return -ENOSPC;
+    }
+    kmutex_lock(&swap_mutex);
+    long ret = _swap_write(o, &pf, 1);
+    kmutex_unlock(&swap_mutex);
+    return ret;
+}
+
+/*
+ * Read pf's contents back from its swap slot into pf->pf_addr. The pages of o
+ * right after pf that went out in the same cluster and are not resident are
+ * read in by the same disk operation.
+ *
+ * Both o and pf must be locked, and pf must already have a page.
+ */
+long swap_in(mobj_t *o, pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(swap_dev && pf->pf_swap && pf->pf_addr);
+
+    pframe_t *pfs[SWAP_CLUSTER] = {pf};
+    size_t n = 1;
+    while (n < SWAP_CLUSTER)
+    {
+        pframe_t *next = (pframe_t *)btree_search(o->mo_btree,
+                                                  pf->pf_pagenum + n);
+        if (!next || next->pf_swap != pf->pf_swap + n ||
+            !kmutex_trylock(&next->pf_mutex))
+        {
+            break;
+        }
+        if (next->pf_addr || pframe_alloc_page(next))
+        {
+            kmutex_unlock(&next->pf_mutex);
+            break;
+        }
+        pfs[n++] = next;
+    }
+
+    long ret;
+    blocknum_t slot = (blocknum_t)(pf->pf_swap - 1);
+    if (n == 1)
+    {
+        ret = swap_dev->bd_ops->read_block(swap_dev, pf->pf_addr, slot, 1);
+    }
+    else
+    {
+        kmutex_lock(&swap_mutex);
+        ret = swap_dev->bd_ops->read_block(swap_dev, swap_buf, slot, n);
+        for (size_t i = 0; !ret && i < n; i++)
+        {
+            memcpy(pfs[i]->pf_addr, swap_buf + i * PAGE_SIZE, PAGE_SIZE);
+        }
+        kmutex_unlock(&swap_mutex);
+    }
+    if (!ret)
+    {
+        swap_pages_in += n;
+        swap_reads++;
+    }
+
+    for (size_t i = 1; i < n; i++)
+    {
+        if (ret)
+        {
+            pframe_free_page(pfs[i]);
+        }
+        pframe_release(&pfs[i]);
+    }
+    return ret;
+}
+
+/*
+ * Give up pf's swap slot, if it has one. Called when the pframe is written to
+ * or freed, after which the copy in swap is of no use. pf must be locked.
+ */
+void swap_release(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    if (pf->pf_swap)
+    {
+        kmutex_lock(&swap_mutex);
+        _swap_free_slot(pf->pf_swap - 1);
+        kmutex_unlock(&swap_mutex);
+        pf->pf_swap = 0;
+    }
+}
+
+/*
+ * Drop page pagenum of o from memory, writing it to swap first if it is dirty.
+ * Dirty pages following it are written out in the same cluster. Returns the
+ * number of pages freed. o must be locked.
+ */
+static size_t _swap_reclaim_cluster(mobj_t *o, size_t pagenum)
+{
+    pframe_t *pfs[SWAP_CLUSTER];
+    size_t n = 0;
+    while (n < SWAP_CLUSTER)
+    {
+        pframe_t *pf = (pframe_t *)btree_search(o->mo_btree, pagenum + n);
+        if (!pf || vmmap_mobj_page_locked(o, pagenum + n) ||
+            !kmutex_trylock(&pf->pf_mutex))
+        {
+            break;
+        }
+        if (!pf->pf_addr || (n && (!pf->pf_dirty || !pfs[0]->pf_dirty)))
+        {
+            kmutex_unlock(&pf->pf_mutex);
+            break;
+        }
+        pfs[n++] = pf;
+    }
+    if (!n)
+    {
+        return 0;
+    }
+
+    long ret = 0;
+    if (pfs[0]->pf_dirty)
+    {
+        kmutex_lock(&swap_mutex);
+        ret = _swap_write(o, pfs, n);
+        kmutex_unlock(&swap_mutex);
+    }
+    else
+    {
+        // the page can be refilled as it is
+        vmmap_unmap_mobj_page(o, pagenum);
+        swap_dropped++;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!ret)
+        {
+            pfs[i]->pf_dirty = 0;
+            pframe_free_page(pfs[i]);
+        }
+        pframe_release(&pfs[i]);
+    }
+    return ret ? 0 : n;
+}
+
+/*
+ * Try to free npages pages by pushing anonymous memory out to swap. Returns
+ * the number of pages freed. Only objects and pframes nobody else has locked
+ * are touched, so this is safe to call while holding other locks, but it
+ * blocks on disk I/O.
+ */
+size_t swap_reclaim(size_t npages)
+{
+    if (!swap_dev || swap_reclaiming || !curthr || !intr_enabled() ||
+        kmutex_owns_mutex(&swap_mutex))
+    {
+        return 0;
+    }
+    swap_reclaiming = 1;
+
+    size_t freed = 0;
+    for (size_t scanned = 0;
+         freed < npages && scanned < npages * SWAP_SCAN_RATIO; scanned++)
+    {
+        size_t pagenum;
+        mobj_t *o = pframe_next_victim(&pagenum);
+        if (!o)
+        {
+            break;
+        }
+        if ((o->mo_type == MOBJ_ANON || o->mo_type == MOBJ_SHADOW) &&
+            kmutex_trylock(&o->mo_mutex))
+        {
+            freed += _swap_reclaim_cluster(o, pagenum);
+            mobj_put_locked(&o);
+        }
+        else
+        {
+            mobj_put(&o);
+        }
+    }
+
+    swap_reclaiming = 0;
+    dbg(DBG_MM, "reclaimed %lu of %lu pages\n", freed, npages);
+    return freed;
+}
+
+size_t swap_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+    if (!swap_dev)
+    {
+        iprintf(&buf, &size, "swap:                disabled\n");
+        return size;
+    }
+    iprintf(&buf, &size, "swap slots used:     %lu of %lu\n", swap_used,
+            swap_nslots);
+    iprintf(&buf, &size, "pages swapped out:   %lu (%lu writes)\n",
+            swap_pages_out, swap_writes);
+    iprintf(&buf, &size, "pages swapped in:    %lu (%lu reads)\n",
+            swap_pages_in, swap_reads);
+    iprintf(&buf, &size, "clean pages dropped: %lu\n", swap_dropped);
+    return size;
+}
@@ -0,0 +1,147 @@
+#include "globals.h"
+
+#include "main/apic.h"
+#include "main/interrupt.h"
+
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+
+/*
+ * TLB shootdown.
+ *
+ * Each core's TLB only learns about page table changes it flushes itself, so
+ * when a translation goes away every other core that has the address space
+ * loaded must be told. The cores that currently have each pml4 loaded are
+ * tracked in tlb_active (kept up to date by pt_set()); tlb_shootdown() hands
+ * each of them a request covering the whole range and interrupts them with
+ * a single IPI, then waits until all of them have flushed. Ranges longer than
+ * TLB_FLUSH_RANGE_MAX pages are flushed wholesale on the target, so the cost
+ * of unmapping a large region is one round trip rather than one per page.
+ *
+ * Cores that merely have stale entries cached under a PCID but are running
+ * something else need no interrupt; pagetable.c makes their next load of the
+ * table flush instead.
+ *
+ * Only one shootdown is in flight at a time. While waiting for the lock or
+ * for acknowledgements a core keeps answering requests aimed at itself, so
+ * two cores shooting at each other with interrupts off cannot deadlock.
+ */
+
+typedef struct tlb_request
+{
+    pml4_t *tr_pml4;
+    uintptr_t tr_vaddr;
+    size_t tr_npages;
+    volatile long tr_pending;
+} tlb_request_t;
+
+static pml4_t *volatile tlb_active[MAX_LAPICS];
+static tlb_request_t tlb_requests[MAX_LAPICS];
+static volatile long tlb_shootdown_lock;
+
+static size_t tlb_shootdowns;
+static size_t tlb_shootdown_ipis;
+
+/* Handles a request aimed at this core, if there is one. */
+static void _tlb_service(void)
+{
+    tlb_request_t *req = &tlb_requests[curcore.kc_id];
+    if (!__atomic_load_n(&req->tr_pending, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    // if we have switched away since, the entries are only cached under the
+    // table's PCID, which the sender has already dealt with
+    if (req->tr_pml4 == pt_get())
+    {
+        tlb_flush_range(req->tr_vaddr, req->tr_npages);
+    }
+    __atomic_store_n(&req->tr_pending, 0, __ATOMIC_RELEASE);
+}
+
+static long _tlb_shootdown_handler(regs_t *regs)
+{
+    _tlb_service();
+    return 0;
+}
+
+void tlb_init()
+{
+    intr_register(INTR_TLB_SHOOTDOWN, _tlb_shootdown_handler);
+}
+
+void tlb_activate(pml4_t *pml4) { tlb_active[curcore.kc_id] = pml4; }
+
+void tlb_shootdown(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
+{
+    long self = curcore.kc_id;
+    long targets[MAX_LAPICS];
+    long ntargets = 0;
+    long nothers = 0;
+    for (long core = 0; core < MAX_LAPICS; core++)
+    {
+        if (core != self && tlb_active[core])
+        {
+            nothers++;
+            if (tlb_active[core] == pml4)
+            {
+                targets[ntargets++] = core;
+            }
+        }
+    }
+    if (!ntargets)
+    {
+        return;
+    }
+
+    while (!__sync_bool_compare_and_swap(&tlb_shootdown_lock, 0, 1))
+    {
+        _tlb_service();
+    }
+
+    for (long i = 0; i < ntargets; i++)
+    {
+        tlb_request_t *req = &tlb_requests[targets[i]];
+        req->tr_pml4 = pml4;
+        req->tr_vaddr = vaddr;
+        req->tr_npages = (vmax - vaddr) >> PAGE_SHIFT;
+        __atomic_store_n(&req->tr_pending, 1, __ATOMIC_RELEASE);
+    }
+    if (ntargets == nothers)
+    {
+        apic_broadcast_ipi(DESTINATION_MODE_FIXED, INTR_TLB_SHOOTDOWN, 0);
+    }
+    else
+    {
+        for (long i = 0; i < ntargets; i++)
+        {
+            apic_send_ipi((uint8_t)targets[i], DESTINATION_MODE_FIXED,
+                          INTR_TLB_SHOOTDOWN);
+            apic_wait_ipi();
+        }
+    }
+    tlb_shootdowns++;
+    tlb_shootdown_ipis += ntargets;
+
+    for (long i = 0; i < ntargets; i++)
+    {
+        while (__atomic_load_n(&tlb_requests[targets[i]].tr_pending,
+                               __ATOMIC_ACQUIRE))
+        {
+            _tlb_service();
+        }
+    }
+    __sync_lock_release(&tlb_shootdown_lock);
+}
+
+size_t tlb_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+    iprintf(&buf, &size, "tlb shootdowns:      %lu (%lu IPIs)\n",
+            tlb_shootdowns, tlb_shootdown_ipis);
+    return size;
+}
@@ -51,7 +51,10 @@ static uintptr_t fork_setup_stack(const regs_t *regs, void *kstack)
  *       we need to push all registers onto the kernel stack of the kthread. 
  *       Use fork_setup_stack to do this, and set RSP accordingly. 
  *    d) Use pt_unmap_range and tlb_flush_all on the parent in advance of
- *       copy-on-write.
+ *       copy-on-write. Alternatively, pt_share_user() hands the parent's page
+ *       tables to the child write-protected (and flushes the TLB once), so
+ *       neither process has to refault pages it only reads; writes fault as
+ *       usual and handle_pagefault()'s pt_map() copies the tables it needs.
  * 5) Prepare the child process to be run on the CPU.
  * 6) Return the child's process id to the parent.
  */
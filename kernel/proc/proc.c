@@ -5,6 +5,7 @@
 #include "fs/vnode.h"
 #include "globals.h"
 #include "kernel.h"
+#include "mm/pagetable.h"
 #include "mm/slab.h"
 #include "util/debug.h"
 #include "util/printf.h"
@@ -26,7 +27,7 @@ proc_t *curproc CORE_SPECIFIC_DATA;
 /*
  * Global list of all processes (except for the idle process) and its lock
  */
-static list_t proc_list = LIST_INITIALIZER(proc_list);
+list_t proc_list = LIST_INITIALIZER(proc_list);
 
 /*
  * Allocator for process descriptors
@@ -76,6 +77,7 @@ void proc_idleproc_init()
 
     proc->p_status = 0;
     proc->p_state = PROC_RUNNING;
+    proc->p_daemon = 0;
 
     memset(&proc->p_wait, 0, sizeof(ktqueue_t)); // should not be used
 
@@ -208,6 +210,7 @@ proc_t *proc_create(const char *name)
     list_link_init(&proc->p_child_link);
     proc->p_status = 0;
     proc->p_state = PROC_RUNNING;
+    proc->p_daemon = 0;
 
     // Initialize wait queue
     sched_queue_init(&proc->p_wait);
@@ -359,6 +362,18 @@ void proc_kill_all()
     do_exit(-1);
 }
 
+long proc_only_daemons_left()
+{
+    list_iterate(&curproc->p_pproc->p_children, child, proc_t, p_child_link)
+    {
+        if (!child->p_daemon)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 /*
  * Destroy / free everything from proc. Be sure to remember reference counting
  * when working on VFS.
@@ -564,6 +579,19 @@ size_t proc_info(const void *arg, char *buf, size_t osize)
     iprintf(&buf, &size, "status:       %ld\n", p->p_status);
     iprintf(&buf, &size, "state:        %i\n", p->p_state);
 
+    if (p->p_pml4)
+    {
+        size_t shared;
+        size_t pages = pt_table_pages(p->p_pml4, &shared);
+        iprintf(&buf, &size, "page tables:  %lu KB (%lu KB shared)\n",
+                pages * PAGE_SIZE / 1024, shared * PAGE_SIZE / 1024);
+    }
+    if (p->p_vmmap)
+    {
+        iprintf(&buf, &size, "locked:       %lu KB\n",
+                vmmap_locked_pages(p->p_vmmap) * PAGE_SIZE / 1024);
+    }
+
 #ifdef __VFS__
 #ifdef __GETCWD__
     if (NULL != p->p_cwd)
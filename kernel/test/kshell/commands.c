@@ -5,13 +5,25 @@
 
 #ifdef __VFS__
 
+#include "fs/dcache.h"
 #include "fs/fcntl.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 
 #endif
 
+#include "mm/compact.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/swap.h"
+#include "mm/tlb.h"
+
 #include "test/kshell/io.h"
+#include "test/pagebench.h"
+#include "test/stringbench.h"
+
+#include "vm/readahead.h"
+#include "vm/shadowd.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -75,6 +87,54 @@ long kshell_echo(kshell_t *ksh, size_t argc, char **argv)
     return 0;
 }
 
+long kshell_pagebench(kshell_t *ksh, size_t argc, char **argv)
+{
+    kprintf(ksh, "PAGEBENCH: Benchmarking... Please wait.\n");
+
+    long ret = pagebench_main(0, NULL);
+
+    kprintf(ksh, "PAGEBENCH: complete, check console for results\n");
+
+    return ret;
+}
+
+long kshell_stringbench(kshell_t *ksh, size_t argc, char **argv)
+{
+    kprintf(ksh, "STRINGBENCH: Benchmarking... Please wait.\n");
+
+    long ret = stringbench_main(0, NULL);
+
+    kprintf(ksh, "STRINGBENCH: complete, check console for results\n");
+
+    return ret;
+}
+
+long kshell_memstat(kshell_t *ksh, size_t argc, char **argv)
+{
+    char buf[2048];
+    page_info(NULL, buf, sizeof(buf));
+    kprintf(ksh, "%s", buf);
+    compact_info(NULL, buf, sizeof(buf));
+    kprintf(ksh, "%s", buf);
+    pframe_info(NULL, buf, sizeof(buf));
+    kprintf(ksh, "%s", buf);
+    swap_info(NULL, buf, sizeof(buf));
+    kprintf(ksh, "%s", buf);
+    tlb_info(NULL, buf, sizeof(buf));
+    kprintf(ksh, "%s", buf);
+    shadowd_info(NULL, buf, sizeof(buf));
+    kprintf(ksh, "%s", buf);
+    readahead_info(NULL, buf, sizeof(buf));
+    kprintf(ksh, "%s", buf);
+#ifdef __VFS__
+    vnode_cache_info(NULL, buf, sizeof(buf));
+    kprintf(ksh, "%s", buf);
+    dcache_info(NULL, buf, sizeof(buf));
+    kprintf(ksh, "%s", buf);
+#endif
+    return 0;
+}
+
 #ifdef __VFS__
 
 long kshell_cat(kshell_t *ksh, size_t argc, char **argv)
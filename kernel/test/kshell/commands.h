@@ -15,6 +15,10 @@ KSHELL_CMD(echo);
 
 KSHELL_CMD(clear);
 
+KSHELL_CMD(pagebench);
+KSHELL_CMD(stringbench);
+KSHELL_CMD(memstat);
+
 #ifdef __VFS__
 KSHELL_CMD(cat);
 KSHELL_CMD(ls);
@@ -52,6 +52,12 @@ void kshell_init()
                        "prints a list of available commands");
     kshell_add_command("echo", kshell_echo, "display a line of text");
     kshell_add_command("clear", kshell_clear, "clears the screen");
+    kshell_add_command("pagebench", kshell_pagebench,
+                       "benchmarks the page allocator");
+    kshell_add_command("stringbench", kshell_stringbench,
+                       "benchmarks memcpy, memset, memcmp and strlen");
+    kshell_add_command("memstat", kshell_memstat,
+                       "prints memory, swap and shadow chain statistics");
 #ifdef __VFS__
     kshell_add_command("cat", kshell_cat,
                        "concatenate files and print on the standard output");
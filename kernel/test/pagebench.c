@@ -0,0 +1,147 @@
+//
+// Microbenchmark for the page allocator. Times sequences of page_alloc_n()
+// and page_free_n() calls that resemble what the slab allocator, kernel
+// stacks and page tables do, and reports the average cost per call.
+//
+// Each sequence is timed twice: first with every free merging its buddies all
+// the way up, as the allocator did before merges were deferred, then with
+// deferred merging (see page_defer_merges()). Single-page allocations are also
+// timed through the btree and through the per-core lists of page_alloc().
+//
+
+#include "globals.h"
+
+#include "test/pagebench.h"
+
+#include "util/debug.h"
+
+#include "mm/page.h"
+
+#define PAGEBENCH_ROUNDS 64
+#define PAGEBENCH_BATCH 256
+
+static inline uint64_t pagebench_rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void pagebench_report(const char *name, size_t calls, uint64_t base,
+                             uint64_t cycles)
+{
+    dbg(DBG_TEST, "%-28s %8lu calls %6lu -> %6lu cycles/call\n", name, calls,
+        base / calls, cycles / calls);
+}
+
+// repeatedly allocate a page and immediately give it back; this is the
+// pattern that used to thrash the btree by merging and splitting every order
+static uint64_t pagebench_pairs(size_t npages)
+{
+    uint64_t start = pagebench_rdtsc();
+    for (size_t i = 0; i < PAGEBENCH_ROUNDS * PAGEBENCH_BATCH; i++)
+    {
+        void *addr = page_alloc_n(npages);
+        KASSERT(addr);
+        page_free_n(addr, npages);
+    }
+    return pagebench_rdtsc() - start;
+}
+
+// allocate a batch, then free it in the same order (fifo) or in the reverse
+// order (lifo); npages of 0 cycles through orders 0 to 2
+static uint64_t pagebench_batch(void **addrs, size_t npages, long lifo)
+{
+    uint64_t start = pagebench_rdtsc();
+    for (size_t round = 0; round < PAGEBENCH_ROUNDS; round++)
+    {
+        for (size_t i = 0; i < PAGEBENCH_BATCH; i++)
+        {
+            addrs[i] = page_alloc_n(npages ? npages : 1UL << (i % 3));
+            KASSERT(addrs[i]);
+        }
+        for (size_t j = 0; j < PAGEBENCH_BATCH; j++)
+        {
+            size_t i = lifo ? PAGEBENCH_BATCH - 1 - j : j;
+            page_free_n(addrs[i], npages ? npages : 1UL << (i % 3));
+        }
+    }
+    return pagebench_rdtsc() - start;
+}
+
+// the per-core fast path, for comparison against the btree path for the same
+// batch of single pages
+static uint64_t pagebench_pcp(void **addrs)
+{
+    uint64_t start = pagebench_rdtsc();
+    for (size_t round = 0; round < PAGEBENCH_ROUNDS; round++)
+    {
+        for (size_t i = 0; i < PAGEBENCH_BATCH; i++)
+        {
+            addrs[i] = page_alloc();
+            KASSERT(addrs[i]);
+        }
+        for (size_t i = 0; i < PAGEBENCH_BATCH; i++)
+        {
+            page_free(addrs[i]);
+        }
+    }
+    return pagebench_rdtsc() - start;
+}
+
+// times pattern (0 for pairs, else a batch) with eager and then deferred
+// merging
+static void pagebench_merges(const char *name, void **addrs, long batch,
+                             size_t npages, long lifo)
+{
+    uint64_t base, cycles;
+
+    page_defer_merges(0);
+    base = batch ? pagebench_batch(addrs, npages, lifo)
+                 : pagebench_pairs(npages);
+    page_defer_merges(1);
+    cycles = batch ? pagebench_batch(addrs, npages, lifo)
+                   : pagebench_pairs(npages);
+    pagebench_report(name, 2 * PAGEBENCH_ROUNDS * PAGEBENCH_BATCH, base,
+                     cycles);
+}
+
+long pagebench_main(long arg1, void *arg2)
+{
+    KASSERT(PAGEBENCH_BATCH * sizeof(void *) <= PAGE_SIZE);
+    void **addrs = page_alloc();
+    if (!addrs)
+    {
+        return -1;
+    }
+
+    size_t free_before = page_free_count();
+    dbg(DBG_TEST, "\nStarting page allocator benchmark (%lu free pages)\n",
+        free_before);
+
+    dbg(DBG_TEST, "eager -> deferred merging:\n");
+    pagebench_merges("alloc/free pairs, 1 page", addrs, 0, 1, 0);
+    pagebench_merges("alloc/free pairs, 4 pages", addrs, 0, 4, 0);
+    pagebench_merges("batch fifo, 1 page", addrs, 1, 1, 0);
+    pagebench_merges("batch lifo, 1 page", addrs, 1, 1, 1);
+    pagebench_merges("batch fifo, mixed orders", addrs, 1, 0, 0);
+    pagebench_merges("batch lifo, mixed orders", addrs, 1, 0, 1);
+
+    dbg(DBG_TEST, "btree -> per-core lists:\n");
+    uint64_t base = pagebench_batch(addrs, 1, 0);
+    pagebench_report("page_alloc/page_free",
+                     2 * PAGEBENCH_ROUNDS * PAGEBENCH_BATCH, base,
+                     pagebench_pcp(addrs));
+
+    // other threads (daemons, the slab allocator) may allocate or free pages
+    // meanwhile, so a difference here is only reported, not a leak for sure
+    size_t free_after = page_free_count();
+    if (free_after != free_before)
+    {
+        dbg(DBG_TEST, "free pages changed from %lu to %lu during the run\n",
+            free_before, free_after);
+    }
+    page_free(addrs);
+    dbg(DBG_TEST, "Page allocator benchmark done\n");
+    return 0;
+}
@@ -11,10 +11,17 @@
 #include "util/printf.h"
 #include "util/string.h"
 
+#include "drivers/blockdev.h"
 #include "fs/fcntl.h"
 #include "fs/lseek.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_subr.h"
+#include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
+#include "mm/kmalloc.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
 
 #define BUFSIZE 256
 #define BIG_BUFSIZE 2056
@@ -126,17 +133,22 @@ static void test_running_out_of_inodes()
     test_assert(do_unlink("file") == 0, "Could not remove file");
 }
 
+// The largest file is much larger than the disk, so only its end is written
 static void test_filling_file()
 {
     long res = 0;
     int fd = (int)do_open("hugefile", O_RDWR | O_CREAT);
     KASSERT(fd >= 0);
 
-    res = write_until_fail(fd);
-    test_assert(res == 0, "Did not write to entire file");
+    char buf[BIG_BUFSIZE] = {0};
+    off_t end = (off_t)S5_MAX_FILE_SIZE;
+    test_assert(do_lseek(fd, end - BIG_BUFSIZE, SEEK_SET) == end - BIG_BUFSIZE,
+                "couldnt seek to the end of the largest file");
+    res = do_write(fd, buf, sizeof(buf));
+    test_assert(res == BIG_BUFSIZE, "Did not write to entire file");
+    test_assert(do_lseek(fd, 0, SEEK_END) == end, "Wrong file size");
 
     // make sure all other writes are unsuccessful/dont complete
-    char buf[BIG_BUFSIZE] = {0};
     res = do_write(fd, buf, sizeof(buf));
     test_assert(res < 0, "Able to write although the file is full");
     test_assert(res == -EFBIG || res == -EINVAL, "Wrong error code");
@@ -145,27 +157,20 @@ static void test_filling_file()
     test_assert(do_unlink("hugefile") == 0, "couldnt unlink hugefile");
 }
 
-// Fill up the disk. Apparently to do this, we should need to fill up one
-// entire file, then start to fill up another. We should eventually get
-// the ENOSPC error
+// Fill up the disk. A single file can be larger than the disk, so writing to
+// one until it fails should give us the ENOSPC error
 static void test_running_out_of_blocks()
 {
     long res = 0;
 
-    int fd1 = (int)do_open("fullfile", O_RDWR | O_CREAT);
+    int fd = (int)do_open("fullfile", O_RDWR | O_CREAT);
 
-    res = write_until_fail(fd1);
-    test_assert(res == 0, "Ran out of space quicker than we expected");
-    test_assert(do_close(fd1) == 0, "could not close");
-
-    int fd2 = (int)do_open("partiallyfullfile", O_RDWR | O_CREAT);
-    res = write_until_fail(fd2);
+    res = write_until_fail(fd);
     test_assert(res == -ENOSPC, "Did not get nospc error");
 
-    test_assert(do_close(fd2) == 0, "could not close");
+    test_assert(do_close(fd) == 0, "could not close");
 
     test_assert(do_unlink("fullfile") == 0, "couldnt do_unlink file");
-    test_assert(do_unlink("partiallyfullfile") == 0, "couldnt do_unlink file");
 }
 
 // Open a new file, write to some random address in the file,
@@ -220,6 +225,164 @@ static int test_sparseness_indirect_blocks()
     return 0;
 }
 
+// Write past the end of the indirect block, into the double and then the
+// triple indirect blocks, and make sure what comes before is still sparse
+static int test_sparseness_multi_indirect_blocks()
+{
+    const char *filename = "hugesparsefile";
+    int fd = (int)do_open(filename, O_RDWR | O_CREAT);
+
+    const off_t addrs[] = {
+        (off_t)(S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS + 1) * S5_BLOCK_SIZE + 3,
+        (off_t)(S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS +
+                S5_NIDIRECT_BLOCKS * S5_NIDIRECT_BLOCKS + 1) *
+                S5_BLOCK_SIZE + 3};
+    const char *b = "iboros";
+    const size_t sz = strlen(b);
+    const size_t nzero = 4 * S5_BLOCK_SIZE;
+
+    for (size_t i = 0; i < sizeof(addrs) / sizeof(addrs[0]); i++)
+    {
+        char readback[BUFSIZE];
+        test_assert(do_lseek(fd, addrs[i], SEEK_SET) == addrs[i],
+                    "couldnt seek");
+        test_assert((size_t)do_write(fd, b, sz) == sz,
+                    "couldnt write to random address");
+        test_assert(do_lseek(fd, addrs[i], SEEK_SET) == addrs[i],
+                    "couldnt seek back");
+        test_assert((size_t)do_read(fd, readback, sz) == sz &&
+                        !memcmp(readback, b, sz),
+                    "couldnt read back what was written");
+
+        test_assert(do_lseek(fd, addrs[i] - nzero, SEEK_SET) ==
+                        addrs[i] - (off_t)nzero,
+                    "couldnt seek before the write");
+        test_assert(is_first_n_bytes_zero(fd, nzero) == 1,
+                    "sparseness for multiply indirect blocks failed");
+    }
+
+    // Get rid of this file
+    test_assert(do_close(fd) == 0, "couldn't close file");
+    test_assert(do_unlink(filename) == 0, "couldnt unlink file");
+
+    return 0;
+}
+
+static long is_filled(const char *buf, char c)
+{
+    for (size_t i = 0; i < S5_BLOCK_SIZE; i++)
+    {
+        if (buf[i] != c)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Commit every dirty metadata block to the journal
+static long journal_commit(s5fs_t *s5fs)
+{
+    mobj_lock(&s5fs->s5f_mobj);
+    long ret = s5_journal_commit(s5fs, NULL);
+    mobj_unlock(&s5fs->s5f_mobj);
+    return ret;
+}
+
+// A committed transaction must be readable before it is checkpointed, both
+// through the cache and after the log is replayed at mount, and replay must
+// not bring back the image of a block that was freed and reused since. This
+// works on two blocks of its own through the block device cache, so it
+// doesn't depend on files, and "remounts" by setting the journal up again the
+// way s5fs_mount() does. Nothing else should be using the disk meanwhile.
+static void test_journal()
+{
+    s5fs_t *s5fs = FS_TO_S5FS(&vfs_root_fs);
+    s5_journal_t *j = &s5fs->s5f_journal;
+    blockdev_t *bd = s5fs->s5f_bdev;
+    if (!j->sj_nblocks)
+    {
+        dbg(DBG_TEST, "No journal on this disk, skipping\n");
+        return;
+    }
+
+    // start from an empty batch, so that our blocks go in one transaction
+    test_assert(journal_commit(s5fs) == 0, "couldn't commit");
+    long kept = s5_alloc_block_near(s5fs, 0, 0);
+    long reused = s5_alloc_block_near(s5fs, 0, 0);
+    test_assert(kept > 0 && reused > 0, "couldn't allocate blocks");
+    char *buf = page_alloc();
+    if (kept <= 0 || reused <= 0 || !buf)
+    {
+        goto out;
+    }
+
+    // the homes of both blocks hold zeros, and their logged images do not
+    memset(buf, 0, S5_BLOCK_SIZE);
+    test_assert(bd->bd_ops->write_block(bd, buf, kept, 1) == 0 &&
+                    bd->bd_ops->write_block(bd, buf, reused, 1) == 0,
+                "couldn't write blocks home");
+    pframe_t *pf;
+    s5_get_meta_disk_block(s5fs, kept, 1, &pf);
+    memset(pf->pf_addr, 'k', S5_BLOCK_SIZE);
+    s5_release_disk_block(&pf);
+    s5_get_meta_disk_block(s5fs, reused, 1, &pf);
+    memset(pf->pf_addr, 'r', S5_BLOCK_SIZE);
+    s5_release_disk_block(&pf);
+    test_assert(journal_commit(s5fs) == 0, "couldn't commit");
+
+    // drop the cached copy; reading it again has to find it in the log
+    mobj_lock(&s5fs->s5f_mobj);
+    blocknum_t logged = s5_journal_locate(s5fs, kept);
+    mobj_delete_pframe(&s5fs->s5f_mobj, kept);
+    mobj_unlock(&s5fs->s5f_mobj);
+    test_assert(logged != (blocknum_t)kept, "committed block not in the log");
+    s5_get_meta_disk_block(s5fs, kept, 0, &pf);
+    test_assert(is_filled(pf->pf_addr, 'k'), "read a stale image back");
+    s5_release_disk_block(&pf);
+    test_assert(bd->bd_ops->read_block(bd, buf, kept, 1) == 0 &&
+                    is_filled(buf, 0),
+                "block written home before a checkpoint");
+
+    // free the other block and reuse it for file data, which is written home
+    // directly; the next transaction carries the revocation
+    s5_free_block(s5fs, reused);
+    memset(buf, 'd', S5_BLOCK_SIZE);
+    test_assert(bd->bd_ops->write_block(bd, buf, reused, 1) == 0,
+                "couldn't write reused block");
+    test_assert(journal_commit(s5fs) == 0, "couldn't commit");
+    blocknum_t freed = (blocknum_t)reused;
+    reused = 0;
+
+    // remount: nothing has been checkpointed, so this replays both
+    // transactions
+    mobj_lock(&s5fs->s5f_mobj);
+    kfree(j->sj_logged);
+    kfree(j->sj_revoked);
+    kfree(j->sj_batch);
+    mobj_unlock(&s5fs->s5f_mobj);
+    test_assert(s5_journal_init(s5fs) == 0, "couldn't replay the journal");
+    test_assert(bd->bd_ops->read_block(bd, buf, kept, 1) == 0 &&
+                    is_filled(buf, 'k'),
+                "replay lost a committed block");
+    test_assert(bd->bd_ops->read_block(bd, buf, freed, 1) == 0 &&
+                    is_filled(buf, 'd'),
+                "replay overwrote a freed and reused block");
+out:
+    if (buf)
+    {
+        page_free(buf);
+    }
+    if (kept > 0)
+    {
+        s5_free_block(s5fs, kept);
+    }
+    if (reused > 0)
+    {
+        s5_free_block(s5fs, reused);
+    }
+}
+
 long s5fstest_main(int arg0, void *arg1)
 {
     dbg(DBG_TEST, "\nStarting S5FS test\n");
@@ -234,13 +397,17 @@ long s5fstest_main(int arg0, void *arg1)
     test_sparseness_direct_blocks();
     dbg(DBG_TEST, "Testing sparseness for indirect blocks\n");
     test_sparseness_indirect_blocks();
+    dbg(DBG_TEST, "Testing sparseness for double and triple indirect blocks\n");
+    test_sparseness_multi_indirect_blocks();
 
     dbg(DBG_TEST, "Testing running out of inodes\n");
     test_running_out_of_inodes();
-    dbg(DBG_TEST, "Testing filling a file to max capacity\n");
+    dbg(DBG_TEST, "Testing writing up to the max file size\n");
     test_filling_file();
     dbg(DBG_TEST, "Testing using all available blocks on disk\n");
     test_running_out_of_blocks();
+    dbg(DBG_TEST, "Testing journal commit and replay\n");
+    test_journal();
 
     test_assert(do_chdir("..") == 0, "");
     test_assert(do_rmdir("s5fstest") == 0, "");
@@ -0,0 +1,247 @@
+//
+// Microbenchmark for memcpy(), memset(), memcmp() and strlen(). Times each
+// against the plain byte-at-a-time version they replaced (rep movsb, rep stosb,
+// repe cmpsb and a byte loop) at a range of sizes, aligned and misaligned,
+// and reports the average cost per call.
+//
+
+#include "globals.h"
+
+#include "test/stringbench.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "mm/page.h"
+
+#define STRINGBENCH_CALLS 4096
+#define STRINGBENCH_PAGES 2
+
+static const size_t stringbench_sizes[] = {3, 8, 15, 64, 200, 512, 4096};
+
+static inline uint64_t stringbench_rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void *stringbench_movsb(void *dest, const void *src, size_t count)
+{
+    __asm__ volatile("cld\n\t"
+                     "rep movsb"
+                     : "+S"(src), "+D"(dest), "+c"(count)
+                     :
+                     : "cc", "memory");
+    return dest;
+}
+
+static void *stringbench_stosb(void *s, int c, size_t count)
+{
+    __asm__ volatile("cld\n\t"
+                     "rep stosb"
+                     : "+D"(s), "+c"(count)
+                     : "a"(c)
+                     : "cc", "memory");
+    return s;
+}
+
+static int stringbench_cmpsb(const void *cs, const void *ct, size_t count)
+{
+    int ret;
+    __asm__ volatile("xor %%eax, %%eax\n\t"
+                     "cld\n\t"
+                     "repe cmpsb\n\t"
+                     "setnz %%al"
+                     : "=a"(ret), "+S"(cs), "+D"(ct), "+c"(count)
+                     :
+                     : "cc", "memory");
+    return ret;
+}
+
+static size_t stringbench_bytelen(const char *s)
+{
+    const char *sc = s;
+    while (*sc)
+    {
+        sc++;
+    }
+    return sc - s;
+}
+
+static void stringbench_report(const char *name, size_t size, size_t misalign,
+                               uint64_t base, uint64_t cycles)
+{
+    dbg(DBG_TEST, "%-8s %5lu bytes +%lu: %6lu -> %6lu cycles/call\n", name,
+        size, misalign, base / STRINGBENCH_CALLS, cycles / STRINGBENCH_CALLS);
+}
+
+static void stringbench_run(char *dst, char *src, size_t size, size_t misalign)
+{
+    char *d = dst + misalign;
+    char *s = src + 2 * misalign; // source and destination out of step
+    uint64_t start, base;
+
+    start = stringbench_rdtsc();
+    for (size_t i = 0; i < STRINGBENCH_CALLS; i++)
+    {
+        stringbench_movsb(d, s, size);
+    }
+    base = stringbench_rdtsc() - start;
+    start = stringbench_rdtsc();
+    for (size_t i = 0; i < STRINGBENCH_CALLS; i++)
+    {
+        memcpy(d, s, size);
+    }
+    stringbench_report("memcpy", size, misalign, base,
+                       stringbench_rdtsc() - start);
+
+    start = stringbench_rdtsc();
+    for (size_t i = 0; i < STRINGBENCH_CALLS; i++)
+    {
+        stringbench_stosb(d, 'x', size);
+    }
+    base = stringbench_rdtsc() - start;
+    start = stringbench_rdtsc();
+    for (size_t i = 0; i < STRINGBENCH_CALLS; i++)
+    {
+        memset(d, 'x', size);
+    }
+    stringbench_report("memset", size, misalign, base,
+                       stringbench_rdtsc() - start);
+
+    // equal buffers, so both compare every byte
+    memset(s, 'x', size);
+    start = stringbench_rdtsc();
+    for (size_t i = 0; i < STRINGBENCH_CALLS; i++)
+    {
+        if (stringbench_cmpsb(d, s, size))
+        {
+            panic("repe cmpsb of equal buffers returned nonzero\n");
+        }
+    }
+    base = stringbench_rdtsc() - start;
+    start = stringbench_rdtsc();
+    for (size_t i = 0; i < STRINGBENCH_CALLS; i++)
+    {
+        if (memcmp(d, s, size))
+        {
+            panic("memcmp of equal buffers returned nonzero\n");
+        }
+    }
+    stringbench_report("memcmp", size, misalign, base,
+                       stringbench_rdtsc() - start);
+
+    d[size - 1] = '\0';
+    start = stringbench_rdtsc();
+    for (size_t i = 0; i < STRINGBENCH_CALLS; i++)
+    {
+        if (stringbench_bytelen(d) != size - 1)
+        {
+            panic("byte strlen returned the wrong length\n");
+        }
+    }
+    base = stringbench_rdtsc() - start;
+    start = stringbench_rdtsc();
+    for (size_t i = 0; i < STRINGBENCH_CALLS; i++)
+    {
+        if (strlen(d) != size - 1)
+        {
+            panic("strlen returned the wrong length\n");
+        }
+    }
+    stringbench_report("strlen", size, misalign, base,
+                       stringbench_rdtsc() - start);
+}
+
+// checks the new routines against the byte versions for every size and
+// alignment around the thresholds where they switch strategy
+static void stringbench_check(char *dst, char *src)
+{
+    for (size_t i = 0; i < PAGE_SIZE; i++)
+    {
+        src[i] = (char)(i * 7 + 1);
+    }
+    for (size_t size = 0; size <= 600; size++)
+    {
+        for (size_t misalign = 0; misalign < 8; misalign++)
+        {
+            memset(dst, 0, size + 16);
+            memcpy(dst + misalign, src + 3, size);
+            if (stringbench_cmpsb(dst + misalign, src + 3, size) ||
+                dst[misalign + size] || (misalign && dst[misalign - 1]))
+            {
+                panic("memcpy of %lu bytes at +%lu is wrong\n", size,
+                      misalign);
+            }
+            if (size && memcmp(dst + misalign, src + 3, size))
+            {
+                panic("memcmp of %lu equal bytes at +%lu\n", size, misalign);
+            }
+            if (size)
+            {
+                // bytes compare unsigned: flipping the top bit of the last one
+                // orders the buffers by that bit
+                unsigned char last = (unsigned char)src[3 + size - 1];
+                dst[misalign + size - 1] = (char)(last ^ 0x80);
+                if (memcmp(dst + misalign, src + 3, size) !=
+                    ((last & 0x80) ? -1 : 1))
+                {
+                    panic("memcmp ordering wrong at %lu bytes\n", size);
+                }
+            }
+
+            memset(dst + misalign, 'y', size);
+            for (size_t j = 0; j < size; j++)
+            {
+                if (dst[misalign + j] != 'y')
+                {
+                    panic("memset of %lu bytes at +%lu missed byte %lu\n",
+                          size, misalign, j);
+                }
+            }
+            if (dst[misalign + size] || (misalign && dst[misalign - 1]))
+            {
+                panic("memset of %lu bytes at +%lu overran\n", size, misalign);
+            }
+            if (strlen(dst + misalign) != size)
+            {
+                panic("strlen of %lu bytes at +%lu is wrong\n", size,
+                      misalign);
+            }
+        }
+    }
+}
+
+long stringbench_main(long arg1, void *arg2)
+{
+    char *dst = page_alloc_n(STRINGBENCH_PAGES);
+    char *src = page_alloc_n(STRINGBENCH_PAGES);
+    if (!dst || !src)
+    {
+        if (dst)
+        {
+            page_free_n(dst, STRINGBENCH_PAGES);
+        }
+        if (src)
+        {
+            page_free_n(src, STRINGBENCH_PAGES);
+        }
+        return -1;
+    }
+
+    dbg(DBG_TEST, "\nStarting string routine benchmark (byte version -> "
+                  "current)\n");
+    stringbench_check(dst, src);
+    for (size_t i = 0;
+         i < sizeof(stringbench_sizes) / sizeof(stringbench_sizes[0]); i++)
+    {
+        stringbench_run(dst, src, stringbench_sizes[i], 0);
+        stringbench_run(dst, src, stringbench_sizes[i], 3);
+    }
+
+    page_free_n(dst, STRINGBENCH_PAGES);
+    page_free_n(src, STRINGBENCH_PAGES);
+    dbg(DBG_TEST, "String routine benchmark done\n");
+    return 0;
+}
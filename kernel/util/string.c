@@ -1,53 +1,207 @@
 #include "ctype.h"
 #include "errno.h"
+#include "globals.h"
+
+#include "main/cpuid.h"
+
+#include "util/debug.h"
+
+/*
+ * memcpy(), memset(), memcmp() and strlen() pick how to do the work by size:
+ *
+ *  - Up to STRING_SMALL bytes: two (possibly overlapping) unaligned loads and
+ *    stores from each end, without a loop.
+ *  - Up to STRING_REP_MIN bytes: a loop over 8-byte words with the destination
+ *    aligned; the ragged ends are covered by overlapping unaligned words.
+ *  - Larger: rep movs/stos. With ERMS (enhanced rep movsb/stosb) the byte
+ *    forms are the fastest way to move a big block; without it rep movsq/stosq
+ *    does the bulk and one more word covers the tail. With FSRM (fast short
+ *    rep movsb) the byte forms are used above STRING_SMALL as well.
+ *
+ * string_init() reads the CPUID bits at boot; until then the word loops are
+ * used for everything. The kernel never touches the SSE/AVX registers (CR4's
+ * OSFXSR bit is clear and no FPU state is saved on a context switch), so
+ * there are no vector paths: the widest loads here are general purpose ones.
+ */
+
+#define STRING_SMALL 16
+#define STRING_REP_MIN 512
+
+#define STRING_ONES 0x0101010101010101UL
+#define STRING_HIGHS 0x8080808080808080UL
+
+/* Unaligned words that may alias anything */
+typedef uint64_t __attribute__((__may_alias__, __aligned__(1))) string_word_t;
+typedef uint32_t __attribute__((__may_alias__, __aligned__(1))) string_half_t;
+
+static long string_erms;
+static long string_fsrm;
+
+void string_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_GETVENDORSTRING, &eax, &ebx, &ecx, &edx);
+    if (eax < CPUID_GETEXTFEATURES)
+    {
+        return;
+    }
+    cpuid_subleaf(CPUID_GETEXTFEATURES, 0, &eax, &ebx, &ecx, &edx);
+    string_erms = !!(ebx & CPUID_EXTFEAT_EBX_ERMS);
+    string_fsrm = !!(edx & CPUID_EXTFEAT_EDX_FSRM);
+    dbg(DBG_INIT, "string routines: ERMS %ld, FSRM %ld\n", string_erms,
+        string_fsrm);
+}
+
+/* Nonzero in the high bit of each byte of x that is zero, lowest one exact */
+static inline uint64_t _string_zero_bytes(uint64_t x)
+{
+    return (x - STRING_ONES) & ~x & STRING_HIGHS;
+}
 
 int memcmp(const void *cs, const void *ct, size_t count)
 {
-    int ret;
-    /* Compare bytes at %esi and %edi up to %ecx bytes OR until
-     * the bytes are not equal */
-    /* If not equal, set zf = 0 and stop */
-    /* Find out zf and sf and use them to return 0,1, or -1 */
-    __asm__ volatile(
-        "xor %%eax, %%eax\n\t" /* Zero output */
-        "cld\n\t"              /* Make sure direction is forwards */
-        "repe\n\t"
-        "cmpsb\n\t"
-        "setnz %%al\n\t" /* If it is not zero, put 1 in low part */
-        "sets %%ah"      /* If sign set (means 2nd arg larger),
-                          * put 1 in high part */
-        : "=a"(ret)
-        : "S"(cs), "D"(ct), "c"(count)
-        : "cc" /* Overwrite flags */
-    );
-    return ((ret & 1) ? ((ret >> 8) ? -1 : 1) : 0);
+    const unsigned char *a = cs;
+    const unsigned char *b = ct;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        uint64_t x = *(const string_word_t *)(a + i);
+        uint64_t y = *(const string_word_t *)(b + i);
+        if (x != y)
+        {
+            // byte-swapped, the first differing byte is the most significant
+            return __builtin_bswap64(x) < __builtin_bswap64(y) ? -1 : 1;
+        }
+    }
+    for (; i < count; i++)
+    {
+        if (a[i] != b[i])
+        {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
 }
 
 void *memcpy(void *dest, const void *src, size_t count)
 {
-    /* Move %ecx bytes from %esi to %edi */
-    __asm__ volatile(
-        "cld\n\t" /* Make sure direction is forwards */
-        "rep\n\t"
-        "movsb"
-        : /* No output */
-        : "S"(src), "D"(dest), "c"(count)
-        : "cc" /* We overwrite condition codes - i.e., flags */
-    );
+    char *d = dest;
+    const char *s = src;
+
+    if (count <= STRING_SMALL)
+    {
+        if (count >= 8)
+        {
+            uint64_t head = *(const string_word_t *)s;
+            uint64_t tail = *(const string_word_t *)(s + count - 8);
+            *(string_word_t *)d = head;
+            *(string_word_t *)(d + count - 8) = tail;
+        }
+        else if (count >= 4)
+        {
+            uint32_t head = *(const string_half_t *)s;
+            uint32_t tail = *(const string_half_t *)(s + count - 4);
+            *(string_half_t *)d = head;
+            *(string_half_t *)(d + count - 4) = tail;
+        }
+        else if (count)
+        {
+            char first = s[0], mid = s[count / 2], last = s[count - 1];
+            d[0] = first;
+            d[count / 2] = mid;
+            d[count - 1] = last;
+        }
+        return dest;
+    }
+
+    if (string_fsrm || (string_erms && count >= STRING_REP_MIN))
+    {
+        __asm__ volatile("cld\n\t"
+                         "rep movsb"
+                         : "+S"(s), "+D"(d), "+c"(count)
+                         :
+                         : "cc", "memory");
+        return dest;
+    }
+
+    uint64_t tail = *(const string_word_t *)(s + count - 8);
+    char *end = d + count - 8;
+    if (count >= STRING_REP_MIN)
+    {
+        size_t nwords = count / 8;
+        __asm__ volatile("cld\n\t"
+                         "rep movsq"
+                         : "+S"(s), "+D"(d), "+c"(nwords)
+                         :
+                         : "cc", "memory");
+    }
+    else
+    {
+        // the first word covers the bytes skipped to align the destination
+        *(string_word_t *)d = *(const string_word_t *)s;
+        for (size_t i = 8 - ((uintptr_t)d & 7); i + 8 < count; i += 8)
+        {
+            *(string_word_t *)(d + i) = *(const string_word_t *)(s + i);
+        }
+    }
+    *(string_word_t *)end = tail;
     return dest;
 }
 
 void *memset(void *s, int c, size_t count)
 {
-    /* Fill %ecx bytes at %edi with %eax (actually %al) */
-    __asm__ volatile(
-        "cld\n\t" /* Make sure direction is forwards */
-        "rep\n\t"
-        "stosb"
-        : /* No output */
-        : "a"(c), "D"(s), "c"(count)
-        : "cc" /* Overwrite flags */
-    );
+    char *d = s;
+    uint64_t word = STRING_ONES * (unsigned char)c;
+
+    if (count <= STRING_SMALL)
+    {
+        if (count >= 8)
+        {
+            *(string_word_t *)d = word;
+            *(string_word_t *)(d + count - 8) = word;
+        }
+        else if (count >= 4)
+        {
+            *(string_half_t *)d = (uint32_t)word;
+            *(string_half_t *)(d + count - 4) = (uint32_t)word;
+        }
+        else if (count)
+        {
+            d[0] = (char)c;
+            d[count / 2] = (char)c;
+            d[count - 1] = (char)c;
+        }
+        return s;
+    }
+
+    if (string_fsrm || (string_erms && count >= STRING_REP_MIN))
+    {
+        __asm__ volatile("cld\n\t"
+                         "rep stosb"
+                         : "+D"(d), "+c"(count)
+                         : "a"(c)
+                         : "cc", "memory");
+        return s;
+    }
+
+    *(string_word_t *)(d + count - 8) = word;
+    if (count >= STRING_REP_MIN)
+    {
+        size_t nwords = count / 8;
+        __asm__ volatile("cld\n\t"
+                         "rep stosq"
+                         : "+D"(d), "+c"(nwords)
+                         : "a"(word)
+                         : "cc", "memory");
+    }
+    else
+    {
+        *(string_word_t *)d = word;
+        for (size_t i = 8 - ((uintptr_t)d & 7); i + 8 < count; i += 8)
+        {
+            *(string_word_t *)(d + i) = word;
+        }
+    }
     return s;
 }
 
@@ -131,12 +285,16 @@ char *strcat(char *dest, const char *src)
 
 size_t strlen(const char *s)
 {
-    const char *sc;
-
-    for (sc = s; *sc != '\0'; ++sc)
+    // aligned words never cross a page, so reading the whole word around the
+    // terminator cannot fault; bytes before s are forced nonzero
+    const string_word_t *w = (const string_word_t *)((uintptr_t)s & ~7UL);
+    uint64_t zeros =
+        _string_zero_bytes(*w | ((1UL << (8 * ((uintptr_t)s & 7))) - 1));
+    while (!zeros)
     {
-        /* nothing */}
-        return sc - s;
+        zeros = _string_zero_bytes(*++w);
+    }
+    return (const char *)w + __builtin_ctzl(zeros) / 8 - s;
 }
 
 char *strchr(const char *s, int c)
@@ -2,6 +2,7 @@
 #include "mm/page.h"
 #include "mm/pframe.h"
 #include "mm/slab.h"
+#include "mm/swap.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -47,6 +48,9 @@ mobj_t *anon_create()
 /* 
  * This function is not complicated -- think about what the pframe should look
  * like for an anonymous object 
+ *
+ * Note that this is only called for writes: mobj_default_get_pframe() hands
+ * out the shared zero page for reads of untouched anonymous pages.
  */
 static long anon_fill_pframe(mobj_t *o, pframe_t *pf)
 {
@@ -54,7 +58,11 @@ static long anon_fill_pframe(mobj_t *o, pframe_t *pf)
     return 0;
 }
 
-static long anon_flush_pframe(mobj_t *o, pframe_t *pf) { return 0; }
+/* Anonymous memory is written back to swap, if there is any */
+static long anon_flush_pframe(mobj_t *o, pframe_t *pf)
+{
+    return swap_flush_pframe(o, pf);
+}
 
 /*
  * Release all resources associated with an anonymous object.
@@ -8,6 +8,7 @@
 #include "mm/mman.h"
 #include "mm/tlb.h"
 #include "util/debug.h"
+#include "vm/vmmap.h"
 
 /*
  * This function implements the mmap(2) syscall: Add a mapping to the current
@@ -48,6 +49,11 @@
  *     newly-mapped region could have been used by someone else, and you don't
  *     want to get stale mappings.
  *  4) Don't forget to set ret if it was provided.
+ *  5) MAP_POPULATE and MAP_LOCKED are not passed on to vmmap_map(). Instead,
+ *     for MAP_LOCKED, call vmmap_lock() on the new range as mlock() would,
+ *     and remove the mapping again if that fails. For MAP_POPULATE alone,
+ *     call vmmap_populate() on it; failing to populate is not an error,
+ *     the pages are simply faulted in later.
  * 
  *  If you are mapping less than a page, make sure that you are still allocating 
  *  a full page.
@@ -80,4 +86,93 @@ long do_munmap(void *addr, size_t len)
 {
     NOT_YET_IMPLEMENTED("VM: do_munmap");
     return -1;
-}
\ No newline at end of file
+}
+
+/*
+ * Checks that [addr, addr + len) is a page-aligned, nonempty range of the user
+ * address space, and turns it into pages. Returns 0 or -EINVAL.
+ */
+static long _user_page_range(void *addr, size_t len, size_t *lopage,
+                             size_t *npages)
+{
+    uintptr_t start = (uintptr_t)addr;
+    if (!PAGE_ALIGNED(start) || !len || start < USER_MEM_LOW ||
+        start >= USER_MEM_HIGH || len > USER_MEM_HIGH - start)
+    {
+        return -EINVAL;
+    }
+    *lopage = ADDR_TO_PN(start);
+    *npages = ADDR_TO_PN(PAGE_ALIGN_UP(start + len)) - *lopage;
+    return 0;
+}
+
+/*
+ * This function implements the madvise(2) syscall: tell the kernel how the
+ * given range of the current process's address space is going to be used.
+ * See vmmap_advise() for what each kind of advice does.
+ *
+ * Return 0 on success, or:
+ *  - EINVAL:
+ *     - addr is not page aligned
+ *     - len is 0
+ *     - the range is out of range of the user address space
+ *     - advice is not one of the MADV_ values in mman.h
+ *  - ENOMEM:
+ *     - part of the range is not mapped
+ *  - Propagate errors from vmmap_advise()
+ */
+long do_madvise(void *addr, size_t len, int advice)
+{
+    size_t lopage, npages;
+    long ret = _user_page_range(addr, len, &lopage, &npages);
+    if (ret)
+    {
+        return ret;
+    }
+    if (advice < MADV_NORMAL || advice > MADV_DONTNEED)
+    {
+        return -EINVAL;
+    }
+    return vmmap_advise(curproc->p_vmmap, lopage, npages, advice);
+}
+
+/*
+ * This function implements the mlock(2) syscall: fault in the given range of
+ * the current process's address space and keep it resident until munlock(),
+ * munmap() or exit. See vmmap_lock().
+ *
+ * Return 0 on success, or:
+ *  - EINVAL:
+ *     - addr is not page aligned
+ *     - len is 0
+ *     - the range is out of range of the user address space
+ *  - ENOMEM:
+ *     - part of the range is not mapped
+ *     - the process would have more than VMMAP_LOCKED_MAX_PAGES locked
+ *  - Propagate errors from vmmap_lock()
+ */
+long do_mlock(void *addr, size_t len)
+{
+    size_t lopage, npages;
+    long ret = _user_page_range(addr, len, &lopage, &npages);
+    if (ret)
+    {
+        return ret;
+    }
+    return vmmap_lock(curproc->p_vmmap, lopage, npages, 1);
+}
+
+/*
+ * This function implements the munlock(2) syscall: undo mlock() for the given
+ * range. Errors are as for do_mlock(), minus the limit.
+ */
+long do_munlock(void *addr, size_t len)
+{
+    size_t lopage, npages;
+    long ret = _user_page_range(addr, len, &lopage, &npages);
+    if (ret)
+    {
+        return ret;
+    }
+    return vmmap_lock(curproc->p_vmmap, lopage, npages, 0);
+}
@@ -8,6 +8,7 @@
 #include "mm/tlb.h"
 #include "types.h"
 #include "util/debug.h"
+#include "vm/readahead.h"
 
 /*
  * Respond to a user mode pagefault by setting up the desired page.
@@ -25,7 +26,8 @@
  *     b) If neither FAULT_WRITE nor FAULT_EXEC is specified, you may assume the
  *     fault was due to an attempted read.
  *  3) Obtain the corresponding pframe from the vmarea's mobj. Be careful about
- *     locking and error checking!
+ *     locking and error checking! If the page was pushed out to swap, getting
+ *     the pframe reads it back in (see swap_in()).
  *  4) Finally, set up a call to pt_map to insert a new mapping into the
  *     appropriate pagetable:
  *     a) Use pt_virt_to_phys() to obtain the physical address of the actual
@@ -34,8 +36,13 @@
  *        provide a page-aligned address to the mapping.
  *     c) For pdflags, use PT_PRESENT | PT_WRITE | PT_USER.
  *     d) For ptflags, start with PT_PRESENT | PT_USER. Also supply PT_WRITE if
- *        the user can and wants to write to the page.
+ *        the user can and wants to write to the page. This matters: a read
+ *        fault on untouched anonymous memory gets the zero page shared by
+ *        all such pframes, which must never be mapped writable.
  *  5) Flush the TLB.
+ *  6) Release the pframe and the mobj, then call readahead_fault() so that the
+ *     pages around vaddr are mapped or read ahead as the vmarea's vma_advice
+ *     asks (see vm/readahead.c).
  *
  * Tips:
  * 1) This gets called by _pt_fault_handler() in mm/pagetable.c, which
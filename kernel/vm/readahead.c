@@ -0,0 +1,321 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "fs/vnode.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "mm/mm.h"
+#include "mm/mman.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/pframe.h"
+
+#include "vm/readahead.h"
+#include "vm/shadow.h"
+#include "vm/vmmap.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/time.h"
+#include "util/timer.h"
+
+/*
+ * Readahead and fault-around for mapped files.
+ *
+ * After handle_pagefault() has mapped the page that faulted, it calls
+ * readahead_fault(), which uses the area's madvise() advice to decide what
+ * else to do:
+ *
+ *  - MADV_NORMAL: map the pages around vaddr (an aligned window of
+ *    FAULT_AROUND_PAGES) that are already in memory. Nothing is read in.
+ *  - MADV_SEQUENTIAL: get and map the next FAULT_AROUND_PAGES pages, reading
+ *    them in if needed, and queue the READAHEAD_PAGES after the fault for
+ *    readaheadd.
+ *  - MADV_RANDOM: nothing.
+ *
+ * Pages are always mapped read-only, so that a write still faults and goes
+ * through get_pframe with forwrite set (dirtying, copy-on-write).
+ *
+ * readaheadd is a kernel daemon that brings queued file pages into memory in
+ * the background. madvise(MADV_WILLNEED) queues work for it as well. Queued
+ * requests hold a reference on their object. When there is no room in the
+ * queue, or memory is short, requests are dropped: they are only hints.
+ */
+
+/* Pages mapped on each side of a fault, or ahead of it for sequential areas */
+#define FAULT_AROUND_PAGES 8
+
+/* Pages read ahead of a fault in a sequential area */
+#define READAHEAD_PAGES 32
+
+#define READAHEAD_QUEUE_LEN 32
+
+/* Below this many free pages, readahead is not worth pushing memory out */
+#define READAHEAD_MIN_FREE_PAGES 256
+
+/* How long readaheadd sleeps before checking whether it should exit, in
+ * jiffies (about a second) */
+#define READAHEAD_IDLE_JIFFIES 1000
+
+typedef struct readahead_req
+{
+    mobj_t *rr_obj; /* referenced */
+    size_t rr_pagenum;
+    size_t rr_npages;
+} readahead_req_t;
+
+static readahead_req_t readahead_queue[READAHEAD_QUEUE_LEN];
+static size_t readahead_head;
+static size_t readahead_count;
+static ktqueue_t readahead_waitq;
+static long readahead_running;
+
+static size_t readahead_requests;
+static size_t readahead_merged;
+static size_t readahead_dropped;
+static size_t readahead_pages;
+static size_t fault_around_pages;
+
+/*
+ * Queues [pagenum, pagenum + npages) of o to be brought into memory by
+ * readaheadd. Pages past the end of a file are left out. o must be locked.
+ */
+void readahead_async(mobj_t *o, size_t pagenum, size_t npages)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    if (o->mo_type == MOBJ_VNODE)
+    {
+        vnode_t *vn = CONTAINER_OF(o, vnode_t, vn_mobj);
+        size_t end = ADDR_TO_PN(PAGE_ALIGN_UP(vn->vn_len));
+        if (!vn->vn_ops->get_pframe || pagenum >= end)
+        {
+            return;
+        }
+        npages = MIN(npages, end - pagenum);
+    }
+    if (!readahead_running || !npages)
+    {
+        return;
+    }
+    if (page_free_count() < READAHEAD_MIN_FREE_PAGES)
+    {
+        readahead_dropped++;
+        return;
+    }
+
+    if (readahead_count)
+    {
+        // sequential faults keep asking for overlapping ranges
+        readahead_req_t *last =
+            &readahead_queue[(readahead_head + readahead_count - 1) %
+                             READAHEAD_QUEUE_LEN];
+        if (last->rr_obj == o && pagenum >= last->rr_pagenum &&
+            pagenum <= last->rr_pagenum + last->rr_npages)
+        {
+            last->rr_npages =
+                MAX(last->rr_npages, pagenum + npages - last->rr_pagenum);
+            readahead_merged++;
+            return;
+        }
+    }
+    if (readahead_count == READAHEAD_QUEUE_LEN)
+    {
+        readahead_dropped++;
+        return;
+    }
+
+    readahead_req_t *req =
+        &readahead_queue[(readahead_head + readahead_count) %
+                         READAHEAD_QUEUE_LEN];
+    mobj_ref(o);
+    req->rr_obj = o;
+    req->rr_pagenum = pagenum;
+    req->rr_npages = npages;
+    readahead_count++;
+    readahead_requests++;
+    sched_broadcast_on(&readahead_waitq);
+}
+
+/*
+ * Brings the pages of req into memory, one page per lock hold so that faults
+ * on the same object do not wait for the whole request. Gives up early if
+ * the reference held by the request is the last one left, or memory runs low.
+ */
+static void _readahead_fill(readahead_req_t *req)
+{
+    mobj_t *o = req->rr_obj;
+    for (size_t pagenum = req->rr_pagenum;
+         pagenum < req->rr_pagenum + req->rr_npages && o->mo_refcount > 1 &&
+         page_free_count() >= READAHEAD_MIN_FREE_PAGES;
+         pagenum++)
+    {
+        pframe_t *pf;
+        mobj_lock(o);
+        long ret = mobj_get_pframe(o, pagenum, 0, &pf);
+        if (!ret)
+        {
+            pframe_release(&pf);
+            readahead_pages++;
+        }
+        mobj_unlock(o);
+        if (ret)
+        {
+            break;
+        }
+    }
+    mobj_put(&req->rr_obj);
+}
+
+static void _readahead_timeout(uint64_t data)
+{
+    sched_broadcast_on(&readahead_waitq);
+}
+
+static void _readahead_wait()
+{
+    timer_t timer;
+    timer_init(&timer);
+    timer.function = _readahead_timeout;
+    timer.data = 0;
+    timer.expires = jiffies + READAHEAD_IDLE_JIFFIES;
+
+    timer_add(&timer);
+    sched_sleep_on(&readahead_waitq);
+    timer_del(&timer);
+}
+
+static void *readahead_run(long arg1, void *arg2)
+{
+    while (!proc_only_daemons_left())
+    {
+        if (!readahead_count)
+        {
+            _readahead_wait();
+            continue;
+        }
+        readahead_req_t req = readahead_queue[readahead_head];
+        readahead_head = (readahead_head + 1) % READAHEAD_QUEUE_LEN;
+        readahead_count--;
+        _readahead_fill(&req);
+    }
+
+    // drop what is still queued, the references would keep vnodes alive past
+    // vfs_shutdown()
+    readahead_running = 0;
+    for (; readahead_count; readahead_count--)
+    {
+        mobj_put(&readahead_queue[readahead_head].rr_obj);
+        readahead_head = (readahead_head + 1) % READAHEAD_QUEUE_LEN;
+    }
+    dbg(DBG_VM, "readaheadd exiting after %lu requests\n",
+        readahead_requests);
+    return NULL;
+}
+
+void readahead_start()
+{
+    sched_queue_init(&readahead_waitq);
+    proc_t *proc = proc_create("readaheadd");
+    KASSERT(proc && "failed to create readaheadd");
+    proc->p_daemon = 1;
+    kthread_t *thread = kthread_create(proc, readahead_run, 0, NULL);
+    KASSERT(thread && "failed to create readaheadd thread");
+    readahead_running = 1;
+    sched_make_runnable(thread);
+}
+
+/*
+ * Maps page vfn of vma read-only to pf, unless something is mapped there
+ * already. Returns 0, or -ENOMEM if a page table could not be allocated.
+ */
+static long _readahead_map(vmarea_t *vma, size_t vfn, pframe_t *pf)
+{
+    pml4_t *pml4 = vma->vma_vmmap->vmm_proc->p_pml4;
+    uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(vfn);
+    if (pt_is_mapped(pml4, vaddr))
+    {
+        return 0;
+    }
+    long ret = pt_map(pml4, pt_virt_to_phys((uintptr_t)pf->pf_addr), vaddr,
+                      PT_PRESENT | PT_WRITE | PT_USER, PT_PRESENT | PT_USER);
+    fault_around_pages += !ret;
+    return ret;
+}
+
+/*
+ * Called by handle_pagefault() once vfn, which lies in vma, is mapped. No
+ * locks may be held. See the top of this file.
+ */
+void readahead_fault(vmarea_t *vma, size_t vfn)
+{
+    if (vma->vma_advice == MADV_RANDOM || !(vma->vma_prot & PROT_READ))
+    {
+        return;
+    }
+    mobj_t *o = vma->vma_obj;
+
+    if (vma->vma_advice == MADV_SEQUENTIAL)
+    {
+        mobj_t *bottom = shadow_chain_bottom(o);
+        if (bottom->mo_type == MOBJ_VNODE)
+        {
+            mobj_lock(bottom);
+            readahead_async(bottom, vma->vma_off + vfn + 1 - vma->vma_start,
+                            READAHEAD_PAGES);
+            mobj_unlock(bottom);
+        }
+
+        size_t end = MIN(vfn + 1 + FAULT_AROUND_PAGES, vma->vma_end);
+        for (size_t next = vfn + 1; next < end; next++)
+        {
+            pframe_t *pf;
+            mobj_lock(o);
+            long ret = mobj_get_pframe(
+                o, vma->vma_off + next - vma->vma_start, 0, &pf);
+            if (!ret)
+            {
+                ret = _readahead_map(vma, next, pf);
+                pframe_release(&pf);
+            }
+            mobj_unlock(o);
+            if (ret)
+            {
+                break;
+            }
+        }
+        return;
+    }
+
+    size_t start = MAX(vfn - vfn % FAULT_AROUND_PAGES, vma->vma_start);
+    size_t end = MIN(start + FAULT_AROUND_PAGES, vma->vma_end);
+    for (size_t next = start; next < end; next++)
+    {
+        pframe_t *pf;
+        if (next == vfn ||
+            !(pf = shadow_peek_pframe(o, vma->vma_off + next - vma->vma_start)))
+        {
+            continue;
+        }
+        long ret = _readahead_map(vma, next, pf);
+        pframe_release(&pf);
+        if (ret)
+        {
+            break;
+        }
+    }
+}
+
+size_t readahead_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+    iprintf(&buf, &size, "readahead requests:  %lu (%lu merged, %lu dropped)\n",
+            readahead_requests, readahead_merged, readahead_dropped);
+    iprintf(&buf, &size, "pages read ahead:    %lu\n", readahead_pages);
+    iprintf(&buf, &size, "fault-around pages:  %lu\n", fault_around_pages);
+    return size;
+}
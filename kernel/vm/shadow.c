@@ -1,9 +1,12 @@
+#include "errno.h"
 #include "vm/shadow.h"
 #include "mm/page.h"
 #include "mm/pframe.h"
 #include "mm/slab.h"
+#include "mm/swap.h"
 #include "util/debug.h"
 #include "util/string.h"
+#include "vm/vmmap.h"
 
 #define SHADOW_SINGLETON_THRESHOLD 5
 
@@ -23,6 +26,8 @@ typedef struct mobj_shadow
 
 #define MOBJ_TO_SO(o) CONTAINER_OF(o, mobj_shadow_t, mobj)
 
+size_t shadow_flatten_count = 0;
+
 static slab_allocator_t *shadow_allocator;
 
 static long shadow_get_pframe(mobj_t *o, size_t pagenum, long forwrite,
@@ -89,6 +94,180 @@ void shadow_collapse(mobj_t *o)
     NOT_YET_IMPLEMENTED("VM: shadow_collapse");
 }
 
+/*
+ * Returns nonzero if target is o itself or any object further down o's shadow
+ * chain. Used by compaction to find the mappings that may be backed by one of
+ * target's pframes. Iterative for the same reason shadow_get_pframe is.
+ */
+long shadow_chain_contains(mobj_t *o, mobj_t *target)
+{
+    while (o)
+    {
+        if (o == target)
+        {
+            return 1;
+        }
+        if (o->mo_type != MOBJ_SHADOW)
+        {
+            return 0;
+        }
+        o = MOBJ_TO_SO(o)->shadowed;
+    }
+    return 0;
+}
+
+/*
+ * Returns the number of shadow objects between o and the bottom object of its
+ * chain, counting o itself; 0 if o is not a shadow object.
+ */
+size_t shadow_chain_depth(mobj_t *o)
+{
+    size_t depth = 0;
+    for (; o->mo_type == MOBJ_SHADOW; o = MOBJ_TO_SO(o)->shadowed)
+    {
+        depth++;
+    }
+    return depth;
+}
+
+/*
+ * Returns the object at the bottom of o's chain, or o itself if it is not a
+ * shadow object.
+ */
+mobj_t *shadow_chain_bottom(mobj_t *o)
+{
+    while (o->mo_type == MOBJ_SHADOW)
+    {
+        o = MOBJ_TO_SO(o)->shadowed;
+    }
+    return o;
+}
+
+/*
+ * Returns, locked, the pframe that a read of page pagenum through o would
+ * find, provided it is already in memory and can be had without blocking.
+ * Returns NULL if the page is not resident anywhere on the chain, or if
+ * something on the way is locked by someone else. Used by fault-around (see
+ * vm/readahead.c), which must never wait. Nothing here blocks, so the chain
+ * cannot change during the walk.
+ */
+pframe_t *shadow_peek_pframe(mobj_t *o, size_t pagenum)
+{
+    while (o)
+    {
+        if (!kmutex_trylock(&o->mo_mutex))
+        {
+            return NULL;
+        }
+        pframe_t *pf =
+            o->mo_btree ? (pframe_t *)btree_search(o->mo_btree, pagenum) : NULL;
+        mobj_t *next =
+            !pf && o->mo_type == MOBJ_SHADOW ? MOBJ_TO_SO(o)->shadowed : NULL;
+        if (pf && !kmutex_trylock(&pf->pf_mutex))
+        {
+            pf = NULL;
+        }
+        else if (pf && !pf->pf_addr)
+        {
+            // out in swap
+            pframe_release(&pf);
+        }
+        mobj_unlock(o);
+        if (pf)
+        {
+            return pf;
+        }
+        o = next;
+    }
+    return NULL;
+}
+
+/*
+ * Copy every page that o sees through its shadow chain but does not hold
+ * itself into o, then make o shadow its bottom object directly. Unlike
+ * shadow_collapse(), this also works when the objects in between are shared
+ * with other chains, at the price of duplicating their pages.
+ *
+ * o must be locked. Returns 0 on success or -ENOMEM, in which case o keeps its
+ * chain (and whatever pages were already copied, which are correct anyway).
+ */
+static long shadow_flatten(mobj_t *o)
+{
+    mobj_shadow_t *so = MOBJ_TO_SO(o);
+    // walk top down, so that the newest copy of a page is the one kept
+    for (mobj_t *s = so->shadowed; s->mo_type == MOBJ_SHADOW;
+         s = MOBJ_TO_SO(s)->shadowed)
+    {
+        mobj_lock(s);
+        list_iterate(&s->mo_pframes, spf, pframe_t, pf_link)
+        {
+            size_t pagenum = spf->pf_pagenum;
+            if (btree_search(o->mo_btree, pagenum))
+            {
+                continue;
+            }
+
+            pframe_t *src, *dst;
+            long ret = mobj_default_get_pframe(s, pagenum, 0, &src);
+            if (ret)
+            {
+                mobj_unlock(s);
+                return ret;
+            }
+            mobj_create_pframe(o, pagenum, 0, &dst);
+            if (!dst || pframe_alloc_page(dst))
+            {
+                pframe_release(&src);
+                mobj_unlock(s);
+                if (dst)
+                {
+                    pframe_release(&dst);
+                    mobj_delete_pframe(o, pagenum);
+                }
+                return -ENOMEM;
+            }
+            memcpy(dst->pf_addr, src->pf_addr, PAGE_SIZE);
+            dst->pf_dirty = 1;
+            pframe_release(&dst);
+            pframe_release(&src);
+        }
+        mobj_unlock(s);
+    }
+
+    // Page tables above o may still map pages of the shadows being dropped;
+    // unmap them so that the next access refaults through the new chain.
+    vmmap_unmap_mobj(o);
+
+    mobj_t *bottom = so->bottom_mobj;
+    mobj_lock(bottom);
+    mobj_ref(bottom);
+    mobj_unlock(bottom);
+    mobj_t *old = so->shadowed;
+    so->shadowed = bottom;
+    mobj_put(&old);
+    shadow_flatten_count++;
+    return 0;
+}
+
+/*
+ * Make sure that o's shadow chain is no deeper than SHADOW_MAX_DEPTH, so that
+ * the cost of a page fault does not grow with the number of forks behind it.
+ * Call shadow_collapse() first; this only kicks in when that is not enough.
+ *
+ * o must be a locked shadow object.
+ */
+long shadow_bound_depth(mobj_t *o)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex) && o->mo_type == MOBJ_SHADOW);
+    if (shadow_chain_depth(o) <= SHADOW_MAX_DEPTH)
+    {
+        return 0;
+    }
+    dbg(DBG_VM, "flattening shadow chain of depth %lu under 0x%p\n",
+        shadow_chain_depth(o), o);
+    return shadow_flatten(o);
+}
+
 /*
  * Obtain the desired pframe from the given mobj, traversing its shadow chain if
  * necessary. This is where copy-on-write logic happens!
@@ -111,6 +290,9 @@ void shadow_collapse(mobj_t *o)
  *        you will cause a kernel buffer overflow (e.g. from forkbomb).
  *     b) If no shadow objects have the page, call mobj_get_pframe() to get the
  *        page from the bottom object and return what it returns.
+ *     c) A pframe found on the chain may have been pushed out to swap, i.e.
+ *        have a NULL pf_addr. mobj_get_pframe() on the object that holds it
+ *        brings it back in.
  * 
  *  Pay attention to pframe locking.
  */
@@ -154,8 +336,8 @@ static long shadow_fill_pframe(mobj_t *o, pframe_t *pf)
  * Return 0 on success.
  *
  * Hint:
- *  - Are shadow objects backed to disk? Do you actually need to do anything
- *    here?
+ *  - Shadow objects are not backed by a file, but their pages can be written
+ *    out to swap; see swap_flush_pframe().
  */
 static long shadow_flush_pframe(mobj_t *o, pframe_t *pf)
 {
@@ -0,0 +1,144 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "mm/mobj.h"
+
+#include "vm/shadow.h"
+#include "vm/shadowd.h"
+#include "vm/vmmap.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/time.h"
+
+/*
+ * shadowd, the shadow object cleanup daemon.
+ *
+ * fork() leaves a pair of shadow objects on top of every private mapping,
+ * and shadow_collapse() is only run on the chains of the process that forks.
+ * The chains of a process that never forks again keep any objects
+ * that its exited relatives left behind. Those objects pin dead pages and
+ * make every read fault walk further.
+ *
+ * Every SHADOWD_INTERVAL_USEC, shadowd goes through all processes and
+ * shortens each chain deeper than SHADOW_MAX_DEPTH: it collapses the chain and,
+ * if that is not enough, flattens it. Chains within the bound are left alone;
+ * shadow_collapse() cannot be relied on to shorten them, and picking them
+ * would only spin on chains that stay the same.
+ *
+ * Built in when SHADOWD=1 in Config.mk. shadowd runs as a child of init and
+ * exits once init has only daemons left, so that init can shut the system
+ * down.
+ */
+
+#define SHADOWD_INTERVAL_USEC 1000000
+
+/* Chains cleaned up per pass; later ones wait for the next pass */
+#define SHADOWD_BATCH 32
+
+static size_t shadowd_passes;
+static size_t shadowd_cleaned;
+
+/*
+ * Returns, with a new reference, the top object of a chain that is too deep,
+ * or NULL if there is none. Nothing here blocks, so
+ * the process and vmarea lists cannot change during the walk.
+ */
+static mobj_t *_shadowd_find_work()
+{
+    list_iterate(&proc_list, p, proc_t, p_list_link)
+    {
+        if (p->p_state == PROC_DEAD || !p->p_vmmap)
+        {
+            continue;
+        }
+        list_iterate(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink)
+        {
+            mobj_t *o = vma->vma_obj;
+            if (o && o->mo_type == MOBJ_SHADOW &&
+                shadow_chain_depth(o) > SHADOW_MAX_DEPTH &&
+                atomic_inc_not_zero(&o->mo_refcount))
+            {
+                return o;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *shadowd_run(long arg1, void *arg2)
+{
+    while (!do_usleep(SHADOWD_INTERVAL_USEC) && !proc_only_daemons_left())
+    {
+        mobj_t *o;
+        for (size_t i = 0; i < SHADOWD_BATCH && (o = _shadowd_find_work());
+             i++)
+        {
+            mobj_lock(o);
+            size_t depth = shadow_chain_depth(o);
+            shadow_collapse(o);
+            shadow_bound_depth(o);
+            if (shadow_chain_depth(o) < depth)
+            {
+                shadowd_cleaned++;
+            }
+            mobj_put_locked(&o);
+        }
+        shadowd_passes++;
+    }
+    dbg(DBG_VM, "shadowd exiting after %lu passes\n", shadowd_passes);
+    return NULL;
+}
+
+void shadowd_start()
+{
+    proc_t *proc = proc_create("shadowd");
+    KASSERT(proc && "failed to create shadowd");
+    proc->p_daemon = 1;
+    kthread_t *thread = kthread_create(proc, shadowd_run, 0, NULL);
+    KASSERT(thread && "failed to create shadowd thread");
+    sched_make_runnable(thread);
+}
+
+/*
+ * Prints how many mappings sit on shadow chains of each depth (0 meaning the
+ * mapping's object is not a shadow object), plus shadowd's counters.
+ */
+size_t shadowd_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+
+    size_t hist[SHADOW_MAX_DEPTH + 2] = {0};
+    list_iterate(&proc_list, p, proc_t, p_list_link)
+    {
+        if (p->p_state == PROC_DEAD || !p->p_vmmap)
+        {
+            continue;
+        }
+        list_iterate(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink)
+        {
+            if (vma->vma_obj)
+            {
+                size_t depth = shadow_chain_depth(vma->vma_obj);
+                hist[MIN(depth, SHADOW_MAX_DEPTH + 1)]++;
+            }
+        }
+    }
+
+    iprintf(&buf, &size, "%5s %10s\n", "DEPTH", "MAPPINGS");
+    for (size_t depth = 0; depth <= SHADOW_MAX_DEPTH; depth++)
+    {
+        iprintf(&buf, &size, "%5lu %10lu\n", depth, hist[depth]);
+    }
+    iprintf(&buf, &size, "%4s%d %10lu\n", ">", SHADOW_MAX_DEPTH,
+            hist[SHADOW_MAX_DEPTH + 1]);
+    iprintf(&buf, &size, "shadowd passes:      %lu (%lu chains shortened)\n",
+            shadowd_passes, shadowd_cleaned);
+    iprintf(&buf, &size, "chains flattened:    %lu\n", shadow_flatten_count);
+    return size;
+}
@@ -3,6 +3,7 @@
 #include <errno.h>
 
 #include "vm/anon.h"
+#include "vm/readahead.h"
 #include "vm/shadow.h"
 
 #include "util/debug.h"
@@ -16,6 +17,7 @@
 #include "mm/mm.h"
 #include "mm/mman.h"
 #include "mm/slab.h"
+#include "mm/tlb.h"
 
 static slab_allocator_t *vmmap_allocator;
 static slab_allocator_t *vmarea_allocator;
@@ -28,7 +30,8 @@ void vmmap_init(void)
 }
 
 /*
- * Allocate and initialize a new vmarea using vmarea_allocator.
+ * Allocate and initialize a new vmarea using vmarea_allocator. Its vma_advice
+ * starts out as MADV_NORMAL.
  */
 vmarea_t *vmarea_alloc(void)
 {
@@ -111,7 +114,8 @@ vmarea_t *vmmap_lookup(vmmap_t *map, size_t vfn)
 }
 
 /*
- * For each vmarea in the map, if it is a shadow object, call shadow_collapse.
+ * For each vmarea in the map, if it is a shadow object, call shadow_collapse,
+ * and then shadow_bound_depth in case the chain is still too long.
  */
 void vmmap_collapse(vmmap_t *map)
 {
@@ -121,6 +125,7 @@ void vmmap_collapse(vmmap_t *map)
         {
             mobj_lock(vma->vma_obj);
             shadow_collapse(vma->vma_obj);
+            shadow_bound_depth(vma->vma_obj);
             mobj_unlock(vma->vma_obj);
         }
     }
@@ -136,6 +141,7 @@ void vmmap_collapse(vmmap_t *map)
  * somewhere in this function. If you're unsure why, look at the "Shadow Objects"
  * portion of the VM handout.
  *  1) vmarea is share-mapped, you don't need to do anything special. 
+ *  Locks are not inherited: clear MAP_LOCKED in the new vmareas.
  *  2) vmarea is not share-mapped, time for shadow objects: 
  *     a) Create two shadow objects, one for map and one for the new vmmap you
  *        are constructing, both of which shadow the current vma_obj the vmarea
@@ -232,6 +238,300 @@ long vmmap_remove(vmmap_t *map, size_t lopage, size_t npages)
     return -1;
 }
 
+/*
+ * Splits vma at page vfn, which must lie strictly inside it. The new area takes
+ * [vfn, vma_end) with the same object and settings, and goes right after vma
+ * in the map. Returns the new area, or NULL if vmarea_alloc() failed.
+ */
+static vmarea_t *_vmarea_split(vmarea_t *vma, size_t vfn)
+{
+    KASSERT(vma->vma_start < vfn && vfn < vma->vma_end);
+    vmarea_t *tail = vmarea_alloc();
+    if (!tail)
+    {
+        return NULL;
+    }
+    tail->vma_start = vfn;
+    tail->vma_end = vma->vma_end;
+    tail->vma_off = vma->vma_off + (vfn - vma->vma_start);
+    tail->vma_prot = vma->vma_prot;
+    tail->vma_flags = vma->vma_flags;
+    tail->vma_advice = vma->vma_advice;
+    tail->vma_vmmap = vma->vma_vmmap;
+    tail->vma_obj = vma->vma_obj;
+    mobj_lock(tail->vma_obj);
+    mobj_ref(tail->vma_obj);
+    mobj_unlock(tail->vma_obj);
+
+    vma->vma_end = vfn;
+    list_insert_before(vma->vma_plink.l_next, &tail->vma_plink);
+    return tail;
+}
+
+/*
+ * Cuts vma down to [lo, hi), which must overlap it, splitting off the parts
+ * outside. Returns the area covering [lo, hi), or NULL if a split failed. The
+ * pieces go right after vma, so a list_iterate() over the map that is at vma
+ * does not visit them.
+ */
+static vmarea_t *_vmarea_clip(vmarea_t *vma, size_t lo, size_t hi)
+{
+    if (lo > vma->vma_start && !(vma = _vmarea_split(vma, lo)))
+    {
+        return NULL;
+    }
+    if (hi < vma->vma_end && !_vmarea_split(vma, hi))
+    {
+        return NULL;
+    }
+    return vma;
+}
+
+/*
+ * Returns nonzero if every page of [lopage, hipage) is mapped.
+ */
+static long _vmmap_range_mapped(vmmap_t *map, size_t lopage, size_t hipage)
+{
+    size_t next = lopage;
+    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
+    {
+        if (next >= hipage || vma->vma_start > next)
+        {
+            break;
+        }
+        next = MAX(next, vma->vma_end);
+    }
+    return next >= hipage;
+}
+
+/*
+ * Returns the number of pages of [lopage, hipage) in MAP_LOCKED areas.
+ */
+static size_t _vmmap_locked_in(vmmap_t *map, size_t lopage, size_t hipage)
+{
+    size_t locked = 0;
+    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
+    {
+        if ((vma->vma_flags & MAP_LOCKED) && vma->vma_end > lopage &&
+            vma->vma_start < hipage)
+        {
+            locked += MIN(hipage, vma->vma_end) - MAX(lopage, vma->vma_start);
+        }
+    }
+    return locked;
+}
+
+/*
+ * MADV_DONTNEED for the part [lopage, hipage) of vma. The pages are unmapped,
+ * and the pframes that only this mapping can see (those of its private shadow
+ * object) are thrown away, so the next access finds what the object below
+ * holds: zeros for anonymous memory, the file for a private file mapping.
+ * Shared mappings are only unmapped; the next access maps the same pages.
+ */
+static void _vmarea_dontneed(vmarea_t *vma, size_t lopage, size_t hipage)
+{
+    pt_unmap_range(vma->vma_vmmap->vmm_proc->p_pml4,
+                   (uintptr_t)PN_TO_ADDR(lopage), (uintptr_t)PN_TO_ADDR(hipage));
+
+    mobj_t *o = vma->vma_obj;
+    if (o->mo_type != MOBJ_SHADOW)
+    {
+        return;
+    }
+    size_t first = vma->vma_off + lopage - vma->vma_start;
+    size_t last = first + (hipage - lopage);
+    mobj_lock(o);
+    list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
+    {
+        if (pf->pf_pagenum >= first && pf->pf_pagenum < last)
+        {
+            mobj_delete_pframe(o, pf->pf_pagenum);
+        }
+    }
+    mobj_unlock(o);
+}
+
+/*
+ * Applies the madvise() advice to [lopage, lopage + npages). Returns -ENOMEM,
+ * before changing anything, if part of the range is not mapped, or -EINVAL
+ * for MADV_DONTNEED on locked pages.
+ *
+ *  - MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL: set vma_advice on the areas in
+ *    the range, splitting those that stick out of it. This tunes fault-around
+ *    and readahead (see vm/readahead.c).
+ *  - MADV_WILLNEED: queue the file pages behind the range for readaheadd.
+ *    Anonymous memory has nothing to read in and is left alone.
+ *  - MADV_DONTNEED: see _vmarea_dontneed().
+ *
+ * May also fail with -ENOMEM if an area cannot be split, in which case the
+ * areas before it have already taken the advice.
+ */
+long vmmap_advise(vmmap_t *map, size_t lopage, size_t npages, int advice)
+{
+    size_t hipage = lopage + npages;
+    if (!_vmmap_range_mapped(map, lopage, hipage))
+    {
+        return -ENOMEM;
+    }
+    if (advice == MADV_DONTNEED && _vmmap_locked_in(map, lopage, hipage))
+    {
+        return -EINVAL;
+    }
+
+    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
+    {
+        if (vma->vma_end <= lopage)
+        {
+            continue;
+        }
+        if (vma->vma_start >= hipage)
+        {
+            break;
+        }
+        size_t lo = MAX(lopage, vma->vma_start);
+        size_t hi = MIN(hipage, vma->vma_end);
+        if (advice == MADV_WILLNEED)
+        {
+            mobj_t *bottom = shadow_chain_bottom(vma->vma_obj);
+            if (bottom->mo_type == MOBJ_VNODE)
+            {
+                mobj_lock(bottom);
+                readahead_async(bottom, vma->vma_off + lo - vma->vma_start,
+                                hi - lo);
+                mobj_unlock(bottom);
+            }
+        }
+        else if (advice == MADV_DONTNEED)
+        {
+            _vmarea_dontneed(vma, lo, hi);
+        }
+        else if (vma->vma_advice != advice)
+        {
+            if (!(vma = _vmarea_clip(vma, lo, hi)))
+            {
+                return -ENOMEM;
+            }
+            vma->vma_advice = advice;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Faults in every page of [lopage, lopage + npages) that its area lets the
+ * process access, as handle_pagefault() would on first touch. Private
+ * writable pages get their own copy right away. Everything else is mapped
+ * read-only, so that writes still go through get_pframe with forwrite set.
+ * Unmapped parts of the range are skipped. Returns 0, or the first error from
+ * mobj_get_pframe() or pt_map().
+ */
+long vmmap_populate(vmmap_t *map, size_t lopage, size_t npages)
+{
+    pml4_t *pml4 = map->vmm_proc->p_pml4;
+    size_t hipage = lopage + npages;
+    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
+    {
+        if (vma->vma_end <= lopage || vma->vma_prot == PROT_NONE)
+        {
+            continue;
+        }
+        if (vma->vma_start >= hipage)
+        {
+            break;
+        }
+        long forwrite =
+            (vma->vma_prot & PROT_WRITE) && (vma->vma_flags & MAP_PRIVATE);
+        size_t end = MIN(hipage, vma->vma_end);
+        for (size_t vfn = MAX(lopage, vma->vma_start); vfn < end; vfn++)
+        {
+            uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(vfn);
+            if (!forwrite && pt_is_mapped(pml4, vaddr))
+            {
+                continue;
+            }
+            pframe_t *pf;
+            mobj_lock(vma->vma_obj);
+            long ret = mobj_get_pframe(
+                vma->vma_obj, vma->vma_off + vfn - vma->vma_start, forwrite,
+                &pf);
+            if (!ret)
+            {
+                ret = pt_map(pml4, pt_virt_to_phys((uintptr_t)pf->pf_addr),
+                             vaddr, PT_PRESENT | PT_WRITE | PT_USER,
+                             PT_PRESENT | PT_USER | (forwrite ? PT_WRITE : 0));
+                pframe_release(&pf);
+            }
+            mobj_unlock(vma->vma_obj);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * mlock() (lock nonzero) and munlock(): set or clear MAP_LOCKED on the areas
+ * in [lopage, lopage + npages), splitting those that stick out of it. Locking
+ * also faults the whole range in. The pages of locked areas then stay
+ * resident and in place: swap reclaim and compaction skip them (see
+ * vmmap_mobj_page_locked()).
+ *
+ * Returns 0, or -ENOMEM if part of the range is not mapped, if locking it
+ * would take the process over VMMAP_LOCKED_MAX_PAGES, or if splitting an area
+ * failed. Errors from vmmap_populate() are passed on; the range stays locked
+ * in that case, and munlock() undoes it.
+ */
+long vmmap_lock(vmmap_t *map, size_t lopage, size_t npages, long lock)
+{
+    size_t hipage = lopage + npages;
+    if (!_vmmap_range_mapped(map, lopage, hipage))
+    {
+        return -ENOMEM;
+    }
+    if (lock && vmmap_locked_pages(map) + npages -
+                        _vmmap_locked_in(map, lopage, hipage) >
+                    VMMAP_LOCKED_MAX_PAGES)
+    {
+        return -ENOMEM;
+    }
+
+    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
+    {
+        if (vma->vma_end <= lopage || !(vma->vma_flags & MAP_LOCKED) == !lock)
+        {
+            continue;
+        }
+        if (vma->vma_start >= hipage)
+        {
+            break;
+        }
+        if (!(vma = _vmarea_clip(vma, MAX(lopage, vma->vma_start),
+                                 MIN(hipage, vma->vma_end))))
+        {
+            return -ENOMEM;
+        }
+        if (lock)
+        {
+            vma->vma_flags |= MAP_LOCKED;
+        }
+        else
+        {
+            vma->vma_flags &= ~MAP_LOCKED;
+        }
+    }
+    return lock ? vmmap_populate(map, lopage, npages) : 0;
+}
+
+/*
+ * Returns the number of pages in the map's MAP_LOCKED areas.
+ */
+size_t vmmap_locked_pages(vmmap_t *map)
+{
+    return _vmmap_locked_in(map, 0, ADDR_TO_PN(USER_MEM_HIGH));
+}
+
 /*
  * Returns 1 if the given address space has no mappings for the given range,
  * 0 otherwise.
@@ -285,6 +585,100 @@ long vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
     return 0;
 }
 
+/*
+ * Remove every user mapping of page pagenum of o, in any process whose vmmap
+ * maps o directly or through a shadow chain. The next access refaults and picks
+ * up whatever pframe o holds for that page at that point. This is how memory
+ * compaction (mm/compact.c) retargets user page tables after moving a pframe.
+ *
+ * The caller must hold o's mutex.
+ */
+void vmmap_unmap_mobj_page(mobj_t *o, size_t pagenum)
+{
+    list_iterate(&proc_list, p, proc_t, p_list_link)
+    {
+        if (!p->p_vmmap)
+        {
+            continue;
+        }
+        list_iterate(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink)
+        {
+            if (pagenum < vma->vma_off ||
+                pagenum - vma->vma_off >= vma->vma_end - vma->vma_start ||
+                !shadow_chain_contains(vma->vma_obj, o))
+            {
+                continue;
+            }
+            uintptr_t vaddr =
+                (uintptr_t)PN_TO_ADDR(vma->vma_start + pagenum - vma->vma_off);
+            pt_unmap(p->p_pml4, vaddr);
+            if (p->p_pml4 == pt_get())
+            {
+                tlb_flush(vaddr);
+            }
+        }
+    }
+}
+
+/*
+ * Remove every user mapping of every vmarea that maps o directly or through a
+ * shadow chain. Used when o's chain is rewired (shadow_flatten()), after which
+ * page table entries may still point at pages of objects o no longer sees.
+ *
+ * The caller must hold o's mutex.
+ */
+void vmmap_unmap_mobj(mobj_t *o)
+{
+    list_iterate(&proc_list, p, proc_t, p_list_link)
+    {
+        if (!p->p_vmmap)
+        {
+            continue;
+        }
+        list_iterate(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink)
+        {
+            if (!shadow_chain_contains(vma->vma_obj, o))
+            {
+                continue;
+            }
+            uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(vma->vma_start);
+            uintptr_t vmax = (uintptr_t)PN_TO_ADDR(vma->vma_end);
+            pt_unmap_range(p->p_pml4, vaddr, vmax);
+            if (p->p_pml4 == pt_get())
+            {
+                tlb_flush_range(vaddr, vma->vma_end - vma->vma_start);
+            }
+        }
+    }
+}
+
+/*
+ * Returns nonzero if page pagenum of o may be seen through a MAP_LOCKED area
+ * of some process. Swap reclaim and compaction leave such pages where they
+ * are. Along a shadow chain this errs on the side of pinning: a locked area
+ * pins the page even if an object above o holds its own copy of it.
+ */
+long vmmap_mobj_page_locked(mobj_t *o, size_t pagenum)
+{
+    list_iterate(&proc_list, p, proc_t, p_list_link)
+    {
+        if (!p->p_vmmap)
+        {
+            continue;
+        }
+        list_iterate(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink)
+        {
+            if ((vma->vma_flags & MAP_LOCKED) && pagenum >= vma->vma_off &&
+                pagenum - vma->vma_off < vma->vma_end - vma->vma_start &&
+                shadow_chain_contains(vma->vma_obj, o))
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
 size_t vmmap_mapping_info(const void *vmmap, char *buf, size_t osize)
 {
     return vmmap_mapping_info_helper(vmmap, buf, osize, "");
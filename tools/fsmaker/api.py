@@ -1,21 +1,45 @@
 import os
+import itertools
 import math
 import struct
 
 S5_MAGIC = 0x727f
-S5_CURRENT_VERSION = 3
+S5_CURRENT_VERSION = 7
+S5_MIN_VERSION = 5
+S5_BITMAP_VERSION = 6
+S5_JOURNAL_VERSION = 7
 S5_BLOCK_SIZE = 4096
 
 S5_NBLKS_PER_FNODE = 30
-S5_NDIRECT_BLOCKS = 28
-S5_MAX_FILE_BLOCKS = S5_NDIRECT_BLOCKS + math.floor(S5_BLOCK_SIZE / 4)
+S5_BITS_PER_BLOCK = S5_BLOCK_SIZE * 8
+S5_GROUP_BLOCKS = 1024
+
+S5_JOURNAL_MAGIC = 0x4c4e524a
+S5_JOURNAL_DESC_MAGIC = 0x4353444a
+S5_JOURNAL_MAX_BLOCKS = 128
+S5_JOURNAL_MIN_BLOCKS = 8
+S5_NDIRECT_BLOCKS = 25
+S5_NIDIRECT_BLOCKS = S5_BLOCK_SIZE // 4
+S5_MAX_FILE_BLOCKS = S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS ** 2 + S5_NIDIRECT_BLOCKS ** 3
 S5_MAX_FILE_SIZE = S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE
 
 S5_NAME_LEN = 28
 S5_DIRENT_SIZE = S5_NAME_LEN + 4
-
-S5_INODE_SIZE = 16 + S5_NDIRECT_BLOCKS * 4
-S5_INODES_PER_BLOCK = S5_BLOCK_SIZE / S5_INODE_SIZE
+S5_DIRENTS_PER_BLOCK = S5_BLOCK_SIZE // S5_DIRENT_SIZE
+
+# Hashed directories, see s5_dir_index_t in kernel/include/fs/s5fs/s5fs.h
+S5_DIR_INDEX_MAGIC = 0x52494448
+S5_DIR_MIN_BUCKETS = 4
+S5_DIR_MAX_BUCKETS = 512
+S5_DIR_SLOTS_PER_BLOCK = S5_DIRENTS_PER_BLOCK - 1
+S5_DIR_INDEX_FORMAT = "IIII"
+S5_DIR_BLOCK_FORMAT = "II"
+
+# size, number, type, link count, direct blocks, indirect, double indirect and
+# triple indirect blocks, high 32 bits of the size
+S5_INODE_SIZE = 12 + S5_NDIRECT_BLOCKS * 4 + 16
+S5_INODE_SIZE_HIGH_OFFSET = S5_INODE_SIZE - 4
+S5_INODES_PER_BLOCK = S5_BLOCK_SIZE // S5_INODE_SIZE
 
 S5_TYPE_FREE = 0x0
 S5_TYPE_DATA = 0x1
@@ -24,6 +48,16 @@ S5_TYPE_CHR = 0x4
 S5_TYPE_BLK = 0x8
 S5_TYPES = set([ S5_TYPE_FREE, S5_TYPE_DATA, S5_TYPE_DIR, S5_TYPE_CHR, S5_TYPE_BLK ])
 
+def s5_dir_hash(name):
+    # 32-bit FNV-1a, the same as s5_dir_hash() in the kernel
+    h = 2166136261
+    for c in bytearray(name):
+        h = ((h ^ c) * 16777619) & 0xffffffff
+    return h
+
+def _name_bytes(name):
+    return name if isinstance(name, bytes) else name.encode("utf8")
+
 class S5fsException(Exception):
 
     def __init__(self, msg):
@@ -68,7 +102,9 @@ class Block:
             self._simdisk._simfile.write(b'\0')
 
     def free(self):
-        if (self._simdisk.get_nfree() < S5_NBLKS_PER_FNODE - 1):
+        if (self._simdisk.has_bitmap()):
+            self._simdisk._set_bitmap_bit(self._blockno, False)
+        elif (self._simdisk.get_nfree() < S5_NBLKS_PER_FNODE - 1):
             self._simdisk.set_free_block(self._simdisk.get_nfree(), self._blockno)
             self._simdisk.set_nfree(self._simdisk.get_nfree() + 1)
         else:
@@ -87,7 +123,7 @@ class Dirent:
         self._offset = offset
 
     def remove(self):
-        self._parent.write(self._offset + 4, '\0')
+        self._parent._remove_dirent(self._offset)
 
 class Inode:
 
@@ -98,18 +134,24 @@ class Inode:
         self._offset = offset
 
     def get_next_free(self):
-        return self.get_size()
+        self._simfile.seek(int(self._offset))
+        return struct.unpack("I", self._simfile.read(4))[0]
 
     def set_next_free(self, val):
-        return self.set_size(val)
+        self._simfile.seek(int(self._offset))
+        self._simfile.write(struct.pack("I", val))
 
     def get_size(self):
         self._simfile.seek(int(self._offset))
-        return struct.unpack("I", self._simfile.read(4))[0]
+        low = struct.unpack("I", self._simfile.read(4))[0]
+        self._simfile.seek(int(self._offset + S5_INODE_SIZE_HIGH_OFFSET))
+        return struct.unpack("I", self._simfile.read(4))[0] << 32 | low
 
     def set_size(self, val):
         self._simfile.seek(int(self._offset))
-        self._simfile.write(struct.pack("I", val))
+        self._simfile.write(struct.pack("I", val & 0xffffffff))
+        self._simfile.seek(int(self._offset + S5_INODE_SIZE_HIGH_OFFSET))
+        self._simfile.write(struct.pack("I", val >> 32))
 
     def get_number(self):
         self._simfile.seek(int(self._offset + 4))
@@ -149,14 +191,98 @@ class Inode:
         else:
             raise S5fsException("direct block index {0} greater than max {1}".format(index, S5_NDIRECT_BLOCKS))
 
-    def get_indirect_blockno(self):
-        self._simfile.seek(int(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS))
+    # depth 1 is the indirect block, 2 the double and 3 the triple indirect block
+    def get_indirect_blockno(self, depth=1):
+        self._simfile.seek(int(self._offset + 12 + 4 * (S5_NDIRECT_BLOCKS + depth - 1)))
         return struct.unpack("I", self._simfile.read(4))[0]
 
-    def set_indirect_blockno(self, val):
-        self._simfile.seek(int(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS))
+    def set_indirect_blockno(self, val, depth=1):
+        self._simfile.seek(int(self._offset + 12 + 4 * (S5_NDIRECT_BLOCKS + depth - 1)))
         self._simfile.write(struct.pack("I", val))
 
+    def clear_blocknos(self):
+        for i in range(S5_NDIRECT_BLOCKS):
+            self.set_direct_blockno(i, 0)
+        for depth in range(1, 4):
+            self.set_indirect_blockno(0, depth)
+
+    def _block_path(self, blockloc):
+        # returns the depth (0 for a direct block) and the index to follow in
+        # the inode or in each indirect block, as s5_block_path() does
+        if (blockloc < S5_NDIRECT_BLOCKS):
+            return (0, [ blockloc ])
+        blockloc -= S5_NDIRECT_BLOCKS
+        depth = 1
+        while (blockloc >= S5_NIDIRECT_BLOCKS ** depth):
+            blockloc -= S5_NIDIRECT_BLOCKS ** depth
+            depth += 1
+        path = []
+        for level in range(depth):
+            path.insert(0, blockloc % S5_NIDIRECT_BLOCKS)
+            blockloc //= S5_NIDIRECT_BLOCKS
+        return (depth, path)
+
+    def _block_goal(self, blockloc):
+        # where to look for a disk block for a file block, as s5_block_goal()
+        # does: right after the file block before it, or else at the start of
+        # the allocation group of this inode
+        if (blockloc > 0):
+            prev = self._map_block(blockloc - 1, False)
+            if (prev != 0):
+                return prev + 1
+        ngroups = self._simdisk.get_ngroups()
+        return (self._number * ngroups // self._simdisk.get_num_inodes()) * S5_GROUP_BLOCKS
+
+    def _alloc_zeroed_block(self, goal):
+        block = self._simdisk.alloc_block(goal)
+        block.zero()
+        return block.get_blockno()
+
+    def _map_block(self, blockloc, alloc):
+        # returns the disk block of a file block, 0 if it is sparse and alloc
+        # is not set
+        if (blockloc >= S5_MAX_FILE_BLOCKS):
+            raise S5fsException("block {0} is past the maximum file size".format(blockloc))
+        (depth, path) = self._block_path(blockloc)
+        goal = self._block_goal(blockloc) if alloc and self._simdisk.has_bitmap() else None
+        if (depth == 0):
+            blockno = self.get_direct_blockno(path[0])
+            if (blockno == 0 and alloc):
+                blockno = self._alloc_zeroed_block(goal)
+                self.set_direct_blockno(path[0], blockno)
+            return blockno
+        blockno = self.get_indirect_blockno(depth)
+        if (blockno == 0 and alloc):
+            blockno = self._alloc_zeroed_block(goal)
+            self.set_indirect_blockno(blockno, depth)
+        for index in path:
+            if (blockno == 0):
+                return 0
+            indirect = self._simdisk.get_block(blockno)
+            blockno = struct.unpack("I", indirect.read(index * 4, 4))[0]
+            if (blockno == 0 and alloc):
+                blockno = self._alloc_zeroed_block(goal)
+                indirect.write(index * 4, struct.pack("I", blockno))
+        return blockno
+
+    def _truncate_indirect(self, blockno, depth, first, keep):
+        # frees the blocks below an indirect block that map file blocks from
+        # keep on, returns whether the indirect block is now empty
+        indirect = self._simdisk.get_block(blockno)
+        span = S5_NIDIRECT_BLOCKS ** (depth - 1)
+        empty = True
+        for i in range(S5_NIDIRECT_BLOCKS):
+            child = struct.unpack("I", indirect.read(i * 4, 4))[0]
+            if (child == 0):
+                continue
+            start = first + i * span
+            if (start + span <= keep or (depth > 1 and not self._truncate_indirect(child, depth - 1, start, keep))):
+                empty = False
+                continue
+            self._simdisk.get_block(child).free()
+            indirect.write(i * 4, struct.pack("I", 0))
+        return empty
+
     def get_type_str(self, short=False):
         t = self.get_type()
         name = "INV" if short else "INVALID"
@@ -184,8 +310,10 @@ class Inode:
                 res += " (INVALID, max file size is {0})".format(S5_MAX_FILE_SIZE)
             elif (self.get_type() == S5_TYPE_DIR and self.get_size() % S5_DIRENT_SIZE != 0):
                 res += " (INVALID, directory size must be multiple of dirent size ({0}))".format(S5_DIRENT_SIZE)
+            elif (self.get_type() == S5_TYPE_DIR and self._is_indexed()):
+                res += " (hashed, {0} buckets, {1} dirents)".format(self._get_index()[1], self._get_index()[2])
             elif (self.get_type() == S5_TYPE_DIR):
-                res += " ({0} dirents)".format(self.get_size() / S5_DIRENT_SIZE)
+                res += " ({0} dirents)".format(self.get_size() // S5_DIRENT_SIZE)
             res += "\n"
             res += "direct blocks ({0}):\n".format(S5_NDIRECT_BLOCKS)
             for i in range(S5_NDIRECT_BLOCKS):
@@ -195,6 +323,8 @@ class Inode:
             if (res[-1] != "\n"):
                 res += "\n"
             res += "indirect block: {0}\n".format(self.get_indirect_blockno())
+            res += "double indirect block: {0}\n".format(self.get_indirect_blockno(2))
+            res += "triple indirect block: {0}\n".format(self.get_indirect_blockno(3))
         elif (self.get_type() == S5_TYPE_FREE):
             res += "next free: {0}\n".format(self.get_next_free())
         res = res[:-1]
@@ -208,21 +338,11 @@ class Inode:
         size = min(size, min(S5_MAX_FILE_SIZE, self.get_size()) - offset)
         res = b""
         while (size > 0):
-            blockno = math.floor(offset / S5_BLOCK_SIZE)
+            blockno = self._map_block(offset // S5_BLOCK_SIZE, False)
             blockoff = offset % S5_BLOCK_SIZE
             amount = min(S5_BLOCK_SIZE - blockoff, size)
-            if (blockno < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockno)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno -= S5_NDIRECT_BLOCKS
-                    blockno = struct.unpack("I", indirect.read(blockno * 4, 4))[0]
             if (blockno == 0):
-                for i in range(amount):
-                    res += '\0'
+                res += b'\0' * amount
             else:
                 res += self._simdisk.get_block(blockno).read(blockoff, amount)
             offset += amount
@@ -236,30 +356,9 @@ class Inode:
             raise S5fsException("cannot write up to byte {0}, max file size is {1}".format(offset + len(data), S5_MAX_FILE_SIZE))
         remaining = len(data)
         while (remaining > 0):
-            blockloc = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             amount = min(S5_BLOCK_SIZE - blockoff, remaining)
-            if (blockloc < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockloc)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    indirect = self._simdisk.alloc_block()
-                    indirect.zero()
-                    self.set_indirect_blockno(indirect.get_blockno())
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((blockloc - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno == 0):
-                block = self._simdisk.alloc_block()
-                block.zero()
-                if (blockloc < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(blockloc, block.get_blockno())
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((blockloc - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", block.get_blockno()))
-            else:
-                block = self._simdisk.get_block(blockno)
+            block = self._simdisk.get_block(self._map_block(offset // S5_BLOCK_SIZE, True))
             if (remaining == amount):
                 block.write(blockoff, data[-remaining:])
             else:
@@ -270,36 +369,18 @@ class Inode:
             self.set_size(offset)
 
     def truncate(self, size=0):
-        target = math.floor((size - 1) / S5_BLOCK_SIZE)
-        curr = math.floor(self.get_size() / S5_BLOCK_SIZE)
-        while (curr > target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(curr)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((curr - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno > 0):
-                block = self._simdisk.get_block(blockno)
-                block.free()
-                if (curr < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(curr, 0)
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
-                    if (curr == S5_NDIRECT_BLOCKS):
-                        indirect.free()
-                        self.set_indirect_blockno(0)
-            curr -= 1
-        if (curr < target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                self.set_indirect_blockno(0)
-            else:
-                if (self.get_indirect_blockno() != 0):
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
+        keep = -(-size // S5_BLOCK_SIZE)
+        for i in range(keep, S5_NDIRECT_BLOCKS):
+            if (self.get_direct_blockno(i) != 0):
+                self._simdisk.get_block(self.get_direct_blockno(i)).free()
+                self.set_direct_blockno(i, 0)
+        first = S5_NDIRECT_BLOCKS
+        for depth in range(1, 4):
+            blockno = self.get_indirect_blockno(depth)
+            if (blockno != 0 and self._truncate_indirect(blockno, depth, first, keep)):
+                self._simdisk.get_block(blockno).free()
+                self.set_indirect_blockno(0, depth)
+            first += S5_NIDIRECT_BLOCKS ** depth
         self.set_size(size)
 
     def _find_dirent(self, name, types=S5_TYPES):
@@ -309,13 +390,19 @@ class Inode:
             raise S5fsException("cannot remove directory entry, inode has size {0} not a multiple of dirent size {1}".format(self.get_size(), S5_DIRENT_SIZE))
         if (len(name) >= S5_NAME_LEN):
             raise S5fsException("directroy entry name '{0}' too long, limit is {1} characters".format(name, S5_NAME_LEN - 1))
-        for i in range(0, self.get_size(), S5_DIRENT_SIZE):
-            inode = struct.unpack("I", self.read(i, 4))[0]
-            parts = self.read(i + 4, S5_NAME_LEN).split('\0', 1)
-            if (len(parts) == 1):
-                raise S5fsException("directory entry name '{0}' does not contain a null character".format(name))
-            if (name == parts[0]):
-                return Dirent(self, inode, name, i)
+        name = _name_bytes(name)
+        if (self._is_indexed()):
+            index = self._get_index()
+            block = index[4 + (s5_dir_hash(name) & (index[1] - 1))]
+            while (block != 0):
+                for dirent in self._block_dirents(block):
+                    if (dirent.name == name):
+                        return dirent
+                block = self._get_block_header(block)[0]
+            return None
+        for dirent in self.getdents():
+            if (dirent.name == name):
+                return dirent
         return None
 
     def unlink(self, name):
@@ -362,19 +449,125 @@ class Inode:
             raise S5fsException("cannot create directory entry, inode has size {0} not a multiple of dirent size {1}".format(self.get_size(), S5_DIRENT_SIZE))
         if (len(name) >= S5_NAME_LEN):
             raise S5fsException("directroy entry name '{0}' too long, limit is {1} characters".format(name, S5_NAME_LEN - 1))
+        if (self._find_dirent(name) != None):
+            raise S5fsException("directory already has entry with same name: {0}".format(name))
+        name = _name_bytes(name)
+        if (self._is_indexed()):
+            self._index_add(inode, name)
+            return
         empty = -1
         for i in range(0, self.get_size(), S5_DIRENT_SIZE):
-            direntname = self.read(i + 4, S5_NAME_LEN).split(b'\0', 1)[0]
-            if (direntname == name):
-                raise S5fsException("directory already has entry with same name: {0}".format(name))
-            if (len(name) == 0):
+            if (self.read(i + 4, 1) == b'\0'):
                 empty = i
-        if (empty >= 0):
-            self.write(empty, struct.pack("I", inode))
-            self.write(empty + 4, name.ljust(S5_NAME_LEN, '\0').encode("utf8"))
-        else:
-            self.write(self.get_size(), struct.pack("I", inode))
-            self.write(self.get_size(), name.ljust(S5_NAME_LEN, '\0').encode("utf8"))
+                break
+        if (empty < 0 and self.get_size() >= S5_BLOCK_SIZE):
+            # a full linear directory turns into a hashed one
+            entries = [ (d.inode, d.name) for d in self.getdents() ]
+            entries.append((inode, name))
+            self._index_write(entries, S5_DIR_MIN_BUCKETS)
+            return
+        if (empty < 0):
+            empty = self.get_size()
+        self.write(empty, struct.pack("I", inode) + name.ljust(S5_NAME_LEN, b'\0'))
+
+    def _remove_dirent(self, offset):
+        if (not self._is_indexed()):
+            self.write(offset + 4, b'\0')
+            return
+        block = offset // S5_BLOCK_SIZE
+        header = self._get_block_header(block)
+        self.write(offset, b'\0' * S5_DIRENT_SIZE)
+        self.write(block * S5_BLOCK_SIZE, struct.pack(S5_DIR_BLOCK_FORMAT, header[0], header[1] - 1))
+        index = self._get_index()
+        self.write(8, struct.pack("I", index[2] - 1))
+
+    def _is_indexed(self):
+        return (self.get_type() == S5_TYPE_DIR and
+                self.get_size() > S5_BLOCK_SIZE)
+
+    def _get_index(self):
+        # (magic, nbuckets, nentries, free, bucket 0, bucket 1, ...)
+        index = struct.unpack(S5_DIR_INDEX_FORMAT + "{0}I".format(S5_DIR_MAX_BUCKETS), self.read(0, 16 + 4 * S5_DIR_MAX_BUCKETS))
+        if (index[0] != S5_DIR_INDEX_MAGIC):
+            raise S5fsException("hashed directory {0} has bad magic 0x{1:08x}".format(self._number, index[0]))
+        return index
+
+    def _get_block_header(self, block):
+        # (next, count)
+        return struct.unpack(S5_DIR_BLOCK_FORMAT, self.read(block * S5_BLOCK_SIZE, 8))
+
+    def _block_dirents(self, block):
+        data = self.read(block * S5_BLOCK_SIZE, S5_BLOCK_SIZE)
+        for i in range(1, S5_DIRENTS_PER_BLOCK):
+            off = i * S5_DIRENT_SIZE
+            name = data[off + 4:off + S5_DIRENT_SIZE].split(b'\0', 1)[0]
+            if (len(name) > 0):
+                yield Dirent(self, struct.unpack("I", data[off:off + 4])[0], name, block * S5_BLOCK_SIZE + off)
+
+    def _index_write(self, entries, nbuckets):
+        # lay the whole table out again: bucket heads in blocks 1 to nbuckets,
+        # overflow blocks after them, and anything left over on the free list
+        buckets = [ [] for b in range(nbuckets) ]
+        for (inode, name) in entries:
+            buckets[s5_dir_hash(name) & (nbuckets - 1)].append((inode, name))
+        chains = []
+        nblocks = 1 + nbuckets
+        for b in range(nbuckets):
+            chain = [ 1 + b ]
+            for i in range(1, max(1, -(-len(buckets[b]) // S5_DIR_SLOTS_PER_BLOCK))):
+                chain.append(nblocks)
+                nblocks += 1
+            chains.append(chain)
+        oldblocks = self.get_size() // S5_BLOCK_SIZE
+        if (max(nblocks, oldblocks) > S5_MAX_FILE_BLOCKS):
+            raise S5fsException("directory {0} is too large".format(self._number))
+        free = list(range(nblocks, oldblocks))
+        for (i, blockno) in enumerate(free):
+            nextfree = free[i + 1] if i + 1 < len(free) else 0
+            self.write(blockno * S5_BLOCK_SIZE, struct.pack(S5_DIR_BLOCK_FORMAT, nextfree, 0).ljust(S5_BLOCK_SIZE, b'\0'))
+        for b in range(nbuckets):
+            for (i, blockno) in enumerate(chains[b]):
+                part = buckets[b][i * S5_DIR_SLOTS_PER_BLOCK:(i + 1) * S5_DIR_SLOTS_PER_BLOCK]
+                nextblock = chains[b][i + 1] if i + 1 < len(chains[b]) else 0
+                data = struct.pack(S5_DIR_BLOCK_FORMAT, nextblock, len(part)).ljust(S5_DIRENT_SIZE, b'\0')
+                for (inode, name) in part:
+                    data += struct.pack("I", inode) + name.ljust(S5_NAME_LEN, b'\0')
+                self.write(blockno * S5_BLOCK_SIZE, data.ljust(S5_BLOCK_SIZE, b'\0'))
+        index = struct.pack(S5_DIR_INDEX_FORMAT, S5_DIR_INDEX_MAGIC, nbuckets, len(entries), free[0] if free else 0)
+        index += struct.pack("{0}I".format(nbuckets), *[ chain[0] for chain in chains ])
+        self.write(0, index.ljust(S5_BLOCK_SIZE, b'\0'))
+
+    def _index_add(self, inode, name):
+        index = self._get_index()
+        nbuckets = index[1]
+        if (index[2] >= nbuckets * S5_DIR_SLOTS_PER_BLOCK and nbuckets < S5_DIR_MAX_BUCKETS):
+            entries = [ (d.inode, d.name) for d in self.getdents() ]
+            entries.append((inode, name))
+            self._index_write(entries, nbuckets * 2)
+            return
+        block = index[4 + (s5_dir_hash(name) & (nbuckets - 1))]
+        while (True):
+            (nextblock, count) = self._get_block_header(block)
+            if (count < S5_DIR_SLOTS_PER_BLOCK):
+                break
+            if (nextblock == 0):
+                if (index[3] != 0):
+                    nextblock = index[3]
+                    self.write(12, struct.pack("I", self._get_block_header(nextblock)[0]))
+                else:
+                    nextblock = self.get_size() // S5_BLOCK_SIZE
+                    if (nextblock >= S5_MAX_FILE_BLOCKS):
+                        raise S5fsException("directory {0} is too large".format(self._number))
+                self.write(nextblock * S5_BLOCK_SIZE, b'\0' * S5_BLOCK_SIZE)
+                self.write(block * S5_BLOCK_SIZE, struct.pack("I", nextblock))
+            block = nextblock
+        for i in range(1, S5_DIRENTS_PER_BLOCK):
+            off = block * S5_BLOCK_SIZE + i * S5_DIRENT_SIZE
+            if (self.read(off + 4, 1) == b'\0'):
+                self.write(off, struct.pack("I", inode) + name.ljust(S5_NAME_LEN, b'\0'))
+                break
+        self.write(block * S5_BLOCK_SIZE + 4, struct.pack("I", count + 1))
+        self.write(8, struct.pack("I", self._get_index()[2] + 1))
 
     def create(self, name):
         inode = self._simdisk.alloc_inode()
@@ -382,9 +575,7 @@ class Inode:
             inode.set_type(S5_TYPE_DATA)
             inode.set_size(0)
             inode.set_link_count(1)
-            for i in range(S5_NDIRECT_BLOCKS):
-                inode.set_direct_blockno(i, 0)
-            inode.set_indirect_blockno(0)
+            inode.clear_blocknos()
             self._make_dirent(inode.get_number(), name)
             return inode
         except S5fsException as e:
@@ -397,9 +588,7 @@ class Inode:
             inode.set_type(S5_TYPE_DIR)
             inode.set_size(0)
             inode.set_link_count(2)
-            for i in range(S5_NDIRECT_BLOCKS):
-                inode.set_direct_blockno(i, 0)
-            inode.set_indirect_blockno(0)
+            inode.clear_blocknos()
             inode._make_dirent(inode.get_number(), ".")
             inode._make_dirent(self.get_number(), "..")
             self.set_link_count(self.get_link_count() + 1)
@@ -414,6 +603,11 @@ class Inode:
             raise S5fsException("cannot get dirents from inode of type " + self.get_type_str())
         if (self.get_size() % S5_DIRENT_SIZE != 0):
             raise S5fsException("cannot get dirents, inode has size {0} not a multiple of dirent size {1}".format(self.get_size(), S5_DIRENT_SIZE))
+        if (self._is_indexed()):
+            for block in range(1, self.get_size() // S5_BLOCK_SIZE):
+                for dirent in self._block_dirents(block):
+                    yield dirent
+            return
         for i in range(0, self.get_size(), S5_DIRENT_SIZE):
             inode = struct.unpack("I", self.read(i, 4))[0]
             name = self.read(i + 4, S5_NAME_LEN)
@@ -539,13 +733,114 @@ class Simdisk:
         self._simfile.seek(20 + 4 * S5_NBLKS_PER_FNODE)
         self._simfile.write(struct.pack("I", val))
 
+    def has_bitmap(self):
+        return self.get_version() >= S5_BITMAP_VERSION
+
+    def get_nblocks(self):
+        self._simfile.seek(24 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_nblocks(self, val):
+        self._simfile.seek(24 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_block(self):
+        self._simfile.seek(28 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_block(self, val):
+        self._simfile.seek(28 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_nblocks(self):
+        self._simfile.seek(32 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_nblocks(self, val):
+        self._simfile.seek(32 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_journal_block(self):
+        self._simfile.seek(36 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_journal_block(self, val):
+        self._simfile.seek(36 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_journal_nblocks(self):
+        self._simfile.seek(40 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_journal_nblocks(self, val):
+        self._simfile.seek(40 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def journal_is_clean(self):
+        # the log is empty unless its first block is the descriptor of the
+        # transaction the header expects; the kernel replays a log that is not
+        # empty at mount, over whatever was written to the disk since
+        header = self.get_block(self.get_journal_block())
+        (magic, seq) = struct.unpack("II", header.read(0, 8))
+        if (magic != S5_JOURNAL_MAGIC):
+            raise S5fsException("journal header magic 0x{0:08x} is invalid".format(magic))
+        desc = self.get_block(self.get_journal_block() + 1)
+        return struct.unpack("II", desc.read(0, 8)) != (S5_JOURNAL_DESC_MAGIC, seq)
+
+    def get_ngroups(self):
+        return (self.get_nblocks() + S5_GROUP_BLOCKS - 1) // S5_GROUP_BLOCKS
+
+    def _bitmap_offset(self, blockno):
+        return S5_BLOCK_SIZE * self.get_bitmap_block() + blockno // 8
+
+    def _get_bitmap_bit(self, blockno):
+        self._simfile.seek(self._bitmap_offset(blockno))
+        return bool(self._simfile.read(1)[0] & (1 << (blockno % 8)))
+
+    def _set_bitmap_bit(self, blockno, used):
+        if (blockno >= self.get_nblocks()):
+            raise S5fsException("block {0} is past the end of the disk".format(blockno))
+        if (self._get_bitmap_bit(blockno) == used):
+            raise S5fsException("block {0} is already {1}".format(blockno, "in use" if used else "free"))
+        self._simfile.seek(self._bitmap_offset(blockno))
+        byte = self._simfile.read(1)[0] ^ (1 << (blockno % 8))
+        self._simfile.seek(self._bitmap_offset(blockno))
+        self._simfile.write(bytes([ byte ]))
+
+    def _bitmap_find(self, start, end):
+        # returns the first free block in [start, end), or None
+        if (start >= end):
+            return None
+        first = start - start % 8
+        self._simfile.seek(self._bitmap_offset(first))
+        bits = self._simfile.read((end - first + 7) // 8)
+        for blockno in range(start, end):
+            if (not bits[(blockno - first) // 8] & (1 << (blockno % 8))):
+                return blockno
+        return None
+
+    def count_free_blocks(self):
+        if (not self.has_bitmap()):
+            raise S5fsException("disk version {0} has no free block bitmap".format(self.get_version()))
+        nblocks = self.get_nblocks()
+        self._simfile.seek(self._bitmap_offset(0))
+        bits = self._simfile.read((nblocks + 7) // 8)
+        return sum(1 for blockno in range(nblocks) if not bits[blockno // 8] & (1 << (blockno % 8)))
+
     def get_super_block_summary(self):
         res = ""
         res += "magic:      0x{0:04x} ({1})\n".format(self.get_magic(), "VALID" if self.get_magic() == S5_MAGIC else "INVALID")
-        res += "version:    0x{0:04x}{1}\n".format(self.get_version(), "" if self.get_version() == S5_CURRENT_VERSION else " (INVALID)")
+        res += "version:    0x{0:04x}{1}\n".format(self.get_version(), "" if S5_MIN_VERSION <= self.get_version() <= S5_CURRENT_VERSION else " (INVALID)")
         res += "num inodes: {0}\n".format(self.get_num_inodes())
         res += "free inode: {0}{1}\n".format(self.get_free_inode(), "" if self.get_free_inode() < self.get_num_inodes() else " (INVALID)")
         res += "root inode: {0}{1}\n".format(self.get_root_inode(), "" if self.get_root_inode() < self.get_num_inodes() else " (INVALID)")
+        if (self.has_bitmap()):
+            res += "num blocks: {0} in {1} allocation groups\n".format(self.get_nblocks(), self.get_ngroups())
+            res += "bitmap:     blocks {0} to {1}\n".format(self.get_bitmap_block(), self.get_bitmap_block() + self.get_bitmap_nblocks() - 1)
+            res += "free blocks: {0}\n".format(self.count_free_blocks())
+            if (self.get_version() >= S5_JOURNAL_VERSION):
+                res += "journal:    blocks {0} to {1} ({2})\n".format(self.get_journal_block(), self.get_journal_block() + self.get_journal_nblocks() - 1, "clean" if self.journal_is_clean() else "needs recovery, mount the disk before changing it")
+            return res
         res += "free blocks ({0}{1}):\n".format(self.get_nfree(), "" if self.get_nfree() <= S5_NBLKS_PER_FNODE else (", too large shouldn't exceed " + str(S5_NBLKS_PER_FNODE)))
         for i in range(min(self.get_nfree(), S5_NBLKS_PER_FNODE - 1)):
             res += "  {0}".format(self.get_free_block(i))
@@ -563,8 +858,10 @@ class Simdisk:
             raise S5fsException("cannot format disk to size {0} which is not a multiple of the block size {1}".format(size, S5_BLOCK_SIZE))
         blocks = int(size / S5_BLOCK_SIZE)
         iblocks = int(math.floor((inodes - 1) / S5_INODES_PER_BLOCK) + 1)
-        if (iblocks + 1 >= blocks):
-            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes require at least {2} bytes of space".format(size, inodes, (1 + iblocks) * S5_BLOCK_SIZE))
+        bblocks = (blocks + S5_BITS_PER_BLOCK - 1) // S5_BITS_PER_BLOCK
+        jblocks = min(S5_JOURNAL_MAX_BLOCKS, max(S5_JOURNAL_MIN_BLOCKS, blocks // 32))
+        if (iblocks + bblocks + jblocks + 1 >= blocks):
+            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes require at least {2} bytes of space".format(size, inodes, (1 + iblocks + bblocks + jblocks) * S5_BLOCK_SIZE))
         self._simfile.truncate()
         self._simfile.seek(size)
         self._simfile.write(b"")
@@ -580,25 +877,25 @@ class Simdisk:
         inode.set_next_free(0xffffffff)
         self.set_free_inode(0)
 
+        # the free list stays empty, the bitmap has every block in front of
+        # the data and every bit past the end of the disk set, and the journal
+        # starts out empty
         self.set_last_free_block(0xffffffff)
-        i = 0
-        for num in range(iblocks+1, blocks):
-            if (i == S5_NBLKS_PER_FNODE - 1):
-                block = self.get_block(num)
-                for j in range(S5_NBLKS_PER_FNODE - 1):
-                    block.write(j * 4, struct.pack("I", self.get_free_block(j)))
-                block.write((S5_NBLKS_PER_FNODE - 1) * 4, struct.pack("I", self.get_last_free_block()))
-                self.set_last_free_block(num)
-                i = 0
-            else:
-                self.set_free_block(i, num)
-                i += 1
-        self.set_nfree(i)
+        self.set_nfree(0)
+        self.set_nblocks(blocks)
+        self.set_bitmap_block(iblocks + 1)
+        self.set_bitmap_nblocks(bblocks)
+        self.set_journal_block(iblocks + 1 + bblocks)
+        self.set_journal_nblocks(jblocks)
+        self.get_block(self.get_journal_block()).write(0, struct.pack("II", S5_JOURNAL_MAGIC, 1))
+        bits = bytearray(bblocks * S5_BLOCK_SIZE)
+        for blockno in itertools.chain(range(iblocks + 1 + bblocks + jblocks), range(blocks, bblocks * S5_BITS_PER_BLOCK)):
+            bits[blockno // 8] |= 1 << (blockno % 8)
+        self._simfile.seek(self._bitmap_offset(0))
+        self._simfile.write(bytes(bits))
 
         root = self.alloc_inode()
-        for i in range(S5_NDIRECT_BLOCKS):
-            root.set_direct_blockno(i, 0)
-        root.set_indirect_blockno(0)
+        root.clear_blocknos()
         root.set_type(S5_TYPE_DIR)
         root.set_size(0)
         root.set_link_count(2)
@@ -632,7 +929,9 @@ class Simdisk:
         offset = S5_BLOCK_SIZE * index
         return Block(self, offset, index)
 
-    def alloc_block(self):
+    def alloc_block(self, goal=None):
+        if (self.has_bitmap()):
+            return self._alloc_bitmap_block(goal)
         if (self.get_nfree() > S5_NBLKS_PER_FNODE - 1):
             raise S5fsException("nfree {0} is invalid, maximum value is {1}".format(self.get_nfree(), S5_NBLKS_PER_FNODE - 1))
         if (self.get_nfree() == 0):
@@ -649,5 +948,25 @@ class Simdisk:
             self.set_nfree(self.get_nfree() - 1)
             return self.get_block(self.get_free_block(self.get_nfree()))
 
+    def _alloc_bitmap_block(self, goal):
+        # the first free block from goal to the end of its allocation group,
+        # then from the start of that group, then in the groups after it, as
+        # s5_bitmap_alloc() does
+        nblocks = self.get_nblocks()
+        if (goal is None or goal >= nblocks):
+            goal = 0
+        ngroups = self.get_ngroups()
+        group = goal // S5_GROUP_BLOCKS
+        for i in range(ngroups):
+            start = ((group + i) % ngroups) * S5_GROUP_BLOCKS
+            end = min(start + S5_GROUP_BLOCKS, nblocks)
+            blockno = self._bitmap_find(goal if i == 0 else start, end)
+            if (blockno is None and i == 0):
+                blockno = self._bitmap_find(start, goal)
+            if (blockno is not None):
+                self._set_bitmap_bit(blockno, True)
+                return self.get_block(blockno)
+        raise S5fsDiskSpaceException()
+
     def open(self, path, create=False):
         return self.get_inode(self.get_root_inode()).open(path, create=create)
@@ -7,59 +7,38 @@
 
 static int do_ls(const char *dir)
 {
-    int fd;
+    DIR *dirp;
     struct dirent *dirent;
-    int nbytes;
     char tmpbuf[256];
     stat_t sbuf;
 
-    union {
-        struct dirent dirent;
-        char buf[4096];
-    } lsb;
-
-    fd = open(dir, O_RDONLY, 0600);
-    if (fd < 0)
+    dirp = opendir(dir);
+    if (!dirp)
     {
         fprintf(stderr, "ls: unable to open \"%s\": errno %d\n", dir, errno);
         return 1;
     }
 
-    while ((nbytes = getdents(fd, &lsb.dirent, sizeof(lsb))) > 0)
+    errno = 0;
+    while ((dirent = readdir(dirp)))
     {
-        dirent = &lsb.dirent;
+        int size;
 
-        if (nbytes % sizeof(struct dirent))
+        snprintf(tmpbuf, sizeof(tmpbuf), "%s/%s", dir, dirent->d_name);
+        if (0 == stat(tmpbuf, &sbuf))
         {
-            fprintf(stderr,
-                    "ls: incorrect return value from getdents (%d):"
-                    " not a multiple of sizeof(struct dirent) (%ld)\n",
-                    nbytes, sizeof(struct dirent));
-            return 1;
+            size = sbuf.st_size;
         }
-        do
+        else
         {
-            int reclen;
-            int size;
-
-            snprintf(tmpbuf, sizeof(tmpbuf), "%s/%s", dir, dirent->d_name);
-            if (0 == stat(tmpbuf, &sbuf))
-            {
-                size = sbuf.st_size;
-            }
-            else
-            {
-                size = 0;
-            }
+            size = 0;
+        }
 
-            reclen = sizeof(struct dirent);
-            fprintf(stdout, "%7d  %-20s   %d\n", size, dirent->d_name,
-                    dirent->d_ino);
-            dirent = (struct dirent *)(((char *)dirent) + reclen);
-            nbytes -= reclen;
-        } while (nbytes);
+        fprintf(stdout, "%7d  %-20s   %d\n", size, dirent->d_name,
+                dirent->d_ino);
+        errno = 0;
     }
-    if (nbytes < 0)
+    if (errno)
     {
         if (errno == ENOTDIR)
         {
@@ -71,7 +50,7 @@ static int do_ls(const char *dir)
         }
     }
 
-    if (close(fd) < 0)
+    if (closedir(dirp) < 0)
     {
         fprintf(stderr, "ls: close %s: errno %d\n", dir, errno);
     }
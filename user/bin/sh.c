@@ -14,6 +14,7 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <weenix/syscall.h>
 
 #define ROOT "/"
 
@@ -47,6 +48,9 @@ static void parse(char *line);
 
 static int execute(int argc, char *argv[], redirect_map_t *map);
 
+static pid_t spawn_cmd(char *argv[], spawn_action_t *actions,
+                       size_t nactions);
+
 static void add_redirect(redirect_map_t *map, int sfd, int dfd);
 
 #define DECL_CMD(x) static int cmd_##x(int argc, char *argv[], ioenv_t *io)
@@ -96,6 +100,10 @@ typedef struct
     const char *cmd_helptext;
 } cmd_t;
 
+static cmd_t *find_builtin(const char *name);
+
+static int builtin_exec(cmd_t *cmd, int argc, char *argv[], ioenv_t *io);
+
 static cmd_t builtin_cmds[] = {
     {"?", cmd_help, "list shell commands"},
     {"cat", cmd_cat, "display file"},
@@ -1344,32 +1352,40 @@ DECL_CMD(parallel)
         return 1;
     }
 
-    /* Fork and execute each command */
+    /* Every command gets our stdin, stdout and stderr. */
+    spawn_action_t actions[3];
+    size_t nactions = 0;
+    for (int ii = 0; ii < 3; ii++)
+    {
+        if (io->io_map_fd[ii] != ii)
+        {
+            actions[nactions].sa_op = SPAWN_DUP2;
+            actions[nactions].sa_fd = io->io_map_fd[ii];
+            actions[nactions++].sa_newfd = ii;
+        }
+    }
+
+    /* Spawn each command directly; builtins have no image to spawn, so they
+     * run here while the others are going. */
+    int status = 0;
     for (i = 0; i < ncmds; i++)
     {
-        if (0 == (cmd_pids[i] = fork()))
+        cmd_t *cmd = find_builtin(cmd_argvs[i][0]);
+        if (cmd)
         {
-            int status, fd, ii;
-            /* Build weird map thing (as in repeat) */
-            redirect_map_t map;
-            map.rm_nfds = 0;
-            for (ii = 0; ii < 3; ii++)
-            {
-                if (0 > (fd = dup(io->io_map_fd[ii])))
-                {
-                    exit(1);
-                }
-                add_redirect(&map, fd, ii);
-            }
-            /* Execute and return its status */
-            exit(execute(cmd_argcs[i], cmd_argvs[i], &map));
+            cmd_pids[i] = -1;
+            status = builtin_exec(cmd, cmd_argcs[i], cmd_argvs[i], io);
+            continue;
         }
+        cmd_pids[i] = spawn_cmd(cmd_argvs[i], actions, nactions);
     }
     /* Wait for each command */
-    int status;
     for (i = 0; i < ncmds; i++)
     {
-        wait(&status);
+        if (cmd_pids[i] > 0)
+        {
+            waitpid(cmd_pids[i], &status, 0);
+        }
     }
     /* Return last status */
     return status;
@@ -1407,31 +1423,6 @@ DECL_CMD(time)
     return ret;
 }
 
-static int do_redirect(redirect_map_t *map)
-{
-    int ii;
-    int newfd, oldfd;
-
-    for (ii = 0; ii < map->rm_nfds; ii++)
-    {
-        oldfd = map->rm_redir[ii].r_sfd;
-        newfd = map->rm_redir[ii].r_dfd;
-
-        dbg((stderr, "do_redirect: dup2(%d,%d)\n", oldfd, newfd));
-
-        if (dup2(oldfd, newfd) < 0)
-        {
-            fprintf(stderr,
-                    "do_redirect: dup2() failed: "
-                    "%s\n",
-                    strerror(errno));
-            return -1;
-        }
-        close(oldfd);
-    }
-    return 0;
-}
-
 static void cleanup_redirects(redirect_map_t *map)
 {
     int ii;
@@ -1471,48 +1462,39 @@ static int builtin_exec(cmd_t *cmd, int argc, char *argv[], ioenv_t *io)
     return (*cmd->cmd_func)(argc, argv, io);
 }
 
-static int execute(int argc, char *argv[], redirect_map_t *map)
+static cmd_t *find_builtin(const char *name)
 {
-    int status, pid;
     cmd_t *cmd;
 
     for (cmd = builtin_cmds; cmd->cmd_name; cmd++)
     {
-        if (!strcmp(cmd->cmd_name, argv[0]))
+        if (!strcmp(cmd->cmd_name, name))
         {
-            break;
+            return cmd;
         }
     }
-    if (cmd->cmd_name)
-    {
-        ioenv_t io;
-
-        build_ioenv(map, &io);
-        status = builtin_exec(cmd, argc, argv, &io);
-        destroy_ioenv(&io);
-        cleanup_redirects(map);
-        return 0;
-    }
+    return NULL;
+}
 
-    if (!(pid = fork()))
-    {
-        if (do_redirect(map) < 0)
-        {
-            exit(1);
-        }
+/* Spawns argv[0], searching the usual directories if it isn't found as given.
+ * Reports failures and returns the pid or a negative value. */
+static pid_t spawn_cmd(char *argv[], spawn_action_t *actions, size_t nactions)
+{
+    pid_t pid = spawn(argv[0], argv, my_envp, actions, nactions);
 
-        execve(argv[0], argv, my_envp);
+    char *search_directories[] = {"/usr/bin/", "/bin/", "/sbin/"};
+    char buf[256];
 
-        char *search_directories[] = {"/usr/bin/", "/bin/", "/sbin/"};
-        char buf[256];
+    for (unsigned i = 0; pid < 0 && errno == ENOENT &&
+                         i < sizeof(search_directories) / sizeof(char *);
+         i++)
+    {
+        snprintf(buf, sizeof(buf), "%s/%s", search_directories[i], argv[0]);
+        pid = spawn(buf, argv, my_envp, actions, nactions);
+    }
 
-        for (unsigned i = 0;
-             errno == ENOENT && i < sizeof(search_directories) / sizeof(char *);
-             i++)
-        {
-            snprintf(buf, sizeof(buf), "%s/%s", search_directories[i], argv[0]);
-            execve(buf, argv, my_envp);
-        }
+    if (0 > pid)
+    {
         if (errno == ENOENT)
         {
             fprintf(stderr, "sh: command not found: %s\n", argv[0]);
@@ -1522,18 +1504,53 @@ static int execute(int argc, char *argv[], redirect_map_t *map)
             fprintf(stderr, "sh: exec failed for %s: %s\n", argv[0],
                     strerror(errno));
         }
-        exit(errno);
     }
-    else
+    return pid;
+}
+
+static int execute(int argc, char *argv[], redirect_map_t *map)
+{
+    int status, pid;
+    cmd_t *cmd = find_builtin(argv[0]);
+
+    if (cmd)
+    {
+        ioenv_t io;
+
+        build_ioenv(map, &io);
+        status = builtin_exec(cmd, argc, argv, &io);
+        destroy_ioenv(&io);
+        cleanup_redirects(map);
+        return 0;
+    }
+
+    /* The child only needs the redirections and the new image, so spawn it
+     * directly instead of copying our address space with fork() just to
+     * throw it away in execve(). */
+    spawn_action_t actions[2 * REDIR_MAX];
+    size_t nactions = 0;
+    for (int ii = 0; ii < map->rm_nfds; ii++)
     {
-        if (0 > pid)
+        int sfd = map->rm_redir[ii].r_sfd;
+        int dfd = map->rm_redir[ii].r_dfd;
+        actions[nactions].sa_op = SPAWN_DUP2;
+        actions[nactions].sa_fd = sfd;
+        actions[nactions++].sa_newfd = dfd;
+        if (sfd != dfd)
         {
-            fprintf(stderr, "sh: fork failed errno = %d\n", errno);
+            actions[nactions].sa_op = SPAWN_CLOSE;
+            actions[nactions++].sa_fd = sfd;
         }
     }
 
+    pid = spawn_cmd(argv, actions, nactions);
     cleanup_redirects(map);
-    int ret = wait(&status);
+    if (0 > pid)
+    {
+        return pid;
+    }
+
+    int ret = waitpid(pid, &status, 0);
     if (status == EFAULT)
     {
         fprintf(stderr, "sh: child process accessed invalid memory\n");
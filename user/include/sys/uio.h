@@ -0,0 +1,34 @@
+/*
+ *  FILE: uio.h
+ *  DESC: vectored I/O (readv and writev)
+ */
+
+#pragma once
+
+/*
+ * Kernel and user header: kernel/include/fs/uio.h and user/include/sys/uio.h
+ * are copies of each other and must be kept identical.
+ */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+#include "sys/types.h"
+#endif
+
+/* Most segments a single readv or writev takes */
+#define IOV_MAX 64
+
+typedef struct iovec
+{
+    void *iov_base; /* start of the segment */
+    size_t iov_len; /* length of the segment */
+} iovec_t;
+
+#ifndef __KERNEL__
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+
+#endif
@@ -14,6 +14,8 @@
 #endif
 
 struct dirent;
+struct dirent64;
+struct spawn_action;
 
 /* User exec-related */
 int fork(void);
@@ -23,6 +25,12 @@ int execle(const char *filename, const char *arg, ...); /* NYI */
 int execv(const char *filename, char *const argv[]);    /* NYI */
 int execve(const char *filename, char *const argv[], char *const envp[]);
 
+/* Runs filename in a new child without copying the caller's address space.
+ * actions (see weenix/syscall.h) rearrange the child's fds first. Returns the
+ * child's pid. */
+pid_t spawn(const char *filename, char *const argv[], char *const envp[],
+            const struct spawn_action *actions, size_t nactions);
+
 /* Kern-related */
 pid_t wait(int *status);
 
@@ -42,6 +50,10 @@ int halt(void);
 
 void sync(void);
 
+int fsync(int fd);
+
+int fdatasync(int fd);
+
 size_t get_free_mem(void);
 
 /* VFS-related */
@@ -53,6 +65,11 @@ ssize_t read(int fd, void *buf, size_t count);
 
 ssize_t write(int fd, const void *buf, size_t count);
 
+/* Read or write at offset, leaving the file position alone */
+ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
+
 off_t lseek(int fd, off_t offset, int whence);
 
 int dup(int fd);
@@ -73,6 +90,8 @@ int chdir(const char *path);
 
 int getdents(int fd, struct dirent *dir, size_t size);
 
+int getdents64(int fd, struct dirent64 *dirp, size_t count);
+
 int stat(const char *path, struct stat *buf);
 
 int pipe(int pipefd[2]);
@@ -82,6 +101,12 @@ void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
 
 int munmap(void *addr, size_t len);
 
+int madvise(void *addr, size_t len, int advice);
+
+int mlock(const void *addr, size_t len);
+
+int munlock(const void *addr, size_t len);
+
 int brk(void *addr);
 
 void *sbrk(intptr_t incr);
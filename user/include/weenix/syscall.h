@@ -60,6 +60,17 @@
 #define SYS_stat 47
 #define SYS_time 48
 #define SYS_usleep 49
+#define SYS_spawn 50
+#define SYS_madvise 51
+#define SYS_mlock 52
+#define SYS_munlock 53
+#define SYS_fsync 54
+#define SYS_fdatasync 55
+#define SYS_getdents64 56
+#define SYS_readv 57
+#define SYS_writev 58
+#define SYS_pread 59
+#define SYS_pwrite 60
 
 /*
  * ... what does the scouter say about his syscall?
@@ -71,6 +82,7 @@
 
 struct regs;
 struct stat;
+struct iovec;
 
 typedef struct argstr
 {
@@ -107,6 +119,19 @@ typedef struct munmap_args
     size_t len;
 } munmap_args_t;
 
+typedef struct madvise_args
+{
+    void *addr;
+    size_t len;
+    int advice;
+} madvise_args_t;
+
+typedef struct mlock_args
+{
+    void *addr;
+    size_t len;
+} mlock_args_t;
+
 typedef struct open_args
 {
     argstr_t filename;
@@ -128,6 +153,23 @@ typedef struct write_args
     size_t nbytes;
 } write_args_t;
 
+/* For readv and writev */
+typedef struct readv_args
+{
+    int fd;
+    const struct iovec *iov;
+    int iovcnt;
+} readv_args_t;
+
+/* For pread and pwrite */
+typedef struct pread_args
+{
+    int fd;
+    void *buf;
+    size_t nbytes;
+    off_t offset;
+} pread_args_t;
+
 typedef struct mkdir_args
 {
     argstr_t path;
@@ -147,6 +189,26 @@ typedef struct execve_args
     argvec_t envp;
 } execve_args_t;
 
+/* fd actions applied to the child's file table by spawn, in order */
+#define SPAWN_CLOSE 1 /* close(sa_fd) */
+#define SPAWN_DUP2 2  /* dup2(sa_fd, sa_newfd) */
+
+typedef struct spawn_action
+{
+    int sa_op;
+    int sa_fd;
+    int sa_newfd;
+} spawn_action_t;
+
+typedef struct spawn_args
+{
+    argstr_t filename;
+    argvec_t argv;
+    argvec_t envp;
+    spawn_action_t *actions;
+    size_t nactions;
+} spawn_args_t;
+
 typedef struct rename_args
 {
     argstr_t oldpath;
@@ -160,6 +222,13 @@ typedef struct getdents_args
     size_t count;
 } getdents_args_t;
 
+typedef struct getdents64_args
+{
+    int fd;
+    struct dirent64 *dirp;
+    size_t count;
+} getdents64_args_t;
+
 typedef struct lseek_args
 {
     int fd;
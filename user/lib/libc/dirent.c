@@ -0,0 +1,74 @@
+#include "sys/types.h"
+
+#include "errno.h"
+#include "fcntl.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+
+#include "dirent.h"
+
+/*
+ * Directory streams. readdir() hands out the entries of a buffer filled by
+ * getdents64(), so a directory is read with one system call per buffer rather
+ * than one per entry.
+ */
+
+DIR *opendir(const char *name)
+{
+    DIR *dirp = malloc(sizeof(DIR));
+    if (!dirp)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    dirp->dd_fd = open(name, O_RDONLY, 0);
+    if (dirp->dd_fd < 0)
+    {
+        free(dirp);
+        return NULL;
+    }
+    dirp->dd_len = 0;
+    dirp->dd_pos = 0;
+    return dirp;
+}
+
+struct dirent *readdir(DIR *dirp)
+{
+    if (dirp->dd_pos >= dirp->dd_len)
+    {
+        int nbytes =
+            getdents64(dirp->dd_fd, (dirent64_t *)dirp->dd_buf,
+                       sizeof(dirp->dd_buf));
+        if (nbytes <= 0)
+        {
+            // end of the directory, or an error with errno set
+            return NULL;
+        }
+        dirp->dd_len = nbytes;
+        dirp->dd_pos = 0;
+    }
+
+    dirent64_t *ent = (dirent64_t *)(dirp->dd_buf + dirp->dd_pos);
+    dirp->dd_pos += ent->d_reclen;
+
+    dirp->dd_ent.d_ino = ent->d_ino;
+    dirp->dd_ent.d_off = ent->d_off;
+    strncpy(dirp->dd_ent.d_name, ent->d_name, NAME_LEN - 1);
+    dirp->dd_ent.d_name[NAME_LEN - 1] = '\0';
+    return &dirp->dd_ent;
+}
+
+void rewinddir(DIR *dirp)
+{
+    lseek(dirp->dd_fd, 0, SEEK_SET);
+    dirp->dd_len = 0;
+    dirp->dd_pos = 0;
+}
+
+int closedir(DIR *dirp)
+{
+    int ret = close(dirp->dd_fd);
+    free(dirp);
+    return ret;
+}
@@ -3,29 +3,109 @@
 #include "sys/types.h"
 #include <stdlib.h>
 
-int memcmp(const void *cs, const void *ct, size_t count)
+/*
+ * memcpy(), memset(), memcmp() and strlen() work a word at a time, with the
+ * same size classes as the kernel's versions: two overlapping loads and
+ * stores from each end up to STRING_SMALL bytes, an aligned word loop up to
+ * STRING_REP_MIN bytes, and rep movsq/stosq beyond that. The kernel picks rep
+ * movsb on CPUs with ERMS; libc has no hook that runs before the dynamic
+ * linker first calls into it, so it sticks to the word forms, which are fast
+ * everywhere. Weenix does not enable SSE for user processes either.
+ */
+
+#define STRING_SMALL 16
+#define STRING_REP_MIN 512
+
+#define STRING_ONES 0x0101010101010101UL
+#define STRING_HIGHS 0x8080808080808080UL
+
+/* Unaligned words that may alias anything */
+typedef uint64_t __attribute__((__may_alias__, __aligned__(1))) string_word_t;
+typedef uint32_t __attribute__((__may_alias__, __aligned__(1))) string_half_t;
+
+/* Nonzero in the high bit of each byte of x that is zero, lowest one exact */
+static inline uint64_t _string_zero_bytes(uint64_t x)
 {
-    const unsigned char *su1, *su2;
-    signed char res = 0;
+    return (x - STRING_ONES) & ~x & STRING_HIGHS;
+}
 
-    for (su1 = cs, su2 = ct; 0 < count; ++su1, ++su2, count--)
+int memcmp(const void *cs, const void *ct, size_t count)
+{
+    const unsigned char *a = cs;
+    const unsigned char *b = ct;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
     {
-        if ((res = *su1 - *su2) != 0)
+        uint64_t x = *(const string_word_t *)(a + i);
+        uint64_t y = *(const string_word_t *)(b + i);
+        if (x != y)
         {
-            break;
+            // byte-swapped, the first differing byte is the most significant
+            return __builtin_bswap64(x) < __builtin_bswap64(y) ? -1 : 1;
         }
     }
-    return res;
+    for (; i < count; i++)
+    {
+        if (a[i] != b[i])
+        {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
 }
 
 void *memcpy(void *dest, const void *src, size_t count)
 {
-    char *tmp = (char *)dest;
+    char *d = dest;
     const char *s = src;
 
-    while (count--)
-        *tmp++ = *s++;
+    if (count <= STRING_SMALL)
+    {
+        if (count >= 8)
+        {
+            uint64_t head = *(const string_word_t *)s;
+            uint64_t tail = *(const string_word_t *)(s + count - 8);
+            *(string_word_t *)d = head;
+            *(string_word_t *)(d + count - 8) = tail;
+        }
+        else if (count >= 4)
+        {
+            uint32_t head = *(const string_half_t *)s;
+            uint32_t tail = *(const string_half_t *)(s + count - 4);
+            *(string_half_t *)d = head;
+            *(string_half_t *)(d + count - 4) = tail;
+        }
+        else if (count)
+        {
+            char first = s[0], mid = s[count / 2], last = s[count - 1];
+            d[0] = first;
+            d[count / 2] = mid;
+            d[count - 1] = last;
+        }
+        return dest;
+    }
 
+    uint64_t tail = *(const string_word_t *)(s + count - 8);
+    char *end = d + count - 8;
+    if (count >= STRING_REP_MIN)
+    {
+        size_t nwords = count / 8;
+        __asm__ volatile("cld\n\t"
+                         "rep movsq"
+                         : "+S"(s), "+D"(d), "+c"(nwords)
+                         :
+                         : "cc", "memory");
+    }
+    else
+    {
+        // the first word covers the bytes skipped to align the destination
+        *(string_word_t *)d = *(const string_word_t *)s;
+        for (size_t i = 8 - ((uintptr_t)d & 7); i + 8 < count; i += 8)
+        {
+            *(string_word_t *)(d + i) = *(const string_word_t *)(s + i);
+        }
+    }
+    *(string_word_t *)end = tail;
     return dest;
 }
 
@@ -86,11 +166,48 @@ char *strncpy(char *dest, const char *src, size_t count)
 
 void *memset(void *s, int c, size_t count)
 {
-    char *xs = (char *)s;
+    char *d = s;
+    uint64_t word = STRING_ONES * (unsigned char)c;
 
-    while (count--)
-        *xs++ = c;
+    if (count <= STRING_SMALL)
+    {
+        if (count >= 8)
+        {
+            *(string_word_t *)d = word;
+            *(string_word_t *)(d + count - 8) = word;
+        }
+        else if (count >= 4)
+        {
+            *(string_half_t *)d = (uint32_t)word;
+            *(string_half_t *)(d + count - 4) = (uint32_t)word;
+        }
+        else if (count)
+        {
+            d[0] = (char)c;
+            d[count / 2] = (char)c;
+            d[count - 1] = (char)c;
+        }
+        return s;
+    }
 
+    *(string_word_t *)(d + count - 8) = word;
+    if (count >= STRING_REP_MIN)
+    {
+        size_t nwords = count / 8;
+        __asm__ volatile("cld\n\t"
+                         "rep stosq"
+                         : "+D"(d), "+c"(nwords)
+                         : "a"(word)
+                         : "cc", "memory");
+    }
+    else
+    {
+        *(string_word_t *)d = word;
+        for (size_t i = 8 - ((uintptr_t)d & 7); i + 8 < count; i += 8)
+        {
+            *(string_word_t *)(d + i) = word;
+        }
+    }
     return s;
 }
 
@@ -119,12 +236,16 @@ char *strcat(char *dest, const char *src)
 
 size_t strlen(const char *s)
 {
-    const char *sc;
-
-    for (sc = s; *sc != '\0'; ++sc)
+    // aligned words never cross a page, so reading the whole word around the
+    // terminator cannot fault; bytes before s are forced nonzero
+    const string_word_t *w = (const string_word_t *)((uintptr_t)s & ~7UL);
+    uint64_t zeros =
+        _string_zero_bytes(*w | ((1UL << (8 * ((uintptr_t)s & 7))) - 1));
+    while (!zeros)
     {
-        /* nothing */}
-        return sc - s;
+        zeros = _string_zero_bytes(*++w);
+    }
+    return (const char *)w + __builtin_ctzl(zeros) / 8 - s;
 }
 
 char *strchr(const char *s, int c)
@@ -8,6 +8,7 @@
 #include "weenix/trap.h"
 
 #include "dirent.h"
+#include "sys/uio.h"
 
 static void *__curbrk = NULL;
 #define MAX_EXIT_HANDLERS 32
@@ -154,6 +155,37 @@ int munmap(void *addr, size_t len)
     return (int)trap(SYS_munmap, (uintptr_t)&args);
 }
 
+int madvise(void *addr, size_t len, int advice)
+{
+    madvise_args_t args;
+
+    args.addr = addr;
+    args.len = len;
+    args.advice = advice;
+
+    return (int)trap(SYS_madvise, (uintptr_t)&args);
+}
+
+int mlock(const void *addr, size_t len)
+{
+    mlock_args_t args;
+
+    args.addr = (void *)addr;
+    args.len = len;
+
+    return (int)trap(SYS_mlock, (uintptr_t)&args);
+}
+
+int munlock(const void *addr, size_t len)
+{
+    mlock_args_t args;
+
+    args.addr = (void *)addr;
+    args.len = len;
+
+    return (int)trap(SYS_munlock, (uintptr_t)&args);
+}
+
 int debug(const char *str)
 {
     argstr_t argstr;
@@ -164,6 +196,10 @@ int debug(const char *str)
 
 void sync(void) { trap(SYS_sync, NULL); }
 
+int fsync(int fd) { return (int)trap(SYS_fsync, (ssize_t)fd); }
+
+int fdatasync(int fd) { return (int)trap(SYS_fdatasync, (ssize_t)fd); }
+
 int open(const char *filename, int flags, int mode)
 {
     open_args_t args;
@@ -325,10 +361,100 @@ int execve(const char *filename, char *const argv[], char *const envp[])
     return (int)trap(SYS_execve, (uintptr_t)&args);
 }
 
+/* Builds a kernel argument vector; the caller frees av->av_vec */
+static int __build_argvec(argvec_t *av, char *const vec[])
+{
+    size_t i;
+    for (i = 0; vec && vec[i] != NULL; i++)
+        ;
+    av->av_len = i;
+    av->av_vec = malloc((av->av_len + 1) * sizeof(argstr_t));
+    if (!av->av_vec)
+        return -1;
+    for (i = 0; i < av->av_len; i++)
+    {
+        av->av_vec[i].as_len = strlen(vec[i]);
+        av->av_vec[i].as_str = vec[i];
+    }
+    av->av_vec[i].as_len = 0;
+    av->av_vec[i].as_str = NULL;
+    return 0;
+}
+
+pid_t spawn(const char *filename, char *const argv[], char *const envp[],
+            const spawn_action_t *actions, size_t nactions)
+{
+    spawn_args_t args;
+    pid_t ret = -1;
+
+    args.filename.as_len = strlen(filename);
+    args.filename.as_str = filename;
+    args.actions = (spawn_action_t *)actions;
+    args.nactions = nactions;
+    args.envp.av_vec = NULL;
+
+    if (__build_argvec(&args.argv, argv) ||
+        __build_argvec(&args.envp, envp))
+        goto out;
+
+    ret = (pid_t)trap(SYS_spawn, (uintptr_t)&args);
+
+out:
+    free(args.argv.av_vec);
+    free(args.envp.av_vec);
+    return ret;
+}
+
 void thr_set_errno(int n) { trap(SYS_set_errno, (ssize_t)n); }
 
 int thr_errno(void) { return (int)trap(SYS_errno, 0); }
 
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    readv_args_t args;
+
+    args.fd = fd;
+    args.iov = iov;
+    args.iovcnt = iovcnt;
+
+    return trap(SYS_readv, (uintptr_t)&args);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    readv_args_t args;
+
+    args.fd = fd;
+    args.iov = iov;
+    args.iovcnt = iovcnt;
+
+    return trap(SYS_writev, (uintptr_t)&args);
+}
+
+ssize_t pread(int fd, void *buf, size_t nbytes, off_t offset)
+{
+    pread_args_t args;
+
+    args.fd = fd;
+    args.buf = buf;
+    args.nbytes = nbytes;
+    args.offset = offset;
+
+    return trap(SYS_pread, (uintptr_t)&args);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+    pread_args_t args;
+
+    args.fd = fd;
+    args.buf = (void *)buf;
+    args.nbytes = nbytes;
+    args.offset = offset;
+
+    return trap(SYS_pwrite, (uintptr_t)&args);
+}
+
 int getdents(int fd, dirent_t *dir, size_t size)
 {
     getdents_args_t args;
@@ -340,6 +466,17 @@ int getdents(int fd, dirent_t *dir, size_t size)
     return (int)trap(SYS_getdents, (uintptr_t)&args);
 }
 
+int getdents64(int fd, struct dirent64 *dirp, size_t count)
+{
+    getdents64_args_t args;
+
+    args.fd = fd;
+    args.dirp = dirp;
+    args.count = count;
+
+    return (int)trap(SYS_getdents64, (uintptr_t)&args);
+}
+
 #ifdef __MOUNTING__
 int mount(const char *spec, const char *dir, const char *fstype)
 {
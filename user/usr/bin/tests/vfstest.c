@@ -37,6 +37,7 @@
 #include <stdio.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <weenix/syscall.h>
 
@@ -947,6 +948,120 @@ static void vfstest_getdents(void)
     syscall_success(chdir(".."));
 }
 
+#ifndef __KERNEL__
+/* Tests getdents64(), and the directory streams built on it */
+static void vfstest_getdents64(void)
+{
+    int fd, ret, off, pos, nents;
+    char buf[256] __attribute__((aligned(8)));
+    dirent64_t *d;
+    DIR *dirp;
+
+    syscall_success(mkdir("getdents64", 0));
+    syscall_success(chdir("getdents64"));
+
+    syscall_success(mkdir("dir01", 0));
+    syscall_success(mkdir("dir01/1", 0));
+    create_file("dir01/2");
+
+    /* all four entries fit in one call, packed one after another */
+    syscall_success(fd = open("dir01", O_RDONLY, 0));
+    syscall_success(ret = getdents64(fd, (dirent64_t *)buf, sizeof(buf)));
+    for (off = 0, nents = 0; off < ret; off += d->d_reclen, nents++)
+    {
+        d = (dirent64_t *)(buf + off);
+        test_assert(DIRENT64_RECLEN(strlen(d->d_name)) == d->d_reclen,
+                    "%s has d_reclen %d", d->d_name, d->d_reclen);
+    }
+    test_assert(4 == nents, "got %d entries", nents);
+    syscall_success(ret = getdents64(fd, (dirent64_t *)buf, sizeof(buf)));
+    test_assert(0 == ret, NULL);
+
+    /* room for one entry gets one entry, and d_off is where the next is */
+    syscall_success(lseek(fd, 0, SEEK_SET));
+    d = (dirent64_t *)buf;
+    syscall_success(ret = getdents64(fd, d, DIRENT64_RECLEN(2)));
+    test_assert(d->d_reclen == ret, NULL);
+    test_fpos(fd, (int)d->d_off);
+
+    /* failed calls do not move the position */
+    syscall_success(pos = lseek(fd, 0, SEEK_CUR));
+    syscall_fail(getdents64(fd, (dirent64_t *)buf, 8), EINVAL);
+    syscall_fail(getdents64(fd, NULL, sizeof(buf)), EFAULT);
+    test_fpos(fd, pos);
+    syscall_success(close(fd));
+
+    /* readdir() sees the same entries, again after rewinddir() */
+    test_assert(NULL != (dirp = opendir("dir01")), NULL);
+    for (nents = 0; readdir(dirp); nents++)
+        ;
+    test_assert(4 == nents, "got %d entries", nents);
+    rewinddir(dirp);
+    for (nents = 0; readdir(dirp); nents++)
+        ;
+    test_assert(4 == nents, "got %d entries after rewinddir", nents);
+    syscall_success(closedir(dirp));
+
+    /* Cannot call getdents64 on regular file */
+    syscall_success(fd = open("dir01/2", O_RDONLY, 0));
+    syscall_fail(getdents64(fd, (dirent64_t *)buf, sizeof(buf)), ENOTDIR);
+    syscall_success(close(fd));
+
+    syscall_success(chdir(".."));
+}
+
+/* Tests readv(), writev(), pread() and pwrite() */
+static void vfstest_rw_vec(void)
+{
+    int fd;
+    char head[4], tail[16], buf[32];
+    struct iovec iov[3];
+
+    syscall_success(mkdir("rw_vec", 0));
+    syscall_success(chdir("rw_vec"));
+    syscall_success(fd = open("file", O_RDWR | O_CREAT, 0));
+
+    /* writev() writes the segments in order, empty ones included */
+    iov[0].iov_base = "hello";
+    iov[0].iov_len = 5;
+    iov[1].iov_base = NULL;
+    iov[1].iov_len = 0;
+    iov[2].iov_base = " world";
+    iov[2].iov_len = 6;
+    test_assert(11 == writev(fd, iov, 3), NULL);
+    test_fpos(fd, 11);
+
+    /* pwrite() and pread() leave the position alone */
+    test_assert(5 == pwrite(fd, "WORLD", 5, 6), NULL);
+    test_fpos(fd, 11);
+    memset(buf, 0, sizeof(buf));
+    test_assert(11 == pread(fd, buf, sizeof(buf), 0), NULL);
+    test_assert(0 == memcmp(buf, "hello WORLD", 11), "read \"%s\"", buf);
+    test_assert(0 == pread(fd, buf, sizeof(buf), 11), NULL);
+    test_fpos(fd, 11);
+
+    /* readv() fills the segments in order and stops at the end of file */
+    syscall_success(lseek(fd, 0, SEEK_SET));
+    iov[0].iov_base = head;
+    iov[0].iov_len = sizeof(head);
+    iov[1].iov_base = tail;
+    iov[1].iov_len = sizeof(tail);
+    test_assert(11 == readv(fd, iov, 2), NULL);
+    test_assert(0 == memcmp(head, "hell", 4), NULL);
+    test_assert(0 == memcmp(tail, "o WORLD", 7), NULL);
+    test_fpos(fd, 11);
+
+    syscall_fail(readv(fd, iov, -1), EINVAL);
+    syscall_fail(readv(fd, iov, IOV_MAX + 1), EINVAL);
+    syscall_fail(pread(fd, buf, sizeof(buf), -1), EINVAL);
+    syscall_fail(pwrite(-1, buf, sizeof(buf), 0), EBADF);
+    syscall_fail(writev(-1, iov, 2), EBADF);
+    syscall_success(close(fd));
+
+    syscall_success(chdir(".."));
+}
+#endif
+
 #ifdef __VM__
 /*
  * Tests link(), rename(), and mmap() (and munmap, and brk).
@@ -1156,6 +1271,10 @@ int vfstest_main(int argc, char **argv)
     vfstest_open();
     vfstest_read();
     vfstest_getdents();
+#ifndef __KERNEL__
+    vfstest_getdents64();
+    vfstest_rw_vec();
+#endif
     vfstest_memdev();
     vfstest_write();
 